@@ -0,0 +1,1015 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+#include "archive.h"
+
+#define ARCHIVE_MAX_MESSAGE 1024 /* Longest message of an archive_error. */
+
+/* One entry of the tree being sent. */
+typedef struct{
+    char            *path;     /* Relative to the directory sent, "." for it. */
+    int             type;
+    uint32_t        mode;
+    struct timespec mtime;
+    long            size;
+    int             fd;        /* The file, opened ahead of the writer. */
+    int             error;     /* errno of opening it, 0 if it opened. */
+    int             ready;     /* 1 once a reader thread is done with it. */
+    char            *message;  /* archive_error: what went wrong. */
+    char            *source;   /* archiveStartFiles(): the path the file is opened from, NULL otherwise. */
+} ArchiveEntry;
+
+/* Everything the threads writing one archive share. */
+typedef struct{
+    int             fd;          /* Where the archive is written. */
+    int             rootfd;
+    int             files;       /* 1 if the entries are the files given to archiveStartFiles(), not a walked tree. */
+    ArchiveEntry    *entries;
+    long            numEntries;
+    long            entriesSize;
+    long            next;        /* The next entry a reader thread takes. */
+    long            written;     /* Entries the writer is done with, the reader threads stay ARCHIVE_READ_AHEAD ahead of it. */
+    int             stop;        /* 1 once the archive can not be written any more. */
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    unsigned char   *buffer;     /* ARCHIVE_BUFFER_SIZE bytes of the archive, written out when full. */
+    long            length;
+} ArchiveJob;
+
+static ArchiveJob *archiveCreateJob(int fd, int dirfd, const char *path);
+static int archiveLaunch(ArchiveJob *job);
+static void *archiveThread(void *arg);
+static void archiveStatFiles(ArchiveJob *job);
+static int archiveOpen(const ArchiveJob *job, const ArchiveEntry *entry);
+static int archiveAdd(ArchiveJob *job, const char *path, int type, const struct stat *s, const char *message);
+static void archiveList(ArchiveJob *job, long index);
+static void *archiveReadAhead(void *arg);
+static int archiveWriteEntry(ArchiveJob *job, ArchiveEntry *entry);
+static int archiveWriteHeader(ArchiveJob *job, int type, const ArchiveEntry *entry, long size);
+static int archiveWriteError(ArchiveJob *job, const char *path, const char *message);
+static int archiveOut(ArchiveJob *job, const void *data, long length);
+static int archiveFlush(ArchiveJob *job);
+static void archiveFreeJob(ArchiveJob *job);
+
+static int archiveBeginEntry(ArchiveReader *reader);
+static int archiveEndEntry(ArchiveReader *reader);
+static int archiveParent(ArchiveReader *reader, const char *path, const char **name);
+static void archiveFailed(ArchiveReader *reader, const char *path, const char *message);
+static int archiveValidPath(const char *path);
+
+
+
+
+/*********************************************************************************
+ * Writing an archive.
+ ********************************************************************************/
+int archiveStart(int fd, int dirfd, const char *path){
+    ArchiveJob *job;
+    
+    job = archiveCreateJob(fd, dirfd, path);
+    if(job == NULL){
+        return -1;
+    }
+    
+    return archiveLaunch(job);
+}
+
+int archiveStartFiles(int fd, int dirfd, char **paths, int numPaths){
+    ArchiveJob *job;
+    const char *name;
+    int        i;
+    
+    job = archiveCreateJob(fd, dirfd, ".");
+    if(job == NULL){
+        return -1;
+    }
+    job->files = 1;
+    
+    /* Named by their last component, what they are is found out by the thread. */
+    for(i=0; i<numPaths; i++){
+        name = strrchr(paths[i], '/');
+        name = name != NULL ? name + 1 : paths[i];
+        
+        if(archiveAdd(job, name, archive_file, NULL, NULL) != 0 || (job->entries[job->numEntries - 1].source = strdup(paths[i])) == NULL){
+            close(job->rootfd);
+            archiveFreeJob(job);
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    
+    return archiveLaunch(job);
+}
+
+/* Returns a job writing into fd, for the directory path relative to dirfd, NULL on failure (errno is set). */
+static ArchiveJob *archiveCreateJob(int fd, int dirfd, const char *path){
+    ArchiveJob *job;
+    int        error;
+    
+    job = calloc(1, sizeof(ArchiveJob));
+    if(job == NULL){
+        return NULL;
+    }
+    
+    job->rootfd = openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    job->buffer = malloc(ARCHIVE_BUFFER_SIZE);
+    if(job->rootfd == -1 || job->buffer == NULL){
+        error = errno;
+        if(job->rootfd != -1){
+            close(job->rootfd);
+        }
+        free(job->buffer);
+        free(job);
+        errno = error;
+        return NULL;
+    }
+    job->fd = fd;
+    
+    pthread_mutex_init(&job->lock, NULL);
+    pthread_cond_init(&job->cond, NULL);
+    
+    return job;
+}
+
+/* Start the thread writing the archive of the job, which owns the job from then on. Returns 0, or -1 (errno is set, the job is freed). */
+static int archiveLaunch(ArchiveJob *job){
+    pthread_t      thread;
+    pthread_attr_t attributes;
+    int            error;
+    
+    /* Fewer context switches between the writer and whoever reads the archive, if the pipe can grow. */
+    fcntl(job->fd, F_SETPIPE_SZ, ARCHIVE_PIPE_SIZE);
+    
+    pthread_attr_init(&attributes);
+    pthread_attr_setdetachstate(&attributes, PTHREAD_CREATE_DETACHED);
+    error = pthread_create(&thread, &attributes, archiveThread, job);
+    pthread_attr_destroy(&attributes);
+    
+    if(error != 0){
+        close(job->rootfd);
+        archiveFreeJob(job);
+        errno = error;
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* Walk the tree, then write it with the reader threads running ahead. */
+static void *archiveThread(void *arg){
+    ArchiveJob  *job;
+    pthread_t   readers[ARCHIVE_READ_THREADS];
+    struct stat s;
+    int         numReaders;
+    long        i;
+    
+    job = arg;
+    
+    /* Every directory is listed once it is reached, so it comes before everything in it. */
+    if(job->files){
+        archiveStatFiles(job);
+    }
+    else if(fstat(job->rootfd, &s) == 0 && archiveAdd(job, ".", archive_directory, &s, NULL) == 0){
+        for(i=0; i<job->numEntries; i++){
+            if(job->entries[i].type == archive_directory){
+                archiveList(job, i);
+            }
+        }
+    }
+    
+    for(numReaders=0; numReaders<ARCHIVE_READ_THREADS; numReaders++){
+        if(pthread_create(&readers[numReaders], NULL, archiveReadAhead, job) != 0){
+            break;
+        }
+    }
+    
+    for(i=0; i<job->numEntries; i++){
+        /* Without any reader thread the writer opens the files itself. */
+        pthread_mutex_lock(&job->lock);
+        while(numReaders > 0 && !job->entries[i].ready){
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        pthread_mutex_unlock(&job->lock);
+        
+        if(archiveWriteEntry(job, &job->entries[i]) != 0){
+            break;
+        }
+        
+        pthread_mutex_lock(&job->lock);
+        job->written = i + 1;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+    
+    if(i == job->numEntries){
+        archiveFlush(job);
+    }
+    
+    /* Whatever happened, the reader threads are let go and what they opened is closed. */
+    pthread_mutex_lock(&job->lock);
+    job->stop = 1;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    
+    while(numReaders > 0){
+        pthread_join(readers[--numReaders], NULL);
+    }
+    
+    close(job->fd);
+    close(job->rootfd);
+    archiveFreeJob(job);
+    
+    return NULL;
+}
+
+/* Find out what the files given to archiveStartFiles() are, anything but a file becomes an archive_error named by its whole path. */
+static void archiveStatFiles(ArchiveJob *job){
+    ArchiveEntry *entry;
+    struct stat  s;
+    const char   *message;
+    long         i;
+    
+    for(i=0; i<job->numEntries; i++){
+        entry = &job->entries[i];
+        
+        message = NULL;
+        if(fstatat(job->rootfd, entry->source, &s, 0) != 0){
+            message = strerror(errno);
+        }
+        else if(S_ISDIR(s.st_mode)){
+            message = "Is a directory, skipped (-r sends directories).";
+        }
+        else if(!S_ISREG(s.st_mode) || entry->path[0] == '\0'){
+            message = "Not a regular file, skipped.";
+        }
+        
+        if(message == NULL){
+            entry->mode  = s.st_mode & 07777;
+            entry->mtime = s.st_mtim;
+            entry->size  = s.st_size;
+            continue;
+        }
+        
+        free(entry->path);
+        entry->type    = archive_error;
+        entry->path    = entry->source;
+        entry->source  = NULL;
+        entry->message = strdup(message);
+    }
+}
+
+/* Add an entry to the job, returns -1 if out of memory. */
+static int archiveAdd(ArchiveJob *job, const char *path, int type, const struct stat *s, const char *message){
+    ArchiveEntry *entries;
+    ArchiveEntry *entry;
+    
+    if(job->numEntries == job->entriesSize){
+        entries = realloc(job->entries, (job->entriesSize * 2 + 64) * sizeof(ArchiveEntry));
+        if(entries == NULL){
+            return -1;
+        }
+        job->entries     = entries;
+        job->entriesSize = job->entriesSize * 2 + 64;
+    }
+    
+    entry = &job->entries[job->numEntries];
+    memset(entry, 0, sizeof(ArchiveEntry));
+    entry->type = type;
+    entry->fd   = -1;
+    
+    entry->path = strdup(path);
+    if(entry->path == NULL){
+        return -1;
+    }
+    if(message != NULL){
+        entry->message = strdup(message);
+        if(entry->message == NULL){
+            free(entry->path);
+            return -1;
+        }
+    }
+    if(s != NULL){
+        entry->mode  = s->st_mode & 07777;
+        entry->mtime = s->st_mtim;
+        entry->size  = type == archive_file ? s->st_size : 0;
+    }
+    
+    job->numEntries++;
+    return 0;
+}
+
+/* Add everything in the directory entries[index] to the job, what can not be read becomes an archive_error. */
+static void archiveList(ArchiveJob *job, long index){
+    char          path[ARCHIVE_MAX_PATH];
+    char          *directory;
+    DIR           *dir;
+    struct dirent *dirent;
+    struct stat   s;
+    int           dirfd;
+    int           type;
+    
+    directory = job->entries[index].path;
+    
+    dirfd = openat(job->rootfd, directory, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    dir   = dirfd != -1 ? fdopendir(dirfd) : NULL;
+    if(dir == NULL){
+        archiveAdd(job, directory, archive_error, NULL, strerror(errno));
+        if(dirfd != -1){
+            close(dirfd);
+        }
+        return;
+    }
+    
+    while((dirent = readdir(dir)) != NULL){
+        if(strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0){
+            continue;
+        }
+        
+        /* The entries of the directory sent are named without a leading "./". */
+        if(snprintf(path, sizeof(path), "%s%s%s", strcmp(directory, ".") == 0 ? "" : directory, strcmp(directory, ".") == 0 ? "" : "/", dirent->d_name) >= (int)sizeof(path)){
+            archiveAdd(job, directory, archive_error, NULL, "Path too long, an entry was skipped.");
+            continue;
+        }
+        
+        if(fstatat(dirfd, dirent->d_name, &s, AT_SYMLINK_NOFOLLOW) != 0){
+            archiveAdd(job, path, archive_error, NULL, strerror(errno));
+            continue;
+        }
+        
+        if(S_ISDIR(s.st_mode)){
+            type = archive_directory;
+        }
+        else if(S_ISREG(s.st_mode)){
+            type = archive_file;
+        }
+        else if(S_ISLNK(s.st_mode)){
+            type = archive_symlink;
+        }
+        else{
+            archiveAdd(job, path, archive_error, NULL, "Not a file, directory or symbolic link, skipped.");
+            continue;
+        }
+        
+        if(archiveAdd(job, path, type, &s, NULL) != 0){
+            break;
+        }
+        directory = job->entries[index].path; /* The entries may have moved. */
+    }
+    
+    closedir(dir);
+}
+
+/* A reader thread: open the next file and read its beginning into the page cache, ahead of the writer. */
+static void *archiveReadAhead(void *arg){
+    ArchiveJob   *job;
+    ArchiveEntry *entry;
+    long         i;
+    int          fd;
+    
+    job = arg;
+    
+    while(1){
+        pthread_mutex_lock(&job->lock);
+        while(!job->stop && job->next < job->numEntries && job->next >= job->written + ARCHIVE_READ_AHEAD){
+            pthread_cond_wait(&job->cond, &job->lock);
+        }
+        i = job->next++;
+        if(job->stop || i >= job->numEntries){
+            pthread_mutex_unlock(&job->lock);
+            return NULL;
+        }
+        pthread_mutex_unlock(&job->lock);
+        
+        entry = &job->entries[i];
+        fd    = -1;
+        
+        if(entry->type == archive_file){
+            fd = archiveOpen(job, entry);
+            if(fd == -1){
+                entry->error = errno;
+            }
+            else if(entry->size > 0){
+                readahead(fd, 0, entry->size < ARCHIVE_READ_AHEAD_SIZE ? entry->size : ARCHIVE_READ_AHEAD_SIZE);
+            }
+        }
+        
+        pthread_mutex_lock(&job->lock);
+        entry->fd    = fd;
+        entry->ready = 1;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->lock);
+    }
+}
+
+/* PURPOSE:
+ *     Write an entry into the archive, a file which can not be read
+ *     becomes an archive_error instead.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - The archive can not be written any more.
+ */
+static int archiveWriteEntry(ArchiveJob *job, ArchiveEntry *entry){
+    char target[ARCHIVE_MAX_PATH];
+    long left;
+    long n;
+    int  ret;
+    
+    switch(entry->type){
+        case archive_directory: {
+            return archiveWriteHeader(job, archive_directory, entry, 0);
+        }
+        
+        case archive_symlink: {
+            n = readlinkat(job->rootfd, entry->path, target, sizeof(target));
+            if(n == -1 || n == sizeof(target)){
+                return archiveWriteError(job, entry->path, n == -1 ? strerror(errno) : "Target too long, skipped.");
+            }
+            if(archiveWriteHeader(job, archive_symlink, entry, n) != 0){
+                return -1;
+            }
+            return archiveOut(job, target, n);
+        }
+        
+        case archive_error: {
+            return archiveWriteError(job, entry->path, entry->message != NULL ? entry->message : strerror(ENOMEM));
+        }
+    }
+    
+    /* A file, opened by a reader thread unless there is none. */
+    if(!entry->ready){
+        entry->fd = archiveOpen(job, entry);
+        if(entry->fd == -1){
+            entry->error = errno;
+        }
+    }
+    if(entry->fd == -1){
+        return archiveWriteError(job, entry->path, strerror(entry->error));
+    }
+    
+    /* The size in the header is the one it had when the tree was walked, exactly that many bytes follow. */
+    ret = archiveWriteHeader(job, archive_file, entry, entry->size);
+    for(left=entry->size; ret == 0 && left>0; left-=n){
+        if(job->length == ARCHIVE_BUFFER_SIZE && archiveFlush(job) != 0){
+            ret = -1;
+            break;
+        }
+        
+        n = ARCHIVE_BUFFER_SIZE - job->length < left ? ARCHIVE_BUFFER_SIZE - job->length : left;
+        n = read(entry->fd, job->buffer + job->length, n);
+        if(n <= 0){
+            break;
+        }
+        job->length += n;
+    }
+    
+    close(entry->fd);
+    entry->fd = -1;
+    
+    if(ret != 0){
+        return -1;
+    }
+    
+    /* The file shrank (or could not be read), the rest is made up of zeros and the receiver is told. */
+    if(left > 0){
+        while(left > 0){
+            if(job->length == ARCHIVE_BUFFER_SIZE && archiveFlush(job) != 0){
+                return -1;
+            }
+            n = ARCHIVE_BUFFER_SIZE - job->length < left ? ARCHIVE_BUFFER_SIZE - job->length : left;
+            memset(job->buffer + job->length, 0, n);
+            job->length += n;
+            left        -= n;
+        }
+        return archiveWriteError(job, entry->path, "Changed while it was sent, its end is missing.");
+    }
+    
+    return 0;
+}
+
+/* Open the file of an entry for reading, a walked tree never follows a symbolic link. */
+static int archiveOpen(const ArchiveJob *job, const ArchiveEntry *entry){
+    if(entry->source != NULL){
+        return openat(job->rootfd, entry->source, O_RDONLY | O_CLOEXEC);
+    }
+    
+    return openat(job->rootfd, entry->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+}
+
+/* Write the header and path of an entry whose data is size bytes long. */
+static int archiveWriteHeader(ArchiveJob *job, int type, const ArchiveEntry *entry, long size){
+    unsigned char header[ARCHIVE_HEADER_SIZE];
+    long          pathLength;
+    
+    pathLength = strlen(entry->path);
+    
+    header[0] = type;
+    packUint32(header + 1, entry->mode);
+    packUint64(header + 5, entry->mtime.tv_sec);
+    packUint32(header + 13, entry->mtime.tv_nsec);
+    packUint64(header + 17, size);
+    header[25] = pathLength >> 8;
+    header[26] = pathLength & 0xFF;
+    
+    if(archiveOut(job, header, sizeof(header)) != 0){
+        return -1;
+    }
+    return archiveOut(job, entry->path, pathLength);
+}
+
+/* Write an archive_error, telling the receiver path could not be sent. */
+static int archiveWriteError(ArchiveJob *job, const char *path, const char *message){
+    ArchiveEntry entry;
+    long         length;
+    
+    memset(&entry, 0, sizeof(entry));
+    entry.path = (char *)path;
+    
+    length = strlen(message);
+    if(length > ARCHIVE_MAX_MESSAGE){
+        length = ARCHIVE_MAX_MESSAGE;
+    }
+    
+    if(archiveWriteHeader(job, archive_error, &entry, length) != 0){
+        return -1;
+    }
+    return archiveOut(job, message, length);
+}
+
+/* Append bytes to the archive, writing it out whenever the buffer is full. */
+static int archiveOut(ArchiveJob *job, const void *data, long length){
+    long n;
+    
+    while(length > 0){
+        if(job->length == ARCHIVE_BUFFER_SIZE && archiveFlush(job) != 0){
+            return -1;
+        }
+        
+        n = ARCHIVE_BUFFER_SIZE - job->length < length ? ARCHIVE_BUFFER_SIZE - job->length : length;
+        memcpy(job->buffer + job->length, data, n);
+        job->length += n;
+        data         = (const char *)data + n;
+        length      -= n;
+    }
+    
+    return 0;
+}
+
+static int archiveFlush(ArchiveJob *job){
+    if(writeAll(job->fd, job->buffer, job->length) != 0){
+        return -1;
+    }
+    job->length = 0;
+    
+    return 0;
+}
+
+static void archiveFreeJob(ArchiveJob *job){
+    long i;
+    
+    for(i=0; i<job->numEntries; i++){
+        if(job->entries[i].fd != -1){
+            close(job->entries[i].fd);
+        }
+        free(job->entries[i].path);
+        free(job->entries[i].message);
+        free(job->entries[i].source);
+    }
+    
+    pthread_mutex_destroy(&job->lock);
+    pthread_cond_destroy(&job->cond);
+    
+    free(job->entries);
+    free(job->buffer);
+    free(job);
+}
+
+
+
+
+/*********************************************************************************
+ * Extracting an archive.
+ ********************************************************************************/
+ArchiveReader *archiveReaderCreate(int rootfd, FILE *report){
+    ArchiveReader *reader;
+    
+    reader = calloc(1, sizeof(ArchiveReader));
+    if(reader == NULL){
+        return NULL;
+    }
+    
+    reader->rootfd   = rootfd;
+    reader->report   = report;
+    reader->fd       = -1;
+    reader->parentfd = -1;
+    
+    /* Only read, so a file can be created with its mode right away when the umask would not cut it. */
+    reader->processUmask = umask(0);
+    umask(reader->processUmask);
+    
+    return reader;
+}
+
+int archiveReaderWrite(ArchiveReader *reader, const void *data, long length){
+    const unsigned char *bytes;
+    long                wanted;
+    long                n;
+    
+    bytes = data;
+    
+    while(length > 0){
+        /* The data of the current entry. */
+        if(reader->dataLeft > 0){
+            n = length < reader->dataLeft ? length : reader->dataLeft;
+            
+            if(reader->type == archive_file){
+                if(reader->fd != -1 && writeAll(reader->fd, bytes, n) != 0){
+                    archiveFailed(reader, (const char *)reader->header + ARCHIVE_HEADER_SIZE, strerror(errno));
+                    close(reader->fd);
+                    reader->fd = -1;
+                }
+                reader->bytes += n;
+            }
+            else{
+                memcpy(reader->data + reader->dataLength, bytes, n);
+                reader->dataLength += n;
+            }
+            
+            bytes            += n;
+            length           -= n;
+            reader->dataLeft -= n;
+            
+            if(reader->dataLeft == 0 && archiveEndEntry(reader) != 0){
+                return -1;
+            }
+            continue;
+        }
+        
+        /* The header, then the path whose length it holds. */
+        wanted = ARCHIVE_HEADER_SIZE;
+        if(reader->headerLength >= ARCHIVE_HEADER_SIZE){
+            wanted += (reader->header[25] << 8) | reader->header[26];
+        }
+        
+        n = wanted - reader->headerLength < length ? wanted - reader->headerLength : length;
+        memcpy(reader->header + reader->headerLength, bytes, n);
+        reader->headerLength += n;
+        bytes                += n;
+        length               -= n;
+        
+        if(reader->headerLength == ARCHIVE_HEADER_SIZE && ((reader->header[25] << 8) | reader->header[26]) >= ARCHIVE_MAX_PATH){
+            errno = EPROTO;
+            return -1;
+        }
+        
+        if(reader->headerLength > ARCHIVE_HEADER_SIZE && reader->headerLength == ARCHIVE_HEADER_SIZE + ((reader->header[25] << 8) | reader->header[26])){
+            if(archiveBeginEntry(reader) != 0){
+                return -1;
+            }
+            if(reader->dataLeft == 0 && archiveEndEntry(reader) != 0){
+                return -1;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+int archiveReaderFinish(ArchiveReader *reader){
+    ArchiveDirectory *directory;
+    struct timespec  times[2];
+    const char       *name;
+    int              parentfd;
+    int              fd;
+    long             i;
+    
+    if(reader->headerLength != 0 || reader->dataLeft != 0){
+        errno = EPROTO;
+        return -1;
+    }
+    
+    /* The deepest directories come last, their parents are only touched after them. */
+    for(i=reader->numDirectories-1; i>=0; i--){
+        directory = &reader->directories[i];
+        
+        if(strcmp(directory->path, ".") == 0){
+            fd = reader->rootfd;
+        }
+        else{
+            parentfd = archiveParent(reader, directory->path, &name);
+            fd       = parentfd != -1 ? openat(parentfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC) : -1;
+        }
+        if(fd == -1){
+            continue;
+        }
+        
+        times[0].tv_nsec = UTIME_OMIT;
+        times[0].tv_sec  = 0;
+        times[1]         = directory->mtime;
+        if(fchmod(fd, directory->mode) != 0 || futimens(fd, times) != 0){
+            archiveFailed(reader, directory->path, strerror(errno));
+        }
+        
+        if(fd != reader->rootfd){
+            close(fd);
+        }
+    }
+    
+    return 0;
+}
+
+void archiveReaderFree(ArchiveReader *reader){
+    long i;
+    
+    if(reader->fd != -1){
+        close(reader->fd);
+    }
+    if(reader->parentfd != -1 && reader->parentfd != reader->rootfd){
+        close(reader->parentfd);
+    }
+    close(reader->rootfd);
+    
+    for(i=0; i<reader->numDirectories; i++){
+        free(reader->directories[i].path);
+    }
+    free(reader->directories);
+    free(reader->data);
+    free(reader);
+}
+
+/* PURPOSE:
+ *     Start the entry whose header and path arrived: create the
+ *     directory, or the file its data is written into.
+ * 
+ * RETURNS:
+ *     0 - Success, or the entry could not be created and is skipped.
+ *    -1 - The header is invalid (errno EPROTO), or out of memory.
+ */
+static int archiveBeginEntry(ArchiveReader *reader){
+    ArchiveDirectory *directories;
+    const char       *path;
+    const char       *name;
+    long             pathLength;
+    long             size;
+    int              parentfd;
+    
+    pathLength = reader->headerLength - ARCHIVE_HEADER_SIZE;
+    reader->header[reader->headerLength] = '\0';
+    path = (const char *)reader->header + ARCHIVE_HEADER_SIZE;
+    
+    reader->type          = reader->header[0];
+    reader->mode          = unpackUint32(reader->header + 1) & 07777;
+    reader->mtime.tv_sec  = unpackUint64(reader->header + 5);
+    reader->mtime.tv_nsec = unpackUint32(reader->header + 13);
+    size                  = unpackUint64(reader->header + 17);
+    
+    reader->headerLength = 0;
+    reader->dataLeft     = size;
+    reader->dataLength   = 0;
+    
+    if((long)strlen(path) != pathLength || reader->mtime.tv_nsec >= 1000000000 || size < 0 || (reader->type != archive_error && !archiveValidPath(path))){
+        errno = EPROTO;
+        return -1;
+    }
+    
+    /* mget and mput: files next to each other, nothing else. */
+    if(reader->filesOnly && reader->type != archive_error && (reader->type != archive_file || strchr(path, '/') != NULL)){
+        errno = EPROTO;
+        return -1;
+    }
+    
+    switch(reader->type){
+        case archive_directory: {
+            if(size != 0){
+                break;
+            }
+            
+            /* Created so the rest can be written into it, its own mode and mtime are set at the end. */
+            if(strcmp(path, ".") != 0){
+                parentfd = archiveParent(reader, path, &name);
+                if(parentfd == -1 || mkdirat(parentfd, name, 0700) != 0){
+                    archiveFailed(reader, path, strerror(errno));
+                    return 0;
+                }
+            }
+            
+            if(reader->numDirectories == reader->directoriesSize){
+                directories = realloc(reader->directories, (reader->directoriesSize * 2 + 16) * sizeof(ArchiveDirectory));
+                if(directories == NULL){
+                    return -1;
+                }
+                reader->directories     = directories;
+                reader->directoriesSize = reader->directoriesSize * 2 + 16;
+            }
+            
+            reader->directories[reader->numDirectories].path  = strdup(path);
+            reader->directories[reader->numDirectories].mode  = reader->mode;
+            reader->directories[reader->numDirectories].mtime = reader->mtime;
+            if(reader->directories[reader->numDirectories].path == NULL){
+                return -1;
+            }
+            reader->numDirectories++;
+            return 0;
+        }
+        
+        case archive_file: {
+            if(strcmp(path, ".") == 0){
+                break;
+            }
+            
+            parentfd   = archiveParent(reader, path, &name);
+            reader->fd = parentfd != -1 ? openat(parentfd, name, O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, reader->filesOnly ? 0666 : reader->mode) : -1;
+            if(reader->fd == -1){
+                archiveFailed(reader, path, strerror(errno));
+            }
+            return 0;
+        }
+        
+        /* Collected until all of it arrived. */
+        case archive_symlink:
+        case archive_error: {
+            if(size >= (reader->type == archive_symlink ? ARCHIVE_MAX_PATH : ARCHIVE_MAX_MESSAGE + 1) || (reader->type == archive_symlink && strcmp(path, ".") == 0)){
+                break;
+            }
+            if(reader->data == NULL){
+                reader->data = malloc(ARCHIVE_MAX_PATH);
+                if(reader->data == NULL){
+                    return -1;
+                }
+            }
+            return 0;
+        }
+    }
+    
+    errno = EPROTO;
+    return -1;
+}
+
+/* PURPOSE:
+ *     Finish the entry all of whose data arrived.
+ * 
+ * RETURNS:
+ *     0 - Success, or the entry could not be finished and is counted.
+ *    -1 - The entry is invalid (errno EPROTO).
+ */
+static int archiveEndEntry(ArchiveReader *reader){
+    struct timespec times[2];
+    const char      *path;
+    const char      *name;
+    int             parentfd;
+    
+    path = (const char *)reader->header + ARCHIVE_HEADER_SIZE;
+    
+    times[0].tv_sec  = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1]         = reader->mtime;
+    
+    switch(reader->type){
+        case archive_file: {
+            if(reader->fd == -1){
+                return 0;
+            }
+            /* Changing the attributes of a file with dirty pages is expensive, only done when needed. mget and mput create files the way get and put do. */
+            if(!reader->filesOnly && (((reader->mode & reader->processUmask) != 0 && fchmod(reader->fd, reader->mode) != 0) || futimens(reader->fd, times) != 0)){
+                archiveFailed(reader, path, strerror(errno));
+            }
+            close(reader->fd);
+            reader->fd = -1;
+            reader->files++;
+            return 0;
+        }
+        
+        case archive_symlink: {
+            reader->data[reader->dataLength] = '\0';
+            if((long)strlen(reader->data) != reader->dataLength){
+                errno = EPROTO;
+                return -1;
+            }
+            
+            parentfd = archiveParent(reader, path, &name);
+            if(parentfd == -1 || symlinkat(reader->data, parentfd, name) != 0 || utimensat(parentfd, name, times, AT_SYMLINK_NOFOLLOW) != 0){
+                archiveFailed(reader, path, strerror(errno));
+                return 0;
+            }
+            reader->links++;
+            return 0;
+        }
+        
+        case archive_error: {
+            reader->data[reader->dataLength] = '\0';
+            archiveFailed(reader, path, reader->data);
+            return 0;
+        }
+    }
+    
+    return 0;
+}
+
+/* PURPOSE:
+ *     Open the directory path is in (below rootfd, one component at a
+ *     time without following symbolic links), and point name at the
+ *     last component of path. The last one opened is kept, entries
+ *     come one directory at a time.
+ * 
+ * RETURNS:
+ *     SUCCESS: The directory.
+ *     FAILURE: -1, errno is set.
+ */
+static int archiveParent(ArchiveReader *reader, const char *path, const char **name){
+    char       component[ARCHIVE_MAX_PATH];
+    const char *slash;
+    const char *start;
+    const char *end;
+    long       length;
+    int        fd;
+    int        next;
+    
+    slash  = strrchr(path, '/');
+    *name  = slash != NULL ? slash + 1 : path;
+    length = slash != NULL ? slash - path : 0;
+    
+    if(reader->parentfd != -1 && (long)strlen(reader->parentPath) == length && strncmp(reader->parentPath, path, length) == 0){
+        return reader->parentfd;
+    }
+    
+    if(reader->parentfd != -1 && reader->parentfd != reader->rootfd){
+        close(reader->parentfd);
+    }
+    reader->parentfd = -1;
+    
+    fd = reader->rootfd;
+    for(start=path; start<path+length; start=end+1){
+        end = memchr(start, '/', path + length - start);
+        if(end == NULL){
+            end = path + length;
+        }
+        
+        memcpy(component, start, end - start);
+        component[end - start] = '\0';
+        
+        next = openat(fd, component, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if(fd != reader->rootfd){
+            close(fd);
+        }
+        if(next == -1){
+            return -1;
+        }
+        fd = next;
+    }
+    
+    memcpy(reader->parentPath, path, length);
+    reader->parentPath[length] = '\0';
+    reader->parentfd = fd;
+    
+    return fd;
+}
+
+/* Count an entry which could not be sent or created, and report it. */
+static void archiveFailed(ArchiveReader *reader, const char *path, const char *message){
+    if(reader->errors == 0){
+        snprintf(reader->error, sizeof(reader->error), "%s: %s", path, message);
+    }
+    reader->errors++;
+    
+    if(reader->report != NULL){
+        fprintf(reader->report, "%s: %s\n", path, message);
+    }
+}
+
+/* Returns 1 if path is "." or relative and stays below it (no "..", "." or empty components), 0 otherwise. */
+static int archiveValidPath(const char *path){
+    const char *start;
+    const char *end;
+    
+    if(strcmp(path, ".") == 0){
+        return 1;
+    }
+    
+    for(start=path; ; start=end+1){
+        end = strchr(start, '/');
+        if(end == NULL){
+            end = start + strlen(start);
+        }
+        
+        if(end == start || (end - start == 1 && start[0] == '.') || (end - start == 2 && start[0] == '.' && start[1] == '.')){
+            return 0;
+        }
+        
+        if(*end == '\0'){
+            return 1;
+        }
+    }
+}
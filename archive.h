@@ -0,0 +1,145 @@
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define ARCHIVE_HEADER_SIZE     27                 /* [type][mode 4][mtime 8][mtime nsec 4][size 8][path length 2] */
+#define ARCHIVE_MAX_PATH        4096               /* Longest path of an entry, relative to the directory sent. */
+#define ARCHIVE_READ_THREADS    4                  /* Threads opening and reading files ahead of the one writing the archive. */
+#define ARCHIVE_READ_AHEAD      256                /* Most entries they run ahead of it. */
+#define ARCHIVE_READ_AHEAD_SIZE (1024 * 1024)      /* Bytes of a file read ahead, the kernel reads the rest of a large one. */
+#define ARCHIVE_BUFFER_SIZE     (256 * 1024)       /* Bytes copied from a file into the archive at a time. */
+#define ARCHIVE_PIPE_SIZE       (1024 * 1024)      /* Size asked for the pipe the archive is written into. */
+
+/* Archive outline (get -r and put -r):
+ * 
+ * A directory is sent as a single stream of entries, every one a header
+ * followed by its path and size bytes of data:
+ * 
+ *   [type][mode 4][mtime 8][mtime nsec 4][size 8][path length 2][path...][data...]
+ * 
+ * The paths are relative to the directory sent, which is the first
+ * entry ("."), and a directory always comes before what is in it. The
+ * data of a file is its contents, of a symbolic link its target, and of
+ * an archive_error what went wrong with path on the sending side (it is
+ * reported, the rest of the directory still arrives).
+ * 
+ * mget and mput send files with archiveStartFiles(), a flat archive
+ * without the "." entry. Many small files end up in every frame_data
+ * instead of a frame_size, frame_data and frame_end each.
+ * 
+ * The sender walks the whole tree first, then writes the entries while
+ * ARCHIVE_READ_THREADS threads open and read the files ahead of it, so
+ * the many small files of a checkout are read in parallel instead of
+ * one after the other. The receiver creates everything with *at() calls
+ * below the directory, never following a symbolic link, and sets the
+ * modes and mtimes of the directories once all of their contents are in.
+ */
+typedef enum{
+    archive_directory = 1,
+    archive_file      = 2,
+    archive_symlink   = 3,
+    archive_error     = 4
+} ArchiveType;
+
+/* A directory whose mode and mtime are set once the archive is complete. */
+typedef struct{
+    char            *path;
+    uint32_t        mode;
+    struct timespec mtime;
+} ArchiveDirectory;
+
+/* Extracts an archive into a directory as it arrives. */
+typedef struct{
+    int              rootfd;
+    int              filesOnly;            /* 1 if only files at the top level are accepted (mget and mput), created without their modes and mtimes, 0 by default. */
+    mode_t           processUmask;         /* Files whose mode it does not cut are created with it, without an fchmod(). */
+    FILE             *report;              /* Where archive_error entries and failures are printed, NULL if nowhere. */
+    
+    unsigned char    header[ARCHIVE_HEADER_SIZE + ARCHIVE_MAX_PATH];
+    long             headerLength;         /* Bytes of the header and path which arrived. */
+    int              type;
+    uint32_t         mode;
+    struct timespec  mtime;
+    long             dataLeft;             /* Bytes of the data of the entry still to arrive. */
+    int              fd;                   /* The file being written, -1 if its data is skipped. */
+    char             *data;                /* The target of a symbolic link or the message of an error, as it arrives. */
+    long             dataLength;
+    
+    char             parentPath[ARCHIVE_MAX_PATH]; /* The directory the last entry was created in, kept open. */
+    int              parentfd;
+    
+    ArchiveDirectory *directories;
+    long             numDirectories;
+    long             directoriesSize;
+    
+    long             files;                /* Entries created. */
+    long             links;
+    long             bytes;                /* Bytes of files written. */
+    long             errors;               /* Entries which could not be sent or created. */
+    char             error[256];           /* The first of them. */
+} ArchiveReader;
+
+
+
+
+/* PURPOSE:
+ *     Start a thread which writes the archive of the directory path
+ *     (relative to dirfd, which may be AT_FDCWD) into fd, and closes fd
+ *     once it is done. Reading fd to the end gives the whole archive.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set, fd is still open.
+ */
+int archiveStart(int fd, int dirfd, const char *path);
+
+/* PURPOSE:
+ *     Like archiveStart(), but the archive holds the files paths
+ *     (relative to dirfd), next to each other and each named by the last
+ *     component of its path. What is not a file is sent as an
+ *     archive_error.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set, fd is still open.
+ */
+int archiveStartFiles(int fd, int dirfd, char **paths, int numPaths);
+
+/* PURPOSE:
+ *     Create a reader which extracts into the directory rootfd (owned by
+ *     the reader from now on), which should be empty.
+ * 
+ * RETURNS:
+ *     SUCCESS: The reader.
+ *     FAILURE: NULL, out of memory, rootfd is still open.
+ */
+ArchiveReader *archiveReaderCreate(int rootfd, FILE *report);
+
+/* PURPOSE:
+ *     Extract length bytes of an archive, any number at a time. An entry
+ *     which can not be created is counted in errors and skipped.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - The archive is invalid (errno EPROTO), or a write failed.
+ */
+int archiveReaderWrite(ArchiveReader *reader, const void *data, long length);
+
+/* PURPOSE:
+ *     Set the modes and mtimes of the directories, once all of the
+ *     archive arrived.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - The archive stopped in the middle of an entry (errno EPROTO).
+ */
+int archiveReaderFinish(ArchiveReader *reader);
+
+/* Free a reader, closing rootfd. */
+void archiveReaderFree(ArchiveReader *reader);
+
+#endif
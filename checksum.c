@@ -0,0 +1,325 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "listing.h"
+#include "delta.h"
+#include "checksum.h"
+
+/* One file of a checksum job. */
+typedef struct{
+    char *name;
+    int  fd;                                    /* -1 if it could not be opened. */
+    int  error;                                 /* errno of whatever went wrong, 0 if nothing did. */
+    char hex[2 * HASH_MAX_DIGEST_SIZE + 1];
+} ChecksumFile;
+
+/* Everything the threads of one smd5sum share. */
+typedef struct{
+    HashType     type;
+    int          fd;        /* Where the lines are written. */
+    ChecksumFile *files;
+    int          numFiles;
+    int          next;      /* The next file nobody has started hashing, taken with __atomic_fetch_add(). */
+    char         *names;    /* The names of every file, the files point into this. */
+} ChecksumJob;
+
+/* The signatures of the copy a put -d rebuilds the new file from. */
+typedef struct{
+    int  fd;       /* Where the signatures are written. */
+    int  basisfd;
+    long size;
+} SignatureJob;
+
+static void *checksumRun(void *arg);
+static void *checksumSignatures(void *arg);
+static void *checksumWork(void *arg);
+static int checksumWriteAll(int fd, const char *buffer, long length);
+static void checksumFree(ChecksumJob *job);
+
+
+
+
+int checksumParseArguments(char *arguments, ChecksumOptions *options, char **files){
+    char *argument;
+    char *save;
+    int  count;
+    
+    options->type = hash_md5;
+    
+    /* Globs, pipes, quotes and the like need a shell. */
+    if(strpbrk(arguments, LISTING_SHELL_CHARACTERS) != NULL){
+        return -1;
+    }
+    
+    count = 0;
+    for(argument = strtok_r(arguments, " \t", &save); argument != NULL; argument = strtok_r(NULL, " \t", &save)){
+        /* A file. */
+        if(argument[0] != '-' || argument[1] == '\0'){
+            if(count == CHECKSUM_MAX_FILES){
+                return -1;
+            }
+            files[count++] = argument;
+            continue;
+        }
+        
+        /* The only option, the algorithm, md5sum handles the rest. */
+        if(strcmp(argument, "-a") != 0){
+            return -1;
+        }
+        
+        argument = strtok_r(NULL, " \t", &save);
+        if(argument == NULL || (options->type = hashFromName(argument)) == hash_unknown){
+            return -2;
+        }
+    }
+    
+    return count;
+}
+
+int checksumStart(int fd, const ChecksumOptions *options, char **files, int numFiles){
+    ChecksumJob    *job;
+    pthread_attr_t attr;
+    pthread_t      thread;
+    long           namesLength;
+    long           offset;
+    int            ret;
+    int            i;
+    
+    job = malloc(sizeof(ChecksumJob));
+    if(job == NULL){
+        return -1;
+    }
+    
+    namesLength = 0;
+    for(i=0; i<numFiles; i++){
+        namesLength += strlen(files[i]) + 1;
+    }
+    
+    job->type     = options->type;
+    job->fd       = fd;
+    job->numFiles = 0;
+    job->next     = 0;
+    job->files    = malloc(numFiles * sizeof(ChecksumFile));
+    job->names    = malloc(namesLength);
+    if(job->files == NULL || job->names == NULL){
+        job->fd = -1;
+        checksumFree(job);
+        return -1;
+    }
+    
+    /* The files are opened now, while the current directory is still the one of the session. */
+    offset = 0;
+    for(i=0; i<numFiles; i++){
+        job->files[i].name  = job->names + offset;
+        job->files[i].fd    = open(files[i], O_RDONLY | O_CLOEXEC);
+        job->files[i].error = job->files[i].fd == -1 ? errno : 0;
+        job->numFiles++;
+        
+        memcpy(job->files[i].name, files[i], strlen(files[i]) + 1);
+        offset += strlen(files[i]) + 1;
+    }
+    
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    
+    ret = pthread_create(&thread, &attr, checksumRun, job);
+    pthread_attr_destroy(&attr);
+    
+    /* fd stays with the caller. */
+    if(ret != 0){
+        job->fd = -1;
+        checksumFree(job);
+        errno = ret;
+        return -1;
+    }
+    
+    return 0;
+}
+
+int checksumStartSignatures(int fd, int basisfd, long size){
+    SignatureJob   *job;
+    pthread_attr_t attr;
+    pthread_t      thread;
+    int            ret;
+    
+    job = malloc(sizeof(SignatureJob));
+    if(job == NULL){
+        return -1;
+    }
+    
+    /* A copy of the file of its own, the stream may be gone before the thread is done with it. */
+    job->fd      = fd;
+    job->size    = size;
+    job->basisfd = fcntl(basisfd, F_DUPFD_CLOEXEC, 0);
+    if(job->basisfd == -1){
+        free(job);
+        return -1;
+    }
+    
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    
+    ret = pthread_create(&thread, &attr, checksumSignatures, job);
+    pthread_attr_destroy(&attr);
+    
+    if(ret != 0){
+        close(job->basisfd);
+        free(job);
+        errno = ret;
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+
+
+/* PURPOSE:
+ *     The thread which owns a job, it starts the other threads, hashes
+ *     files itself, then writes the lines and frees the job.
+ */
+static void *checksumRun(void *arg){
+    ChecksumJob *job = arg;
+    pthread_t   threads[CHECKSUM_MAX_THREADS];
+    int         numThreads;
+    long        cpus;
+    char        *line;
+    int         length;
+    int         i;
+    
+    /* One thread per CPU, this one included. */
+    cpus       = sysconf(_SC_NPROCESSORS_ONLN);
+    numThreads = cpus < 1 ? 1 : (cpus > CHECKSUM_MAX_THREADS ? CHECKSUM_MAX_THREADS : cpus);
+    if(numThreads > job->numFiles){
+        numThreads = job->numFiles;
+    }
+    
+    for(i=0; i<numThreads-1; i++){
+        if(pthread_create(&threads[i], NULL, checksumWork, job) != 0){
+            break;
+        }
+    }
+    numThreads = i;
+    
+    checksumWork(job);
+    
+    for(i=0; i<numThreads; i++){
+        pthread_join(threads[i], NULL);
+    }
+    
+    /* The lines are written in the order of the files, just as md5sum would. */
+    for(i=0; i<job->numFiles; i++){
+        if(job->files[i].error == 0){
+            length = asprintf(&line, "%s  %s\n", job->files[i].hex, job->files[i].name);
+        }
+        else{
+            length = asprintf(&line, "smd5sum: %s: %s\n", job->files[i].name, strerror(job->files[i].error));
+        }
+        
+        if(length == -1){
+            break;
+        }
+        
+        /* The client went away, nobody is reading. */
+        if(checksumWriteAll(job->fd, line, length) != 0){
+            free(line);
+            break;
+        }
+        free(line);
+    }
+    
+    checksumFree(job);
+    
+    return NULL;
+}
+
+/* Make the signatures of a file and write them, nothing is written if the file could not be read, the client sends all of it then. */
+static void *checksumSignatures(void *arg){
+    SignatureJob  *job = arg;
+    unsigned char *signatures;
+    long          length;
+    
+    signatures = deltaSignatures(job->basisfd, job->size, &length);
+    if(signatures != NULL){
+        checksumWriteAll(job->fd, (const char *)signatures, length);
+        free(signatures);
+    }
+    
+    close(job->basisfd);
+    close(job->fd);
+    free(job);
+    
+    return NULL;
+}
+
+/* Hash files until there are none left to start. */
+static void *checksumWork(void *arg){
+    ChecksumJob   *job = arg;
+    ChecksumFile  *file;
+    unsigned char digest[HASH_MAX_DIGEST_SIZE];
+    int           length;
+    int           i;
+    
+    while((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->numFiles){
+        file = &job->files[i];
+        if(file->fd == -1){
+            continue;
+        }
+        
+        length = hashFile(file->fd, job->type, digest);
+        if(length == -1){
+            file->error = errno;
+            continue;
+        }
+        hashToHex(digest, length, file->hex);
+    }
+    
+    return NULL;
+}
+
+/* Write all of buffer to the (blocking) fd, returns 0 on success and -1 on failure. */
+static int checksumWriteAll(int fd, const char *buffer, long length){
+    long n;
+    
+    while(length > 0){
+        n = write(fd, buffer, length);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        buffer += n;
+        length -= n;
+    }
+    
+    return 0;
+}
+
+/* Close the files (and fd) of a job and free it. */
+static void checksumFree(ChecksumJob *job){
+    int i;
+    
+    for(i=0; i<job->numFiles; i++){
+        if(job->files[i].fd != -1){
+            close(job->files[i].fd);
+        }
+    }
+    if(job->fd != -1){
+        close(job->fd);
+    }
+    
+    free(job->files);
+    free(job->names);
+    free(job);
+}
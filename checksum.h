@@ -0,0 +1,82 @@
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+#include "hash.h"
+
+#define CHECKSUM_MAX_FILES   256 /* Most files one smd5sum hashes. */
+#define CHECKSUM_MAX_THREADS 16  /* Most threads one smd5sum hashes on, fewer if there are fewer CPUs. */
+
+/* Checksum outline (smd5sum without md5sum, and the signatures of put -d):
+ * 
+ * 1. The arguments are parsed, if they use an option which is not
+ *    supported here the server falls back to popen()ing md5sum.
+ * 
+ * 2. Every file is opened, then a thread takes over so the session
+ *    is never blocked by a large file. It hashes the files on as many
+ *    threads as there are CPUs (see hash.h for the algorithms), each
+ *    thread taking the next file which nobody has started yet.
+ * 
+ * 3. Once every file is hashed the lines, in the order the files were
+ *    given, are written to a pipe in the format of md5sum. The session
+ *    sends them like the output of a command.
+ * 
+ * The block signatures put -d sends the client are made the same way,
+ * by a thread of their own writing them to a pipe.
+ */
+
+typedef struct{
+    HashType type; /* -a md5|crc32c|xxh3|blake3: The algorithm, md5 by default. */
+} ChecksumOptions;
+
+/* PURPOSE:
+ *     Parse the arguments of an smd5sum command, for example
+ *     "-a xxh3 a.bin b.bin".
+ * 
+ * PARAMETERS:
+ *     char *arguments:          The arguments, split into pieces in place.
+ *     ChecksumOptions *options: Filled in with the options.
+ *     char **files:             Filled in with the files to hash, pointers
+ *                               into arguments, at most CHECKSUM_MAX_FILES.
+ * 
+ * RETURNS:
+ *     SUCCESS: The number of files.
+ *     FAILURE: -1, an option or the number of files is not supported.
+ *              -2, the algorithm given with -a is not known.
+ */
+int checksumParseArguments(char *arguments, ChecksumOptions *options, char **files);
+
+/* PURPOSE:
+ *     Open the files (relative to the current directory) and start
+ *     hashing them in the background.
+ * 
+ * PARAMETERS:
+ *     int fd:                         The write end of a pipe, the lines
+ *                                     are written to it, and it is closed
+ *                                     once they all have been.
+ *     const ChecksumOptions *options: The parsed options.
+ *     char **files:                   The files to hash.
+ *     int numFiles:                   The number of files.
+ * 
+ * RETURNS:
+ *     0 - The files are being hashed, fd belongs to the hashing now.
+ *    -1 - Failure, errno is set and fd is still open.
+ */
+int checksumStart(int fd, const ChecksumOptions *options, char **files, int numFiles);
+
+/* PURPOSE:
+ *     Start making the block signatures (see delta.h) of the first size
+ *     bytes of a file in the background, for put -d.
+ * 
+ * PARAMETERS:
+ *     int fd:      The write end of a pipe, the signatures are written to
+ *                  it, and it is closed once they all have been.
+ *     int basisfd: The file, it is duplicated.
+ *     long size:   Its size.
+ * 
+ * RETURNS:
+ *     0 - The signatures are being made, fd belongs to the thread now.
+ *    -1 - Failure, errno is set and fd is still open.
+ */
+int checksumStartSignatures(int fd, int basisfd, long size);
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -6,19 +8,33 @@
 
 #include <errno.h>
 
+#include <poll.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <signal.h>
 
+#include <time.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <glob.h>
 #include <sys/socket.h>
 #include <netdb.h>
 
 #include "shared.h"
+#include "stripe.h"
 #include "client.h"
 
+/* Where the prompt is connected, get -p and put -p open their connections there too. */
+static const char *serverIp;
+static const char *serverPort;
+
 int main(int argc, char **argv){
     /* Command line arguments. */
     const char *ipstr;   /* The ip address from the command line arguments (argv[1])  */
     const char *portstr; /* The port number from the command line arguments (argv[2]) */
+    const char *hashes;  /* The hashes offered to the server (-H). */
+    const char *codecs;  /* The codecs offered to the server (-Z). */
+    int        opt;      /* Option returned by getopt(). */
     
     /* Network variables. */
     int sockfd; /* The socket file descriptor. */
@@ -31,15 +47,38 @@ int main(int argc, char **argv){
     /* Other */
     int ret; /* Hold return value from various functions. */
     
+    /* Parse the options. */
+    hashes = FRAME_HASHES;
+    codecs = COMPRESS_NAME;
+    while((opt = getopt(argc, argv, "H:Z:")) != -1){
+        switch(opt){
+            case 'H': { hashes = optarg; break; }
+            case 'Z': { codecs = optarg; break; }
+            default: {
+                printUsage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    
     /* Not enough arguments. */
-    if(argc != 3){
+    if(argc - optind != 2){
         printUsage(argv[0]);
         exit(EXIT_FAILURE);
     }
     
     /* Get the ip address and port from the command line. */
-    ipstr   = argv[1];
-    portstr = argv[2];
+    ipstr   = argv[optind];
+    portstr = argv[optind + 1];
+    
+    serverIp   = ipstr;
+    serverPort = portstr;
+    
+    /* A server closing the connection should be reported as an error, not kill the client. */
+    if(signal(SIGPIPE, SIG_IGN) == SIG_ERR){
+        perror("ERROR");
+        exit(EXIT_FAILURE);
+    }
     
     /* Attempt to connect to the server. */
     printf("Attempting to connect to %s on port %s.\n", ipstr, portstr);
@@ -55,6 +94,18 @@ int main(int argc, char **argv){
         exit(EXIT_FAILURE);
     }
     
+    /* Offer the hashes transfers are checked with, the reply arrives before that of any command. */
+    if(strcmp(hashes, "none") != 0 && frameSend(sockfd, frame_hash, 0, 0, hashes, strnlen(hashes, BUFFER_SIZE - 1)) != 0){
+        perror(CFLRED "ERROR" C_RST);
+        exit(EXIT_FAILURE);
+    }
+    
+    /* Offer the codecs frame_data may be compressed with, the same way. */
+    if(strcmp(codecs, "none") != 0 && frameSend(sockfd, frame_compress, 0, 0, codecs, strnlen(codecs, BUFFER_SIZE - 1)) != 0){
+        perror(CFLRED "ERROR" C_RST);
+        exit(EXIT_FAILURE);
+    }
+    
     /* Succesfully connected. */
     printf("Succesfully connected to %s on port %s.\n"
            "Enter 'q' to quit,\n"
@@ -64,8 +115,24 @@ int main(int argc, char **argv){
     line           = NULL;
     lineBufferSize = 0;
     
+    /* Commands running in the background are serviced while waiting for the user, which relies
+     * on poll() seeing every byte the user typed, so stdin can not hold any back in a buffer.
+     */
+    setvbuf(stdin, NULL, _IONBF, 0);
+    
     /* Continually loop until the user types 'q'. */
-    while((printPrompt() == 0) && (lineLength = getline(&line, &lineBufferSize, stdin)) != -1){
+    ret = 0;
+    while(printPrompt() == 0){
+        if(pumpConnection(sockfd, NULL, 1) != 0){
+            ret = -1;
+            break;
+        }
+        
+        lineLength = getline(&line, &lineBufferSize, stdin);
+        if(lineLength == -1){
+            break;
+        }
+        
         /* User entered a 'q' and hit ctrl+d. */
         if(lineLength == 1 && line[0] == 'q'){
             puts("\nQuitting...");
@@ -93,20 +160,23 @@ int main(int argc, char **argv){
         }
         
         /* Execute the command. */
-        if(executeCommand(sockfd, line) == -1){
-            if(errno == 0){
-                puts(CFLRED "ERROR:" C_RST " Server closed connection.");
-            }
-            else{
-                perror(CFLRED "ERROR" C_RST);
-            }
-            
+        ret = executeCommand(sockfd, line);
+        if(ret == -1){
             break;
         }
         
         putchar('\n');
     }
     
+    if(ret == -1){
+        if(errno == 0){
+            puts(CFLRED "ERROR:" C_RST " Server closed connection.");
+        }
+        else{
+            perror(CFLRED "ERROR" C_RST);
+        }
+    }
+    
     free(line);
     
     /* Close the socket. */
@@ -126,6 +196,20 @@ int main(int argc, char **argv){
  *************************************************************************************/
 int executeCommand(int sockfd, const char *command){
     SharedCommandType commandType;
+    PendingCommand    *pending;
+    char              buffer[BUFFER_SIZE];
+    long              length;
+    int               background;
+    int               ret;
+    
+    /* A trailing " &" runs a server command in the background. */
+    length     = strlen(command);
+    background = length > 2 && strcmp(command + length - 2, CLIENT_BACKGROUND) == 0;
+    if(background){
+        memcpy(buffer, command, length - 2);
+        buffer[length - 2] = '\0';
+        command = buffer;
+    }
     
     /* Determine the command type. */
     commandType = getSharedCommandType(command);
@@ -133,26 +217,148 @@ int executeCommand(int sockfd, const char *command){
     /* Call the appropriate function to handle this known command. */
     switch(commandType){
         case command_unknown: {
+            if(background){
+                printf(CFLRED "ERROR:" C_RST " only server commands can run in the background.");
+                return 1;
+            }
+            if(getClientCommandType(command) == client_command_batch){
+                return executeBatch(sockfd, command + strlen(CLIENT_COMMAND_BATCH));
+            }
             return executeLocalCommand(command);
         }
         
         case command_cd:
         case command_list:
         case command_md5:
-        case command_pwd: {
-            return executeServerReadOnlyCommand(sockfd, command);
+        case command_pwd:
+        case command_get:
+        case command_put:
+        case command_mget:
+        case command_mput: {
+            /* "get -p N FILE" and "put -p N FILE" are sent over connections of their own, see stripe.h. */
+            if((commandType == command_get || commandType == command_put) && strncmp(command + 3, " -p ", 4) == 0){
+                if(background){
+                    printf(CFLRED "ERROR:" C_RST " -p can not run in the background.");
+                    return 1;
+                }
+                return executeStriped(sockfd, command);
+            }
+            
+            ret = sendServerCommand(sockfd, command, background, &pending);
+            if(ret != 0){
+                return ret;
+            }
+            
+            /* The output is printed once it is done, see reapBackgroundCommands(). */
+            if(background){
+                pending->background = 1;
+                printf("Running in the background: %s", command);
+                return 0;
+            }
+            
+            return receiveServerReply(sockfd, pending);
+        }
+    }
+    
+    return 0;
+}
+
+int executeBatch(int sockfd, const char *filePath){
+    PendingCommand *pending[CLIENT_PIPELINE_DEPTH];
+    int            first;       /* Oldest command still waiting for its reply. */
+    int            count;       /* Number of commands waiting for their replies. */
+    int            ret;
+    
+    FILE   *fp;
+    char   *line;
+    long   lineLength;
+    size_t lineBufferSize;
+    
+    fp = fopen(filePath, "r");
+    if(fp == NULL){
+        perror(CFLRED "ERROR" C_RST);
+        return 1;
+    }
+    
+    first = 0;
+    count = 0;
+    ret   = 0;
+    
+    line           = NULL;
+    lineBufferSize = 0;
+    
+    while(ret != -1 && (lineLength = getline(&line, &lineBufferSize, fp)) != -1){
+        /* Remove the trailing newline. */
+        if(lineLength > 0 && line[lineLength-1] == '\n'){
+            line[--lineLength] = '\0';
+        }
+        
+        /* Skip blank lines and comments. */
+        if(lineLength == 0 || line[0] == '#'){
+            continue;
         }
         
-        case command_get: {
-            return executeCommandget(sockfd, command);
+        /* Make sure the command fits into the buffer. */
+        if(lineLength >= BUFFER_SIZE){
+            printf(CFLRED "ERROR:" C_RST " command too long.\n");
+            continue;
         }
         
-        case command_put: {
-            return executeCommandput(sockfd, command);
+        switch(getSharedCommandType(line)){
+            /* Local commands write straight to the terminal, so they wait for every reply
+             * before them to be printed first.
+             */
+            case command_unknown: {
+                while(count > 0 && ret != -1){
+                    ret = receiveBatchReply(sockfd, pending[first]);
+                    first = (first + 1) % CLIENT_PIPELINE_DEPTH;
+                    count--;
+                }
+                
+                if(ret != -1){
+                    printf(CFLBLU "%s" C_RST "\n", line);
+                    fflush(stdout);
+                    
+                    ret = executeCommand(sockfd, line);
+                    putchar('\n');
+                }
+                break;
+            }
+            
+            /* Send the command without waiting for the replies to the ones before it, its
+             * output is collected until the replies before it have been printed.
+             */
+            default: {
+                /* Too many replies outstanding, wait for the oldest one. */
+                if(count == CLIENT_PIPELINE_DEPTH){
+                    ret = receiveBatchReply(sockfd, pending[first]);
+                    first = (first + 1) % CLIENT_PIPELINE_DEPTH;
+                    count--;
+                    if(ret == -1){
+                        break;
+                    }
+                }
+                
+                ret = sendServerCommand(sockfd, line, 1, &pending[(first + count) % CLIENT_PIPELINE_DEPTH]);
+                if(ret == 0){
+                    count++;
+                }
+                break;
+            }
         }
     }
     
-    return 0;
+    /* Wait for the remaining replies. */
+    while(count > 0 && ret != -1){
+        ret = receiveBatchReply(sockfd, pending[first]);
+        first = (first + 1) % CLIENT_PIPELINE_DEPTH;
+        count--;
+    }
+    
+    free(line);
+    fclose(fp);
+    
+    return ret == -1 ? -1 : 0;
 }
 
 int executeLocalCommand(const char *command){
@@ -180,273 +386,1785 @@ int executeLocalCommand(const char *command){
             printHelpScreen();
             break;
         }
+        
+        /* Handled by executeCommand(), it needs the connection. */
+        case client_command_batch: {
+            break;
+        }
     }
     
     return 0;
 }
 
-int executeServerReadOnlyCommand(int sockfd, const char *command){
-    char buffer[BUFFER_SIZE]; 
-    long n;                   /* Number of bytes read from the socket into the buffer */
-    
-    /* Send the command. */
-    if(write(sockfd, command, strlen(command)+1) <= 0){
-        return -1;
+
+
+
+/**************************************************************************************
+ * Server command functions.
+ *************************************************************************************/
+
+/* The server commands which have been sent and not released yet, NULL where free. */
+static PendingCommand *activeCommands[CLIENT_MAX_ACTIVE];
+
+/* The hash the server picked, every get and put is checked with it, hash_unknown for none. */
+static HashType transferHash = hash_unknown;
+
+/* 1 once the server picked COMPRESS_NAME, frame_data may be compressed both ways. */
+static int transferCompress = 0;
+
+/* The payload of the frame_data being handled, once decompressed, readPayload() hands it out. */
+static unsigned char inflated[FRAME_DATA_SIZE];
+static long          inflatedLength;
+static long          inflatedOffset;
+
+int executeStriped(int sockfd, const char *command){
+    StripeServer server;
+    const char   *filePath;
+    const char   *fileName;
+    char         *end;
+    long         connections;
+    int          get;
+    int          ret;
+    
+    get = getSharedCommandType(command) == command_get;
+    
+    /* Skip the leading "get -p " or "put -p ". */
+    connections = strtol(command + 7, &end, 10);
+    if(end == command + 7 || *end != ' ' || connections < 1){
+        printf(CFLRED "ERROR:" C_RST " -p needs the number of connections, for example '%s -p 4 FILE'.", get ? "get" : "put");
+        return 1;
     }
     
-    n = read(sockfd, buffer, sizeof(buffer));
-    if(n == 0){
-        return -1;
+    filePath = end + 1;
+    fileName = *filePath != '\0' ? extractFileName(filePath) : NULL;
+    if(fileName == NULL){
+        printf(CFLRED "ERROR:" C_RST " %s requires a path to a file.", get ? "get" : "put");
+        return 1;
     }
     
-    while(n > 0 && buffer[n-1] != '\0'){
-        fwrite(buffer, 1, n, stdout);
-        n = read(sockfd, buffer, sizeof(buffer));
+    if(get && fileExists(fileName)){
+        printf(CFLRED "ERROR:" C_RST " The file %s already exists.\n", fileName);
+        return 1;
     }
-    
-    if(n == -1){
-        return -1;
+    if(!get && isRegularFile(filePath) != 1){
+        printf("%s is not a regular file.\n", filePath);
+        return 1;
     }
     
-    /* Write the remaining bytes read. */
-    fwrite(buffer, 1, n, stdout);
+    /* The new connections start out where the prompt is, and checked the same way. */
+    server.ip   = serverIp;
+    server.port = serverPort;
+    server.hash = transferHash;
     
-    return 0;
+    ret = serverWorkingDirectory(sockfd, server.directory, sizeof(server.directory));
+    if(ret != 0){
+        return ret;
+    }
+    
+    if(get){
+        return stripeGet(&server, filePath, fileName, connections, stdout);
+    }
+    return stripePut(&server, filePath, fileName, connections, stdout);
 }
 
-int executeCommandget(int sockfd, const char *command){
-    char buffer[BUFFER_SIZE]; 
-    long totalFileSize;       
-    long numBytesLeft;        
-    long n;                   
-    int  displayNumBytesLeft; 
-    
-    const char *filePath;     
-    const char *fileName;     
-    FILE       *fp;           
+int serverWorkingDirectory(int sockfd, char *directory, long size){
+    PendingCommand *pending;
+    int            ret;
     
-    filePath = command + 3; /* Skip the leading "get" */
-    
-    /* Skip whitespace. */
-    while(*filePath != '\0' && (*filePath == ' ' || *filePath == '\t')){
-        filePath++;
+    ret = sendServerCommand(sockfd, "spwd", 1, &pending);
+    if(ret != 0){
+        return ret;
+    }
+    if(pumpConnection(sockfd, pending, 0) != 0){
+        return -1;
     }
     
-    if(*filePath == '\0'){ /* No file specified. */
-        printf(CFLRED "ERROR:" C_RST " get requires a path to a file.");
-        return 1;
+    /* Taken out of the output, so releasing the command does not print it. */
+    fclose(pending->output);
+    pending->output = stdout;
+    
+    ret = pending->result;
+    if(ret == 0 && (pending->outputSize < 2 || pending->outputBuffer[0] != '/' || (long)pending->outputSize > size)){
+        ret = 1;
     }
-    else if(filePath - command > 4){ /* More than one whitespace. */
-        printf(CFLRED "ERROR:" C_RST " only one whitespace is permitted between the command and the argument.");
-        return 1;
+    if(ret == 0){
+        memcpy(directory, pending->outputBuffer, pending->outputSize - 1);
+        directory[pending->outputSize - 1] = '\0';
     }
     
-    /* Extract the file name from the file path. */
-    fileName = extractFileName(filePath);
-    if(fileName == NULL){
-        printf(CFLRED "ERROR:" C_RST " %s is a directory.", filePath);
-        return 1;
-    }
+    free(pending->outputBuffer);
+    releaseServerCommand(pending);
     
-    /* Check if the file alreay exists. */
-    if(fileExists(fileName)){
-        printf(CFLRED "ERROR:" C_RST " The file %s already exists.\n", filePath);
-        return 1;
+    if(ret != 0){
+        printf(CFLRED "ERROR:" C_RST " Could not find the working directory on the server.");
     }
     
-    /* Create the file. */
-    fp = fopen(fileName, "w");
-    if(fp == NULL){
-        return -1;
+    return ret;
+}
+
+int sendServerCommand(int sockfd, const char *command, int buffered, PendingCommand **pending){
+    PendingCommand *p;
+    int            slot;
+    int            ret;
+    
+    /* Find room for the command. */
+    for(slot=0; slot<CLIENT_MAX_ACTIVE && activeCommands[slot] != NULL; slot++);
+    if(slot == CLIENT_MAX_ACTIVE){
+        printf(CFLRED "ERROR:" C_RST " too many commands running, wait for one to finish.");
+        return 1;
     }
     
-    /* Send the command. */
-    if(write(sockfd, command, strlen(command)+1) < 0){
+    p = malloc(sizeof(PendingCommand));
+    if(p == NULL){
         return -1;
     }
     
-    /* Get the get reply. */
-    n = read(sockfd, buffer, GET_REPLY_SIZE);
-    if(memcmp(buffer, GET_REPLY_NO, strlen(GET_REPLY_NO)) == 0){ /* An error occured, get the error message. */
-        n = read(sockfd, buffer, sizeof(buffer));
-        if(n < 0){
-            return -1;
-        }
-        fwrite(buffer, 1, n, stdout);
-        putchar('\n');
-        
-        /* Close and delete the file (fopen creates the file). */
-        if(fclose(fp) != 0){
-            return -1;
-        }
-        if(remove(fileName) != 0){
+    p->type          = getSharedCommandType(command);
+    p->background    = 0;
+    p->done          = 0;
+    p->result        = 0;
+    p->unacked       = 0;
+    p->displayCount  = 0;
+    p->fp            = NULL;
+    p->totalFileSize = -1;
+    p->numBytesLeft  = 0;
+    p->listing       = NULL;
+    p->listingSize   = 0;
+    p->listingLength = 0;
+    p->fd            = -1;
+    p->sending       = 0;
+    p->sendLeft      = 0;
+    p->hash          = NULL;
+    p->resumeOffset  = 0;
+    p->deltaApply    = NULL;
+    p->deltaEncoder  = NULL;
+    p->deltaWire     = 0;
+    p->archive       = 0;
+    p->archiveReader = NULL;
+    p->archiveBytes  = 0;
+    p->wireBytes     = 0;
+    p->rawBytes      = 0;
+    compressorInit(&p->compressor);
+    memcpy(p->command, command, strlen(command)+1);
+    
+    /* Collect the output in memory, it is printed when the command is released. */
+    p->output       = stdout;
+    p->outputBuffer = NULL;
+    p->outputSize   = 0;
+    if(buffered){
+        p->output = open_memstream(&p->outputBuffer, &p->outputSize);
+        if(p->output == NULL){
+            free(p);
             return -1;
         }
-        
-        return 1;
     }
     
-    /* Extract the size of the file from the get reply. */
-    totalFileSize = *((long *)(buffer + strlen(GET_REPLY_NO)));
-    numBytesLeft  = totalFileSize;
-    
-    /* Download the file. */
-    displayNumBytesLeft = 0;
-    while(numBytesLeft > 0 && (n=read(sockfd, buffer, sizeof(buffer))) > 0){
-        fwrite(buffer, 1, n, fp);
-        numBytesLeft -= n;
-        
-        /* Display the download status every DISPLAY_GET_PUT_INTERVAL packets. */
-        if(displayNumBytesLeft >= DISPLAY_GET_PUT_INTERVAL){
-            printf("%15ld / %ld (%%%2.2f)\r", numBytesLeft, totalFileSize, ((double)(totalFileSize-numBytesLeft) / totalFileSize) * 100.0);
-            fflush(stdout);
-            displayNumBytesLeft = 0;
-        }
-        displayNumBytesLeft++;
+    /* get has to create the file first, put has to open it. */
+    p->streamId = nextStreamId();
+    if(p->type == command_get){
+        ret = sendCommandget(sockfd, command, p);
+    }
+    else if(p->type == command_put){
+        ret = sendCommandput(sockfd, command, p);
+    }
+    else if(p->type == command_mget){
+        ret = sendCommandmget(sockfd, command, p);
+    }
+    else if(p->type == command_mput){
+        ret = sendCommandmput(sockfd, command, p);
+    }
+    else{
+        ret = frameSend(sockfd, frame_command, 0, p->streamId, command, strlen(command)) != 0 ? -1 : 0;
     }
     
-    /* Check if an error occured. */
-    if(n <= 0){
-        puts(CFLRED "ERROR:" C_RST " Could not download file.");
-        fclose(fp);
-        if(n == 0){
-            errno = 0;
+    if(ret != 0){
+        if(p->output != stdout){
+            fclose(p->output);
+            free(p->outputBuffer);
         }
-        return -1;
+        free(p);
+        return ret;
     }
     
-    puts("File downloaded, use 'smd5sum' to verify the files checksum on the server,\n"
-         "and then 'md5sum' on your computer, if they match, then the file was\n"
-         "download without error.");
-    
-    fclose(fp);
+    activeCommands[slot] = p;
+    *pending             = p;
     
     return 0;
 }
 
-int executeCommandput(int sockfd, const char *command){
-    char buffer[BUFFER_SIZE]; 
-    long totalFileSize;       
-    long numBytesLeft;        
-    long n;                   
-    int  displayNumBytesLeft; 
+int receiveServerReply(int sockfd, PendingCommand *pending){
+    int ret;
     
-    const char *filePath;     
-    const char *fileName;     
-    FILE       *fp;           
+    if(pumpConnection(sockfd, pending, 0) != 0){
+        return -1;
+    }
     
-    long ret;
+    ret = pending->result;
+    releaseServerCommand(pending);
     
-    filePath = command + 3; /* Skip the leading "get" */
+    return ret;
+}
+
+int receiveBatchReply(int sockfd, PendingCommand *pending){
+    int ret;
     
-    /* Skip whitespace. */
-    while(*filePath != '\0' && (*filePath == ' ' || *filePath == '\t')){
-        filePath++;
+    if(pumpConnection(sockfd, pending, 0) != 0){
+        return -1;
     }
     
-    /* No parameters were specified. */
-    if(*filePath == '\0'){
-        printf(CFLRED "ERROR:" C_RST " put requires a path to a file.");
-        return 1;
-    }
+    /* Label the output with the command it belongs to. */
+    printf(CFLBLU "%s" C_RST "\n", pending->command);
     
-    /* More than one whitespace. */
-    if(filePath - command > 4){
-        printf(CFLRED "ERROR:" C_RST " only one whitespace is permitted between the command and the argument.");
-        return 1;
-    }
+    ret = pending->result;
+    releaseServerCommand(pending);
+    putchar('\n');
     
-    /* Determine whether this file is a regular file. */
-    ret = isRegularFile(filePath);
-    if(ret == 0){
-        printf("%s is not a regular file.\n", filePath);
-        return 1;
-    }
-    else if(ret == -1){
-        perror(CFLRED "ERROR" C_RST);
-        return 1;
-    }
+    return ret;
+}
+
+void releaseServerCommand(PendingCommand *pending){
+    int i;
     
-    /* Extract the file name from the path */
-    fileName = extractFileName(filePath);
+    for(i=0; i<CLIENT_MAX_ACTIVE; i++){
+        if(activeCommands[i] == pending){
+            activeCommands[i] = NULL;
+        }
+    }
     
-    /* Create a new command which contains just "put " and the file name. */
-    memcpy(buffer, "put ", 4);
-    memcpy(buffer + strlen("put "), fileName, strlen(fileName)+1);
+    /* Worth a word for transfers compression saved something on. */
+    if(pending->type != command_list && pending->wireBytes < pending->rawBytes){
+        fprintf(pending->output, "Compressed: %ld bytes crossed the network for %ld bytes (%.1f%%).\n", pending->wireBytes, pending->rawBytes, 100.0 * pending->wireBytes / pending->rawBytes);
+    }
     
-    /* Open the file. */
-    fp = fopen(filePath, "r");
-    if(fp == NULL){
-        perror(CFLRED "ERROR" C_RST);
-        return 1;
+    if(pending->output != stdout){
+        fclose(pending->output);
+        fwrite(pending->outputBuffer, 1, pending->outputSize, stdout);
+        free(pending->outputBuffer);
     }
     
-    /* Send the command. */
-    if(write(sockfd, buffer, strlen(buffer)+1) <= 0){
-        return -1;
+    if(pending->deltaApply != NULL){
+        deltaApplyFree(pending->deltaApply);
+    }
+    if(pending->deltaEncoder != NULL){
+        deltaEncoderFree(pending->deltaEncoder);
+    }
+    if(pending->archiveReader != NULL){
+        archiveReaderFree(pending->archiveReader);
     }
     
-    /* Get the servers response (is it ok to upload this file or not). */
-    n = read(sockfd, buffer, PUT_REPLY_SIZE);
-    if(n <= 0){
-        return -1;
+    free(pending->hash);
+    free(pending);
+}
+
+int reapBackgroundCommands(){
+    int count;
+    int i;
+    
+    count = 0;
+    for(i=0; i<CLIENT_MAX_ACTIVE; i++){
+        if(activeCommands[i] != NULL && activeCommands[i]->background && activeCommands[i]->done){
+            printf("\n" CFLBLU "[done] %s" C_RST "\n", activeCommands[i]->command);
+            releaseServerCommand(activeCommands[i]);
+            putchar('\n');
+            count++;
+        }
     }
     
-    if(memcmp(buffer, PUT_REPLY_NO, strlen(PUT_REPLY_NO)) == 0){
-        /* An error occured, get the error message. */
-        n = read(sockfd, buffer, sizeof(buffer));
-        if(n <= 0){
+    return count;
+}
+
+int pumpConnection(int sockfd, PendingCommand *waitFor, int watchStdin){
+    static int     nextUpload = 0; /* Where the search for an upload to send starts, so they all get a turn. */
+    PendingCommand *upload;
+    struct pollfd  fds[2];
+    int            i;
+    
+    while(1){
+        /* The prompt was printed before the output, print it again. */
+        if(reapBackgroundCommands() > 0 && watchStdin){
+            printPrompt();
+        }
+        
+        if(waitFor != NULL && waitFor->done){
+            return 0;
+        }
+        
+        /* An upload which has more to send. */
+        upload = NULL;
+        for(i=0; i<CLIENT_MAX_ACTIVE && upload == NULL; i++){
+            upload = activeCommands[(nextUpload + i) % CLIENT_MAX_ACTIVE];
+            if(upload != NULL && !upload->sending){
+                upload = NULL;
+            }
+        }
+        
+        fflush(stdout);
+        
+        fds[0].fd      = sockfd;
+        fds[0].events  = POLLIN | (upload != NULL ? POLLOUT : 0);
+        fds[0].revents = 0;
+        fds[1].fd      = STDIN_FILENO;
+        fds[1].events  = POLLIN;
+        fds[1].revents = 0;
+        
+        if(poll(fds, watchStdin ? 2 : 1, -1) == -1){
+            if(errno == EINTR){
+                continue;
+            }
             return -1;
         }
-        fwrite(buffer, 1, n, stdout);
         
-        fclose(fp);
-        return 1;
-    }
-    
-    /* Send the file size. */
-    totalFileSize = fileSize(filePath);
-    numBytesLeft  = totalFileSize;
-    
-    if(write(sockfd, &totalFileSize, sizeof(totalFileSize)) <= 0){
-        return -1;
-    }
-    
-    /* Send the file. */
-    displayNumBytesLeft = 0;
-    while((n=fread(buffer, 1, sizeof(buffer), fp)) > 0){
-        if(write(sockfd, buffer, n) <= 0){
+        if(fds[0].revents & POLLIN){
+            if(receiveServerFrame(sockfd) != 0){
+                return -1;
+            }
+        }
+        else if(fds[0].revents & (POLLERR | POLLHUP | POLLNVAL)){
+            errno = 0;
             return -1;
         }
-        numBytesLeft -= n;
         
-        /* Display the upload status every DISPLAY_GET_PUT_INTERVAL packets. */
-        if(displayNumBytesLeft >= DISPLAY_GET_PUT_INTERVAL){
-            printf("%15ld / %ld (%%%2.2f)\r", numBytesLeft
-                                            , totalFileSize
-                                            , ((double)(totalFileSize-numBytesLeft)) / totalFileSize * 100.0);
-            fflush(stdout);
-            displayNumBytesLeft = 0;
+        if(upload != NULL && (fds[0].revents & POLLOUT)){
+            nextUpload = (nextUpload + i) % CLIENT_MAX_ACTIVE;
+            if(sendCommandputData(sockfd, upload) != 0){
+                return -1;
+            }
+        }
+        
+        /* The user typed something. */
+        if(watchStdin && fds[1].revents != 0){
+            return 0;
         }
-        displayNumBytesLeft++;
     }
-    
-    fclose(fp);
-    
-    puts("File uploaded, use 'smd5sum' to verify the files checksum on the server,\n"
-         "and then 'md5sum' on your computer, if they match, then the file was\n"
-         "uploaded without error.");
-    
-    return 0;
 }
 
-ClientCommandType getClientCommandType(const char *command){
-    if(strncmp(CLIENT_COMMAND_CD, command, strlen(CLIENT_COMMAND_CD)) == 0){
-        return client_command_cd;
+int receiveServerFrame(int sockfd){
+    PendingCommand *pending;
+    FrameHeader    header;
+    uint32_t       wireLength;
+    int            i;
+    
+    if(frameReceiveHeader(sockfd, &header) != 0){
+        return -1;
+    }
+    
+    /* The server picked the hash transfers are checked with, and the codec. */
+    if(header.type == frame_hash && header.streamId == 0){
+        return receiveTransferHash(sockfd, &header);
+    }
+    if(header.type == frame_compress && header.streamId == 0){
+        return receiveTransferCompression(sockfd, &header);
+    }
+    
+    /* A compressed payload is decompressed before anyone sees it, the handlers read it with readPayload(). */
+    inflatedLength = 0;
+    inflatedOffset = 0;
+    wireLength     = header.length;
+    if((header.flags & FRAME_FLAG_COMPRESSED) && receiveCompressed(sockfd, &header) != 0){
+        return -1;
+    }
+    
+    /* Find the command the frame belongs to, a frame for any other stream means the two sides are out of sync. */
+    pending = NULL;
+    for(i=0; i<CLIENT_MAX_ACTIVE; i++){
+        if(activeCommands[i] != NULL && !activeCommands[i]->done && activeCommands[i]->streamId == header.streamId){
+            pending = activeCommands[i];
+            break;
+        }
+    }
+    if(pending == NULL){
+        errno = EPROTO;
+        return -1;
+    }
+    
+    if(header.type == frame_data && transferCompress){
+        pending->wireBytes += wireLength;
+        pending->rawBytes  += header.length;
+    }
+    
+    switch(pending->type){
+        case command_get: { return receiveCommandget(sockfd, pending, &header); }
+        case command_put: { return receiveCommandput(sockfd, pending, &header); }
+        case command_mget: { return receiveCommandget(sockfd, pending, &header); }
+        case command_mput: { return receiveCommandput(sockfd, pending, &header); }
+        default:          { return receiveServerReadOnlyReply(sockfd, pending, &header); }
+    }
+}
+
+int receiveTransferHash(int sockfd, const FrameHeader *header){
+    char name[BUFFER_SIZE];
+    
+    if(header->length >= sizeof(name) || readAll(sockfd, name, header->length) != 0){
+        errno = EPROTO;
+        return -1;
+    }
+    name[header->length] = '\0';
+    
+    transferHash = hashFromName(name);
+    
+    return 0;
+}
+
+int receiveTransferCompression(int sockfd, const FrameHeader *header){
+    char name[BUFFER_SIZE];
+    
+    if(header->length >= sizeof(name) || readAll(sockfd, name, header->length) != 0){
+        errno = EPROTO;
+        return -1;
+    }
+    name[header->length] = '\0';
+    
+    transferCompress = strcmp(name, COMPRESS_NAME) == 0;
+    
+    return 0;
+}
+
+int receiveCompressed(int sockfd, FrameHeader *header){
+    unsigned char payload[COMPRESS_FRAME_SIZE];
+    long          n;
+    
+    if(header->type != frame_data || !transferCompress || header->length > sizeof(payload)){
+        errno = EPROTO;
+        return -1;
+    }
+    
+    if(readAll(sockfd, payload, header->length) != 0){
+        return -1;
+    }
+    
+    n = decompressFrame(payload, header->length, inflated, sizeof(inflated));
+    if(n == -1){
+        return -1;
+    }
+    
+    header->length = n;
+    inflatedLength = n;
+    inflatedOffset = 0;
+    
+    return 0;
+}
+
+int readPayload(int sockfd, void *data, long length){
+    if(inflatedLength == 0){
+        return readAll(sockfd, data, length);
+    }
+    
+    if(length > inflatedLength - inflatedOffset){
+        errno = EPROTO;
+        return -1;
+    }
+    
+    memcpy(data, inflated + inflatedOffset, length);
+    inflatedOffset += length;
+    
+    return 0;
+}
+
+int startTransferHash(PendingCommand *pending){
+    if(transferHash == hash_unknown){
+        return 0;
+    }
+    
+    pending->hash = malloc(sizeof(HashState));
+    if(pending->hash == NULL){
+        return -1;
+    }
+    hashInit(pending->hash, transferHash);
+    
+    return 0;
+}
+
+int acknowledgeData(int sockfd, PendingCommand *pending, uint32_t length){
+    unsigned char windowBuffer[FRAME_WINDOW_SIZE];
+    
+    /* Half of the window is a good trade between the number of frame_window sent and the server waiting for one. */
+    pending->unacked += length;
+    if(pending->unacked < FRAME_WINDOW / 2){
+        return 0;
+    }
+    
+    packUint32(windowBuffer, pending->unacked);
+    pending->unacked = 0;
+    
+    return frameSend(sockfd, frame_window, 0, pending->streamId, windowBuffer, sizeof(windowBuffer));
+}
+
+int receiveServerReadOnlyReply(int sockfd, PendingCommand *pending, const FrameHeader *header){
+    unsigned char sizeBuffer[FRAME_SIZE_SIZE];
+    int           ret;
+    
+    switch(header->type){
+        /* A native sls, the listing records follow. */
+        case frame_size: {
+            if(pending->type != command_list || pending->listing != NULL || header->length != FRAME_SIZE_SIZE || readAll(sockfd, sizeBuffer, sizeof(sizeBuffer)) != 0){
+                break;
+            }
+            
+            pending->listingSize = unpackUint64(sizeBuffer);
+            pending->listing     = malloc(pending->listingSize > 0 ? pending->listingSize : 1);
+            if(pending->listing == NULL){
+                return -1;
+            }
+            return 0;
+        }
+        
+        /* Print the output until the end of the stream, or collect the listing records. */
+        case frame_data: {
+            if(pending->listing != NULL){
+                if((long)header->length > pending->listingSize - pending->listingLength || readPayload(sockfd, pending->listing + pending->listingLength, header->length) != 0){
+                    break;
+                }
+                pending->listingLength += header->length;
+            }
+            else if(receivePayload(sockfd, header->length, pending->output) != 0){
+                return -1;
+            }
+            return acknowledgeData(sockfd, pending, header->length);
+        }
+        
+        case frame_end: {
+            if(pending->listing != NULL){
+                ret = pending->listingLength == pending->listingSize ? printListing(pending->output, pending->listing, pending->listingLength, listingLongFormat(pending->command)) : -1;
+                
+                free(pending->listing);
+                pending->listing = NULL;
+                
+                if(ret != 0){
+                    break;
+                }
+            }
+            
+            pending->done = 1;
+            return 0;
+        }
+        
+        case frame_error: {
+            if(receivePayload(sockfd, header->length, pending->output) != 0){
+                return -1;
+            }
+            fputc('\n', pending->output);
+            
+            pending->done   = 1;
+            pending->result = 1;
+            return 0;
+        }
+        
+        default: {
+            break;
+        }
+    }
+    
+    errno = EPROTO;
+    return -1;
+}
+
+int printListing(FILE *output, const unsigned char *records, long length, int longFormat){
+    ListingRecord record;
+    char          mode[11];
+    char          timeBuffer[32];
+    time_t        mtime;
+    struct tm     *tm;
+    int           printed;      /* 1 once anything has been printed. */
+    long          n;
+    
+    printed = 0;
+    while(length > 0){
+        n = listingDecodeRecord(records, length, &record);
+        if(n == -1){
+            return -1;
+        }
+        records += n;
+        length  -= n;
+        
+        /* The entries which follow belong to another directory, separated by a blank line like ls does. */
+        if(record.kind == listing_record_directory){
+            fprintf(output, "%s%.*s:\n", printed ? "\n" : "", record.nameLength, record.name);
+            printed = 1;
+            continue;
+        }
+        printed = 1;
+        
+        if(!longFormat){
+            fprintf(output, "%.*s\n", record.nameLength, record.name);
+            continue;
+        }
+        
+        /* The file type and permissions, "drwxr-xr-x". */
+        mode[0]  = S_ISDIR(record.mode) ? 'd' : S_ISLNK(record.mode) ? 'l' : S_ISCHR(record.mode) ? 'c' : S_ISBLK(record.mode) ? 'b' : S_ISFIFO(record.mode) ? 'p' : S_ISSOCK(record.mode) ? 's' : '-';
+        mode[1]  = (record.mode & S_IRUSR) ? 'r' : '-';
+        mode[2]  = (record.mode & S_IWUSR) ? 'w' : '-';
+        mode[3]  = (record.mode & S_IXUSR) ? ((record.mode & S_ISUID) ? 's' : 'x') : ((record.mode & S_ISUID) ? 'S' : '-');
+        mode[4]  = (record.mode & S_IRGRP) ? 'r' : '-';
+        mode[5]  = (record.mode & S_IWGRP) ? 'w' : '-';
+        mode[6]  = (record.mode & S_IXGRP) ? ((record.mode & S_ISGID) ? 's' : 'x') : ((record.mode & S_ISGID) ? 'S' : '-');
+        mode[7]  = (record.mode & S_IROTH) ? 'r' : '-';
+        mode[8]  = (record.mode & S_IWOTH) ? 'w' : '-';
+        mode[9]  = (record.mode & S_IXOTH) ? ((record.mode & S_ISVTX) ? 't' : 'x') : ((record.mode & S_ISVTX) ? 'T' : '-');
+        mode[10] = '\0';
+        
+        mtime = record.mtime;
+        tm    = localtime(&mtime);
+        if(tm == NULL || strftime(timeBuffer, sizeof(timeBuffer), "%b %e %H:%M", tm) == 0){
+            strcpy(timeBuffer, "?");
+        }
+        
+        /* The server sends numeric owners, its user names mean nothing on this machine. */
+        fprintf(output, "%s %3u %5u %5u %10llu %s %.*s\n", mode, record.nlink, record.uid, record.gid, (unsigned long long)record.size, timeBuffer, record.nameLength, record.name);
+    }
+    
+    return 0;
+}
+
+int listingLongFormat(const char *command){
+    const char *c;
+    
+    /* Any option group containing an 'l', "sls -l", "sls -la /tmp". */
+    for(c = command; *c != '\0'; c++){
+        if(*c == '-' && (c == command || c[-1] == ' ' || c[-1] == '\t')){
+            for(c++; *c != '\0' && *c != ' ' && *c != '\t'; c++){
+                if(*c == 'l'){
+                    return 1;
+                }
+            }
+            if(*c == '\0'){
+                break;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+int sendCommandget(int sockfd, const char *command, PendingCommand *pending){
+    char          buffer[BUFFER_SIZE];
+    const char    *argument;
+    const char    *filePath;     
+    const char    *fileName;     
+    int           resume;
+    int           delta;
+    long          offset;
+    unsigned char digest[RESUME_HASH_SIZE];
+    char          hex[2 * RESUME_HASH_SIZE + 1];
+    
+    argument = command + 3; /* Skip the leading "get" */
+    
+    /* Striped transfers have connections of their own, executeCommand() runs them. */
+    if(strncmp(argument, " -p ", 4) == 0){
+        printf(CFLRED "ERROR:" C_RST " get -p can not run in a batch.");
+        return 1;
+    }
+    
+    /* "get -r DIR" downloads a whole directory. */
+    if(strncmp(argument, " -r ", 4) == 0){
+        return sendCommandgetDirectory(sockfd, argument + 4, pending);
+    }
+    
+    /* "get -c FILE" carries on with a download which was cut short, "get -d FILE" only downloads what changed. */
+    resume = strncmp(argument, " -c ", 4) == 0;
+    delta  = strncmp(argument, " -d ", 4) == 0;
+    if(resume || delta){
+        argument += 3;
+    }
+    
+    /* Skip whitespace. */
+    filePath = argument;
+    while(*filePath != '\0' && (*filePath == ' ' || *filePath == '\t')){
+        filePath++;
+    }
+    
+    if(*filePath == '\0'){ /* No file specified. */
+        printf(CFLRED "ERROR:" C_RST " get requires a path to a file.");
+        return 1;
+    }
+    else if(filePath - argument > 1){ /* More than one whitespace. */
+        printf(CFLRED "ERROR:" C_RST " only one whitespace is permitted between the command and the argument.");
+        return 1;
+    }
+    
+    /* Extract the file name from the file path. */
+    fileName = extractFileName(filePath);
+    if(fileName == NULL){
+        printf(CFLRED "ERROR:" C_RST " %s is a directory.", filePath);
+        return 1;
+    }
+    
+    /* Check if the file alreay exists. */
+    offset = resume ? fileSize(fileName) : -1;
+    if(delta && fileExists(fileName)){
+        return sendCommandgetDelta(sockfd, filePath, fileName, pending);
+    }
+    if(!resume && !delta && fileExists(fileName)){
+        printf(CFLRED "ERROR:" C_RST " The file %s already exists, 'get -c' resumes it, 'get -d' updates it.\n", filePath);
+        return 1;
+    }
+    
+    /* Open what was downloaded so far, or create the file. */
+    pending->fp = fopen(fileName, offset > 0 ? "r+" : "w");
+    if(pending->fp == NULL){
+        return -1;
+    }
+    memcpy(pending->fileName, fileName, strlen(fileName)+1);
+    
+    /* Ask for the rest, telling the server how the part which is here ends. */
+    if(offset > 0){
+        if(resumeBlockHash(fileno(pending->fp), offset, digest) != 0){
+            fclose(pending->fp);
+            return -1;
+        }
+        hashToHex(digest, RESUME_HASH_SIZE, hex);
+        
+        if(snprintf(buffer, sizeof(buffer), "get -c %ld %s %s", offset, hex, filePath) >= (int)sizeof(buffer)){
+            printf(CFLRED "ERROR:" C_RST " command too long.");
+            fclose(pending->fp);
+            return 1;
+        }
+        command = buffer;
+        pending->resumeOffset = offset;
+    }
+    else{
+        snprintf(buffer, sizeof(buffer), "get %s", filePath);
+        command = buffer;
+    }
+    
+    /* Send the command. */
+    if(frameSend(sockfd, frame_command, 0, pending->streamId, command, strlen(command)) != 0){
+        fclose(pending->fp);
+        return -1;
+    }
+    
+    return 0;
+}
+
+int sendCommandgetDelta(int sockfd, const char *filePath, const char *fileName, PendingCommand *pending){
+    char        buffer[BUFFER_SIZE];
+    struct stat s;
+    int         basisfd;
+    
+    basisfd = open(fileName, O_RDONLY | O_CLOEXEC);
+    if(basisfd == -1 || fstat(basisfd, &s) != 0 || !S_ISREG(s.st_mode)){
+        printf(CFLRED "ERROR:" C_RST " %s is not a regular file.", fileName);
+        if(basisfd != -1){
+            close(basisfd);
+        }
+        return 1;
+    }
+    
+    if(snprintf(buffer, sizeof(buffer), "get -d %ld %s", (long)s.st_size, filePath) >= (int)sizeof(buffer)){
+        printf(CFLRED "ERROR:" C_RST " command too long.");
+        close(basisfd);
+        return 1;
+    }
+    
+    /* The new file is rebuilt next to the copy here, and takes its place once all of it arrived. */
+    pending->deltaApply = deltaApplyCreate(AT_FDCWD, fileName, basisfd, s.st_size);
+    if(pending->deltaApply == NULL){
+        close(basisfd);
+        return -1;
+    }
+    
+    pending->fp = fdopen(pending->deltaApply->outfd, "w");
+    if(pending->fp == NULL){
+        close(pending->deltaApply->outfd);
+        deltaApplyFree(pending->deltaApply);
+        pending->deltaApply = NULL;
+        return -1;
+    }
+    memcpy(pending->fileName, fileName, strlen(fileName)+1);
+    
+    if(frameSend(sockfd, frame_command, 0, pending->streamId, buffer, strlen(buffer)) != 0){
+        fclose(pending->fp);
+        deltaApplyFree(pending->deltaApply);
+        pending->deltaApply = NULL;
+        return -1;
+    }
+    
+    return 0;
+}
+
+int sendDeltaSignatures(int sockfd, PendingCommand *pending){
+    unsigned char sizeBuffer[FRAME_SIZE_SIZE];
+    unsigned char *signatures;
+    long          length;
+    long          sent;
+    long          n;
+    
+    signatures = deltaSignatures(pending->deltaApply->basisfd, pending->deltaApply->basisSize, &length);
+    if(signatures == NULL){
+        if(errno == 0){
+            puts(CFLRED "ERROR:" C_RST " File shrank while its signatures were made.");
+            errno = EIO;
+        }
+        return -1;
+    }
+    
+    packUint64(sizeBuffer, length);
+    if(frameSend(sockfd, frame_size, 0, pending->streamId, sizeBuffer, sizeof(sizeBuffer)) != 0){
+        free(signatures);
+        return -1;
+    }
+    
+    for(sent=0; sent<length; sent+=n){
+        n = length - sent < FRAME_DATA_SIZE ? length - sent : FRAME_DATA_SIZE;
+        if(frameSend(sockfd, frame_data, 0, pending->streamId, signatures + sent, n) != 0){
+            free(signatures);
+            return -1;
+        }
+    }
+    free(signatures);
+    pending->deltaWire += length;
+    
+    return frameSend(sockfd, frame_end, 0, pending->streamId, NULL, 0);
+}
+
+int receiveCommandget(int sockfd, PendingCommand *pending, const FrameHeader *header){
+    char          buffer[FRAME_DATA_SIZE];
+    unsigned char sizeBuffer[FRAME_SIZE_SIZE];
+    unsigned char trailer[FRAME_TRAILER_SIZE];
+    long          offset;
+    
+    if(pending->archive){
+        return receiveCommandgetArchive(sockfd, pending, header);
+    }
+    
+    switch(header->type){
+        /* The file could not be downloaded. */
+        case frame_error: {
+            if(receivePayload(sockfd, header->length, pending->output) != 0){
+                return -1;
+            }
+            fputc('\n', pending->output);
+            
+            /* Close the file, and delete it unless it holds an earlier download (fopen creates the file). get -d only removes the file it would have rebuilt. */
+            if(fclose(pending->fp) != 0){
+                return -1;
+            }
+            if(pending->deltaApply != NULL){
+                deltaApplyFree(pending->deltaApply);
+                pending->deltaApply = NULL;
+            }
+            else if(pending->resumeOffset == 0 && remove(pending->fileName) != 0){
+                return -1;
+            }
+            
+            pending->done   = 1;
+            pending->result = 1;
+            return 0;
+        }
+        
+        /* get -d: the server wants the signatures of the copy here before it sends anything. */
+        case frame_ok: {
+            if(pending->deltaApply != NULL && pending->totalFileSize == -1 && header->length == 0){
+                return sendDeltaSignatures(sockfd, pending);
+            }
+            
+            /* get -c: where the server carries on from, 0 if the part which is here does not match. */
+            if(pending->resumeOffset == 0 || pending->totalFileSize != -1 || header->length != FRAME_SIZE_SIZE || readAll(sockfd, sizeBuffer, sizeof(sizeBuffer)) != 0){
+                break;
+            }
+            
+            offset = unpackUint64(sizeBuffer);
+            if(offset != pending->resumeOffset){
+                fputs("The file here does not match the one on the server, downloading all of it.\n", pending->output);
+                fflush(pending->fp);
+                if(ftruncate(fileno(pending->fp), offset) != 0){
+                    return -1;
+                }
+            }
+            
+            pending->resumeOffset = offset;
+            return fseek(pending->fp, offset, SEEK_SET);
+        }
+        
+        /* The number of bytes which follow, the rest of the file. */
+        case frame_size: {
+            if(pending->totalFileSize != -1 || header->length != FRAME_SIZE_SIZE || readAll(sockfd, sizeBuffer, sizeof(sizeBuffer)) != 0){
+                break;
+            }
+            
+            pending->numBytesLeft  = unpackUint64(sizeBuffer);
+            pending->totalFileSize = pending->resumeOffset + pending->numBytesLeft;
+            if(startTransferHash(pending) != 0){
+                return -1;
+            }
+            
+            /* get -d: the file is hashed as it is rebuilt. */
+            if(pending->deltaApply != NULL){
+                pending->deltaApply->hash = pending->hash;
+            }
+            return 0;
+        }
+        
+        /* Every frame_data holds the next part of the file (get -d: the next instructions to rebuild it, the file is as long as they say). */
+        case frame_data: {
+            if(pending->totalFileSize == -1 || header->length > sizeof(buffer) || (pending->deltaApply == NULL && (long)header->length > pending->numBytesLeft) || readPayload(sockfd, buffer, header->length) != 0){
+                break;
+            }
+            
+            if(pending->deltaApply != NULL){
+                if(deltaApply(pending->deltaApply, buffer, header->length) != 0 || pending->deltaApply->written > pending->totalFileSize){
+                    break;
+                }
+                pending->numBytesLeft  = pending->totalFileSize - pending->deltaApply->written;
+                pending->deltaWire    += header->length;
+            }
+            else{
+                fwrite(buffer, 1, header->length, pending->fp);
+                pending->numBytesLeft -= header->length;
+                
+                if(pending->hash != NULL){
+                    hashUpdate(pending->hash, buffer, header->length);
+                }
+            }
+            
+            /* Display the download status every DISPLAY_GET_PUT_INTERVAL frames, unless the output is not being shown. */
+            if(pending->output == stdout && pending->displayCount >= DISPLAY_GET_PUT_INTERVAL){
+                printf("%15ld / %ld (%%%2.2f)\r", pending->numBytesLeft, pending->totalFileSize, ((double)(pending->totalFileSize-pending->numBytesLeft) / pending->totalFileSize) * 100.0);
+                fflush(stdout);
+                pending->displayCount = 0;
+            }
+            pending->displayCount++;
+            
+            return acknowledgeData(sockfd, pending, header->length);
+        }
+        
+        /* The stream has to end with the whole file, and the hash of it if one was negotiated. */
+        case frame_end: {
+            fclose(pending->fp);
+            
+            if(pending->resumeOffset > 0){
+                fprintf(pending->output, "Resumed after %ld bytes.\n", pending->resumeOffset);
+            }
+            
+            if(pending->totalFileSize == -1 || pending->numBytesLeft != 0 || header->length > sizeof(trailer) || readAll(sockfd, trailer, header->length) != 0){
+                puts(CFLRED "ERROR:" C_RST " Could not download file.");
+                errno = EPROTO;
+                return -1;
+            }
+            
+            if(pending->deltaApply != NULL){
+                return finishCommandgetDelta(pending, trailer, header->length);
+            }
+            
+            /* No trailer, the file can only be checked by hand. */
+            if(pending->hash == NULL || header->length == 0){
+                fputs("File downloaded, use 'smd5sum' to verify the files checksum on the server,\n"
+                      "and then 'md5sum' on your computer, if they match, then the file was\n"
+                      "download without error.\n", pending->output);
+            }
+            else if(frameCheckTrailer(trailer, header->length, pending->hash)){
+                fprintf(pending->output, "File downloaded, %s checksum verified.\n", hashName(transferHash));
+            }
+            /* The file is not what the server sent, do not leave it behind looking like it is. What an earlier download got is kept. */
+            else if(pending->resumeOffset > 0){
+                fprintf(pending->output, CFLRED "ERROR:" C_RST " %s checksum mismatch, the download was damaged and has been cut back to where it resumed.\n", hashName(transferHash));
+                if(truncate(pending->fileName, pending->resumeOffset) != 0){
+                    return -1;
+                }
+                pending->result = 1;
+            }
+            else{
+                fprintf(pending->output, CFLRED "ERROR:" C_RST " %s checksum mismatch, the download was damaged and has been removed.\n", hashName(transferHash));
+                if(remove(pending->fileName) != 0){
+                    return -1;
+                }
+                pending->result = 1;
+            }
+            
+            pending->done = 1;
+            return 0;
+        }
+    }
+    
+    puts(CFLRED "ERROR:" C_RST " Could not download file.");
+    errno = EPROTO;
+    return -1;
+}
+
+int sendCommandgetDirectory(int sockfd, const char *path, PendingCommand *pending){
+    char buffer[BUFFER_SIZE];
+    int  dirfd;
+    
+    if(*path == '\0' || *path == ' ' || *path == '\t'){
+        printf(CFLRED "ERROR:" C_RST " get -r requires a path to a directory.");
+        return 1;
+    }
+    
+    /* The directory is created here under its own name, it must not exist yet. */
+    if(directoryName(path, pending->fileName, sizeof(pending->fileName)) != 0){
+        printf(CFLRED "ERROR:" C_RST " %s does not end with a directory name.", path);
+        return 1;
+    }
+    
+    if(mkdir(pending->fileName, 0700) != 0){
+        if(errno == EEXIST){
+            printf(CFLRED "ERROR:" C_RST " %s already exists.", pending->fileName);
+        }
+        else{
+            perror(CFLRED "ERROR" C_RST);
+        }
+        return 1;
+    }
+    
+    dirfd = open(pending->fileName, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if(dirfd == -1){
+        rmdir(pending->fileName);
+        return -1;
+    }
+    
+    pending->archiveReader = archiveReaderCreate(dirfd, pending->output);
+    if(pending->archiveReader == NULL){
+        close(dirfd);
+        rmdir(pending->fileName);
+        return -1;
+    }
+    pending->archive = 1;
+    
+    snprintf(buffer, sizeof(buffer), "get -r %s", path);
+    if(frameSend(sockfd, frame_command, 0, pending->streamId, buffer, strlen(buffer)) != 0){
+        archiveReaderFree(pending->archiveReader);
+        pending->archiveReader = NULL;
+        rmdir(pending->fileName);
+        return -1;
+    }
+    
+    return 0;
+}
+
+int sendCommandmget(int sockfd, const char *command, PendingCommand *pending){
+    const char *patterns;
+    int        dirfd;
+    
+    patterns = command + 4; /* Skip the leading "mget" */
+    while(*patterns == ' ' || *patterns == '\t'){
+        patterns++;
+    }
+    
+    if(*patterns == '\0'){
+        printf(CFLRED "ERROR:" C_RST " mget requires patterns of the files.");
+        return 1;
+    }
+    
+    /* The files arrive next to each other in the working directory, one which already exists is skipped. */
+    dirfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(dirfd == -1){
+        return -1;
+    }
+    
+    pending->archiveReader = archiveReaderCreate(dirfd, pending->output);
+    if(pending->archiveReader == NULL){
+        close(dirfd);
+        return -1;
+    }
+    pending->archiveReader->filesOnly = 1;
+    pending->archive                  = 1;
+    
+    if(frameSend(sockfd, frame_command, 0, pending->streamId, command, strlen(command)) != 0){
+        archiveReaderFree(pending->archiveReader);
+        pending->archiveReader = NULL;
+        return -1;
+    }
+    
+    return 0;
+}
+
+int receiveCommandgetArchive(int sockfd, PendingCommand *pending, const FrameHeader *header){
+    char          buffer[FRAME_DATA_SIZE];
+    unsigned char trailer[FRAME_TRAILER_SIZE];
+    ArchiveReader *reader;
+    
+    reader = pending->archiveReader;
+    
+    switch(header->type){
+        /* The directory could not be sent, the empty one here goes again. */
+        case frame_error: {
+            if(receivePayload(sockfd, header->length, pending->output) != 0){
+                return -1;
+            }
+            fputc('\n', pending->output);
+            
+            archiveReaderFree(reader);
+            pending->archiveReader = NULL;
+            if(pending->type == command_get){
+                rmdir(pending->fileName);
+            }
+            
+            pending->done   = 1;
+            pending->result = 1;
+            return 0;
+        }
+        
+        /* The archive follows. */
+        case frame_ok: {
+            if(header->length != 0 || pending->totalFileSize != -1){
+                break;
+            }
+            pending->totalFileSize = 0;
+            return startTransferHash(pending);
+        }
+        
+        /* The next part of the archive, extracted as it arrives. */
+        case frame_data: {
+            if(pending->totalFileSize == -1 || header->length > sizeof(buffer) || readPayload(sockfd, buffer, header->length) != 0){
+                break;
+            }
+            
+            if(pending->hash != NULL){
+                hashUpdate(pending->hash, buffer, header->length);
+            }
+            if(archiveReaderWrite(reader, buffer, header->length) != 0){
+                break;
+            }
+            pending->archiveBytes += header->length;
+            
+            /* Display the download status every DISPLAY_GET_PUT_INTERVAL frames, unless the output is not being shown. */
+            if(pending->output == stdout && pending->displayCount >= DISPLAY_GET_PUT_INTERVAL){
+                printf("%15ld files, %ld bytes\r", reader->files, reader->bytes);
+                fflush(stdout);
+                pending->displayCount = 0;
+            }
+            pending->displayCount++;
+            
+            return acknowledgeData(sockfd, pending, header->length);
+        }
+        
+        /* The whole archive arrived, and the hash of it if one was negotiated. */
+        case frame_end: {
+            if(pending->totalFileSize == -1 || header->length > sizeof(trailer) || readAll(sockfd, trailer, header->length) != 0 || archiveReaderFinish(reader) != 0){
+                break;
+            }
+            
+            if(pending->type == command_mget){
+                fprintf(pending->output, "Files downloaded: %ld files, %ld bytes (%ld bytes of archive).\n", reader->files, reader->bytes, pending->archiveBytes);
+            }
+            else{
+                fprintf(pending->output, "Directory downloaded: %ld files, %ld directories, %ld symbolic links, %ld bytes (%ld bytes of archive).\n", reader->files, reader->numDirectories, reader->links, reader->bytes, pending->archiveBytes);
+            }
+            
+            /* What arrived stays, the user can tell what is wrong with it. */
+            if(pending->hash != NULL && header->length != 0 && !frameCheckTrailer(trailer, header->length, pending->hash)){
+                fprintf(pending->output, CFLRED "ERROR:" C_RST " %s checksum mismatch, the download was damaged.\n", hashName(transferHash));
+                pending->result = 1;
+            }
+            else if(pending->hash != NULL && header->length != 0){
+                fprintf(pending->output, "%s checksum verified.\n", hashName(transferHash));
+            }
+            
+            if(reader->errors > 0){
+                fprintf(pending->output, CFLRED "ERROR:" C_RST " %ld entries could not be downloaded, they are listed above.\n", reader->errors);
+                pending->result = 1;
+            }
+            
+            pending->done = 1;
+            return 0;
+        }
+    }
+    
+    puts(CFLRED "ERROR:" C_RST " Could not download the archive.");
+    errno = EPROTO;
+    return -1;
+}
+
+int finishCommandgetDelta(PendingCommand *pending, const unsigned char *trailer, uint32_t trailerLength){
+    fprintf(pending->output, "Delta: %ld bytes crossed the network for a %ld byte file (%.1f%%).\n", pending->deltaWire, pending->totalFileSize, pending->totalFileSize > 0 ? 100.0 * pending->deltaWire / pending->totalFileSize : 100.0);
+    
+    /* The file here is only replaced by one which is intact. */
+    if(pending->hash != NULL && trailerLength != 0 && !frameCheckTrailer(trailer, trailerLength, pending->hash)){
+        fprintf(pending->output, CFLRED "ERROR:" C_RST " %s checksum mismatch, the download was damaged, %s was left as it was.\n", hashName(transferHash), pending->fileName);
+        pending->result = 1;
+    }
+    else if(deltaApplyFinish(pending->deltaApply) != 0){
+        perror(CFLRED "ERROR" C_RST);
+        pending->result = 1;
+    }
+    else if(pending->hash == NULL || trailerLength == 0){
+        fputs("File updated, use 'smd5sum' to verify the files checksum on the server,\n"
+              "and then 'md5sum' on your computer, if they match, then the file was\n"
+              "download without error.\n", pending->output);
+    }
+    else{
+        fprintf(pending->output, "File updated, %s checksum verified.\n", hashName(transferHash));
+    }
+    
+    deltaApplyFree(pending->deltaApply);
+    pending->deltaApply = NULL;
+    pending->done       = 1;
+    
+    return 0;
+}
+
+int sendCommandput(int sockfd, const char *command, PendingCommand *pending){
+    char       buffer[BUFFER_SIZE]; 
+    const char *argument;
+    const char *filePath;     
+    const char *fileName;     
+    const char *prefix;
+    long       ret;
+    
+    argument = command + 3; /* Skip the leading "put" */
+    
+    /* Striped transfers have connections of their own, executeCommand() runs them. */
+    if(strncmp(argument, " -p ", 4) == 0){
+        printf(CFLRED "ERROR:" C_RST " put -p can not run in a batch.");
+        return 1;
+    }
+    
+    /* "put -r DIR" uploads a whole directory. */
+    if(strncmp(argument, " -r ", 4) == 0){
+        return sendCommandputDirectory(sockfd, argument + 4, pending);
+    }
+    
+    /* "put -c FILE" carries on with an upload which was cut short, "put -d FILE" only uploads what changed. */
+    prefix = "put ";
+    if(strncmp(argument, " -c ", 4) == 0 || strncmp(argument, " -d ", 4) == 0){
+        prefix    = argument[2] == 'c' ? "put -c " : "put -d ";
+        argument += 3;
+    }
+    
+    /* Skip whitespace. */
+    filePath = argument;
+    while(*filePath != '\0' && (*filePath == ' ' || *filePath == '\t')){
+        filePath++;
+    }
+    
+    /* No parameters were specified. */
+    if(*filePath == '\0'){
+        printf(CFLRED "ERROR:" C_RST " put requires a path to a file.");
+        return 1;
+    }
+    
+    /* More than one whitespace. */
+    if(filePath - argument > 1){
+        printf(CFLRED "ERROR:" C_RST " only one whitespace is permitted between the command and the argument.");
+        return 1;
+    }
+    
+    /* Determine whether this file is a regular file. */
+    ret = isRegularFile(filePath);
+    if(ret == 0){
+        printf("%s is not a regular file.\n", filePath);
+        return 1;
+    }
+    else if(ret == -1){
+        perror(CFLRED "ERROR" C_RST);
+        return 1;
+    }
+    
+    /* Extract the file name from the path */
+    fileName = extractFileName(filePath);
+    
+    /* Create a new command which contains just "put " (or "put -c ", "put -d ") and the file name. */
+    snprintf(buffer, sizeof(buffer), "%s%s", prefix, fileName);
+    
+    /* Open the file, it is sent once the server accepts it. */
+    pending->fd = open(filePath, O_RDONLY | O_CLOEXEC);
+    if(pending->fd == -1){
+        perror(CFLRED "ERROR" C_RST);
+        return 1;
+    }
+    
+    /* Send the command. */
+    if(frameSend(sockfd, frame_command, 0, pending->streamId, buffer, strlen(buffer)) != 0){
+        close(pending->fd);
+        return -1;
+    }
+    
+    return 0;
+}
+
+int sendCommandputDirectory(int sockfd, const char *path, PendingCommand *pending){
+    char        buffer[BUFFER_SIZE];
+    char        name[BUFFER_SIZE];
+    struct stat s;
+    int         pipefd[2];
+    
+    if(*path == '\0' || *path == ' ' || *path == '\t'){
+        printf(CFLRED "ERROR:" C_RST " put -r requires a path to a directory.");
+        return 1;
+    }
+    
+    if(stat(path, &s) != 0 || !S_ISDIR(s.st_mode)){
+        printf(CFLRED "ERROR:" C_RST " %s is not a directory.", path);
+        return 1;
+    }
+    
+    if(directoryName(path, name, sizeof(name)) != 0){
+        printf(CFLRED "ERROR:" C_RST " %s does not end with a directory name.", path);
+        return 1;
+    }
+    
+    if(snprintf(buffer, sizeof(buffer), "put -r %s", name) >= (int)sizeof(buffer)){
+        printf(CFLRED "ERROR:" C_RST " command too long.");
+        return 1;
+    }
+    
+    /* A thread writes the archive into a pipe, it is sent from there once the server created the directory. */
+    if(pipe2(pipefd, O_CLOEXEC) != 0){
+        return -1;
+    }
+    if(archiveStart(pipefd[1], AT_FDCWD, path) != 0){
+        perror(CFLRED "ERROR" C_RST);
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return 1;
+    }
+    pending->fd      = pipefd[0];
+    pending->archive = 1;
+    
+    if(frameSend(sockfd, frame_command, 0, pending->streamId, buffer, strlen(buffer)) != 0){
+        close(pending->fd);
+        return -1;
+    }
+    
+    return 0;
+}
+
+int sendCommandmput(int sockfd, const char *command, PendingCommand *pending){
+    char        arguments[BUFFER_SIZE];
+    char        *pattern;
+    char        *save;
+    char        **files;
+    glob_t      matches;
+    struct stat s;
+    int         pipefd[2];
+    int         numFiles;
+    int         flags;
+    int         ret;
+    size_t      i;
+    
+    /* Expanded here, the server only learns the names of the files from the archive. */
+    memcpy(arguments, command + 4, strlen(command + 4) + 1);
+    
+    flags = 0;
+    for(pattern = strtok_r(arguments, " \t", &save); pattern != NULL; pattern = strtok_r(NULL, " \t", &save)){
+        ret = glob(pattern, flags, NULL, &matches);
+        if(ret == GLOB_NOSPACE){
+            globfree(&matches);
+            return -1;
+        }
+        if(ret == GLOB_NOMATCH){
+            printf("%s: No match.\n", pattern);
+        }
+        flags = GLOB_APPEND;
+    }
+    
+    if(!flags){
+        printf(CFLRED "ERROR:" C_RST " mput requires patterns of the files.");
+        return 1;
+    }
+    
+    /* Only the regular files are sent, directories need put -r. */
+    files = malloc((matches.gl_pathc + 1) * sizeof(char *));
+    if(files == NULL){
+        globfree(&matches);
+        return -1;
+    }
+    
+    numFiles = 0;
+    for(i=0; i<matches.gl_pathc; i++){
+        if(stat(matches.gl_pathv[i], &s) == 0 && S_ISREG(s.st_mode)){
+            files[numFiles++] = matches.gl_pathv[i];
+        }
+        else{
+            printf("%s: Not a regular file, skipped.\n", matches.gl_pathv[i]);
+        }
+    }
+    
+    if(numFiles == 0){
+        printf(CFLRED "ERROR:" C_RST " No files to upload.");
+        free(files);
+        globfree(&matches);
+        return 1;
+    }
+    
+    /* A thread writes the archive into a pipe, it is sent from there once the server accepted it. */
+    if(pipe2(pipefd, O_CLOEXEC) != 0){
+        free(files);
+        globfree(&matches);
+        return -1;
+    }
+    
+    ret = archiveStartFiles(pipefd[1], AT_FDCWD, files, numFiles);
+    free(files);
+    globfree(&matches);
+    
+    if(ret != 0){
+        close(pipefd[0]);
+        close(pipefd[1]);
+        return -1;
+    }
+    
+    pending->fd      = pipefd[0];
+    pending->archive = 1;
+    
+    if(frameSend(sockfd, frame_command, 0, pending->streamId, "mput", 4) != 0){
+        close(pending->fd);
+        return -1;
+    }
+    
+    return 0;
+}
+
+int directoryName(const char *path, char *name, long size){
+    const char *end;
+    const char *start;
+    
+    end = path + strlen(path);
+    while(end > path + 1 && end[-1] == '/'){
+        end--;
+    }
+    
+    start = end;
+    while(start > path && start[-1] != '/'){
+        start--;
+    }
+    
+    if(start == end || end - start >= size || (end - start == 1 && *start == '.') || (end - start == 2 && start[0] == '.' && start[1] == '.')){
+        return 1;
+    }
+    
+    memcpy(name, start, end - start);
+    name[end - start] = '\0';
+    
+    return 0;
+}
+
+int receiveCommandput(int sockfd, PendingCommand *pending, const FrameHeader *header){
+    unsigned char resumeBuffer[FRAME_RESUME_SIZE];
+    unsigned char digest[RESUME_HASH_SIZE];
+    unsigned char buffer[FRAME_DATA_SIZE];
+    struct stat   s;
+    long          offset;
+    
+    switch(header->type){
+        /* The server accepted the file, send the number of bytes which follow, pumpConnection() sends them. */
+        case frame_ok: {
+            /* put -r: the archive is sent until the thread writing it is done, its size is not known up front. */
+            if(pending->archive){
+                if(pending->fd == -1 || pending->sending || header->length != 0){
+                    break;
+                }
+                pending->sending = 1;
+                return startTransferHash(pending);
+            }
+            
+            if(pending->fd == -1 || (header->length != 0 && header->length != FRAME_SIZE_SIZE && header->length != FRAME_RESUME_SIZE) || readAll(sockfd, resumeBuffer, header->length) != 0 || fstat(pending->fd, &s) != 0){
+                break;
+            }
+            
+            /* put -d: the server has a copy of the size which came along, its signatures follow. */
+            if(header->length == FRAME_SIZE_SIZE){
+                pending->totalFileSize = s.st_size;
+                if(startTransferHash(pending) != 0){
+                    return -1;
+                }
+                pending->deltaEncoder = deltaEncoderCreate(unpackUint64(resumeBuffer), pending->fd, pending->hash);
+                return pending->deltaEncoder == NULL ? -1 : 0;
+            }
+            
+            /* put -c: the server has part of the file, carry on after it if it matches this file. */
+            offset = 0;
+            if(header->length == FRAME_RESUME_SIZE){
+                offset = unpackUint64(resumeBuffer);
+                if(offset > s.st_size || resumeBlockHash(pending->fd, offset, digest) != 0 || memcmp(digest, resumeBuffer + FRAME_SIZE_SIZE, RESUME_HASH_SIZE) != 0){
+                    if(offset > 0){
+                        fputs("The file on the server does not match this one, uploading all of it.\n", pending->output);
+                    }
+                    offset = 0;
+                }
+                if(lseek(pending->fd, offset, SEEK_SET) == -1){
+                    return -1;
+                }
+            }
+            
+            pending->resumeOffset  = offset;
+            pending->totalFileSize = s.st_size;
+            pending->sendLeft      = s.st_size - offset;
+            pending->sending       = 1;
+            
+            if(startTransferHash(pending) != 0){
+                return -1;
+            }
+            
+            packUint64(resumeBuffer, pending->sendLeft);
+            packUint64(resumeBuffer + FRAME_SIZE_SIZE, offset);
+            return frameSend(sockfd, frame_size, 0, pending->streamId, resumeBuffer, header->length == FRAME_RESUME_SIZE ? FRAME_RESUME_SIZE : FRAME_SIZE_SIZE);
+        }
+        
+        /* The file could not be created, or not all of it arrived. */
+        case frame_error: {
+            if(receivePayload(sockfd, header->length, pending->output) != 0){
+                return -1;
+            }
+            fputc('\n', pending->output);
+            
+            if(pending->fd != -1){
+                close(pending->fd);
+                pending->fd = -1;
+            }
+            
+            pending->sending = 0;
+            pending->done    = 1;
+            pending->result  = 1;
+            return 0;
+        }
+        
+        /* put -d: the signatures of the copy on the server. */
+        case frame_data: {
+            if(pending->deltaEncoder == NULL || pending->sending || header->length > sizeof(buffer) || readPayload(sockfd, buffer, header->length) != 0){
+                break;
+            }
+            
+            deltaEncoderSignatures(pending->deltaEncoder, buffer, header->length);
+            pending->deltaWire += header->length;
+            
+            return acknowledgeData(sockfd, pending, header->length);
+        }
+        
+        /* The server confirmed all of the file arrived (put -d: before that, all of the signatures did). */
+        case frame_end: {
+            if(pending->deltaEncoder != NULL && pending->fd != -1 && !pending->sending && header->length == 0){
+                packUint64(resumeBuffer, pending->totalFileSize);
+                pending->sendLeft = pending->totalFileSize;
+                pending->sending  = 1;
+                return frameSend(sockfd, frame_size, 0, pending->streamId, resumeBuffer, FRAME_SIZE_SIZE);
+            }
+            if(pending->fd != -1){
+                break;
+            }
+            
+            if(pending->deltaEncoder != NULL){
+                fprintf(pending->output, "Delta: %ld bytes crossed the network for a %ld byte file (%.1f%%).\n", pending->deltaWire, pending->totalFileSize, pending->totalFileSize > 0 ? 100.0 * pending->deltaWire / pending->totalFileSize : 100.0);
+            }
+            
+            if(pending->resumeOffset > 0){
+                fprintf(pending->output, "Resumed after %ld bytes.\n", pending->resumeOffset);
+            }
+            
+            if(pending->archive){
+                fprintf(pending->output, "%s uploaded (%ld bytes of archive)", pending->type == command_mput ? "Files" : "Directory", pending->archiveBytes);
+                if(pending->hash != NULL){
+                    fprintf(pending->output, ", %s checksum verified by the server", hashName(pending->hash->type));
+                }
+                fputs(".\n", pending->output);
+            }
+            else if(pending->hash == NULL){
+                fputs("File uploaded, use 'smd5sum' to verify the files checksum on the server,\n"
+                      "and then 'md5sum' on your computer, if they match, then the file was\n"
+                      "uploaded without error.\n", pending->output);
+            }
+            else{
+                fprintf(pending->output, "File uploaded, %s checksum verified by the server.\n", hashName(pending->hash->type));
+            }
+            
+            pending->done = 1;
+            return 0;
+        }
+    }
+    
+    errno = EPROTO;
+    return -1;
+}
+
+int sendCommandputData(int sockfd, PendingCommand *pending){
+    unsigned char buffer[FRAME_DATA_SIZE];
+    unsigned char trailer[FRAME_TRAILER_SIZE];
+    uint32_t      trailerLength;
+    long          n;
+    
+    if(pending->deltaEncoder != NULL){
+        return sendCommandputDelta(sockfd, pending);
+    }
+    if(pending->archive){
+        return sendCommandputArchive(sockfd, pending);
+    }
+    
+    /* The whole file was sent, tell the server (and the hash of the file) and wait for it to confirm it all arrived. */
+    if(pending->sendLeft == 0){
+        close(pending->fd);
+        pending->fd      = -1;
+        pending->sending = 0;
+        
+        trailerLength = pending->hash != NULL ? frameEncodeTrailer(trailer, pending->hash) : 0;
+        
+        return frameSend(sockfd, frame_end, 0, pending->streamId, trailer, trailerLength);
+    }
+    
+    /* Send the next FRAME_DATA_SIZE bytes. A frame worth compressing is read in and hashed here. */
+    n = pending->sendLeft < FRAME_DATA_SIZE ? pending->sendLeft : FRAME_DATA_SIZE;
+    
+    if(transferCompress && compressWanted(&pending->compressor, n)){
+        if(readAll(pending->fd, buffer, n) != 0){
+            /* The file shrank, the server keeps what it got. */
+            if(errno == 0){
+                puts(CFLRED "ERROR:" C_RST " File shrank while it was being uploaded.");
+                errno = EPROTO;
+            }
+            return -1;
+        }
+        
+        if(pending->hash != NULL){
+            hashUpdate(pending->hash, buffer, n);
+        }
+        if(sendData(sockfd, pending, buffer, n) != 0){
+            return -1;
+        }
+    }
+    /* Otherwise it goes out with sendfile(), hashed out of the page cache first since sendfile() never shows it to us. */
+    else{
+        if(pending->hash != NULL && hashUpdateFile(pending->hash, pending->fd, lseek(pending->fd, 0, SEEK_CUR), n) != 0){
+            if(errno == 0){
+                puts(CFLRED "ERROR:" C_RST " File shrank while it was being uploaded.");
+                errno = EPROTO;
+            }
+            return -1;
+        }
+        
+        if(frameSendFileData(sockfd, pending->streamId, pending->fd, n) != 0){
+            /* The file shrank, the server keeps what it got. */
+            if(errno == 0){
+                puts(CFLRED "ERROR:" C_RST " File shrank while it was being uploaded.");
+                errno = EPROTO;
+            }
+            return -1;
+        }
+        
+        if(transferCompress){
+            compressSkipped(&pending->compressor, n);
+            pending->wireBytes += n;
+            pending->rawBytes  += n;
+        }
+    }
+    pending->sendLeft -= n;
+    
+    /* Display the upload status every DISPLAY_GET_PUT_INTERVAL frames, unless the output is not being shown. */
+    if(pending->output == stdout && pending->displayCount >= DISPLAY_GET_PUT_INTERVAL){
+        printf("%15ld / %ld (%%%2.2f)\r", pending->sendLeft
+                                        , pending->totalFileSize
+                                        , ((double)(pending->totalFileSize-pending->sendLeft)) / pending->totalFileSize * 100.0);
+        fflush(stdout);
+        pending->displayCount = 0;
+    }
+    pending->displayCount++;
+    
+    return 0;
+}
+
+int sendCommandputDelta(int sockfd, PendingCommand *pending){
+    unsigned char buffer[FRAME_DATA_SIZE];
+    unsigned char trailer[FRAME_TRAILER_SIZE];
+    uint32_t      trailerLength;
+    long          n;
+    
+    /* The instructions are all out, the encoder hashed the whole file while it read it. */
+    if(pending->deltaEncoder->done){
+        close(pending->fd);
+        pending->fd      = -1;
+        pending->sending = 0;
+        
+        trailerLength = pending->hash != NULL ? frameEncodeTrailer(trailer, pending->hash) : 0;
+        
+        return frameSend(sockfd, frame_end, 0, pending->streamId, trailer, trailerLength);
+    }
+    
+    n = deltaEncode(pending->deltaEncoder, buffer, sizeof(buffer));
+    if(n == -1){
+        return -1;
+    }
+    if(n > 0 && sendData(sockfd, pending, buffer, n) != 0){
+        return -1;
+    }
+    pending->deltaWire += n;
+    pending->sendLeft   = pending->totalFileSize - pending->deltaEncoder->consumed;
+    
+    /* Display the upload status every DISPLAY_GET_PUT_INTERVAL frames, unless the output is not being shown. */
+    if(pending->output == stdout && pending->displayCount >= DISPLAY_GET_PUT_INTERVAL){
+        printf("%15ld / %ld (%%%2.2f)\r", pending->sendLeft
+                                        , pending->totalFileSize
+                                        , ((double)(pending->totalFileSize-pending->sendLeft)) / pending->totalFileSize * 100.0);
+        fflush(stdout);
+        pending->displayCount = 0;
+    }
+    pending->displayCount++;
+    
+    return 0;
+}
+
+int sendCommandputArchive(int sockfd, PendingCommand *pending){
+    unsigned char buffer[FRAME_DATA_SIZE];
+    unsigned char trailer[FRAME_TRAILER_SIZE];
+    uint32_t      trailerLength;
+    long          n;
+    
+    n = read(pending->fd, buffer, sizeof(buffer));
+    if(n == -1){
+        return errno == EINTR ? 0 : -1;
+    }
+    
+    /* The thread closed the pipe, all of the archive was sent. */
+    if(n == 0){
+        close(pending->fd);
+        pending->fd      = -1;
+        pending->sending = 0;
+        
+        trailerLength = pending->hash != NULL ? frameEncodeTrailer(trailer, pending->hash) : 0;
+        
+        return frameSend(sockfd, frame_end, 0, pending->streamId, trailer, trailerLength);
+    }
+    
+    if(pending->hash != NULL){
+        hashUpdate(pending->hash, buffer, n);
+    }
+    if(sendData(sockfd, pending, buffer, n) != 0){
+        return -1;
+    }
+    pending->archiveBytes += n;
+    
+    /* Display the upload status every DISPLAY_GET_PUT_INTERVAL frames, unless the output is not being shown. */
+    if(pending->output == stdout && pending->displayCount >= DISPLAY_GET_PUT_INTERVAL){
+        printf("%15ld bytes\r", pending->archiveBytes);
+        fflush(stdout);
+        pending->displayCount = 0;
+    }
+    pending->displayCount++;
+    
+    return 0;
+}
+
+int sendData(int sockfd, PendingCommand *pending, const unsigned char *data, long length){
+    unsigned char payload[COMPRESS_FRAME_SIZE];
+    long          n;
+    
+    if(!transferCompress){
+        return frameSend(sockfd, frame_data, 0, pending->streamId, data, length);
+    }
+    
+    n = 0;
+    if(compressWanted(&pending->compressor, length)){
+        n = compressFrame(&pending->compressor, data, length, payload);
+    }
+    else{
+        compressSkipped(&pending->compressor, length);
+    }
+    
+    pending->wireBytes += n > 0 ? n : length;
+    pending->rawBytes  += length;
+    
+    if(n > 0){
+        return frameSend(sockfd, frame_data, FRAME_FLAG_COMPRESSED, pending->streamId, payload, n);
+    }
+    return frameSend(sockfd, frame_data, 0, pending->streamId, data, length);
+}
+
+ClientCommandType getClientCommandType(const char *command){
+    if(strncmp(CLIENT_COMMAND_CD, command, strlen(CLIENT_COMMAND_CD)) == 0){
+        return client_command_cd;
     }
     else if(strcmp("help" , command) == 0){
         return client_command_help;
     }
+    else if(strncmp(CLIENT_COMMAND_BATCH, command, strlen(CLIENT_COMMAND_BATCH)) == 0){
+        return client_command_batch;
+    }
     
     return client_command_unknown;
 }
@@ -454,6 +2172,36 @@ ClientCommandType getClientCommandType(const char *command){
 
 
 
+/**************************************************************************************
+ * Frame functions.
+ *************************************************************************************/
+uint32_t nextStreamId(){
+    static uint32_t streamId = 0;
+    
+    return ++streamId;
+}
+
+int receivePayload(int sockfd, uint32_t length, FILE *stream){
+    char buffer[BUFFER_SIZE * 16];
+    long n;
+    
+    while(length > 0){
+        n = length < sizeof(buffer) ? length : sizeof(buffer);
+        
+        if(readPayload(sockfd, buffer, n) != 0){
+            return -1;
+        }
+        
+        fwrite(buffer, 1, n, stream);
+        length -= n;
+    }
+    
+    return 0;
+}
+
+
+
+
 /**************************************************************************************
  * Connect functions.
  *************************************************************************************/
@@ -556,7 +2304,11 @@ int printPrompt(){
 }
 
 void printUsage(const char *executableName){
-    printf("USAGE:   %s <ip> <port>\n", executableName);
+    printf("USAGE:   %s [-H hashes] [-Z codecs] <ip> <port>\n", executableName);
+    printf("OPTIONS: -H hashes  Hashes get and put are checked with, most preferred first\n"
+           "                    (default " FRAME_HASHES "), or none.\n"
+           "         -Z codecs  Codecs transfers and output may be compressed with, when\n"
+           "                    it pays off (default " COMPRESS_NAME "), or none.\n");
     printf("EXAMPLE: %s 127.0.0.1 12345\n", executableName);
 }
 
@@ -568,17 +2320,36 @@ void printHelpScreen(){
     /* Client commands. */
     puts(CFLBLU "Recognized client side commands:" C_RST "\n"
          "  cd PATH              - Change directory.\n"
+         "  batch FILE           - Run the commands in FILE, one per line, without waiting\n"
+         "                         for each reply before sending the next command.\n"
          "  help                 - Print this help screen.\n");
     
     /* Server commands. */
     puts(CFLBLU "Recognized server side commands:" C_RST "\n"
          "  scd PATH             - Server change directory.\n"
-         "  sls [PATH] [OPTIONS] - Server list files (compatible with all 'ls' arguments).\n"
+         "  sls [PATH] [OPTIONS] - Server list files (compatible with all 'ls' arguments,\n"
+         "                         -l -a -R -r -S -t are handled without a shell).\n"
          "  spwd                 - Server print working directory\n"
-         "  smd5sum FILES        - Server compute the md5 for the following set of files.\n");
+         "  smd5sum FILES        - Server compute the md5 for the following set of files.\n"
+         "  smd5sum -a ALG FILES - The same with md5, crc32c, xxh3 or blake3.\n");
     
     /* Download/Upload commands. */
     puts(CFLBLU "File transfer commands:" C_RST "\n"
          "  get FILE             - Download a file from the server.\n"
-         "  put FILE             - Upload a file to the servers current working directory.\n");
+         "  put FILE             - Upload a file to the servers current working directory.\n"
+         "  get -c FILE          - Resume a download which was cut short.\n"
+         "  put -c FILE          - Resume an upload which was cut short.\n"
+         "  get -d FILE          - Update a file which is here, only what changed is sent.\n"
+         "  put -d FILE          - Update a file on the server, only what changed is sent.\n"
+         "  get -p N FILE        - Download a large file over N connections at once.\n"
+         "  put -p N FILE        - Upload a large file over N connections at once.\n"
+         "  get -r DIR           - Download a directory and everything in it.\n"
+         "  put -r DIR           - Upload a directory and everything in it.\n"
+         "  mget PATTERN...      - Download the files matching the patterns on the server.\n"
+         "  mput PATTERN...      - Upload the files matching the patterns here.\n");
+    
+    /* Background commands. */
+    puts(CFLBLU "Background commands:" C_RST "\n"
+         "  COMMAND &            - Run a server or file transfer command in the background,\n"
+         "                         its output is printed once it is done.\n");
 }
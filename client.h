@@ -1,13 +1,32 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
-#define CLIENT_COMMAND_CD "cd "
+#include <stdio.h>
+#include <stdint.h>
 
-#define DISPLAY_GET_PUT_INTERVAL 1000 /* The interval to display upload/download statuses in executeCommandget() and executeCommandput() */
+#include "shared.h"
+#include "delta.h"
+#include "archive.h"
+#include "compress.h"
+
+#define CLIENT_COMMAND_CD    "cd "
+#define CLIENT_COMMAND_BATCH "batch "
+
+/* Most commands a batch sends ahead of their replies. Bounded so the commands always fit
+ * in the socket buffers, otherwise the client could block sending a command while the
+ * server blocks sending a reply nobody is reading.
+ */
+#define CLIENT_PIPELINE_DEPTH 64
+
+#define CLIENT_MAX_ACTIVE (2 * CLIENT_PIPELINE_DEPTH) /* Most server commands running at once, batch and background ones included. */
+#define CLIENT_BACKGROUND " &"                        /* A command ending with this runs in the background. */
+
+#define DISPLAY_GET_PUT_INTERVAL 8 /* The interval (in frames) to display upload/download statuses of get and put. */
 
 typedef enum{
     client_command_cd,     /* Change directory. */
     client_command_help,   /* Print help screen. */
+    client_command_batch,  /* Run a file of commands, pipelined. */
     client_command_unknown /* Unknown command. */
 } ClientCommandType;
 
@@ -26,8 +45,71 @@ typedef enum{
  * 
  * 4. Call the appropriate function which can handle this command.
  * 5. Repeat.
+ * 
+ * Every server command runs on a stream of its own. Sending the command
+ * and receiving its reply are split, and pumpConnection() handles the
+ * frames of every running command as they arrive, in whatever order the
+ * server interleaves them. So:
+ *   + "get FILE &" downloads in the background while the prompt is
+ *     used for other commands, it reports back when it is done.
+ *   + "batch FILE" sends up to CLIENT_PIPELINE_DEPTH commands before
+ *     reading the first reply, and prints the replies in order.
  */
 
+/* A server command which has been sent and has not finished yet. */
+typedef struct{
+    SharedCommandType type;
+    uint32_t          streamId;
+    char              command[BUFFER_SIZE];
+    int               background; /* 1 if nobody waits for it, its output is printed once it is done. */
+    int               done;       /* 1 once the stream has ended. */
+    int               result;     /* Once done: 0 - Success, 1 - The server sent an error. */
+    FILE              *output;    /* Where the reply is printed, stdout or outputBuffer. */
+    char              *outputBuffer;
+    size_t            outputSize;
+    long              unacked;    /* Bytes of frame_data consumed since the last frame_window. */
+    int               displayCount;
+    
+    /* get: the file being downloaded into, removed if the server sends an error. */
+    FILE *fp;
+    char fileName[BUFFER_SIZE];
+    long totalFileSize; /* -1 until frame_size arrives. */
+    long numBytesLeft;
+    
+    /* sls: the listing records, formatted once all of them have arrived. */
+    unsigned char *listing;
+    long          listingSize;
+    long          listingLength;
+    
+    /* put: the file being uploaded. */
+    int  fd;
+    int  sending;       /* 1 while frame_data is being sent. */
+    long sendLeft;
+    
+    /* get and put -c: where the transfer carried on from, 0 if it started at the beginning. */
+    long resumeOffset;
+    
+    /* get and put -d: the side rebuilding the file and the side encoding it (see delta.h), NULL for a plain transfer. */
+    DeltaApply   *deltaApply;   /* get -d */
+    DeltaEncoder *deltaEncoder; /* put -d */
+    long         deltaWire;     /* Bytes of instructions which crossed the network. */
+    
+    /* get and put -r, mget and mput: a directory or files sent as an archive (see archive.h), put reads it from the pipe in fd. */
+    int           archive;
+    ArchiveReader *archiveReader; /* get -r, extracts it. */
+    long          archiveBytes;   /* Bytes of the archive which crossed the network. */
+    
+    /* get and put: the hash of the frame_data, checked against the trailer, NULL if no hash was negotiated. */
+    HashState *hash;
+    
+    /* Once a codec was negotiated: whether the frame_data sent are compressed, and the payload bytes of
+     * the frame_data which crossed the network both ways against the bytes they held.
+     */
+    Compressor compressor;
+    long       wireBytes;
+    long       rawBytes;
+} PendingCommand;
+
 
 
 /* PURPOSE:
@@ -60,6 +142,112 @@ int connectipport(const char *ip, const char *port, int *fd);
 
 
 
+/* Returns the stream id for the next command sent to the server. */
+uint32_t nextStreamId();
+
+/* PURPOSE:
+ *          Handle the traffic of every running server command: read the
+ *          frames the server sends and send the files being uploaded,
+ *          until waitFor is done, or (watchStdin) the user typed
+ *          something. Background commands which are done are printed
+ *          along the way.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *         -1  Failure, errno is set (0 if the server closed the
+ *             connection).
+ */
+int pumpConnection(int sockfd, PendingCommand *waitFor, int watchStdin);
+
+/* PURPOSE:
+ *          Read the next frame the server sent and hand it to the
+ *          command whose stream it belongs to.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *         -1  Failure, errno is set (0 if the server closed the
+ *             connection).
+ */
+int receiveServerFrame(int sockfd);
+
+/* PURPOSE:
+ *          Read the frame_hash the server answers the offered hashes with,
+ *          every get and put from then on is checked with the one it
+ *          picked.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *         -1  Failure, errno is set.
+ */
+int receiveTransferHash(int sockfd, const FrameHeader *header);
+
+/* PURPOSE:
+ *          Read the frame_compress the server answers the offered codecs
+ *          with, frame_data may be compressed from then on if it picked
+ *          COMPRESS_NAME.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *         -1  Failure, errno is set.
+ */
+int receiveTransferCompression(int sockfd, const FrameHeader *header);
+
+/* PURPOSE:
+ *          Read the compressed payload of a frame_data and decompress it,
+ *          header->length is changed to the length it holds, which
+ *          readPayload() hands out from then on instead of the socket.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *         -1  Failure, errno is set (EPROTO if the payload is invalid).
+ */
+int receiveCompressed(int sockfd, FrameHeader *header);
+
+/* PURPOSE:
+ *          Read length bytes of the payload of the current frame, out of
+ *          the socket, or of what receiveCompressed() decompressed.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *         -1  Failure, errno is set (0 if the server closed the
+ *             connection).
+ */
+int readPayload(int sockfd, void *data, long length);
+
+/* PURPOSE:
+ *          Start hashing the frame_data of a get or put, if a hash was
+ *          negotiated.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *         -1  Out of memory.
+ */
+int startTransferHash(PendingCommand *pending);
+
+/* PURPOSE:
+ *          Tell the server length more bytes of a stream were consumed,
+ *          once enough of them add up to be worth a frame_window.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *         -1  Failure, errno is set.
+ */
+int acknowledgeData(int sockfd, PendingCommand *pending, uint32_t length);
+
+/* PURPOSE:
+ *          Read the length bytes of payload following a frame header
+ *          and write them to stream.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *         -1  Failure, errno is set (0 if the server closed the
+ *             connection).
+ */
+int receivePayload(int sockfd, uint32_t length, FILE *stream);
+
+
+
+
 /* PURPOSE:
  *          Prints out the prompt for this program (without newline).
  * 
@@ -121,24 +309,175 @@ int executeCommand(int sockfd, const char *command);
  */
 int executeLocalCommand(const char *command);
 
-/* Used for simple read only server side commands such as:
- *     sls
- *     spwd
- *     scd
+/* PURPOSE:
+ *          Run every line of a file as a command. Server commands are
+ *          sent without waiting for the replies to the ones before them
+ *          (at most CLIENT_PIPELINE_DEPTH at a time), local commands
+ *          wait until every reply has arrived.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *          1  The file could not be opened.
+ *         -1  Critical error.
+ */
+int executeBatch(int sockfd, const char *filePath);
+
+/* PURPOSE:
+ *          Run "get -p N FILE" or "put -p N FILE" (see stripe.h), which
+ *          can not run in the background or a batch.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *          1  Non critical error.
+ *         -1  Critical error.
+ */
+int executeStriped(int sockfd, const char *command);
+
+/* PURPOSE:
+ *          Put the working directory of the server (spwd) into directory,
+ *          size bytes long.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *          1  Non critical error, the reply was not a directory.
+ *         -1  Critical error.
+ */
+int serverWorkingDirectory(int sockfd, char *directory, long size);
+
+/* PURPOSE:
+ *          Send a server command (sls, spwd, scd, smd5sum, get, put),
+ *          pending is set to the running command so its reply can be
+ *          received later with receiveServerReply(). If buffered its
+ *          output is collected instead of printed as it arrives.
+ * 
+ * RETURNS:
+ *          0  The command was sent.
+ *          1  Non critical error, nothing was sent.
+ *         -1  Critical error.
+ */
+int sendServerCommand(int sockfd, const char *command, int buffered, PendingCommand **pending);
+int sendCommandget(int sockfd, const char *command, PendingCommand *pending);
+int sendCommandput(int sockfd, const char *command, PendingCommand *pending);
+
+/* PURPOSE:
+ *          get -d (see delta.h): send "get -d SIZE PATH" for the copy of
+ *          the file which is here, and the signatures of that copy once
+ *          the server accepts it.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *          1  Non critical error, nothing was sent.
+ *         -1  Critical error.
+ */
+int sendCommandgetDelta(int sockfd, const char *filePath, const char *fileName, PendingCommand *pending);
+int sendDeltaSignatures(int sockfd, PendingCommand *pending);
+
+/* PURPOSE:
+ *          get -r and put -r (see archive.h): send "get -r PATH" after
+ *          creating the directory it is extracted into here, or start
+ *          writing the archive of the directory path and send "put -r
+ *          NAME".
+ * 
+ * RETURNS:
+ *          0  Success.
+ *          1  Non critical error, nothing was sent.
+ *         -1  Critical error.
+ */
+int sendCommandgetDirectory(int sockfd, const char *path, PendingCommand *pending);
+int sendCommandputDirectory(int sockfd, const char *path, PendingCommand *pending);
+
+/* PURPOSE:
+ *          mget and mput: send "mget PATTERN...", the server expands the
+ *          patterns and sends the files as an archive, or expand the
+ *          patterns here and send "mput" and the archive of the files.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *          1  Non critical error, nothing was sent.
+ *         -1  Critical error.
+ */
+int sendCommandmget(int sockfd, const char *command, PendingCommand *pending);
+int sendCommandmput(int sockfd, const char *command, PendingCommand *pending);
+
+/* PURPOSE:
+ *          Put the last component of path, without any trailing slash,
+ *          into name, size bytes long.
  * 
- * These commands require no synchronization between the
- * server and client.
+ * RETURNS:
+ *          0  Success.
+ *          1  path does not end with a name ("/", "." or "..").
+ */
+int directoryName(const char *path, char *name, long size);
+
+/* PURPOSE:
+ *          Wait for a command sent with sendServerCommand() to finish,
+ *          print its buffered output and free it. receiveBatchReply()
+ *          prints the command first.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *          1  The server sent an error.
+ *         -1  Critical error.
  */
-int executeServerReadOnlyCommand(int sockfd, const char *command);
+int receiveServerReply(int sockfd, PendingCommand *pending);
+int receiveBatchReply(int sockfd, PendingCommand *pending);
+
+/* Print the buffered output of a finished command and free it. */
+void releaseServerCommand(PendingCommand *pending);
+
+/* Print and free the background commands which are done, returns how many there were. */
+int reapBackgroundCommands();
 
-/* File download/upload commands.
+/* PURPOSE:
+ *          Handle one frame of the reply to a command.
+ * 
  * RETURNS:
- *     0 - Success.
- *     1 - Non critical error.
- *    -1 - Critical error.
+ *          0  Success.
+ *         -1  Critical error.
+ */
+int receiveServerReadOnlyReply(int sockfd, PendingCommand *pending, const FrameHeader *header);
+int receiveCommandget(int sockfd, PendingCommand *pending, const FrameHeader *header);
+int receiveCommandput(int sockfd, PendingCommand *pending, const FrameHeader *header);
+int receiveCommandgetArchive(int sockfd, PendingCommand *pending, const FrameHeader *header);
+
+/* Replace the file with the one get -d rebuilt if it is intact, and tell the user how much was sent, returns 0. */
+int finishCommandgetDelta(PendingCommand *pending, const unsigned char *trailer, uint32_t trailerLength);
+
+/* PURPOSE:
+ *          Print listing records (see shared.h) the way ls does, one
+ *          entry per line, with the details if longFormat.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *         -1  The records are malformed.
+ */
+int printListing(FILE *output, const unsigned char *records, long length, int longFormat);
+
+/* Returns 1 if the sls command asks for the long format (-l), 0 otherwise. */
+int listingLongFormat(const char *command);
+
+/* PURPOSE:
+ *          Send the next frame of a file being uploaded, or the frame_end
+ *          once all of it has been sent.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *         -1  Critical error.
+ */
+int sendCommandputData(int sockfd, PendingCommand *pending);
+int sendCommandputDelta(int sockfd, PendingCommand *pending);
+int sendCommandputArchive(int sockfd, PendingCommand *pending);
+
+/* PURPOSE:
+ *          Send length bytes of an upload as a frame_data, compressed if a
+ *          codec was negotiated and the compressor of the command finds
+ *          it worth it.
+ * 
+ * RETURNS:
+ *          0  Success.
+ *         -1  Failure, errno is set.
  */
-int executeCommandget(int sockfd, const char *command);
-int executeCommandput(int sockfd, const char *command);
+int sendData(int sockfd, PendingCommand *pending, const unsigned char *data, long length);
 
 /* PURPOSE:
  *     To determine what type of command the string passed
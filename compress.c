@@ -0,0 +1,468 @@
+#define _GNU_SOURCE
+
+#include <string.h>
+
+#include <errno.h>
+#include <time.h>
+
+#include "shared.h"
+#include "compress.h"
+
+static double compressClock(void);
+static void compressRecord(Compressor *compressor, long sent, double now);
+static double compressCost(const Compressor *compressor, int level);
+static void compressAdapt(Compressor *compressor);
+static long compressBlock(const unsigned char *src, long length, unsigned char *dst, int level);
+static long compressExtend(const unsigned char *src, long candidate, long position, long length);
+static unsigned char *compressCount(unsigned char *dst, long count);
+static uint32_t compressLoad(const unsigned char *p);
+
+/* Matches looked at for every position, by level. */
+static const int compressDepth[COMPRESS_MAX_LEVEL + 1] = { 0, 1, 4, 32 };
+
+
+
+
+/*********************************************************************************
+ * Choosing the level.
+ ********************************************************************************/
+void compressorInit(Compressor *compressor){
+    int i;
+    
+    compressor->level      = 1;
+    compressor->skip       = 0;
+    compressor->frames     = 0;
+    compressor->probe      = COMPRESS_PROBE_FRAMES;
+    compressor->network    = 0;
+    compressor->last       = 0;
+    compressor->lastLength = 0;
+    
+    for(i=0; i<=COMPRESS_MAX_LEVEL; i++){
+        compressor->cpu[i]   = 0;
+        compressor->ratio[i] = 1;
+    }
+}
+
+int compressWanted(const Compressor *compressor, long length){
+    return length >= COMPRESS_MIN_SIZE && compressor->level > 0 && compressor->skip == 0;
+}
+
+long compressFrame(Compressor *compressor, const unsigned char *data, long length, unsigned char *payload){
+    double start;
+    double now;
+    long   n;
+    
+    start = compressClock();
+    
+    /* The time since the previous frame was spent sending it (and reading this one). */
+    compressRecord(compressor, 0, start);
+    
+    /* A sample which does not shrink by an eighth, the frames which follow are most likely the same. */
+    if(length >= 2 * COMPRESS_SAMPLE_SIZE){
+        n = compressBlock(data, COMPRESS_SAMPLE_SIZE, payload + COMPRESS_HEADER_SIZE, 1);
+        if(n > COMPRESS_SAMPLE_SIZE - COMPRESS_SAMPLE_SIZE / 8){
+            compressor->skip = COMPRESS_SKIP_FRAMES;
+            compressRecord(compressor, length, compressClock());
+            return 0;
+        }
+    }
+    
+    n    = COMPRESS_HEADER_SIZE + compressBlock(data, length, payload + COMPRESS_HEADER_SIZE, compressor->level);
+    now  = compressClock();
+    packUint32(payload, length);
+    
+    /* Averaged over the last few frames, one slow frame should not move the level. */
+    if(compressor->cpu[compressor->level] == 0){
+        compressor->cpu[compressor->level]   = (now - start) / length;
+        compressor->ratio[compressor->level] = (double)n / length;
+    }
+    else{
+        compressor->cpu[compressor->level]   = 0.75 * compressor->cpu[compressor->level] + 0.25 * (now - start) / length;
+        compressor->ratio[compressor->level] = 0.75 * compressor->ratio[compressor->level] + 0.25 * n / length;
+    }
+    
+    if(n >= length){
+        compressRecord(compressor, length, now);
+        return 0;
+    }
+    
+    compressRecord(compressor, n, now);
+    return n;
+}
+
+void compressSkipped(Compressor *compressor, long length){
+    double now;
+    
+    now = compressClock();
+    compressRecord(compressor, 0, now);
+    compressRecord(compressor, length, now);
+    
+    if(compressor->skip > 0){
+        compressor->skip--;
+    }
+}
+
+/* Returns the time in seconds, from an arbitrary point. */
+static double compressClock(void){
+    struct timespec now;
+    
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* PURPOSE:
+ *     Called twice for every frame. With sent 0 when it is about to be
+ *     made, the time since the previous one was handed on is how long the
+ *     network took for it. With the bytes it sends once it is handed on.
+ */
+static void compressRecord(Compressor *compressor, long sent, double now){
+    double network;
+    
+    if(sent == 0){
+        if(compressor->last != 0 && compressor->lastLength > 0){
+            network = (now - compressor->last) / compressor->lastLength;
+            compressor->network = compressor->network == 0 ? network : 0.75 * compressor->network + 0.25 * network;
+        }
+        return;
+    }
+    
+    compressor->last       = now;
+    compressor->lastLength = sent;
+    
+    /* Frames skipped after a sample which did not compress say nothing about the level. */
+    if(compressor->skip > 0){
+        return;
+    }
+    
+    compressor->frames++;
+    compressAdapt(compressor);
+}
+
+/* Returns the seconds a byte costs at level, compressing it and then carrying what is left of it. */
+static double compressCost(const Compressor *compressor, int level){
+    if(level == 0){
+        return compressor->network;
+    }
+    
+    return compressor->cpu[level] + compressor->ratio[level] * compressor->network;
+}
+
+/* Move to the level next to the current one which makes a byte cheapest. */
+static void compressAdapt(Compressor *compressor){
+    int level;
+    
+    level = compressor->level;
+    
+    /* Sending everything as it is, try compressing again now and then. */
+    if(level == 0){
+        if(compressor->frames >= compressor->probe){
+            compressor->level  = 1;
+            compressor->frames = 0;
+        }
+        return;
+    }
+    
+    if(compressor->frames < COMPRESS_ADAPT_FRAMES || compressor->network == 0){
+        return;
+    }
+    compressor->frames = 0;
+    
+    if(compressCost(compressor, level - 1) < compressCost(compressor, level)){
+        compressor->level = level - 1;
+        
+        /* Compressing lost against the network, the next try waits twice as long. */
+        if(level == 1){
+            compressor->probe = compressor->probe * 2 < COMPRESS_PROBE_MAX ? compressor->probe * 2 : COMPRESS_PROBE_MAX;
+        }
+        return;
+    }
+    
+    /* Compressing won, it is tried again quickly once the link changes. */
+    if(level == 1){
+        compressor->probe = COMPRESS_PROBE_FRAMES;
+    }
+    
+    if(level < COMPRESS_MAX_LEVEL && (compressor->cpu[level + 1] == 0 || compressCost(compressor, level + 1) < compressCost(compressor, level))){
+        compressor->level = level + 1;
+    }
+}
+
+
+
+
+/*********************************************************************************
+ * The codec.
+ ********************************************************************************/
+
+/* PURPOSE:
+ *     Compress length bytes of src into dst (which has room for
+ *     COMPRESS_BOUND(length) bytes), looking at compressDepth[level]
+ *     earlier positions with the same hash for every position. Level 1
+ *     also skips ahead faster the longer it goes without a match.
+ * 
+ * RETURNS:
+ *     The length of the block.
+ */
+static long compressBlock(const unsigned char *src, long length, unsigned char *dst, int level){
+    uint32_t      head[1 << COMPRESS_HASH_BITS]; /* Last position + 1 with every hash, 0 for none. */
+    uint16_t      chain[COMPRESS_WINDOW];        /* Distance from a position to the previous one with its hash, 0 for none. */
+    unsigned char *out;
+    long          anchor;
+    long          position;
+    long          limit;
+    long          candidate;
+    long          best;
+    long          bestOffset;
+    long          n;
+    long          misses;
+    long          literals;
+    long          distance;
+    uint32_t      hash;
+    int           tries;
+    
+    memset(head, 0, sizeof(head));
+    
+    out      = dst;
+    anchor   = 0;
+    position = 0;
+    misses   = 0;
+    limit    = length - 4;
+    
+    while(position <= limit){
+        hash      = (compressLoad(src + position) * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+        candidate = (long)head[hash] - 1;
+        distance  = candidate >= 0 ? position - candidate : 0;
+        
+        head[hash] = position + 1;
+        if(level > 1){
+            chain[position & (COMPRESS_WINDOW - 1)] = distance < COMPRESS_WINDOW ? distance : 0;
+        }
+        
+        /* The longest match among the positions with the same hash, as far back as the window reaches. */
+        best       = 0;
+        bestOffset = 0;
+        tries      = compressDepth[level];
+        while(candidate >= 0 && position - candidate < COMPRESS_WINDOW && tries-- > 0){
+            if(compressLoad(src + candidate) == compressLoad(src + position)){
+                n = compressExtend(src, candidate, position, length);
+                if(n > best){
+                    best       = n;
+                    bestOffset = position - candidate;
+                }
+            }
+            
+            distance = tries > 0 ? chain[candidate & (COMPRESS_WINDOW - 1)] : 0;
+            if(distance == 0){
+                break;
+            }
+            candidate -= distance;
+        }
+        
+        if(best == 0){
+            misses++;
+            position += 1 + (level == 1 ? misses >> 5 : misses >> 7);
+            continue;
+        }
+        misses = 0;
+        
+        /* The token, the literals since the last match, then the match. */
+        literals = position - anchor;
+        *out++   = ((literals < 15 ? literals : 15) << 4) | (best - 4 < 15 ? best - 4 : 15);
+        if(literals >= 15){
+            out = compressCount(out, literals - 15);
+        }
+        memcpy(out, src + anchor, literals);
+        out += literals;
+        
+        *out++ = bestOffset;
+        *out++ = bestOffset >> 8;
+        if(best - 4 >= 15){
+            out = compressCount(out, best - 4 - 15);
+        }
+        
+        /* The higher levels find more matches with the positions of this one in the chains, the start of a long one is enough. */
+        if(level > 1){
+            for(n=position + 1; n < position + best && n < position + COMPRESS_INSERT_MAX && n <= limit; n++){
+                hash     = (compressLoad(src + n) * 2654435761u) >> (32 - COMPRESS_HASH_BITS);
+                distance = head[hash] != 0 ? n - ((long)head[hash] - 1) : 0;
+                
+                head[hash]                       = n + 1;
+                chain[n & (COMPRESS_WINDOW - 1)] = distance < COMPRESS_WINDOW ? distance : 0;
+            }
+        }
+        
+        position += best;
+        anchor    = position;
+    }
+    
+    /* The rest are literals, in a token without a match. */
+    literals = length - anchor;
+    *out++   = (literals < 15 ? literals : 15) << 4;
+    if(literals >= 15){
+        out = compressCount(out, literals - 15);
+    }
+    memcpy(out, src + anchor, literals);
+    out += literals;
+    
+    return out - dst;
+}
+
+/* Returns the length of the match at position with the one at candidate, whose first 4 bytes are known to match. */
+static long compressExtend(const unsigned char *src, long candidate, long position, long length){
+    uint64_t a;
+    uint64_t b;
+    long     n;
+    
+    /* 8 bytes at a time, the first which differs is found from the lowest bit set (little endian). */
+    n = 4;
+    while(position + n + 8 <= length){
+        memcpy(&a, src + candidate + n, sizeof(a));
+        memcpy(&b, src + position + n, sizeof(b));
+        if(a != b){
+            return n + (__builtin_ctzll(a ^ b) >> 3);
+        }
+        n += 8;
+    }
+    
+    while(position + n < length && src[candidate + n] == src[position + n]){
+        n++;
+    }
+    
+    return n;
+}
+
+/* Write what is left of a count beyond the 15 of its token, in bytes of 255 and the remainder. */
+static unsigned char *compressCount(unsigned char *dst, long count){
+    while(count >= 255){
+        *dst++  = 255;
+        count  -= 255;
+    }
+    *dst++ = count;
+    
+    return dst;
+}
+
+static uint32_t compressLoad(const unsigned char *p){
+    uint32_t value;
+    
+    memcpy(&value, p, sizeof(value));
+    
+    return value;
+}
+
+long decompressFrame(const unsigned char *payload, long length, unsigned char *data, long size){
+    const unsigned char *in;
+    const unsigned char *end;
+    long                expected;
+    long                out;
+    long                literals;
+    long                match;
+    long                offset;
+    long                repeat;
+    long                i;
+    unsigned char       byte;
+    
+    if(length < COMPRESS_HEADER_SIZE + 1){
+        errno = EPROTO;
+        return -1;
+    }
+    
+    expected = unpackUint32(payload);
+    if(expected > size){
+        errno = EPROTO;
+        return -1;
+    }
+    
+    in  = payload + COMPRESS_HEADER_SIZE;
+    end = payload + length;
+    out = 0;
+    
+    while(in < end){
+        byte = *in++;
+        
+        literals = byte >> 4;
+        if(literals == 15){
+            do{
+                if(in == end){
+                    errno = EPROTO;
+                    return -1;
+                }
+                literals += *in;
+            }while(*in++ == 255);
+        }
+        
+        if(literals > end - in || literals > expected - out){
+            errno = EPROTO;
+            return -1;
+        }
+        /* Short runs are copied 16 bytes at a time, whatever is copied past them is overwritten next. */
+        if(literals <= 16 && end - in >= 16 && size - out >= 16){
+            memcpy(data + out, in, 16);
+        }
+        else{
+            memcpy(data + out, in, literals);
+        }
+        in  += literals;
+        out += literals;
+        
+        /* The last token has no match. */
+        if(in == end){
+            break;
+        }
+        
+        if(end - in < 2){
+            errno = EPROTO;
+            return -1;
+        }
+        offset  = in[0] | (in[1] << 8);
+        in     += 2;
+        
+        match = (byte & 15) + 4;
+        if((byte & 15) == 15){
+            do{
+                if(in == end){
+                    errno = EPROTO;
+                    return -1;
+                }
+                match += *in;
+            }while(*in++ == 255);
+        }
+        
+        if(offset == 0 || offset > out || match > expected - out){
+            errno = EPROTO;
+            return -1;
+        }
+        
+        /* A match closer than its length repeats itself. Its first bytes are copied one at a time until
+         * the copy is a whole number of repeats at least 8 long, from then on it is 8 bytes at a time.
+         */
+        i = 0;
+        if(offset < 8){
+            repeat = (8 + offset - 1) / offset * offset;
+            while(i < match && i < repeat){
+                data[out + i] = data[out - offset + i];
+                i++;
+            }
+            offset = repeat;
+        }
+        if(size - out >= match + 8){
+            for(; i<match; i+=8){
+                memcpy(data + out + i, data + out + i - offset, 8);
+            }
+        }
+        else{
+            for(; i<match; i++){
+                data[out + i] = data[out + i - offset];
+            }
+        }
+        out += match;
+    }
+    
+    if(out != expected){
+        errno = EPROTO;
+        return -1;
+    }
+    
+    return out;
+}
@@ -0,0 +1,108 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdint.h>
+
+#include "shared.h"
+
+#define COMPRESS_NAME          "lz"               /* The codec offered and picked with frame_compress. */
+#define COMPRESS_MAX_LEVEL     3
+#define COMPRESS_HEADER_SIZE   4                  /* [raw length 4] in front of the block. */
+#define COMPRESS_BOUND(n)      ((n) + (n) / 255 + 16) /* Largest block n bytes compress into. */
+#define COMPRESS_FRAME_SIZE    (COMPRESS_HEADER_SIZE + COMPRESS_BOUND(FRAME_DATA_SIZE)) /* Largest payload of a compressed frame_data. */
+#define COMPRESS_WINDOW        65536              /* Farthest back a match may start. */
+#define COMPRESS_HASH_BITS     14
+#define COMPRESS_INSERT_MAX    64                 /* Positions of a match added to the chains, at most, by the higher levels. */
+#define COMPRESS_MIN_SIZE      256                /* Smaller frames are never worth compressing. */
+#define COMPRESS_SAMPLE_SIZE   4096               /* Bytes at the start of a frame compressed first, to tell whether the rest is worth it. */
+#define COMPRESS_SKIP_FRAMES   16                 /* Frames sent as they are after a sample which did not compress. */
+#define COMPRESS_ADAPT_FRAMES  4                  /* Frames between two looks at the level. */
+#define COMPRESS_PROBE_FRAMES  16                 /* Frames sent as they are before compressing is tried again, at first. */
+#define COMPRESS_PROBE_MAX     1024               /* At most, it doubles every time sending them as they are still wins. */
+
+/* Compression outline (frame_compress):
+ * 
+ * The client names the codecs it can decompress with frame_compress
+ * before its first command, and the server picks one, like the hash.
+ * From then on either side may send any frame_data with
+ * FRAME_FLAG_COMPRESSED set, the payload is then:
+ * 
+ *   [raw length 4][block...]
+ * 
+ * and the window, the sizes and the trailers all count the bytes once
+ * decompressed. A frame is compressed on its own, the receiver never
+ * has to keep anything from one frame to the next.
+ * 
+ * The block is a sequence of LZ77 matches in the format of LZ4, every
+ * one a token, the literals in front of the match and where it is:
+ * 
+ *   [literals 4 bits|length 4 bits][more literals...][literals...][offset 2][more length...]
+ * 
+ * where a 4 bit count of 15 carries on in bytes of 255 until a smaller
+ * one, the length is that of the match minus 4, and the last token
+ * holds only literals.
+ * 
+ * Whether a frame is worth compressing depends on the link: over a slow
+ * one every byte saved is time saved, over loopback compressing costs
+ * more than it saves. A Compressor keeps, for every level, how long it
+ * takes to compress a byte and how many bytes it sends for one, and
+ * how long the network takes to carry a byte, from the time between two
+ * frames it was not compressing. Every COMPRESS_ADAPT_FRAMES frames it
+ * moves to the level next to its own which makes a byte cheapest, or
+ * to 0 (frames sent as they are, files still go out with sendfile())
+ * when compressing costs more than it saves. From 0 it tries level 1
+ * again after a while, every time a bit later if it keeps losing.
+ * 
+ * Data which does not compress (archives, media) is caught by a sample
+ * of COMPRESS_SAMPLE_SIZE bytes first, the next COMPRESS_SKIP_FRAMES
+ * frames are then sent as they are.
+ */
+
+/* Decides, frame by frame, whether and how hard to compress one direction of a stream. */
+typedef struct{
+    int    level;                          /* Level of the next frames, 0 sends them as they are. */
+    int    skip;                           /* Frames still sent as they are after a sample which did not compress. */
+    long   frames;                         /* Frames since the level was last looked at. */
+    long   probe;                          /* Frames at level 0 before level 1 is tried again. */
+    double cpu[COMPRESS_MAX_LEVEL + 1];    /* Seconds compressing a byte takes at each level, 0 if unknown. */
+    double ratio[COMPRESS_MAX_LEVEL + 1];  /* Bytes sent for a byte at each level. */
+    double network;                        /* Seconds the network takes to carry a byte, 0 if unknown. */
+    double last;                           /* When the previous frame was handed on, 0 before the first. */
+    long   lastLength;                     /* Bytes it sent. */
+} Compressor;
+
+
+
+
+/* Start a compressor out at level 1, for a new stream. */
+void compressorInit(Compressor *compressor);
+
+/* Returns 1 if a frame of length bytes should go through compressFrame(), 0 if it should be sent as it is (then call compressSkipped()). */
+int compressWanted(const Compressor *compressor, long length);
+
+/* PURPOSE:
+ *     Compress a frame_data of length bytes (at most FRAME_DATA_SIZE)
+ *     into payload, which has room for COMPRESS_HEADER_SIZE +
+ *     COMPRESS_BOUND(length) bytes.
+ * 
+ * RETURNS:
+ *     SUCCESS: The length of the payload, to be sent with
+ *              FRAME_FLAG_COMPRESSED.
+ *     0:       The frame should be sent as it is, it does not compress.
+ */
+long compressFrame(Compressor *compressor, const unsigned char *data, long length, unsigned char *payload);
+
+/* Tell the compressor a frame of length bytes was sent as it is, its timing tells it about the network. */
+void compressSkipped(Compressor *compressor, long length);
+
+/* PURPOSE:
+ *     Decompress the payload of a frame_data sent with
+ *     FRAME_FLAG_COMPRESSED into data, which has room for size bytes.
+ * 
+ * RETURNS:
+ *     SUCCESS: The number of bytes it held.
+ *     FAILURE: -1, the payload is invalid or too large (errno EPROTO).
+ */
+long decompressFrame(const unsigned char *payload, long length, unsigned char *data, long size);
+
+#endif
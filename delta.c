@@ -0,0 +1,796 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+#include "delta.h"
+
+static void deltaWeak(const unsigned char *data, long length, uint32_t *a, uint32_t *b);
+static uint64_t deltaStrong(const unsigned char *data, long length);
+static int deltaBuildTable(DeltaEncoder *encoder);
+static long deltaFind(DeltaEncoder *encoder, long length);
+static int deltaFill(DeltaEncoder *encoder);
+static int deltaEmitRun(DeltaEncoder *encoder, unsigned char *out, long size, long *used);
+static int deltaEmitLiteral(DeltaEncoder *encoder, unsigned char *out, long size, long *used);
+static int deltaCopy(DeltaApply *apply, long offset, long length);
+
+
+
+
+uint32_t deltaBlockSize(long size){
+    uint32_t blockSize;
+    
+    blockSize = DELTA_MIN_BLOCK;
+    while(blockSize < DELTA_MAX_BLOCK && (long)blockSize * blockSize < size){
+        blockSize *= 2;
+    }
+    
+    return blockSize;
+}
+
+unsigned char *deltaSignatures(int fd, long size, long *length){
+    unsigned char *signatures;
+    unsigned char *buffer;
+    unsigned char *record;
+    uint32_t      blockSize;
+    long          numBlocks;
+    long          chunk;
+    long          offset;
+    long          block;
+    long          n;
+    ssize_t       m;
+    uint32_t      a;
+    uint32_t      b;
+    
+    blockSize = deltaBlockSize(size);
+    numBlocks = (size + blockSize - 1) / blockSize;
+    
+    /* Whole blocks are read at a time, about HASH_READ_SIZE bytes of them. */
+    chunk = (HASH_READ_SIZE / blockSize) * blockSize;
+    
+    signatures = malloc(numBlocks * DELTA_SIGNATURE_SIZE + 1);
+    buffer     = malloc(chunk);
+    if(signatures == NULL || buffer == NULL){
+        free(signatures);
+        free(buffer);
+        return NULL;
+    }
+    
+    record = signatures;
+    for(offset = 0; offset < size; offset += n){
+        n = size - offset < chunk ? size - offset : chunk;
+        
+        m = pread(fd, buffer, n, offset);
+        if(m == -1 && errno == EINTR){
+            n = 0;
+            continue;
+        }
+        if(m != n){
+            if(m >= 0){
+                errno = 0;
+            }
+            free(signatures);
+            free(buffer);
+            return NULL;
+        }
+        
+        for(block = 0; block < n; block += blockSize){
+            deltaWeak(buffer + block, n - block < blockSize ? n - block : blockSize, &a, &b);
+            packUint32(record, (a & 0xFFFF) | (b << 16));
+            packUint64(record + 4, deltaStrong(buffer + block, n - block < blockSize ? n - block : blockSize));
+            record += DELTA_SIGNATURE_SIZE;
+        }
+    }
+    
+    free(buffer);
+    
+    *length = numBlocks * DELTA_SIGNATURE_SIZE;
+    return signatures;
+}
+
+
+
+
+/*********************************************************************************
+ * Encoder.
+ ********************************************************************************/
+DeltaEncoder *deltaEncoderCreate(long basisSize, int fd, HashState *hash){
+    DeltaEncoder *encoder;
+    
+    encoder = malloc(sizeof(DeltaEncoder));
+    if(encoder == NULL){
+        return NULL;
+    }
+    
+    encoder->blockSize     = deltaBlockSize(basisSize);
+    encoder->numBlocks     = (basisSize + encoder->blockSize - 1) / encoder->blockSize;
+    encoder->lastBlockSize = basisSize - (encoder->numBlocks - 1) * encoder->blockSize;
+    encoder->received      = 0;
+    encoder->partialLength = 0;
+    encoder->heads         = NULL;
+    encoder->chain         = NULL;
+    encoder->filter        = NULL;
+    
+    encoder->fd       = fd;
+    encoder->hash     = hash;
+    encoder->length   = 0;
+    encoder->position = 0;
+    encoder->literal  = 0;
+    encoder->eof      = 0;
+    encoder->a        = 0;
+    encoder->b        = 0;
+    encoder->rolling  = 0;
+    encoder->runBlock = 0;
+    encoder->runCount = 0;
+    encoder->consumed = 0;
+    encoder->done     = 0;
+    
+    encoder->weak   = malloc(encoder->numBlocks * sizeof(uint32_t) + 1);
+    encoder->strong = malloc(encoder->numBlocks * sizeof(uint64_t) + 1);
+    encoder->buffer = malloc(DELTA_BUFFER_SIZE);
+    if(encoder->weak == NULL || encoder->strong == NULL || encoder->buffer == NULL){
+        deltaEncoderFree(encoder);
+        return NULL;
+    }
+    
+    return encoder;
+}
+
+void deltaEncoderSignatures(DeltaEncoder *encoder, const void *data, long length){
+    const unsigned char *p = data;
+    long                n;
+    
+    while(length > 0 && encoder->received < encoder->numBlocks){
+        n = DELTA_SIGNATURE_SIZE - encoder->partialLength;
+        if(n > length){
+            n = length;
+        }
+        
+        memcpy(encoder->partial + encoder->partialLength, p, n);
+        encoder->partialLength += n;
+        p                      += n;
+        length                 -= n;
+        
+        if(encoder->partialLength == DELTA_SIGNATURE_SIZE){
+            encoder->weak[encoder->received]   = unpackUint32(encoder->partial);
+            encoder->strong[encoder->received] = unpackUint64(encoder->partial + 4);
+            encoder->received++;
+            encoder->partialLength = 0;
+        }
+    }
+}
+
+long deltaEncode(DeltaEncoder *encoder, unsigned char *out, long size){
+    unsigned char *window;
+    long          available;
+    long          length;
+    long          scanned;
+    long          used;
+    long          block;
+    long          step;
+    long          end;
+    unsigned char *p;
+    uint32_t      a;
+    uint32_t      b;
+    uint32_t      leaving;
+    uint32_t      slot;
+    
+    if(encoder->heads == NULL && deltaBuildTable(encoder) != 0){
+        return -1;
+    }
+    
+    used    = 0;
+    scanned = 0;
+    while(!encoder->done){
+        /* Keep the bytes which did not match few enough to stay in the buffer. */
+        if(encoder->position - encoder->literal >= DELTA_LITERAL_MAX && deltaEmitLiteral(encoder, out, size, &used) != 0){
+            break;
+        }
+        
+        /* Read more of the file once the window no longer fits. */
+        if(!encoder->eof && encoder->length - encoder->position < encoder->blockSize){
+            if(deltaFill(encoder) != 0){
+                return -1;
+            }
+            continue;
+        }
+        
+        available = encoder->length - encoder->position;
+        
+        /* The end of the file, send whatever is left. */
+        if(available == 0){
+            if(deltaEmitLiteral(encoder, out, size, &used) != 0 || deltaEmitRun(encoder, out, size, &used) != 0){
+                break;
+            }
+            encoder->done = 1;
+            break;
+        }
+        
+        /* Long runs of matching blocks send nothing, return something every so often. */
+        if(scanned >= DELTA_SCAN_BUDGET){
+            if(used == 0){
+                if(deltaEmitLiteral(encoder, out, size, &used) == 0){
+                    deltaEmitRun(encoder, out, size, &used);
+                }
+            }
+            break;
+        }
+        
+        /* Near the end of the file the window can only be the last block of the old copy, if it is a short one. */
+        length = encoder->blockSize;
+        if(available < length){
+            if(encoder->numBlocks == 0 || encoder->received < encoder->numBlocks || available != encoder->lastBlockSize){
+                step = DELTA_LITERAL_MAX - (encoder->position - encoder->literal);
+                if(encoder->lastBlockSize < available && encoder->received == encoder->numBlocks){
+                    step = step < available - encoder->lastBlockSize ? step : available - encoder->lastBlockSize;
+                }
+                else if(step > available){
+                    step = available;
+                }
+                
+                encoder->position += step;
+                encoder->rolling   = 0;
+                scanned           += step;
+                continue;
+            }
+            length = available;
+        }
+        
+        window = encoder->buffer + encoder->position;
+        if(!encoder->rolling){
+            deltaWeak(window, length, &encoder->a, &encoder->b);
+            encoder->rolling = 1;
+        }
+        
+        block = deltaFind(encoder, length);
+        
+        /* The window is a block of the old copy, the bytes before it are sent as they are. */
+        if(block != -1){
+            if(encoder->position > encoder->literal && deltaEmitLiteral(encoder, out, size, &used) != 0){
+                break;
+            }
+            
+            if(encoder->runCount == 0 || block != encoder->runBlock + encoder->runCount || encoder->runCount == UINT32_MAX){
+                if(deltaEmitRun(encoder, out, size, &used) != 0){
+                    break;
+                }
+                encoder->runBlock = block;
+            }
+            encoder->runCount++;
+            
+            encoder->position += length;
+            encoder->literal   = encoder->position;
+            encoder->consumed += length;
+            encoder->rolling   = 0;
+            scanned           += length;
+            continue;
+        }
+        
+        /* No match, and the next byte is not in the buffer yet (or the window is short), start over after it. */
+        if(length < encoder->blockSize || encoder->position + length >= encoder->length){
+            encoder->rolling = 0;
+            encoder->position++;
+            scanned++;
+            continue;
+        }
+        
+        /* No match, roll the window along a byte at a time for as long as no block even has its weak checksum. */
+        end = encoder->length - length;
+        if(end > encoder->literal + DELTA_LITERAL_MAX){
+            end = encoder->literal + DELTA_LITERAL_MAX;
+        }
+        
+        a = encoder->a;
+        b = encoder->b;
+        p = window;
+        do{
+            leaving = p[0];
+            a      += p[length] - leaving;
+            b      += a - (uint32_t)length * leaving;
+            p++;
+            slot = (((a & 0xFFFF) | (b << 16)) * 2654435761U) >> encoder->filterShift;
+        } while(p - encoder->buffer < end && !(encoder->filter[slot >> 6] & (1ULL << (slot & 63))));
+        
+        encoder->a         = a;
+        encoder->b         = b;
+        scanned           += p - window;
+        encoder->position += p - window;
+    }
+    
+    return used;
+}
+
+void deltaEncoderFree(DeltaEncoder *encoder){
+    free(encoder->weak);
+    free(encoder->strong);
+    free(encoder->heads);
+    free(encoder->chain);
+    free(encoder->filter);
+    free(encoder->buffer);
+    free(encoder);
+}
+
+
+
+
+/*********************************************************************************
+ * Apply.
+ ********************************************************************************/
+DeltaApply *deltaApplyCreate(int dirfd, const char *name, int basisfd, long basisSize){
+    DeltaApply      *apply;
+    struct stat     s;
+    struct timespec now;
+    int             i;
+    
+    apply = malloc(sizeof(DeltaApply));
+    if(apply == NULL){
+        return NULL;
+    }
+    
+    apply->basisSize   = basisSize;
+    apply->blockSize   = deltaBlockSize(basisSize);
+    apply->numBlocks   = (basisSize + apply->blockSize - 1) / apply->blockSize;
+    apply->written     = 0;
+    apply->hash        = NULL;
+    apply->opLength    = 0;
+    apply->literalLeft = 0;
+    apply->outfd       = -1;
+    
+    /* The name may be relative to dirfd for as long as the new file is arriving, even if dirfd is closed by then. */
+    apply->dirfd    = dirfd == AT_FDCWD ? AT_FDCWD : fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+    apply->name     = strdup(name);
+    apply->tempName = malloc(strlen(name) + 8);
+    if(apply->dirfd == -1 || apply->name == NULL || apply->tempName == NULL){
+        free(apply->tempName);
+        apply->tempName = NULL;
+        apply->basisfd  = -1;
+        deltaApplyFree(apply);
+        errno = ENOMEM;
+        return NULL;
+    }
+    
+    /* "name.XXXXXX", mkostemp() only knows the current directory. */
+    clock_gettime(CLOCK_REALTIME, &now);
+    for(i=0; i<100 && apply->outfd == -1; i++){
+        sprintf(apply->tempName, "%s.%06lx", name, ((unsigned long)now.tv_nsec + getpid() * 7919UL + i * 104729UL) & 0xFFFFFF);
+        apply->outfd = openat(apply->dirfd, apply->tempName, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if(apply->outfd == -1 && errno != EEXIST){
+            break;
+        }
+    }
+    if(apply->outfd == -1){
+        i = errno;
+        free(apply->tempName);
+        apply->tempName = NULL;
+        apply->basisfd  = -1;
+        deltaApplyFree(apply);
+        errno = i;
+        return NULL;
+    }
+    
+    /* The new file takes the place of the old one, permissions included. */
+    if(fstat(basisfd, &s) == 0){
+        fchmod(apply->outfd, s.st_mode & 07777);
+    }
+    
+    apply->basisfd = basisfd;
+    
+    return apply;
+}
+
+int deltaApply(DeltaApply *apply, const void *data, long length){
+    const unsigned char *p = data;
+    long                needed;
+    long                n;
+    uint64_t            block;
+    uint32_t            count;
+    long                offset;
+    
+    while(length > 0){
+        /* The bytes of a literal go straight into the file. */
+        if(apply->literalLeft > 0){
+            n = apply->literalLeft < length ? apply->literalLeft : length;
+            if(writeAll(apply->outfd, p, n) != 0){
+                return -1;
+            }
+            if(apply->hash != NULL){
+                hashUpdate(apply->hash, p, n);
+            }
+            
+            apply->written     += n;
+            apply->literalLeft -= n;
+            p                  += n;
+            length             -= n;
+            continue;
+        }
+        
+        /* Collect the next instruction. */
+        if(apply->opLength == 0){
+            if(*p != delta_op_copy && *p != delta_op_literal){
+                errno = EPROTO;
+                return -1;
+            }
+        }
+        needed = (apply->opLength > 0 ? apply->op[0] : *p) == delta_op_copy ? DELTA_COPY_SIZE : DELTA_LITERAL_HEADER;
+        
+        n = needed - apply->opLength < length ? needed - apply->opLength : length;
+        memcpy(apply->op + apply->opLength, p, n);
+        apply->opLength += n;
+        p               += n;
+        length          -= n;
+        
+        if(apply->opLength < needed){
+            break;
+        }
+        apply->opLength = 0;
+        
+        if(apply->op[0] == delta_op_literal){
+            apply->literalLeft = unpackUint32(apply->op + 1);
+            continue;
+        }
+        
+        /* Blocks of the old copy, the last one may be short. */
+        block = unpackUint64(apply->op + 1);
+        count = unpackUint32(apply->op + 9);
+        if(block >= (uint64_t)apply->numBlocks || count == 0 || count > apply->numBlocks - block){
+            errno = EPROTO;
+            return -1;
+        }
+        
+        offset = block * apply->blockSize;
+        n      = (long)count * apply->blockSize;
+        if(n > apply->basisSize - offset){
+            n = apply->basisSize - offset;
+        }
+        
+        if(deltaCopy(apply, offset, n) != 0){
+            return -1;
+        }
+        apply->written += n;
+    }
+    
+    return 0;
+}
+
+int deltaApplyFinish(DeltaApply *apply){
+    if(apply->opLength != 0 || apply->literalLeft != 0){
+        errno = EPROTO;
+        return -1;
+    }
+    
+    if(renameat(apply->dirfd, apply->tempName, apply->dirfd, apply->name) != 0){
+        return -1;
+    }
+    
+    free(apply->tempName);
+    apply->tempName = NULL;
+    
+    return 0;
+}
+
+void deltaApplyFree(DeltaApply *apply){
+    if(apply->tempName != NULL){
+        unlinkat(apply->dirfd, apply->tempName, 0);
+    }
+    if(apply->basisfd != -1){
+        close(apply->basisfd);
+    }
+    if(apply->dirfd != AT_FDCWD && apply->dirfd != -1){
+        close(apply->dirfd);
+    }
+    
+    free(apply->name);
+    free(apply->tempName);
+    free(apply);
+}
+
+
+
+
+/*********************************************************************************
+ * Helpers.
+ ********************************************************************************/
+
+/* The two sums of the weak checksum of rsync, a is the sum of the bytes and b the sum of the sums so far. */
+static void deltaWeak(const unsigned char *data, long length, uint32_t *a, uint32_t *b){
+    uint32_t sumA = 0;
+    uint32_t sumB = 0;
+    long     i;
+    
+    for(i=0; i<length; i++){
+        sumA += data[i];
+        sumB += sumA;
+    }
+    
+    *a = sumA;
+    *b = sumB;
+}
+
+/* The xxh3 of a block. */
+static uint64_t deltaStrong(const unsigned char *data, long length){
+    HashState     state;
+    unsigned char digest[HASH_MAX_DIGEST_SIZE];
+    
+    hashInit(&state, hash_xxh3);
+    hashUpdate(&state, data, length);
+    hashFinal(&state, digest);
+    
+    return unpackUint64(digest);
+}
+
+/* PURPOSE:
+ *     Index the full size blocks of the old copy by their weak checksum,
+ *     the first one of each chain is the first block in the file.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Out of memory.
+ */
+static int deltaBuildTable(DeltaEncoder *encoder){
+    int      tableBits;
+    int      filterBits;
+    long     i;
+    uint32_t hash;
+    
+    /* 2 slots and 32 bits of the filter per block. */
+    tableBits = 4;
+    while(tableBits < 30 && (1L << tableBits) < 2 * encoder->received){
+        tableBits++;
+    }
+    filterBits = tableBits + 4 < 16 ? 16 : (tableBits + 4 > 30 ? 30 : tableBits + 4);
+    
+    encoder->heads  = malloc((1L << tableBits) * sizeof(long));
+    encoder->chain  = malloc(encoder->received * sizeof(long) + 1);
+    encoder->filter = calloc((1L << filterBits) / 64, sizeof(uint64_t));
+    if(encoder->heads == NULL || encoder->chain == NULL || encoder->filter == NULL){
+        free(encoder->heads);
+        free(encoder->chain);
+        free(encoder->filter);
+        encoder->heads  = NULL;
+        encoder->chain  = NULL;
+        encoder->filter = NULL;
+        return -1;
+    }
+    encoder->tableShift  = 32 - tableBits;
+    encoder->filterShift = 32 - filterBits;
+    
+    for(i=0; i<(1L << tableBits); i++){
+        encoder->heads[i] = -1;
+    }
+    for(i = encoder->received - 1; i >= 0; i--){
+        if(i == encoder->numBlocks - 1 && encoder->lastBlockSize != encoder->blockSize){
+            continue;
+        }
+        
+        hash = encoder->weak[i] * 2654435761U;
+        
+        encoder->chain[i]                             = encoder->heads[hash >> encoder->tableShift];
+        encoder->heads[hash >> encoder->tableShift]   = i;
+        encoder->filter[(hash >> encoder->filterShift) >> 6] |= 1ULL << ((hash >> encoder->filterShift) & 63);
+    }
+    
+    return 0;
+}
+
+/* PURPOSE:
+ *     Find the block of the old copy the window (of length bytes) is,
+ *     the one after the blocks matched just before it first, so runs
+ *     of blocks are sent as a single copy.
+ * 
+ * RETURNS:
+ *     The block, -1 if there is none.
+ */
+static long deltaFind(DeltaEncoder *encoder, long length){
+    const unsigned char *window;
+    uint32_t            weak;
+    uint64_t            strong;
+    int                 haveStrong;
+    long                block;
+    
+    window     = encoder->buffer + encoder->position;
+    weak       = (encoder->a & 0xFFFF) | (encoder->b << 16);
+    haveStrong = 0;
+    strong     = 0;
+    
+    /* A short window can only be the last block. */
+    if(length < (long)encoder->blockSize){
+        block = encoder->numBlocks - 1;
+        if(encoder->weak[block] == weak && encoder->strong[block] == deltaStrong(window, length)){
+            return block;
+        }
+        return -1;
+    }
+    
+    block = encoder->runBlock + encoder->runCount;
+    if(encoder->runCount > 0 && block < encoder->received && (block < encoder->numBlocks - 1 || encoder->lastBlockSize == encoder->blockSize) && encoder->weak[block] == weak){
+        strong     = deltaStrong(window, length);
+        haveStrong = 1;
+        if(encoder->strong[block] == strong){
+            return block;
+        }
+    }
+    
+    for(block = encoder->heads[(weak * 2654435761U) >> encoder->tableShift]; block != -1; block = encoder->chain[block]){
+        if(encoder->weak[block] != weak){
+            continue;
+        }
+        if(!haveStrong){
+            strong     = deltaStrong(window, length);
+            haveStrong = 1;
+        }
+        if(encoder->strong[block] == strong){
+            return block;
+        }
+    }
+    
+    return -1;
+}
+
+/* PURPOSE:
+ *     Read more of the new file, after dropping the bytes which have been
+ *     dealt with from the front of the buffer.
+ * 
+ * RETURNS:
+ *     0 - Success, eof is set at the end of the file.
+ *    -1 - Failure, errno set by read().
+ */
+static int deltaFill(DeltaEncoder *encoder){
+    long n;
+    
+    memmove(encoder->buffer, encoder->buffer + encoder->literal, encoder->length - encoder->literal);
+    encoder->length   -= encoder->literal;
+    encoder->position -= encoder->literal;
+    encoder->literal   = 0;
+    
+    do{
+        n = read(encoder->fd, encoder->buffer + encoder->length, DELTA_BUFFER_SIZE - encoder->length);
+    } while(n == -1 && errno == EINTR);
+    
+    if(n == -1){
+        return -1;
+    }
+    if(n == 0){
+        encoder->eof = 1;
+        return 0;
+    }
+    
+    if(encoder->hash != NULL){
+        hashUpdate(encoder->hash, encoder->buffer + encoder->length, n);
+    }
+    encoder->length += n;
+    
+    return 0;
+}
+
+/* PURPOSE:
+ *     Write the copy of the blocks matched so far into out.
+ * 
+ * RETURNS:
+ *     0 - Success (or nothing to write).
+ *    -1 - out is full.
+ */
+static int deltaEmitRun(DeltaEncoder *encoder, unsigned char *out, long size, long *used){
+    if(encoder->runCount == 0){
+        return 0;
+    }
+    if(size - *used < DELTA_COPY_SIZE){
+        return -1;
+    }
+    
+    out[*used] = delta_op_copy;
+    packUint64(out + *used + 1, encoder->runBlock);
+    packUint32(out + *used + 9, encoder->runCount);
+    *used += DELTA_COPY_SIZE;
+    
+    encoder->runCount = 0;
+    
+    return 0;
+}
+
+/* PURPOSE:
+ *     Write the bytes before the window which did not match into out (as
+ *     many as fit), after the blocks matched before them.
+ * 
+ * RETURNS:
+ *     0 - Success, all of them were written.
+ *    -1 - out is full.
+ */
+static int deltaEmitLiteral(DeltaEncoder *encoder, unsigned char *out, long size, long *used){
+    long length;
+    long room;
+    
+    if(deltaEmitRun(encoder, out, size, used) != 0){
+        return -1;
+    }
+    
+    length = encoder->position - encoder->literal;
+    if(length == 0){
+        return 0;
+    }
+    
+    room = size - *used - DELTA_LITERAL_HEADER;
+    if(room <= 0){
+        return -1;
+    }
+    if(length > room){
+        length = room;
+    }
+    
+    out[*used] = delta_op_literal;
+    packUint32(out + *used + 1, length);
+    memcpy(out + *used + DELTA_LITERAL_HEADER, encoder->buffer + encoder->literal, length);
+    *used += DELTA_LITERAL_HEADER + length;
+    
+    encoder->literal  += length;
+    encoder->consumed += length;
+    
+    return encoder->literal == encoder->position ? 0 : -1;
+}
+
+/* PURPOSE:
+ *     Copy length bytes of the old copy, from offset, to the end of the
+ *     new file. With a hash they are read in once and hashed on the way,
+ *     otherwise copy_file_range() lets the file system share the blocks.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set (EPROTO if the old copy shrank).
+ */
+static int deltaCopy(DeltaApply *apply, long offset, long length){
+    unsigned char buffer[64 * 1024];
+    loff_t        from;
+    ssize_t       n;
+    
+    from = offset;
+    while(length > 0 && apply->hash == NULL){
+        n = copy_file_range(apply->basisfd, &from, apply->outfd, NULL, length, 0);
+        if(n == -1 && errno == EINTR){
+            continue;
+        }
+        if(n == -1 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS || errno == EOPNOTSUPP)){
+            break;
+        }
+        if(n <= 0){
+            if(n == 0){
+                errno = EPROTO;
+            }
+            return -1;
+        }
+        length -= n;
+    }
+    
+    while(length > 0){
+        n = pread(apply->basisfd, buffer, length < (long)sizeof(buffer) ? length : (long)sizeof(buffer), from);
+        if(n == -1 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            if(n == 0){
+                errno = EPROTO;
+            }
+            return -1;
+        }
+        
+        if(writeAll(apply->outfd, buffer, n) != 0){
+            return -1;
+        }
+        if(apply->hash != NULL){
+            hashUpdate(apply->hash, buffer, n);
+        }
+        
+        from   += n;
+        length -= n;
+    }
+    
+    return 0;
+}
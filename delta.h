@@ -0,0 +1,182 @@
+#ifndef DELTA_H
+#define DELTA_H
+
+#include <stdint.h>
+
+#include "hash.h"
+
+#define DELTA_MIN_BLOCK        1024               /* Smallest block the old copy is cut into. */
+#define DELTA_MAX_BLOCK        (128 * 1024)       /* Largest block, reached by files of 16 GiB. */
+#define DELTA_SIGNATURE_SIZE   12                 /* [weak 4][strong 8] per block. */
+#define DELTA_COPY_SIZE        13                 /* [delta_op_copy][first block 8][blocks 4] */
+#define DELTA_LITERAL_HEADER   5                  /* [delta_op_literal][length 4], followed by the bytes. */
+#define DELTA_LITERAL_MAX      (32 * 1024)        /* Longest literal the encoder keeps back before sending it. */
+#define DELTA_MIN_ROOM         (DELTA_COPY_SIZE + DELTA_LITERAL_HEADER + 1) /* Smallest out deltaEncode() can work with. */
+#define DELTA_BUFFER_SIZE      (1024 * 1024)      /* Bytes of the new file the encoder reads at a time. */
+#define DELTA_SCAN_BUDGET      (4 * 1024 * 1024)  /* Bytes deltaEncode() looks at before it returns, even if it has nothing to send. */
+
+/* Delta outline (get -d and put -d):
+ * 
+ * The side which has an old copy of the file (the receiver) cuts it into
+ * blocks of deltaBlockSize() bytes and sends a signature for every one:
+ * 
+ *   [weak 4][strong 8]
+ * 
+ * The weak checksum is the one of rsync, two 16 bit sums which can be
+ * rolled along the file a byte at a time, the strong one is xxh3.
+ * 
+ * The side with the new file (the sender) slides a window of a block
+ * along it. Wherever the weak checksum of the window is one of a block,
+ * and so is the strong one, the window is replaced by a reference to the
+ * block, everything in between is sent as it is:
+ * 
+ *   [delta_op_copy][first block 8][blocks 4]  Consecutive blocks of the old copy.
+ *   [delta_op_literal][length 4][bytes...]    Bytes of the new file.
+ * 
+ * so appending to a file sends the appended bytes, and an edit in place
+ * sends the blocks around the edit. The receiver writes the new file
+ * next to the old one and renames it over the old one once all of it
+ * arrived (and its hash matched).
+ */
+typedef enum{
+    delta_op_copy    = 1,
+    delta_op_literal = 2
+} DeltaOp;
+
+/* Makes the instructions from the new file and the signatures of the old copy. */
+typedef struct{
+    uint32_t      blockSize;
+    long          numBlocks;        /* Blocks of the old copy. */
+    long          lastBlockSize;    /* The last one may be shorter. */
+    uint32_t      *weak;
+    uint64_t      *strong;
+    long          received;         /* Signatures which have arrived, the ones missing are never referenced. */
+    unsigned char partial[DELTA_SIGNATURE_SIZE];
+    int           partialLength;
+    long          *heads;           /* Blocks by weak checksum, built once the signatures are all in. */
+    long          *chain;
+    int           tableShift;
+    uint64_t      *filter;          /* A bit per weak checksum (hashed), far sparser than heads, so most windows are turned down by it alone. */
+    int           filterShift;
+    
+    int           fd;               /* The new file, read from its current offset. */
+    HashState     *hash;            /* Hash of the new file, NULL if none. */
+    unsigned char *buffer;          /* DELTA_BUFFER_SIZE bytes of it. */
+    long          length;           /* Bytes in buffer. */
+    long          position;         /* Where the window starts. */
+    long          literal;          /* Where the bytes which have not been sent or matched start. */
+    int           eof;
+    uint32_t      a;                /* The two sums of the weak checksum of the window. */
+    uint32_t      b;
+    int           rolling;          /* 1 if a and b are those of the window at position. */
+    long          runBlock;         /* Consecutive blocks matched which have not been sent yet. */
+    long          runCount;
+    long          consumed;         /* Bytes of the new file dealt with. */
+    int           done;
+} DeltaEncoder;
+
+/* Rebuilds the new file from the old copy and the instructions. */
+typedef struct{
+    int           basisfd;          /* The old copy. */
+    long          basisSize;
+    uint32_t      blockSize;
+    long          numBlocks;
+    int           outfd;            /* The new file, a temporary one next to the old copy. */
+    long          written;          /* Bytes of the new file written. */
+    HashState     *hash;            /* Hash of the new file, NULL if none, may be set after deltaApplyCreate(). */
+    int           dirfd;
+    char          *name;            /* The old copy, replaced by tempName once it is complete. */
+    char          *tempName;        /* NULL once it has been renamed. */
+    unsigned char op[DELTA_COPY_SIZE]; /* The instruction which is arriving. */
+    int           opLength;
+    long          literalLeft;      /* Bytes of the literal being written still to arrive. */
+} DeltaApply;
+
+
+
+
+/* Returns the size of the blocks a file of size bytes is cut into, about its square root. */
+uint32_t deltaBlockSize(long size);
+
+/* PURPOSE:
+ *     Make the signatures of the first size bytes of a file (read with
+ *     pread(), its offset is left alone).
+ * 
+ * RETURNS:
+ *     SUCCESS: The signatures, to be free()d, their size is put in length.
+ *     FAILURE: NULL, errno is set (0 if the file is shorter than size).
+ */
+unsigned char *deltaSignatures(int fd, long size, long *length);
+
+
+
+
+/* PURPOSE:
+ *     Create an encoder for the file fd, to be sent to the side which
+ *     has an old copy of basisSize bytes. Its signatures are handed to
+ *     deltaEncoderSignatures() as they arrive, then deltaEncode() makes
+ *     the instructions.
+ * 
+ * RETURNS:
+ *     SUCCESS: The encoder.
+ *     FAILURE: NULL, out of memory.
+ */
+DeltaEncoder *deltaEncoderCreate(long basisSize, int fd, HashState *hash);
+
+/* Add length bytes of the signatures of the old copy, any number at a time. */
+void deltaEncoderSignatures(DeltaEncoder *encoder, const void *data, long length);
+
+/* PURPOSE:
+ *     Write the next instructions into out, at least DELTA_MIN_ROOM bytes.
+ *     The new file is hashed into encoder->hash as it is read.
+ * 
+ * RETURNS:
+ *     SUCCESS: The number of bytes written, 0 once encoder->done.
+ *     FAILURE: -1, errno set by read() or malloc().
+ */
+long deltaEncode(DeltaEncoder *encoder, unsigned char *out, long size);
+
+/* Free an encoder (fd stays open). */
+void deltaEncoderFree(DeltaEncoder *encoder);
+
+
+
+
+/* PURPOSE:
+ *     Create a temporary file next to the old copy name (relative to
+ *     dirfd, which may be AT_FDCWD) to rebuild the new file in.
+ * 
+ * PARAMETERS:
+ *     int basisfd:    The old copy, owned by the DeltaApply from now on.
+ *     long basisSize: Its size when its signatures were made.
+ * 
+ * RETURNS:
+ *     SUCCESS: The DeltaApply, outfd is the temporary file (the caller
+ *              closes it).
+ *     FAILURE: NULL, errno is set, basisfd is still open.
+ */
+DeltaApply *deltaApplyCreate(int dirfd, const char *name, int basisfd, long basisSize);
+
+/* PURPOSE:
+ *     Carry out length bytes of instructions, any number at a time.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set (EPROTO if the instructions are invalid).
+ */
+int deltaApply(DeltaApply *apply, const void *data, long length);
+
+/* PURPOSE:
+ *     Replace the old copy with the new file, once all of the
+ *     instructions have been carried out.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set (EPROTO if an instruction was cut short).
+ */
+int deltaApplyFinish(DeltaApply *apply);
+
+/* Free a DeltaApply, removing the temporary file unless deltaApplyFinish() renamed it. */
+void deltaApplyFree(DeltaApply *apply);
+
+#endif
@@ -0,0 +1,322 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "shared.h"
+#include "session.h"
+#include "server.h"
+#include "eventloop.h"
+
+typedef struct{
+    int       epollfd;
+    int       listenfd;
+    int       dirfd;        /* The directory every new session starts out in. */
+    Session **sessions;     /* Sessions indexed by file descriptor, for both sockets and pipes. */
+    long      sessionsSize;
+} EventLoop;
+
+
+
+
+static int eventLoopSetSession(EventLoop *loop, int fd, Session *session);
+static int eventLoopAccept(EventLoop *loop);
+static int eventLoopUpdate(EventLoop *loop, Session *session);
+static void eventLoopUnwatchPipes(EventLoop *loop, Session *session);
+static void eventLoopClose(EventLoop *loop, Session *session);
+
+
+
+
+int runEventLoop(int listenfd){
+    EventLoop          loop;
+    struct epoll_event events[EVENTLOOP_MAX_EVENTS];
+    struct epoll_event event;
+    Session            *session;
+    int                numEvents;
+    int                fd;
+    int                ret;
+    int                i;
+    
+    loop.listenfd     = listenfd;
+    loop.sessions     = NULL;
+    loop.sessionsSize = 0;
+    
+    /* Commands change the working directory of this process, remember where sessions start. */
+    loop.dirfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if(loop.dirfd == -1){
+        perror("ERROR, open()");
+        return -1;
+    }
+    
+    loop.epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop.epollfd == -1){
+        perror("ERROR, epoll_create1()");
+        close(loop.dirfd);
+        return -1;
+    }
+    
+    /* Watch the listening socket for new connections. */
+    if(setNonBlocking(listenfd) != 0){
+        perror("ERROR, setNonBlocking()");
+        close(loop.epollfd);
+        close(loop.dirfd);
+        return -1;
+    }
+    
+    event.events  = EPOLLIN;
+    event.data.fd = listenfd;
+    if(epoll_ctl(loop.epollfd, EPOLL_CTL_ADD, listenfd, &event) != 0){
+        perror("ERROR, epoll_ctl()");
+        close(loop.epollfd);
+        close(loop.dirfd);
+        return -1;
+    }
+    
+    while(1){
+        numEvents = epoll_wait(loop.epollfd, events, EVENTLOOP_MAX_EVENTS, -1);
+        if(numEvents == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            perror("ERROR, epoll_wait()");
+            break;
+        }
+        
+        for(i=0; i<numEvents; i++){
+            fd = events[i].data.fd;
+            
+            /* New connections. */
+            if(fd == listenfd){
+                if(eventLoopAccept(&loop) != 0){
+                    numEvents = -1;
+                    break;
+                }
+                continue;
+            }
+            
+            /* The session was closed by an earlier event in this batch. */
+            session = (fd < loop.sessionsSize) ? loop.sessions[fd] : NULL;
+            if(session == NULL){
+                continue;
+            }
+            
+            /* The output of a command the session is running. The pipes are only
+             * watched while the session waits on them, they may be closed in the
+             * handler so stop watching them first.
+             */
+            if(fd != session->sockfd){
+                eventLoopUnwatchPipes(&loop, session);
+                ret = sessionOnPipeReadable(session);
+            }
+            /* Socket error, or the client hung up while we were not reading. */
+            else if((events[i].events & EPOLLERR) || ((events[i].events & EPOLLHUP) && !(events[i].events & EPOLLIN))){
+                ret = -1;
+            }
+            else{
+                ret = 0;
+                
+                if(events[i].events & EPOLLOUT){
+                    ret = sessionOnWritable(session);
+                }
+                
+                if(ret == 0 && (events[i].events & EPOLLIN) && session->state != session_state_closed){
+                    ret = sessionOnReadable(session);
+                }
+            }
+            
+            if(ret != 0 || session->state == session_state_closed || eventLoopUpdate(&loop, session) != 0){
+                eventLoopClose(&loop, session);
+            }
+        }
+        
+        if(numEvents == -1){
+            break;
+        }
+    }
+    
+    close(loop.epollfd);
+    close(loop.dirfd);
+    free(loop.sessions);
+    
+    return -1;
+}
+
+
+
+
+/* PURPOSE:
+ *     Remember which session a file descriptor belongs to, growing
+ *     the table when needed.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Out of memory.
+ */
+static int eventLoopSetSession(EventLoop *loop, int fd, Session *session){
+    Session **sessions;
+    long    size;
+    
+    if(fd >= loop->sessionsSize){
+        size = loop->sessionsSize == 0 ? 1024 : loop->sessionsSize;
+        while(size <= fd){
+            size *= 2;
+        }
+        
+        sessions = realloc(loop->sessions, size * sizeof(Session *));
+        if(sessions == NULL){
+            return -1;
+        }
+        memset(sessions + loop->sessionsSize, 0, (size - loop->sessionsSize) * sizeof(Session *));
+        
+        loop->sessions     = sessions;
+        loop->sessionsSize = size;
+    }
+    
+    loop->sessions[fd] = session;
+    
+    return 0;
+}
+
+/* PURPOSE:
+ *     Accept every pending connection and create a session for each.
+ * 
+ * RETURNS:
+ *     0 - OK (clients which could not be set up are dropped).
+ *    -1 - Critical error.
+ */
+static int eventLoopAccept(EventLoop *loop){
+    struct sockaddr_storage clientAddr;
+    socklen_t               clientAddrSize;
+    struct epoll_event      event;
+    Session                 *session;
+    int                     sockfd;
+    
+    while(1){
+        clientAddrSize = sizeof(clientAddr);
+        sockfd         = accept4(loop->listenfd, (struct sockaddr *)&clientAddr, &clientAddrSize, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        
+        if(sockfd == -1){
+            /* No more pending connections. */
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return 0;
+            }
+            
+            /* The client gave up before we got to it, or we ran out of descriptors for now. */
+            if(errno == EINTR || errno == ECONNABORTED || errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM){
+                perror("ERROR, accept()");
+                return 0;
+            }
+            
+            perror("ERROR, accept()");
+            return -1;
+        }
+        
+        printClientDetails((struct sockaddr *)&clientAddr, clientAddrSize, ": " CFLGRN "Connected." C_RST "\n");
+        
+        session = sessionCreate(sockfd, (struct sockaddr *)&clientAddr, clientAddrSize, loop->dirfd);
+        if(session == NULL){
+            perror(CFLRED "ERROR" C_RST);
+            close(sockfd);
+            continue;
+        }
+        
+        if(eventLoopSetSession(loop, sockfd, session) != 0){
+            perror(CFLRED "ERROR" C_RST);
+            sessionDestroy(session);
+            continue;
+        }
+        
+        /* A new session always waits for a command first. */
+        event.events  = EPOLLIN;
+        event.data.fd = sockfd;
+        if(epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, sockfd, &event) != 0){
+            perror("ERROR, epoll_ctl()");
+            loop->sessions[sockfd] = NULL;
+            sessionDestroy(session);
+            continue;
+        }
+        session->watchedEvents = EPOLLIN;
+    }
+}
+
+/* PURPOSE:
+ *     Make epoll watch what the session is waiting for now.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, the session should be closed.
+ */
+static int eventLoopUpdate(EventLoop *loop, Session *session){
+    struct epoll_event event;
+    int                events;
+    int                pipefds[SESSION_MAX_STREAMS];
+    int                numPipes;
+    int                i;
+    
+    /* The socket. */
+    events = (sessionWantsRead(session) ? EPOLLIN : 0) | (sessionWantsWrite(session) ? EPOLLOUT : 0);
+    if(events != session->watchedEvents){
+        event.events  = events;
+        event.data.fd = session->sockfd;
+        if(epoll_ctl(loop->epollfd, EPOLL_CTL_MOD, session->sockfd, &event) != 0){
+            perror("ERROR, epoll_ctl()");
+            return -1;
+        }
+        session->watchedEvents = events;
+    }
+    
+    /* The pipes of the commands which have no output ready, the whole set is replaced when it changes. */
+    numPipes = sessionPipefds(session, pipefds);
+    if(numPipes != session->watchedPipes || memcmp(pipefds, session->watchedPipefds, numPipes * sizeof(int)) != 0){
+        eventLoopUnwatchPipes(loop, session);
+        
+        for(i=0; i<numPipes; i++){
+            if(eventLoopSetSession(loop, pipefds[i], session) != 0){
+                return -1;
+            }
+            
+            event.events  = EPOLLIN;
+            event.data.fd = pipefds[i];
+            if(epoll_ctl(loop->epollfd, EPOLL_CTL_ADD, pipefds[i], &event) != 0){
+                perror("ERROR, epoll_ctl()");
+                loop->sessions[pipefds[i]] = NULL;
+                return -1;
+            }
+            session->watchedPipefds[session->watchedPipes++] = pipefds[i];
+        }
+    }
+    
+    return 0;
+}
+
+/* Stop watching the pipes of the session. */
+static void eventLoopUnwatchPipes(EventLoop *loop, Session *session){
+    int i;
+    
+    for(i=0; i<session->watchedPipes; i++){
+        epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, session->watchedPipefds[i], NULL);
+        loop->sessions[session->watchedPipefds[i]] = NULL;
+    }
+    
+    session->watchedPipes = 0;
+}
+
+/* Stop watching everything belonging to the session and destroy it. */
+static void eventLoopClose(EventLoop *loop, Session *session){
+    eventLoopUnwatchPipes(loop, session);
+    
+    epoll_ctl(loop->epollfd, EPOLL_CTL_DEL, session->sockfd, NULL);
+    loop->sessions[session->sockfd] = NULL;
+    
+    sessionDestroy(session);
+}
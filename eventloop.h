@@ -0,0 +1,37 @@
+#ifndef EVENTLOOP_H
+#define EVENTLOOP_H
+
+#define EVENTLOOP_MAX_EVENTS 256 /* Events handled per call to epoll_wait(). */
+
+/* Event loop outline (the epoll engine):
+ * 
+ * 1. The listening socket and every client socket are non-blocking
+ *    and registered with a single epoll instance.
+ * 
+ * 2. When the listening socket is readable, every pending connection
+ *    is accepted and gets a session (see session.h).
+ * 
+ * 3. When a client socket is ready, the session it belongs to is told
+ *    to read or write, it does as much as it can without blocking and
+ *    returns.
+ * 
+ * 4. After every event the loop asks the session what it is waiting
+ *    for next and updates epoll to match. This includes the pipes of
+ *    the sls/spwd/smd5sum commands whose output has not arrived yet.
+ * 
+ * 5. Back to 2.
+ */
+
+
+
+
+/* PURPOSE:
+ *     Accept clients on listenfd and handle all of them in this process,
+ *     until a critical error occurs.
+ * 
+ * RETURNS:
+ *     -1 - A critical error occured, errno is set.
+ */
+int runEventLoop(int listenfd);
+
+#endif
@@ -0,0 +1,896 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "hash.h"
+
+/* MD5 */
+static void md5Init(Md5State *state);
+static void md5Update(Md5State *state, const unsigned char *data, size_t length);
+static void md5Final(Md5State *state, unsigned char *digest);
+static void md5Block(uint32_t *hash, const unsigned char *block);
+
+/* CRC32C */
+static uint32_t crc32cSoftware(uint32_t crc, const unsigned char *data, size_t length);
+#if defined(__x86_64__)
+static uint32_t crc32cSse42(uint32_t crc, const unsigned char *data, size_t length);
+#endif
+
+/* XXH3 */
+static void xxh3Init(Xxh3State *state);
+static void xxh3Update(Xxh3State *state, const unsigned char *data, size_t length);
+static uint64_t xxh3Final(const Xxh3State *state);
+static uint64_t xxh3Short(const unsigned char *data, size_t length);
+static void xxh3ConsumeStripes(uint64_t *acc, size_t *stripesSoFar, const unsigned char *data, size_t stripes);
+static void xxh3AccumulateScalar(uint64_t *acc, const unsigned char *data, const unsigned char *secret, size_t stripes);
+#if defined(__x86_64__)
+static void xxh3AccumulateAvx2(uint64_t *acc, const unsigned char *data, const unsigned char *secret, size_t stripes);
+#endif
+static void xxh3Scramble(uint64_t *acc, const unsigned char *secret);
+
+/* BLAKE3 */
+static void blake3ChunkInit(Blake3Chunk *chunk, uint64_t chunkCounter);
+static void blake3ChunkUpdate(Blake3Chunk *chunk, const unsigned char *data, size_t length);
+static void blake3Update(Blake3State *state, const unsigned char *data, size_t length);
+static void blake3Final(const Blake3State *state, unsigned char *digest);
+static void blake3Compress(const uint32_t *cv, const unsigned char *block, uint64_t counter, uint32_t blockLength, uint32_t flags, uint32_t *out);
+
+static uint32_t readLE32(const unsigned char *p);
+static uint64_t readLE64(const unsigned char *p);
+
+/* The fastest implementation the CPU supports, chosen by hashSelect() before main(). */
+static uint32_t (*crc32cUpdate)(uint32_t crc, const unsigned char *data, size_t length) = NULL;
+static void (*xxh3Accumulate)(uint64_t *acc, const unsigned char *data, const unsigned char *secret, size_t stripes) = NULL;
+
+__attribute__((constructor)) static void hashSelect(void);
+
+
+
+
+HashType hashFromName(const char *name){
+    HashType type;
+    
+    for(type=hash_md5; type<hash_unknown; type++){
+        if(strcmp(name, hashName(type)) == 0){
+            break;
+        }
+    }
+    
+    return type;
+}
+
+const char *hashName(HashType type){
+    switch(type){
+        case hash_md5:    { return "md5"; }
+        case hash_crc32c: { return "crc32c"; }
+        case hash_xxh3:   { return "xxh3"; }
+        case hash_blake3: { return "blake3"; }
+        case hash_unknown: break;
+    }
+    
+    return NULL;
+}
+
+int hashDigestSize(HashType type){
+    switch(type){
+        case hash_md5:    { return 16; }
+        case hash_crc32c: { return 4; }
+        case hash_xxh3:   { return 8; }
+        case hash_blake3: { return 32; }
+        case hash_unknown: break;
+    }
+    
+    return 0;
+}
+
+void hashInit(HashState *state, HashType type){
+    state->type = type;
+    
+    switch(type){
+        case hash_md5:    { md5Init(&state->u.md5); break; }
+        case hash_crc32c: { state->u.crc32c = 0xFFFFFFFF; break; }
+        case hash_xxh3:   { xxh3Init(&state->u.xxh3); break; }
+        case hash_blake3: {
+            blake3ChunkInit(&state->u.blake3.chunk, 0);
+            state->u.blake3.cvStackLength = 0;
+            break;
+        }
+        case hash_unknown: break;
+    }
+}
+
+void hashUpdate(HashState *state, const void *data, size_t length){
+    switch(state->type){
+        case hash_md5:    { md5Update(&state->u.md5, data, length); break; }
+        case hash_crc32c: { state->u.crc32c = crc32cUpdate(state->u.crc32c, data, length); break; }
+        case hash_xxh3:   { xxh3Update(&state->u.xxh3, data, length); break; }
+        case hash_blake3: { blake3Update(&state->u.blake3, data, length); break; }
+        case hash_unknown: break;
+    }
+}
+
+int hashFinal(HashState *state, unsigned char *digest){
+    uint64_t value;
+    int      i;
+    
+    switch(state->type){
+        case hash_md5: { md5Final(&state->u.md5, digest); break; }
+        
+        /* Both are printed as a big endian number, like their reference tools do. */
+        case hash_crc32c:
+        case hash_xxh3: {
+            value = (state->type == hash_crc32c) ? (uint32_t)~state->u.crc32c : xxh3Final(&state->u.xxh3);
+            for(i=hashDigestSize(state->type)-1; i>=0; i--){
+                digest[i] = value & 0xFF;
+                value   >>= 8;
+            }
+            break;
+        }
+        
+        case hash_blake3: { blake3Final(&state->u.blake3, digest); break; }
+        case hash_unknown: break;
+    }
+    
+    return hashDigestSize(state->type);
+}
+
+int hashFile(int fd, HashType type, unsigned char *digest){
+    HashState     state;
+    struct stat   s;
+    unsigned char *data;
+    ssize_t       n;
+    
+    if(fstat(fd, &s) != 0){
+        return -1;
+    }
+    
+    hashInit(&state, type);
+    
+    /* Regular files are hashed straight out of the page cache. */
+    if(S_ISREG(s.st_mode) && s.st_size > 0){
+        data = mmap(NULL, s.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(data != MAP_FAILED){
+            madvise(data, s.st_size, MADV_SEQUENTIAL);
+            hashUpdate(&state, data, s.st_size);
+            munmap(data, s.st_size);
+            
+            return hashFinal(&state, digest);
+        }
+    }
+    
+    /* Pipes, files in /proc, and files which could not be mapped. */
+    data = malloc(HASH_READ_SIZE);
+    if(data == NULL){
+        return -1;
+    }
+    
+    while((n = read(fd, data, HASH_READ_SIZE)) != 0){
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            free(data);
+            return -1;
+        }
+        hashUpdate(&state, data, n);
+    }
+    
+    free(data);
+    
+    return hashFinal(&state, digest);
+}
+
+int hashUpdateFile(HashState *state, int fd, long offset, long length){
+    unsigned char buffer[64 * 1024];
+    ssize_t       n;
+    
+    while(length > 0){
+        n = pread(fd, buffer, length < (long)sizeof(buffer) ? length : (long)sizeof(buffer), offset);
+        if(n == -1 && errno == EINTR){
+            continue;
+        }
+        if(n <= 0){
+            if(n == 0){
+                errno = 0;
+            }
+            return -1;
+        }
+        
+        hashUpdate(state, buffer, n);
+        offset += n;
+        length -= n;
+    }
+    
+    return 0;
+}
+
+void hashToHex(const unsigned char *digest, int length, char *hex){
+    const char *digits = "0123456789abcdef";
+    int        i;
+    
+    for(i=0; i<length; i++){
+        hex[2*i]   = digits[digest[i] >> 4];
+        hex[2*i+1] = digits[digest[i] & 0x0F];
+    }
+    hex[2*length] = '\0';
+}
+
+
+
+
+/******************************************************************************
+ * MD5 (RFC 1321)
+ */
+static const uint32_t md5K[64] = {
+    0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+    0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+    0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+    0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+    0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+    0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+    0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+    0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char md5Shift[16] = {
+    7, 12, 17, 22, 5, 9, 14, 20, 4, 11, 16, 23, 6, 10, 15, 21
+};
+
+static void md5Init(Md5State *state){
+    state->state[0] = 0x67452301;
+    state->state[1] = 0xefcdab89;
+    state->state[2] = 0x98badcfe;
+    state->state[3] = 0x10325476;
+    state->length   = 0;
+}
+
+static void md5Update(Md5State *state, const unsigned char *data, size_t length){
+    size_t used;
+    size_t take;
+    
+    used           = state->length % 64;
+    state->length += length;
+    
+    /* Complete the block left over from last time. */
+    if(used > 0){
+        take = 64 - used < length ? 64 - used : length;
+        memcpy(state->buffer + used, data, take);
+        data   += take;
+        length -= take;
+        
+        if(used + take < 64){
+            return;
+        }
+        md5Block(state->state, state->buffer);
+    }
+    
+    for(; length >= 64; data += 64, length -= 64){
+        md5Block(state->state, data);
+    }
+    
+    memcpy(state->buffer, data, length);
+}
+
+static void md5Final(Md5State *state, unsigned char *digest){
+    unsigned char padding[72];
+    uint64_t      bits;
+    size_t        padLength;
+    int           i;
+    
+    /* A 1 bit, zeros up to 56 bytes into a block, then the length in bits. */
+    bits      = state->length * 8;
+    padLength = (state->length % 64 < 56) ? 56 - state->length % 64 : 120 - state->length % 64;
+    
+    memset(padding, 0, sizeof(padding));
+    padding[0] = 0x80;
+    for(i=0; i<8; i++){
+        padding[padLength + i] = (bits >> (8 * i)) & 0xFF;
+    }
+    md5Update(state, padding, padLength + 8);
+    
+    for(i=0; i<16; i++){
+        digest[i] = (state->state[i / 4] >> (8 * (i % 4))) & 0xFF;
+    }
+}
+
+static void md5Block(uint32_t *hash, const unsigned char *block){
+    uint32_t m[16];
+    uint32_t a, b, c, d;
+    uint32_t f, t;
+    int      g;
+    int      i;
+    
+    for(i=0; i<16; i++){
+        m[i] = readLE32(block + 4 * i);
+    }
+    
+    a = hash[0];
+    b = hash[1];
+    c = hash[2];
+    d = hash[3];
+    
+    for(i=0; i<64; i++){
+        switch(i / 16){
+            case 0:  { f = (b & c) | (~b & d); g = i; break; }
+            case 1:  { f = (d & b) | (~d & c); g = (5 * i + 1) % 16; break; }
+            case 2:  { f = b ^ c ^ d;          g = (3 * i + 5) % 16; break; }
+            default: { f = c ^ (b | ~d);       g = (7 * i) % 16; break; }
+        }
+        
+        t = a + f + md5K[i] + m[g];
+        a = d;
+        d = c;
+        c = b;
+        b = b + ((t << md5Shift[(i / 16) * 4 + i % 4]) | (t >> (32 - md5Shift[(i / 16) * 4 + i % 4])));
+    }
+    
+    hash[0] += a;
+    hash[1] += b;
+    hash[2] += c;
+    hash[3] += d;
+}
+
+
+
+
+/******************************************************************************
+ * CRC32C (Castagnoli), the polynomial the SSE4.2 crc32 instruction uses.
+ */
+static uint32_t crc32cSoftware(uint32_t crc, const unsigned char *data, size_t length){
+    int bit;
+    
+    while(length-- > 0){
+        crc ^= *data++;
+        for(bit=0; bit<8; bit++){
+            crc = (crc >> 1) ^ (0x82F63B78 & -(crc & 1));
+        }
+    }
+    
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32cSse42(uint32_t crc, const unsigned char *data, size_t length){
+    uint64_t crc64;
+    uint64_t word;
+    
+    crc64 = crc;
+    for(; length >= 8; data += 8, length -= 8){
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    
+    crc = crc64;
+    while(length-- > 0){
+        crc = _mm_crc32_u8(crc, *data++);
+    }
+    
+    return crc;
+}
+#endif
+
+
+
+
+/******************************************************************************
+ * XXH3 64 bit, seed 0 and the default secret.
+ */
+#define XXH_PRIME32_1 0x9E3779B1U
+#define XXH_PRIME32_2 0x85EBCA77U
+#define XXH_PRIME32_3 0xC2B2AE3DU
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+#define XXH_PRIME_MX1 0x165667919E3779F9ULL
+#define XXH_PRIME_MX2 0x9FB21C651E98DF25ULL
+
+#define XXH_STRIPE_LENGTH     64
+#define XXH_SECRET_SIZE       192
+#define XXH_STRIPES_PER_BLOCK ((XXH_SECRET_SIZE - XXH_STRIPE_LENGTH) / 8)
+#define XXH_MIDSIZE_MAX       240
+
+static const unsigned char xxh3Secret[XXH_SECRET_SIZE] = {
+    0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+    0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+    0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+    0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+    0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+    0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+    0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+    0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+    0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+    0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+    0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+    0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+};
+
+static uint64_t xxh3Multiply128Fold(uint64_t a, uint64_t b){
+    __extension__ unsigned __int128 product;
+    
+    product = __extension__ (unsigned __int128)a * b;
+    
+    return (uint64_t)product ^ (uint64_t)(product >> 64);
+}
+
+static uint64_t xxh3Rotate(uint64_t value, int bits){
+    return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t xxh64Avalanche(uint64_t h){
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    
+    return h;
+}
+
+static uint64_t xxh3Avalanche(uint64_t h){
+    h ^= h >> 37;
+    h *= XXH_PRIME_MX1;
+    h ^= h >> 32;
+    
+    return h;
+}
+
+static uint64_t xxh3Mix16(const unsigned char *data, const unsigned char *secret){
+    return xxh3Multiply128Fold(readLE64(data) ^ readLE64(secret), readLE64(data + 8) ^ readLE64(secret + 8));
+}
+
+static void xxh3Init(Xxh3State *state){
+    static const uint64_t acc[8] = {
+        XXH_PRIME32_3, XXH_PRIME64_1, XXH_PRIME64_2, XXH_PRIME64_3,
+        XXH_PRIME64_4, XXH_PRIME32_2, XXH_PRIME64_5, XXH_PRIME32_1
+    };
+    
+    memcpy(state->acc, acc, sizeof(acc));
+    state->bufferedSize = 0;
+    state->stripesSoFar = 0;
+    state->length       = 0;
+}
+
+/* Up to XXH_MIDSIZE_MAX bytes are hashed in one go, longer input is accumulated a stripe at a time. */
+static uint64_t xxh3Short(const unsigned char *data, size_t length){
+    const unsigned char *secret = xxh3Secret;
+    uint64_t            acc;
+    uint64_t            low;
+    uint64_t            high;
+    size_t              i;
+    
+    if(length == 0){
+        return xxh64Avalanche(readLE64(secret + 56) ^ readLE64(secret + 64));
+    }
+    
+    if(length <= 3){
+        acc = ((uint32_t)data[0] << 16) | ((uint32_t)data[length >> 1] << 24) | data[length - 1] | ((uint32_t)length << 8);
+        return xxh64Avalanche(acc ^ (readLE32(secret) ^ readLE32(secret + 4)));
+    }
+    
+    if(length <= 8){
+        acc  = readLE32(data + length - 4) + ((uint64_t)readLE32(data) << 32);
+        acc ^= readLE64(secret + 8) ^ readLE64(secret + 16);
+        
+        acc ^= xxh3Rotate(acc, 49) ^ xxh3Rotate(acc, 24);
+        acc *= XXH_PRIME_MX2;
+        acc ^= (acc >> 35) + length;
+        acc *= XXH_PRIME_MX2;
+        return acc ^ (acc >> 28);
+    }
+    
+    if(length <= 16){
+        low  = readLE64(data) ^ (readLE64(secret + 24) ^ readLE64(secret + 32));
+        high = readLE64(data + length - 8) ^ (readLE64(secret + 40) ^ readLE64(secret + 48));
+        acc  = length + __builtin_bswap64(low) + high + xxh3Multiply128Fold(low, high);
+        return xxh3Avalanche(acc);
+    }
+    
+    acc = length * XXH_PRIME64_1;
+    
+    if(length <= 128){
+        if(length > 32){
+            if(length > 64){
+                if(length > 96){
+                    acc += xxh3Mix16(data + 48, secret + 96);
+                    acc += xxh3Mix16(data + length - 64, secret + 112);
+                }
+                acc += xxh3Mix16(data + 32, secret + 64);
+                acc += xxh3Mix16(data + length - 48, secret + 80);
+            }
+            acc += xxh3Mix16(data + 16, secret + 32);
+            acc += xxh3Mix16(data + length - 32, secret + 48);
+        }
+        acc += xxh3Mix16(data, secret);
+        acc += xxh3Mix16(data + length - 16, secret + 16);
+        return xxh3Avalanche(acc);
+    }
+    
+    for(i=0; i<8; i++){
+        acc += xxh3Mix16(data + 16 * i, secret + 16 * i);
+    }
+    acc = xxh3Avalanche(acc);
+    for(i=8; i<length/16; i++){
+        acc += xxh3Mix16(data + 16 * i, secret + 16 * (i - 8) + 3);
+    }
+    acc += xxh3Mix16(data + length - 16, secret + 136 - 17);
+    
+    return xxh3Avalanche(acc);
+}
+
+static void xxh3AccumulateScalar(uint64_t *acc, const unsigned char *data, const unsigned char *secret, size_t stripes){
+    uint64_t value;
+    uint64_t key;
+    size_t   n;
+    int      i;
+    
+    for(n=0; n<stripes; n++, data += XXH_STRIPE_LENGTH, secret += 8){
+        for(i=0; i<8; i++){
+            value       = readLE64(data + 8 * i);
+            key         = value ^ readLE64(secret + 8 * i);
+            acc[i ^ 1] += value;
+            acc[i]     += (key & 0xFFFFFFFF) * (key >> 32);
+        }
+    }
+}
+
+#if defined(__x86_64__)
+__attribute__((target("avx2")))
+static void xxh3AccumulateAvx2(uint64_t *acc, const unsigned char *data, const unsigned char *secret, size_t stripes){
+    __m256i accs[2];
+    __m256i value;
+    __m256i key;
+    size_t  n;
+    int     i;
+    
+    accs[0] = _mm256_loadu_si256((const __m256i *)acc);
+    accs[1] = _mm256_loadu_si256((const __m256i *)(acc + 4));
+    
+    /* The same as the scalar loop, 4 lanes at a time. */
+    for(n=0; n<stripes; n++, data += XXH_STRIPE_LENGTH, secret += 8){
+        for(i=0; i<2; i++){
+            value   = _mm256_loadu_si256((const __m256i *)(data + 32 * i));
+            key     = _mm256_xor_si256(value, _mm256_loadu_si256((const __m256i *)(secret + 32 * i)));
+            key     = _mm256_mul_epu32(key, _mm256_srli_epi64(key, 32));
+            accs[i] = _mm256_add_epi64(accs[i], _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2)));
+            accs[i] = _mm256_add_epi64(accs[i], key);
+        }
+    }
+    
+    _mm256_storeu_si256((__m256i *)acc, accs[0]);
+    _mm256_storeu_si256((__m256i *)(acc + 4), accs[1]);
+}
+#endif
+
+static void xxh3Scramble(uint64_t *acc, const unsigned char *secret){
+    int i;
+    
+    for(i=0; i<8; i++){
+        acc[i] ^= acc[i] >> 47;
+        acc[i] ^= readLE64(secret + 8 * i);
+        acc[i] *= XXH_PRIME32_1;
+    }
+}
+
+/* Accumulate whole stripes, scrambling the accumulators after every block. */
+static void xxh3ConsumeStripes(uint64_t *acc, size_t *stripesSoFar, const unsigned char *data, size_t stripes){
+    size_t toEnd;
+    
+    while(stripes > 0){
+        toEnd = XXH_STRIPES_PER_BLOCK - *stripesSoFar;
+        if(toEnd > stripes){
+            xxh3Accumulate(acc, data, xxh3Secret + *stripesSoFar * 8, stripes);
+            *stripesSoFar += stripes;
+            return;
+        }
+        
+        xxh3Accumulate(acc, data, xxh3Secret + *stripesSoFar * 8, toEnd);
+        xxh3Scramble(acc, xxh3Secret + XXH_SECRET_SIZE - XXH_STRIPE_LENGTH);
+        *stripesSoFar = 0;
+        
+        data    += toEnd * XXH_STRIPE_LENGTH;
+        stripes -= toEnd;
+    }
+}
+
+static void xxh3Update(Xxh3State *state, const unsigned char *data, size_t length){
+    size_t size = sizeof(state->buffer);
+    size_t take;
+    size_t stripes;
+    
+    state->length += length;
+    
+    if(state->bufferedSize + length <= size){
+        memcpy(state->buffer + state->bufferedSize, data, length);
+        state->bufferedSize += length;
+        return;
+    }
+    
+    /* At least one byte is always left buffered, the last stripe is treated differently. */
+    if(state->bufferedSize > 0){
+        take = size - state->bufferedSize;
+        memcpy(state->buffer + state->bufferedSize, data, take);
+        data   += take;
+        length -= take;
+        
+        xxh3ConsumeStripes(state->acc, &state->stripesSoFar, state->buffer, size / XXH_STRIPE_LENGTH);
+        state->bufferedSize = 0;
+    }
+    
+    if(length > size){
+        stripes = (length - 1) / XXH_STRIPE_LENGTH;
+        xxh3ConsumeStripes(state->acc, &state->stripesSoFar, data, stripes);
+        data   += stripes * XXH_STRIPE_LENGTH;
+        length -= stripes * XXH_STRIPE_LENGTH;
+        
+        /* xxh3Final() may need the stripe before what is buffered. */
+        memcpy(state->buffer + size - XXH_STRIPE_LENGTH, data - XXH_STRIPE_LENGTH, XXH_STRIPE_LENGTH);
+    }
+    
+    memcpy(state->buffer, data, length);
+    state->bufferedSize = length;
+}
+
+static uint64_t xxh3Final(const Xxh3State *state){
+    const unsigned char *last;
+    unsigned char       lastStripe[XXH_STRIPE_LENGTH];
+    uint64_t            acc[8];
+    size_t              stripesSoFar;
+    size_t              catchUp;
+    uint64_t            result;
+    int                 i;
+    
+    if(state->length <= XXH_MIDSIZE_MAX){
+        return xxh3Short(state->buffer, state->length);
+    }
+    
+    memcpy(acc, state->acc, sizeof(acc));
+    stripesSoFar = state->stripesSoFar;
+    
+    if(state->bufferedSize >= XXH_STRIPE_LENGTH){
+        xxh3ConsumeStripes(acc, &stripesSoFar, state->buffer, (state->bufferedSize - 1) / XXH_STRIPE_LENGTH);
+        last = state->buffer + state->bufferedSize - XXH_STRIPE_LENGTH;
+    }
+    else{
+        catchUp = XXH_STRIPE_LENGTH - state->bufferedSize;
+        memcpy(lastStripe, state->buffer + sizeof(state->buffer) - catchUp, catchUp);
+        memcpy(lastStripe + catchUp, state->buffer, state->bufferedSize);
+        last = lastStripe;
+    }
+    xxh3Accumulate(acc, last, xxh3Secret + XXH_SECRET_SIZE - XXH_STRIPE_LENGTH - 7, 1);
+    
+    /* Merge the accumulators. */
+    result = state->length * XXH_PRIME64_1;
+    for(i=0; i<4; i++){
+        result += xxh3Multiply128Fold(acc[2*i] ^ readLE64(xxh3Secret + 11 + 16 * i), acc[2*i+1] ^ readLE64(xxh3Secret + 11 + 16 * i + 8));
+    }
+    
+    return xxh3Avalanche(result);
+}
+
+
+
+
+/******************************************************************************
+ * BLAKE3 256 bit, unkeyed, a tree of 1024 byte chunks.
+ */
+#define BLAKE3_BLOCK_LENGTH 64
+#define BLAKE3_CHUNK_LENGTH 1024
+
+#define BLAKE3_CHUNK_START 1
+#define BLAKE3_CHUNK_END   2
+#define BLAKE3_PARENT      4
+#define BLAKE3_ROOT        8
+
+static const uint32_t blake3IV[8] = {
+    0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+static const unsigned char blake3Schedule[7][16] = {
+    { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15 },
+    { 2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8 },
+    { 3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1 },
+    { 10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6 },
+    { 12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4 },
+    { 9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7 },
+    { 11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13 }
+};
+
+static uint32_t blake3Rotate(uint32_t value, int bits){
+    return (value >> bits) | (value << (32 - bits));
+}
+
+static void blake3G(uint32_t *v, int a, int b, int c, int d, uint32_t x, uint32_t y){
+    v[a] = v[a] + v[b] + x;
+    v[d] = blake3Rotate(v[d] ^ v[a], 16);
+    v[c] = v[c] + v[d];
+    v[b] = blake3Rotate(v[b] ^ v[c], 12);
+    v[a] = v[a] + v[b] + y;
+    v[d] = blake3Rotate(v[d] ^ v[a], 8);
+    v[c] = v[c] + v[d];
+    v[b] = blake3Rotate(v[b] ^ v[c], 7);
+}
+
+/* Fills out with all 16 words, the first 8 are the chaining value. */
+static void blake3Compress(const uint32_t *cv, const unsigned char *block, uint64_t counter, uint32_t blockLength, uint32_t flags, uint32_t *out){
+    uint32_t            m[16];
+    const unsigned char *s;
+    int                 round;
+    int                 i;
+    
+    for(i=0; i<16; i++){
+        m[i] = readLE32(block + 4 * i);
+    }
+    
+    memcpy(out, cv, 8 * sizeof(uint32_t));
+    memcpy(out + 8, blake3IV, 4 * sizeof(uint32_t));
+    out[12] = (uint32_t)counter;
+    out[13] = (uint32_t)(counter >> 32);
+    out[14] = blockLength;
+    out[15] = flags;
+    
+    for(round=0; round<7; round++){
+        s = blake3Schedule[round];
+        
+        blake3G(out, 0, 4,  8, 12, m[s[0]],  m[s[1]]);
+        blake3G(out, 1, 5,  9, 13, m[s[2]],  m[s[3]]);
+        blake3G(out, 2, 6, 10, 14, m[s[4]],  m[s[5]]);
+        blake3G(out, 3, 7, 11, 15, m[s[6]],  m[s[7]]);
+        blake3G(out, 0, 5, 10, 15, m[s[8]],  m[s[9]]);
+        blake3G(out, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+        blake3G(out, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+        blake3G(out, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+    }
+    
+    for(i=0; i<8; i++){
+        out[i]     ^= out[i + 8];
+        out[i + 8] ^= cv[i];
+    }
+}
+
+static void blake3ChunkInit(Blake3Chunk *chunk, uint64_t chunkCounter){
+    memcpy(chunk->cv, blake3IV, sizeof(blake3IV));
+    chunk->chunkCounter     = chunkCounter;
+    chunk->blockLength      = 0;
+    chunk->blocksCompressed = 0;
+    memset(chunk->block, 0, sizeof(chunk->block));
+}
+
+static uint32_t blake3ChunkStart(const Blake3Chunk *chunk){
+    return chunk->blocksCompressed == 0 ? BLAKE3_CHUNK_START : 0;
+}
+
+static void blake3ChunkUpdate(Blake3Chunk *chunk, const unsigned char *data, size_t length){
+    uint32_t out[16];
+    size_t   take;
+    
+    while(length > 0){
+        /* The last block of a chunk is compressed by whoever finishes the chunk, with BLAKE3_CHUNK_END. */
+        if(chunk->blockLength == BLAKE3_BLOCK_LENGTH){
+            blake3Compress(chunk->cv, chunk->block, chunk->chunkCounter, BLAKE3_BLOCK_LENGTH, blake3ChunkStart(chunk), out);
+            memcpy(chunk->cv, out, sizeof(chunk->cv));
+            chunk->blocksCompressed++;
+            chunk->blockLength = 0;
+            memset(chunk->block, 0, sizeof(chunk->block));
+        }
+        
+        take = BLAKE3_BLOCK_LENGTH - chunk->blockLength;
+        if(take > length){
+            take = length;
+        }
+        memcpy(chunk->block + chunk->blockLength, data, take);
+        chunk->blockLength += take;
+        data               += take;
+        length             -= take;
+    }
+}
+
+static void blake3Update(Blake3State *state, const unsigned char *data, size_t length){
+    Blake3Chunk   *chunk = &state->chunk;
+    unsigned char block[BLAKE3_BLOCK_LENGTH];
+    uint32_t      out[16];
+    uint64_t      chunks;
+    size_t        take;
+    
+    while(length > 0){
+        /* The chunk is full and more input follows, so it is not the root, fold it into the tree. */
+        if(chunk->blocksCompressed * BLAKE3_BLOCK_LENGTH + chunk->blockLength == BLAKE3_CHUNK_LENGTH){
+            blake3Compress(chunk->cv, chunk->block, chunk->chunkCounter, chunk->blockLength, blake3ChunkStart(chunk) | BLAKE3_CHUNK_END, out);
+            
+            /* Every trailing zero bit of the chunk count completes a subtree. */
+            for(chunks=chunk->chunkCounter+1; (chunks & 1) == 0; chunks >>= 1){
+                state->cvStackLength--;
+                memcpy(block, state->cvStack[state->cvStackLength], 32);
+                memcpy(block + 32, out, 32);
+                blake3Compress(blake3IV, block, 0, BLAKE3_BLOCK_LENGTH, BLAKE3_PARENT, out);
+            }
+            memcpy(state->cvStack[state->cvStackLength++], out, 32);
+            
+            blake3ChunkInit(chunk, chunk->chunkCounter + 1);
+        }
+        
+        take = BLAKE3_CHUNK_LENGTH - (chunk->blocksCompressed * BLAKE3_BLOCK_LENGTH + chunk->blockLength);
+        if(take > length){
+            take = length;
+        }
+        blake3ChunkUpdate(chunk, data, take);
+        data   += take;
+        length -= take;
+    }
+}
+
+static void blake3Final(const Blake3State *state, unsigned char *digest){
+    const Blake3Chunk *chunk = &state->chunk;
+    const uint32_t    *cv;
+    unsigned char     block[BLAKE3_BLOCK_LENGTH];
+    uint64_t          counter;
+    uint32_t          blockLength;
+    uint32_t          flags;
+    uint32_t          out[16];
+    int               i;
+    
+    /* The last node is compressed again with BLAKE3_ROOT once it is known to be the root. */
+    cv          = chunk->cv;
+    counter     = chunk->chunkCounter;
+    blockLength = chunk->blockLength;
+    flags       = blake3ChunkStart(chunk) | BLAKE3_CHUNK_END;
+    memcpy(block, chunk->block, sizeof(block));
+    
+    for(i=state->cvStackLength-1; i>=0; i--){
+        blake3Compress(cv, block, counter, blockLength, flags, out);
+        
+        memcpy(block, state->cvStack[i], 32);
+        memcpy(block + 32, out, 32);
+        cv          = blake3IV;
+        counter     = 0;
+        blockLength = BLAKE3_BLOCK_LENGTH;
+        flags       = BLAKE3_PARENT;
+    }
+    
+    blake3Compress(cv, block, 0, blockLength, flags | BLAKE3_ROOT, out); /* 0: the first block of output. */
+    
+    for(i=0; i<32; i++){
+        digest[i] = (out[i / 4] >> (8 * (i % 4))) & 0xFF;
+    }
+}
+
+
+
+
+/******************************************************************************
+ * Helpers
+ */
+static uint32_t readLE32(const unsigned char *p){
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t readLE64(const unsigned char *p){
+    return (uint64_t)readLE32(p) | ((uint64_t)readLE32(p + 4) << 32);
+}
+
+/* Pick the fastest implementations the CPU supports, before any thread can hash. */
+static void hashSelect(void){
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    
+    crc32cUpdate   = __builtin_cpu_supports("sse4.2") ? crc32cSse42 : crc32cSoftware;
+    xxh3Accumulate = __builtin_cpu_supports("avx2") ? xxh3AccumulateAvx2 : xxh3AccumulateScalar;
+#else
+    crc32cUpdate   = crc32cSoftware;
+    xxh3Accumulate = xxh3AccumulateScalar;
+#endif
+}
@@ -0,0 +1,113 @@
+#ifndef HASH_H
+#define HASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define HASH_MAX_DIGEST_SIZE 32            /* Largest digest of any algorithm (BLAKE3). */
+#define HASH_READ_SIZE       (1024 * 1024) /* Files which can not be mmap()ed are hashed this many bytes at a time. */
+
+/* Hash outline:
+ * 
+ * Every algorithm is used the same way, hashInit(), hashUpdate() as
+ * many times as needed, then hashFinal(), so the bytes can be hashed as
+ * they stream past (a file being sent or received) as well as a whole
+ * file at once with hashFile().
+ * 
+ *   + md5:    Compatible with md5sum, the slowest.
+ *   + crc32c: The crc32 instruction of SSE4.2 where the CPU has it.
+ *   + xxh3:   XXH3 64 bit, accumulated with AVX2 where the CPU has it.
+ *   + blake3: BLAKE3 256 bit, the only cryptographic one besides md5.
+ */
+typedef enum{
+    hash_md5,
+    hash_crc32c,
+    hash_xxh3,
+    hash_blake3,
+    hash_unknown
+} HashType;
+
+typedef struct{
+    uint32_t      state[4];
+    uint64_t      length;     /* Bytes hashed so far. */
+    unsigned char buffer[64];
+} Md5State;
+
+typedef struct{
+    uint64_t      acc[8];
+    unsigned char buffer[256];   /* The input not accumulated yet, followed by the last stripe which was. */
+    size_t        bufferedSize;
+    size_t        stripesSoFar;  /* Stripes accumulated in the current block. */
+    uint64_t      length;
+} Xxh3State;
+
+typedef struct{
+    uint32_t      cv[8];
+    uint64_t      chunkCounter;
+    unsigned char block[64];
+    unsigned int  blockLength;
+    unsigned int  blocksCompressed;
+} Blake3Chunk;
+
+typedef struct{
+    Blake3Chunk chunk;
+    uint32_t    cvStack[54][8]; /* Chaining values of the subtrees which are complete, enough for 2^64 bytes. */
+    int         cvStackLength;
+} Blake3State;
+
+typedef struct{
+    HashType type;
+    union{
+        Md5State    md5;
+        uint32_t    crc32c;
+        Xxh3State   xxh3;
+        Blake3State blake3;
+    } u;
+} HashState;
+
+/* PURPOSE:
+ *     Convert between the type of a hash and its name ("md5", "crc32c",
+ *     "xxh3", "blake3").
+ * 
+ * RETURNS:
+ *     hashFromName(): hash_unknown if the name is not recognized.
+ *     hashName():     NULL if the type is hash_unknown.
+ */
+HashType hashFromName(const char *name);
+const char *hashName(HashType type);
+
+/* Returns the size in bytes of the digest of the type of hash. */
+int hashDigestSize(HashType type);
+
+/* Hash bytes, see the outline. hashFinal() returns the size of the digest. */
+void hashInit(HashState *state, HashType type);
+void hashUpdate(HashState *state, const void *data, size_t length);
+int hashFinal(HashState *state, unsigned char *digest);
+
+/* PURPOSE:
+ *     Hash the rest of a file (from its current offset if it is not
+ *     mmap()ed). Regular files are mmap()ed, anything else is read
+ *     HASH_READ_SIZE bytes at a time.
+ * 
+ * RETURNS:
+ *     SUCCESS: The size of the digest.
+ *     FAILURE: -1, errno is set.
+ */
+int hashFile(int fd, HashType type, unsigned char *digest);
+
+/* PURPOSE:
+ *     Hash length bytes of a file starting at offset, with pread(), so
+ *     the file offset is left alone. Used for bytes sendfile() or
+ *     splice() move without them entering the process, they come
+ *     straight back out of the page cache.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set (0 if the file is shorter than that).
+ */
+int hashUpdateFile(HashState *state, int fd, long offset, long length);
+
+/* Write the digest as lower case hex, followed by a null terminator, into hex. */
+void hashToHex(const unsigned char *digest, int length, char *hex);
+
+#endif
@@ -0,0 +1,396 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "shared.h"
+#include "listing.h"
+
+/* An entry of a directory, its name is kept in the names of the directory. */
+typedef struct{
+    long        nameOffset;
+    int         nameLength;
+    struct stat s;          /* Only st_mode (the file type) is known unless the entry was fstatat()ed. */
+} ListingEntry;
+
+/* A directory read into memory, so it can be sorted. */
+typedef struct{
+    ListingEntry *entries;
+    long         count;
+    long         capacity;
+    char         *names;         /* Every name, null terminated, one after the other. */
+    long         namesLength;
+    long         namesCapacity;
+    ListingSort  sort;
+} ListingDirectory;
+
+/* Records waiting to be written to fd. */
+typedef struct{
+    int           fd;
+    unsigned char buffer[LISTING_BUFFER_SIZE];
+    long          length;
+} ListingWriter;
+
+static int listingDirectory(ListingWriter *writer, int dirfd, const char *path, int heading, const ListingOptions *options);
+static int listingReadDirectory(int dirfd, ListingDirectory *directory, const ListingOptions *options);
+static int listingAddEntry(ListingDirectory *directory, const char *name, int nameLength, unsigned char type);
+static int listingCompare(const void *a, const void *b, void *arg);
+static int listingWriteRecord(ListingWriter *writer, unsigned char kind, const struct stat *s, const char *name, long nameLength);
+static int listingFlush(ListingWriter *writer);
+
+
+
+
+int listingParseArguments(char *arguments, ListingOptions *options, char **paths){
+    char *argument;
+    char *save;
+    int  count;
+    
+    options->all        = 0;
+    options->longFormat = 0;
+    options->recursive  = 0;
+    options->reverse    = 0;
+    options->sort       = listing_sort_name;
+    
+    /* Globs, pipes, quotes and the like need a shell. */
+    if(strpbrk(arguments, LISTING_SHELL_CHARACTERS) != NULL){
+        return -1;
+    }
+    
+    count = 0;
+    for(argument = strtok_r(arguments, " \t", &save); argument != NULL; argument = strtok_r(NULL, " \t", &save)){
+        /* A path. */
+        if(argument[0] != '-' || argument[1] == '\0'){
+            if(count == LISTING_MAX_PATHS){
+                return -1;
+            }
+            paths[count++] = argument;
+            continue;
+        }
+        
+        /* Options, which may be combined ("-la"). */
+        for(argument++; *argument != '\0'; argument++){
+            switch(*argument){
+                case 'a': { options->all        = 1;                 break; }
+                case 'l': { options->longFormat = 1;                 break; }
+                case 'R': { options->recursive  = 1;                 break; }
+                case 'r': { options->reverse    = 1;                 break; }
+                case 'S': { options->sort       = listing_sort_size; break; }
+                case 't': { options->sort       = listing_sort_time; break; }
+                case '1': {                                          break; }
+                default:  { return -1; }
+            }
+        }
+    }
+    
+    return count;
+}
+
+int listingWrite(int fd, const char *path, int heading, const ListingOptions *options){
+    ListingWriter *writer;
+    struct stat   s;
+    int           dirfd;
+    int           ret;
+    
+    /* The writer holds a large buffer, keep it off the stack. */
+    writer = malloc(sizeof(ListingWriter));
+    if(writer == NULL){
+        return -1;
+    }
+    writer->fd     = fd;
+    writer->length = 0;
+    
+    dirfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    
+    /* Not a directory, list the path on its own. */
+    if(dirfd == -1 && errno == ENOTDIR){
+        ret = stat(path, &s) != 0 ? -1 : listingWriteRecord(writer, listing_record_entry, &s, path, strlen(path));
+    }
+    else if(dirfd == -1){
+        ret = -1;
+    }
+    else{
+        ret = listingDirectory(writer, dirfd, path, heading || options->recursive, options);
+        close(dirfd);
+    }
+    
+    if(ret == 0){
+        ret = listingFlush(writer);
+    }
+    
+    free(writer);
+    
+    return ret;
+}
+
+/* PURPOSE:
+ *     Write the records for every entry of a directory, then (-R) for
+ *     every subdirectory of it.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set.
+ */
+static int listingDirectory(ListingWriter *writer, int dirfd, const char *path, int heading, const ListingOptions *options){
+    ListingDirectory directory;
+    ListingEntry     *entry;
+    const char       *name;
+    char             *subpath;
+    int              subdirfd;
+    long             i;
+    int              ret;
+    
+    directory.entries       = NULL;
+    directory.count         = 0;
+    directory.capacity      = 0;
+    directory.names         = NULL;
+    directory.namesLength   = 0;
+    directory.namesCapacity = 0;
+    directory.sort          = options->sort;
+    
+    ret = listingReadDirectory(dirfd, &directory, options);
+    if(ret == 0){
+        qsort_r(directory.entries, directory.count, sizeof(ListingEntry), listingCompare, &directory);
+    }
+    
+    if(ret == 0 && heading){
+        ret = listingWriteRecord(writer, listing_record_directory, NULL, path, strlen(path));
+    }
+    
+    for(i=0; ret == 0 && i<directory.count; i++){
+        entry = &directory.entries[options->reverse ? directory.count - 1 - i : i];
+        ret   = listingWriteRecord(writer, listing_record_entry, &entry->s, directory.names + entry->nameOffset, entry->nameLength);
+    }
+    
+    /* Then the subdirectories in the same order, symbolic links to directories are not followed. */
+    for(i=0; ret == 0 && options->recursive && i<directory.count; i++){
+        entry = &directory.entries[options->reverse ? directory.count - 1 - i : i];
+        name  = directory.names + entry->nameOffset;
+        
+        if(!S_ISDIR(entry->s.st_mode) || strcmp(name, ".") == 0 || strcmp(name, "..") == 0){
+            continue;
+        }
+        
+        /* Directories which can not be opened are skipped. */
+        subdirfd = openat(dirfd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if(subdirfd == -1){
+            continue;
+        }
+        
+        subpath = malloc(strlen(path) + 1 + entry->nameLength + 1);
+        if(subpath == NULL){
+            close(subdirfd);
+            ret = -1;
+            break;
+        }
+        sprintf(subpath, "%s/%s", path, name);
+        
+        ret = listingDirectory(writer, subdirfd, subpath, 1, options);
+        
+        free(subpath);
+        close(subdirfd);
+    }
+    
+    free(directory.entries);
+    free(directory.names);
+    
+    return ret;
+}
+
+/* PURPOSE:
+ *     Read every entry of a directory with getdents64(). Entries are
+ *     only fstatat()ed when the options need more than the type of the
+ *     entry, which getdents64() returns on most file systems.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set.
+ */
+static int listingReadDirectory(int dirfd, ListingDirectory *directory, const ListingOptions *options){
+    char            buffer[LISTING_BUFFER_SIZE];
+    struct dirent64 *d;
+    ListingEntry    *entry;
+    ssize_t         n;
+    ssize_t         offset;
+    int             needStat;
+    long            i;
+    
+    while((n = getdents64(dirfd, buffer, sizeof(buffer))) > 0){
+        for(offset = 0; offset < n; offset += d->d_reclen){
+            d = (struct dirent64 *)(buffer + offset);
+            
+            /* Hidden entries, "." and ".." included. */
+            if(d->d_name[0] == '.' && !options->all){
+                continue;
+            }
+            
+            if(listingAddEntry(directory, d->d_name, strlen(d->d_name), d->d_type) != 0){
+                return -1;
+            }
+        }
+    }
+    
+    if(n == -1){
+        return -1;
+    }
+    
+    /* Fill in the rest of the details, an entry which disappeared in the meantime keeps what is known. */
+    needStat = options->longFormat || options->sort != listing_sort_name;
+    for(i=0; i<directory->count; i++){
+        entry = &directory->entries[i];
+        
+        /* -R has to know which entries are directories. */
+        if(needStat || (options->recursive && entry->s.st_mode == 0)){
+            fstatat(dirfd, directory->names + entry->nameOffset, &entry->s, AT_SYMLINK_NOFOLLOW);
+        }
+    }
+    
+    return 0;
+}
+
+/* PURPOSE:
+ *     Add an entry to a directory, growing its arrays as needed.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Out of memory.
+ */
+static int listingAddEntry(ListingDirectory *directory, const char *name, int nameLength, unsigned char type){
+    ListingEntry *entries;
+    ListingEntry *entry;
+    char         *names;
+    long         capacity;
+    
+    if(directory->count == directory->capacity){
+        capacity = directory->capacity == 0 ? 256 : directory->capacity * 2;
+        entries  = realloc(directory->entries, capacity * sizeof(ListingEntry));
+        if(entries == NULL){
+            return -1;
+        }
+        directory->entries  = entries;
+        directory->capacity = capacity;
+    }
+    
+    if(directory->namesLength + nameLength + 1 > directory->namesCapacity){
+        capacity = directory->namesCapacity == 0 ? 4096 : directory->namesCapacity * 2;
+        while(directory->namesLength + nameLength + 1 > capacity){
+            capacity *= 2;
+        }
+        
+        names = realloc(directory->names, capacity);
+        if(names == NULL){
+            return -1;
+        }
+        directory->names         = names;
+        directory->namesCapacity = capacity;
+    }
+    
+    memcpy(directory->names + directory->namesLength, name, nameLength + 1);
+    
+    entry = &directory->entries[directory->count++];
+    memset(&entry->s, 0, sizeof(entry->s));
+    entry->nameOffset = directory->namesLength;
+    entry->nameLength = nameLength;
+    entry->s.st_mode  = type == DT_UNKNOWN ? 0 : DTTOIF(type);
+    
+    directory->namesLength += nameLength + 1;
+    
+    return 0;
+}
+
+/* Order two entries for qsort_r(), arg is the directory they belong to. Ties are broken by name. */
+static int listingCompare(const void *a, const void *b, void *arg){
+    const ListingDirectory *directory;
+    const ListingEntry     *x;
+    const ListingEntry     *y;
+    
+    directory = arg;
+    x         = a;
+    y         = b;
+    
+    switch(directory->sort){
+        case listing_sort_size: {
+            if(x->s.st_size != y->s.st_size){
+                return x->s.st_size > y->s.st_size ? -1 : 1;
+            }
+            break;
+        }
+        
+        case listing_sort_time: {
+            if(x->s.st_mtim.tv_sec != y->s.st_mtim.tv_sec){
+                return x->s.st_mtim.tv_sec > y->s.st_mtim.tv_sec ? -1 : 1;
+            }
+            if(x->s.st_mtim.tv_nsec != y->s.st_mtim.tv_nsec){
+                return x->s.st_mtim.tv_nsec > y->s.st_mtim.tv_nsec ? -1 : 1;
+            }
+            break;
+        }
+        
+        case listing_sort_name: {
+            break;
+        }
+    }
+    
+    return strcmp(directory->names + x->nameOffset, directory->names + y->nameOffset);
+}
+
+/* PURPOSE:
+ *     Add a record to the writer, s is NULL for a listing_record_directory.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set.
+ */
+static int listingWriteRecord(ListingWriter *writer, unsigned char kind, const struct stat *s, const char *name, long nameLength){
+    ListingRecord record;
+    
+    /* No file system has names this long, but the paths built by -R could get there. */
+    if(LISTING_RECORD_HEADER_SIZE + nameLength > (long)sizeof(writer->buffer)){
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    
+    if(writer->length + LISTING_RECORD_HEADER_SIZE + nameLength > (long)sizeof(writer->buffer)){
+        if(listingFlush(writer) != 0){
+            return -1;
+        }
+    }
+    
+    memset(&record, 0, sizeof(record));
+    record.kind       = kind;
+    record.nameLength = nameLength;
+    if(s != NULL){
+        record.mode  = s->st_mode;
+        record.nlink = s->st_nlink;
+        record.uid   = s->st_uid;
+        record.gid   = s->st_gid;
+        record.size  = s->st_size;
+        record.mtime = s->st_mtim.tv_sec;
+    }
+    
+    listingEncodeRecord(writer->buffer + writer->length, &record);
+    memcpy(writer->buffer + writer->length + LISTING_RECORD_HEADER_SIZE, name, nameLength);
+    writer->length += LISTING_RECORD_HEADER_SIZE + nameLength;
+    
+    return 0;
+}
+
+/* Write out the records in the writer, returns 0 on success, -1 on failure (errno set by write()). */
+static int listingFlush(ListingWriter *writer){
+    if(writeAll(writer->fd, writer->buffer, writer->length) != 0){
+        return -1;
+    }
+    
+    writer->length = 0;
+    
+    return 0;
+}
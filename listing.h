@@ -0,0 +1,68 @@
+#ifndef LISTING_H
+#define LISTING_H
+
+#define LISTING_MAX_PATHS   64          /* Most paths one sls lists. */
+#define LISTING_BUFFER_SIZE (64 * 1024) /* Records are written out, and directories read, this many bytes at a time. */
+#define LISTING_SHELL_CHARACTERS "|&;<>()$`\\\"'*?[]{}~" /* Arguments with any of these are left to the shell and ls. */
+
+/* Listing outline (sls without a shell):
+ * 
+ * 1. The arguments are parsed, if they use an option which is not
+ *    supported here the server falls back to popen()ing ls.
+ * 
+ * 2. Every directory is read with getdents64(), entries are only
+ *    fstatat()ed when the options need more than the name and type.
+ * 
+ * 3. The entries are sorted and written as listing records (see
+ *    shared.h) into a file, which the session then sends like a get.
+ *    The client formats the records.
+ */
+
+/* How entries are ordered. */
+typedef enum{
+    listing_sort_name, /* By name (default). */
+    listing_sort_size, /* -S: Largest first. */
+    listing_sort_time  /* -t: Newest first. */
+} ListingSort;
+
+typedef struct{
+    int         all;        /* -a: Include entries starting with a '.'. */
+    int         longFormat; /* -l: The client prints the mode, owner, size and time. */
+    int         recursive;  /* -R: List subdirectories too. */
+    int         reverse;    /* -r: Reverse the order. */
+    ListingSort sort;
+} ListingOptions;
+
+/* PURPOSE:
+ *     Parse the arguments of an sls command, for example "-la /tmp".
+ * 
+ * PARAMETERS:
+ *     char *arguments:         The arguments, split into pieces in place.
+ *     ListingOptions *options: Filled in with the options.
+ *     char **paths:            Filled in with the paths to list, pointers
+ *                              into arguments, at most LISTING_MAX_PATHS.
+ * 
+ * RETURNS:
+ *     SUCCESS: The number of paths (0 means the current directory).
+ *     FAILURE: -1, an option or the number of paths is not supported.
+ */
+int listingParseArguments(char *arguments, ListingOptions *options, char **paths);
+
+/* PURPOSE:
+ *     Write the listing records for a path to fd, a directory has its
+ *     entries listed, anything else is listed on its own.
+ * 
+ * PARAMETERS:
+ *     int fd:                        Where the records are written.
+ *     const char *path:              The path to list.
+ *     int heading:                   1 to start a directory with a
+ *                                    listing_record_directory.
+ *     const ListingOptions *options: The parsed options.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set.
+ */
+int listingWrite(int fd, const char *path, int heading, const ListingOptions *options);
+
+#endif
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,34 +9,60 @@
 #include <sys/wait.h>
 #include <signal.h>
 
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <glob.h>
 #include <sys/socket.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 
 #include "shared.h"
+#include "listing.h"
+#include "checksum.h"
+#include "archive.h"
+#include "session.h"
+#include "eventloop.h"
 #include "server.h"
 
 int main(int argc, char **argv){
     const char *portstr;          /*  */
+    ServerMode mode;              /* How clients are handled (-m). */
+    int opt;                      /* Option returned by getopt(). */
     
     struct addrinfo hints;        /*  */
     struct addrinfo *serverInfo;  /*  */
     int listenfd;                 /*  */
-    int sockfd;                   /*  */
     int ret;                      /*  */
     
-    long n;                /*  */
-    char buffer[BUFFER_SIZE]; /*  */
-    
-    struct sockaddr_storage clientAddr;
-    socklen_t               clientAddrSize;
-    
-    pid_t pid;
+    /* Parse the options. */
+    mode = server_mode_fork;
+    while((opt = getopt(argc, argv, "m:")) != -1){
+        switch(opt){
+            case 'm': {
+                if(strcmp(optarg, "fork") == 0){
+                    mode = server_mode_fork;
+                }
+                else if(strcmp(optarg, "epoll") == 0){
+                    mode = server_mode_epoll;
+                }
+                else{
+                    printUsage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            }
+            default: {
+                printUsage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
     
     /* Not the right amount of arguments. */
-    if(argc != 2){
+    if(argc - optind != 1){
         printUsage(argv[0]);
         exit(EXIT_FAILURE);
     }
@@ -45,8 +73,14 @@ int main(int argc, char **argv){
         exit(EXIT_FAILURE);
     }
     
+    /* A client disconnecting in the middle of a reply should not kill the server. */
+    if (signal(SIGPIPE, SIG_IGN) == SIG_ERR){
+        perror("ERROR");
+        exit(EXIT_FAILURE);
+    }
+    
     /* Get the port from the command line. */
-    portstr = argv[1];
+    portstr = argv[optind];
     
     /* Start up the server. */
     printf("Starting up server on port %s...\n", portstr);
@@ -65,7 +99,7 @@ int main(int argc, char **argv){
     }
     
     /* Just bind on the first address. */
-    listenfd = socket(serverInfo->ai_family, serverInfo->ai_socktype, serverInfo->ai_protocol);
+    listenfd = socket(serverInfo->ai_family, serverInfo->ai_socktype | SOCK_CLOEXEC, serverInfo->ai_protocol);
     if(listenfd == -1){
         perror("ERROR, socket()");
         exit(EXIT_FAILURE);
@@ -91,15 +125,41 @@ int main(int argc, char **argv){
     /* Server is ready to accept connections now. */
     printf("Server succesfully started.\n");
     
+    /* Handle clients until a critical error occurs. */
+    if(mode == server_mode_epoll){
+        runEventLoop(listenfd);
+    }
+    else{
+        runForkServer(listenfd);
+    }
+    
+    /* Close the listen socket. */
+    if(close(listenfd) != 0){
+        perror("ERROR, close() listening socket");
+        exit(EXIT_FAILURE);
+    }
+    
+    return EXIT_FAILURE;
+}
+
+int runForkServer(int listenfd){
+    int sockfd;
+    
+    struct sockaddr_storage clientAddr;
+    socklen_t               clientAddrSize;
+    
+    Session *session;
+    pid_t   pid;
+    
     while(1){
         /* Accept a connection. */
         clientAddrSize = sizeof(clientAddr);
-        sockfd         = accept(listenfd, (struct sockaddr *)&clientAddr, &clientAddrSize);
+        sockfd         = accept4(listenfd, (struct sockaddr *)&clientAddr, &clientAddrSize, SOCK_NONBLOCK | SOCK_CLOEXEC);
         
         /* accept() error. */
         if(sockfd < 0){
             perror("ERROR, accept()");
-            exit(EXIT_FAILURE);
+            return -1;
         }
         
         printClientDetails((struct sockaddr *)&clientAddr, clientAddrSize, ": " CFLGRN "Connected." C_RST "\n");
@@ -109,88 +169,85 @@ int main(int argc, char **argv){
         /* fork error. */
         if(pid == -1){
             perror("ERROR");
+            return -1;
+        }
+        
+        /* Parent continues listening. */
+        if(pid != 0){
+            close(sockfd);
+            continue;
+        }
+        
+        /* Child will now handle the client until THEY close the connection. */
+        close(listenfd);
+        
+        session = sessionCreate(sockfd, (struct sockaddr *)&clientAddr, clientAddrSize, AT_FDCWD);
+        if(session == NULL){
+            perror(CFLRED "ERROR" C_RST);
             exit(EXIT_FAILURE);
         }
         
-        /* Child will now handle the client, parent will continue listening. */
-        if(pid == 0){
-            /* Handle this client until THEY close the connection. */
-            while((n=recv(sockfd, buffer, sizeof(buffer), 0)) > 0){
-                /* Print out client details. */
-                printClientDetails((struct sockaddr *)&clientAddr, clientAddrSize, ": ");
-                
-                /* Command is not null terminated, exit to prevent segmentation fault. */
-                if(buffer[n-1] != '\0'){
-                    puts(CFLRED "ERROR:" C_RST " Client sent a non-null terminated command, exiting...");
-                    exit(EXIT_FAILURE);
-                }
-                
-                /* Print out the command sent in blue. */
-                printf(CFLBLU);
-                fwrite(buffer, 1, n, stdout);
-                puts(C_RST);
-                
-                
-                /* Execute the command. */
-                if(executeCommand(sockfd, buffer) == -1){
-                    if(errno != 0){
-                        perror(CFLRED "ERROR" C_RST);
-                    }
-                    close(sockfd);
-                    exit(EXIT_FAILURE);
-                }
-            }
-            
-            if(n == -1){
-                perror(CFLRED "ERROR" C_RST);
-                close(sockfd);
-                exit(EXIT_FAILURE);
-            }
-            
-            printClientDetails((struct sockaddr *)&clientAddr, clientAddrSize, ": " CFLRED "Disconnected." C_RST "\n");
-            exit(EXIT_SUCCESS);
+        if(runSession(session) != 0){
+            sessionDestroy(session);
+            exit(EXIT_FAILURE);
         }
+        
+        sessionDestroy(session);
+        exit(EXIT_SUCCESS);
     }
     
-    /* Close the listen socket. */
-    if(close(listenfd) != 0){
-        perror("ERROR, close() listening socket");
-        exit(EXIT_FAILURE);
-    }
-    
-    return EXIT_FAILURE;
+    return -1;
 }
 
-int executeCommand(int sockfd, const char *command){
+int executeCommand(Session *session, Stream *stream, const char *command){
     SharedCommandType commandType;
     
     commandType = getSharedCommandType(command);
     
     switch(commandType){
-        case command_cd:   { return executeCommandcd(sockfd, command); }
+        case command_cd:   { return executeCommandcd(session, stream, command); }
+        
+        case command_list: { return executeCommandls(session, stream, command); }
+        
+        case command_md5:  { return executeCommandmd5(session, stream, command); }
+        
+        case command_pwd:  { return executeReadOnlyUnixCommand(stream, command); }
         
-        case command_list:
-        case command_pwd:
-        case command_md5:  { return executeReadOnlyUnixCommand(sockfd, command); }
+        case command_get: { return executeCommandget(session, stream, command); }
+        case command_put: { return executeCommandput(session, stream, command); }
         
-        case command_get: { return executeCommandget(sockfd, command); }
-        case command_put: { return executeCommandput(sockfd, command); }
+        case command_mget: { return executeCommandmget(session, stream, command); }
+        case command_mput: { return startArchiveUpload(session, stream, NULL); }
         
         case command_unknown: {
-            return -1;
+            if(sendReplyError(session, stream, "Unknown command.") != 0){
+                return -1;
+            }
+            return 1;
         }
     }
     
     return 0;
 }
 
-int executeCommandget(int sockfd, const char *command){
-    char buffer[BUFFER_SIZE];
-    long n;                   /* Number of bytes read. */
-    long size;                /* File size. */
+int executeCommandget(Session *session, Stream *stream, const char *command){
+    unsigned char sizeBuffer[FRAME_SIZE_SIZE];
+    long size;                /* Bytes of the file which are sent. */
     
     const char *filePath;
-    FILE *fp;
+    struct stat s;
+    int fd;
+    
+    long          offset;     /* Where sending starts, what the client already has (get -c). */
+    int           resume;
+    char          expected[2 * RESUME_HASH_SIZE + 1];
+    unsigned char digest[RESUME_HASH_SIZE];
+    char          hex[2 * RESUME_HASH_SIZE + 1];
+    int           consumed;
+    
+    long          basisSize;  /* Size of the copy the client has (get -d), -1 if none. */
+    
+    long          rangeLength; /* Bytes from offset on which are sent (get -s), -1 for all of them. */
     
     const char *errorstr;
     
@@ -199,16 +256,60 @@ int executeCommandget(int sockfd, const char *command){
     /* Skip the initial "get " in the command string. */
     filePath = command + 4;
     
-    /* Determine if the file is a regular file. */
-    ret = isRegularFile(filePath);
-    if(ret == -1){ /* An error occured in isRegularFile() */
-        errorstr = strerror(errno);
-        ret      = sendGetReplyNo(sockfd, errorstr);
-        return 1;
+    /* "get -r PATH": the directory PATH and everything in it, as an archive. */
+    if(strncmp(filePath, "-r ", 3) == 0){
+        return startArchiveDownload(session, stream, filePath + 3, NULL, 0);
+    }
+    
+    /* "get -s OFFSET LENGTH PATH": LENGTH bytes from OFFSET on, one stripe of a get -p. */
+    rangeLength = -1;
+    if(strncmp(filePath, "-s ", 3) == 0){
+        consumed = 0;
+        if(sscanf(filePath + 3, "%ld %ld %n", &offset, &rangeLength, &consumed) != 2 || consumed == 0 || offset < 0 || rangeLength < 0){
+            if(sendReplyError(session, stream, "Invalid range request.") != 0){
+                return -1;
+            }
+            return 1;
+        }
+        filePath += 3 + consumed;
+    }
+    
+    /* "get -d SIZE PATH": the client has a copy of SIZE bytes, it sends its signatures and gets the changes. */
+    basisSize = -1;
+    if(strncmp(filePath, "-d ", 3) == 0){
+        consumed = 0;
+        if(sscanf(filePath + 3, "%ld %n", &basisSize, &consumed) != 1 || consumed == 0 || basisSize < 0){
+            if(sendReplyError(session, stream, "Invalid delta request.") != 0){
+                return -1;
+            }
+            return 1;
+        }
+        filePath += 3 + consumed;
+    }
+    
+    /* "get -c OFFSET HASH PATH": the client has the first OFFSET bytes, the block before OFFSET hashes to HASH. */
+    offset = 0;
+    resume = strncmp(filePath, "-c ", 3) == 0;
+    if(resume){
+        consumed = 0;
+        if(sscanf(filePath + 3, "%ld %16s %n", &offset, expected, &consumed) != 2 || consumed == 0 || offset < 0){
+            if(sendReplyError(session, stream, "Invalid resume request.") != 0){
+                return -1;
+            }
+            return 1;
+        }
+        filePath += 3 + consumed;
     }
-    else if(ret == 0){ /* File is a directory. */
-        errorstr = "Can not download directory.";
-        ret      = sendGetReplyNo(sockfd, errorstr);
+    
+    /* Open the file. */
+    fd = open(filePath, O_RDONLY | O_CLOEXEC);
+    if(fd == -1 || fstat(fd, &s) != 0){
+        errorstr = strerror(errno);
+        ret      = sendReplyError(session, stream, errorstr);
+        
+        if(fd != -1){
+            close(fd);
+        }
         
         if(ret != 0){
             return -1;
@@ -217,11 +318,12 @@ int executeCommandget(int sockfd, const char *command){
         return 1;
     }
     
-    /* Open the file. */
-    fp = fopen(filePath, "r");
-    if(fp == NULL){
-        errorstr = strerror(errno);
-        ret      = sendGetReplyNo(sockfd, errorstr);
+    /* Determine if the file is a regular file. */
+    if(!S_ISREG(s.st_mode)){
+        errorstr = S_ISDIR(s.st_mode) ? "Can not download directory." : "Not a regular file.";
+        ret      = sendReplyError(session, stream, errorstr);
+        
+        close(fd);
         
         if(ret != 0){
             return -1;
@@ -230,141 +332,666 @@ int executeCommandget(int sockfd, const char *command){
         return 1;
     }
     
-    /* Send an OK message and the file size. */
-    size = fileSize(filePath);
-    memcpy(buffer, GET_REPLY_OK, strlen(GET_REPLY_OK));       /* Set the start of the packet to OK */
-    memcpy(buffer+strlen(GET_REPLY_OK), &size, sizeof(long)); /* Append the size of the file. */
-    ret = write(sockfd, buffer, GET_REPLY_SIZE);              /* Send the packet. */
-    if(ret <= 0){
-        return -1;
+    if(basisSize != -1){
+        return startDeltaDownload(session, stream, fd, s.st_size, basisSize);
     }
     
-    /* Send the file data. */
-    while((n=fread(buffer, 1, sizeof(buffer), fp)) > 0){
-        n = write(sockfd, buffer, n);
-        if(n <= 0){
+    /* Carry on from where the client stopped if its copy ends the way this file does there, otherwise start over. */
+    if(resume){
+        if(offset > s.st_size || resumeBlockHash(fd, offset, digest) != 0){
+            offset = 0;
+        }
+        hashToHex(digest, RESUME_HASH_SIZE, hex);
+        if(offset > 0 && strcmp(hex, expected) != 0){
+            offset = 0;
+        }
+        
+        packUint64(sizeBuffer, offset);
+        if(lseek(fd, offset, SEEK_SET) == -1 || sessionQueueFrame(session, stream, frame_ok, sizeBuffer, sizeof(sizeBuffer)) != 0){
+            close(fd);
             return -1;
         }
     }
     
-    fclose(fp);
+    /* A range is cut down to the file, the size of the whole file tells the client how to cut up the rest. */
+    if(rangeLength != -1){
+        if(offset > s.st_size){
+            offset = s.st_size;
+        }
+        if(rangeLength > s.st_size - offset){
+            rangeLength = s.st_size - offset;
+        }
+        
+        packUint64(sizeBuffer, s.st_size);
+        if(lseek(fd, offset, SEEK_SET) == -1 || sessionQueueFrame(session, stream, frame_ok, sizeBuffer, sizeof(sizeBuffer)) != 0){
+            close(fd);
+            return -1;
+        }
+    }
     
-    /* Check if an error occured. */
-    if(ferror(fp)){
+    /* Queue the number of bytes which follow as frame_data. */
+    size = rangeLength != -1 ? rangeLength : s.st_size - offset;
+    packUint64(sizeBuffer, size);
+    if(sessionQueueFrame(session, stream, frame_size, sizeBuffer, sizeof(sizeBuffer)) != 0){
+        close(fd);
         return -1;
     }
     
+    /* The stream sends the file data after the reply. */
+    stream->sourcefd        = fd;
+    stream->sourceLeft      = size;
+    stream->sourceFrameLeft = 0;
+    stream->sourceBuffered  = 0;
+    stream->state           = stream_state_send;
+    
+    /* The frame_end carries the hash of everything sent. */
+    if(session->hashType != hash_unknown){
+        stream->hash = malloc(sizeof(HashState));
+        if(stream->hash == NULL){
+            return -1;
+        }
+        hashInit(stream->hash, session->hashType);
+    }
+    
     return 0;
 }
 
-int executeCommandput(int sockfd, const char *command){
-    char buffer[BUFFER_SIZE];
-    long numBytesLeft;
-    long n;
-    
+int executeCommandput(Session *session, Stream *stream, const char *command){
     const char *errorstr;
     
     const char *fileName;
-    FILE *fp;
+    int fd;
+    
+    unsigned char resumeBuffer[FRAME_RESUME_SIZE];
+    int           resume;
+    struct stat   s;
+    
+    long          offset;     /* Where the stripe of a put -p starts. */
+    long          size;       /* Size of the whole file. */
+    int           consumed;
     
     fileName = command + 4; /* Skip the leading "put " */
     
-    /* Check if the file already exists. */
-    if(fileExists(fileName)){
-        errorstr = "File already exists";
+    /* "put -r NAME": the directory NAME is created and the archive the client sends extracted into it. */
+    if(strncmp(fileName, "-r ", 3) == 0){
+        return startArchiveUpload(session, stream, fileName + 3);
+    }
+    
+    /* "put -s OFFSET SIZE NAME": one stripe of a put -p, the first one creates the file. */
+    if(strncmp(fileName, "-s ", 3) == 0){
+        consumed = 0;
+        if(sscanf(fileName + 3, "%ld %ld %n", &offset, &size, &consumed) != 2 || consumed == 0 || offset < 0 || offset > size){
+            if(sendReplyError(session, stream, "Invalid range request.") != 0){
+                return -1;
+            }
+            return 1;
+        }
+        return startRangeUpload(session, stream, fileName + 3 + consumed, offset, size);
+    }
+    
+    /* "put -c NAME": carry on with the copy which is already here. */
+    resume = strncmp(fileName, "-c ", 3) == 0;
+    if(resume){
+        fileName += 3;
+    }
+    
+    /* "put -d NAME": only the changes to the copy which is already here are sent, without one it is a plain put. */
+    if(strncmp(fileName, "-d ", 3) == 0){
+        fileName += 3;
         
-        /* Send the PUT_REPLY_NO packet. */
-        if(write(sockfd, PUT_REPLY_NO, strlen(PUT_REPLY_NO)) <= 0){
-            return -1;
+        fd = open(fileName, O_RDONLY | O_CLOEXEC);
+        if(fd != -1){
+            return startDeltaUpload(session, stream, fileName, fd);
+        }
+        if(errno != ENOENT){
+            if(sendReplyError(session, stream, strerror(errno)) != 0){
+                return -1;
+            }
+            return 1;
+        }
+    }
+    
+    /* Create the file, failing if it already exists unless it is being resumed. Readable too, what is splice()d in is hashed back out of it. */
+    fd = open(fileName, O_RDWR | O_CREAT | (resume ? 0 : O_EXCL) | O_CLOEXEC, 0666);
+    
+    /* Could not create file, send an error message. */
+    if(fd == -1 || (resume && (fstat(fd, &s) != 0 || !S_ISREG(s.st_mode)))){
+        errorstr = (errno == EEXIST) ? "File already exists, 'put -c' resumes it." : strerror(errno); /* Get the error message. */
+        if(fd != -1){
+            errorstr = "Not a regular file.";
+            close(fd);
         }
         
-        /* Send the error message. */
-        if(write(sockfd, errorstr, strlen(errorstr)) <= 0){
+        if(sendReplyError(session, stream, errorstr) != 0){
             return -1;
         }
         
         return 1;
     }
     
-    /* Create the file. */
-    fp = fopen(fileName, "w");
+    /* Queue OK reply, when resuming with the size of the copy here and the hash of its last block, the client decides where to carry on from. */
+    if(resume){
+        packUint64(resumeBuffer, s.st_size);
+        if(resumeBlockHash(fd, s.st_size, resumeBuffer + FRAME_SIZE_SIZE) != 0 || sessionQueueFrame(session, stream, frame_ok, resumeBuffer, sizeof(resumeBuffer)) != 0){
+            close(fd);
+            return -1;
+        }
+    }
+    else if(sessionQueueFrame(session, stream, frame_ok, NULL, 0) != 0){
+        close(fd);
+        return -1;
+    }
+    
+    /* The stream receives the file size and then the file, until the client sends frame_end. */
+    stream->sinkfd       = fd;
+    stream->sinkSize     = -1;
+    stream->sinkReceived = 0;
+    stream->state        = stream_state_receive;
+    
+    /* Checked against the trailer of the frame_end of the client. */
+    if(session->hashType != hash_unknown){
+        stream->hash = malloc(sizeof(HashState));
+        if(stream->hash == NULL){
+            return -1;
+        }
+        hashInit(stream->hash, session->hashType);
+    }
     
-    /* Could not create file, send "NO" error message. */
-    if(fp == NULL){
-        errorstr = strerror(errno);                        /* Get the error message. */
+    return 0;
+}
+
+int startRangeUpload(Session *session, Stream *stream, const char *fileName, long offset, long size){
+    const char  *errorstr;
+    struct stat s;
+    int         fd;
+    
+    /* The first stripe creates the file at its full size, so the others can write into it in any order. */
+    errorstr = NULL;
+    if(offset == 0){
+        fd = open(fileName, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if(fd == -1){
+            errorstr = errno == EEXIST ? "File already exists." : strerror(errno);
+        }
+        else if(size > 0 && fallocate(fd, 0, 0, size) != 0 && ftruncate(fd, size) != 0){
+            errorstr = strerror(errno);
+            close(fd);
+            unlink(fileName);
+            fd = -1;
+        }
+    }
+    else{
+        fd = open(fileName, O_RDWR | O_CLOEXEC);
+        if(fd == -1){
+            errorstr = strerror(errno);
+        }
+        else if(fstat(fd, &s) != 0 || !S_ISREG(s.st_mode) || s.st_size != size || lseek(fd, offset, SEEK_SET) == -1){
+            errorstr = "The file on the server is not the one being uploaded.";
+            close(fd);
+            fd = -1;
+        }
+    }
+    
+    if(fd == -1){
+        if(sendReplyError(session, stream, errorstr) != 0){
+            return -1;
+        }
+        return 1;
+    }
+    
+    if(sessionQueueFrame(session, stream, frame_ok, NULL, 0) != 0){
+        close(fd);
+        return -1;
+    }
+    
+    /* From here on it is a plain put of the stripe, written from offset on. */
+    stream->sinkfd       = fd;
+    stream->sinkSize     = -1;
+    stream->sinkReceived = 0;
+    stream->state        = stream_state_receive;
+    
+    if(session->hashType != hash_unknown){
+        stream->hash = malloc(sizeof(HashState));
+        if(stream->hash == NULL){
+            return -1;
+        }
+        hashInit(stream->hash, session->hashType);
+    }
+    
+    return 0;
+}
+
+int startDeltaDownload(Session *session, Stream *stream, int fd, long size, long basisSize){
+    /* The encoder hashes the file as it reads it, for the trailer of the frame_end. */
+    if(session->hashType != hash_unknown){
+        stream->hash = malloc(sizeof(HashState));
+        if(stream->hash == NULL){
+            close(fd);
+            return -1;
+        }
+        hashInit(stream->hash, session->hashType);
+    }
+    
+    stream->deltaEncoder = deltaEncoderCreate(basisSize, fd, stream->hash);
+    if(stream->deltaEncoder == NULL || sessionQueueFrame(session, stream, frame_ok, NULL, 0) != 0){
+        close(fd);
+        return -1;
+    }
+    
+    /* The stream receives the signatures until the client sends frame_end, then sends the size of the file and the instructions. */
+    stream->sourcefd        = fd;
+    stream->sourceLeft      = size;
+    stream->sourceFrameLeft = 0;
+    stream->sourceBuffered  = 0;
+    stream->sinkfd          = -1;
+    stream->sinkSize        = -1;
+    stream->sinkReceived    = 0;
+    stream->state           = stream_state_receive;
+    
+    return 0;
+}
+
+int startDeltaUpload(Session *session, Stream *stream, const char *fileName, int basisfd){
+    unsigned char sizeBuffer[FRAME_SIZE_SIZE];
+    struct stat   s;
+    int           pipefd[2];
+    FILE          *pipefp;
+    DeltaApply    *apply;
+    const char    *errorstr;
+    
+    if(fstat(basisfd, &s) != 0 || !S_ISREG(s.st_mode)){
+        errorstr = S_ISDIR(s.st_mode) ? "Can not upload over a directory." : "Not a regular file.";
+        close(basisfd);
         
-        /* Send the PUT_REPLY_NO packet. */
-        if(write(sockfd, PUT_REPLY_NO, strlen(PUT_REPLY_NO)) <= 0){
+        if(sendReplyError(session, stream, errorstr) != 0){
             return -1;
         }
+        return 1;
+    }
+    
+    /* The new file is rebuilt next to the copy here, and takes its place once all of it arrived. */
+    apply = deltaApplyCreate(session->dirfd, fileName, basisfd, s.st_size);
+    if(apply == NULL){
+        errorstr = strerror(errno);
+        close(basisfd);
         
-        /* Send the error message. */
-        if(write(sockfd, errorstr, strlen(errorstr)) <= 0){
+        if(sendReplyError(session, stream, errorstr) != 0){
             return -1;
         }
         return 1;
     }
+    stream->deltaApply = apply;
+    stream->sinkfd     = apply->outfd;
     
-    /* Send OK reply. */
-    if(write(sockfd, PUT_REPLY_OK, strlen(PUT_REPLY_OK)) <= 0){
+    /* Checked against the trailer of the frame_end of the client, hashed as the new file is written. */
+    if(session->hashType != hash_unknown){
+        stream->hash = malloc(sizeof(HashState));
+        if(stream->hash == NULL){
+            return -1;
+        }
+        hashInit(stream->hash, session->hashType);
+        apply->hash = stream->hash;
+    }
+    
+    /* A thread writes the signatures into a pipe, the stream sends them like the output of a command. */
+    if(pipe2(pipefd, O_CLOEXEC) != 0){
+        perror(CFLRED "ERROR" C_RST);
         return -1;
     }
     
-    /* Get the file size. */
-    n = read(sockfd, &numBytesLeft, sizeof(numBytesLeft));
+    pipefp = fdopen(pipefd[0], "r");
+    if(pipefp == NULL || setNonBlocking(pipefd[0]) != 0){
+        perror(CFLRED "ERROR" C_RST);
+        if(pipefp != NULL){
+            fclose(pipefp);
+        }
+        else{
+            close(pipefd[0]);
+        }
+        close(pipefd[1]);
+        return -1;
+    }
     
-    if(n <= 0){
+    if(checksumStartSignatures(pipefd[1], basisfd, s.st_size) != 0){
+        perror(CFLRED "ERROR" C_RST);
+        fclose(pipefp);
+        close(pipefd[1]);
         return -1;
     }
     
-    /* Download the file. */
-    while(numBytesLeft > 0 && (n=read(sockfd, buffer, sizeof(buffer))) > 0){
-        fwrite(buffer, 1, n, fp);
-        numBytesLeft -= n;
+    /* The size of the copy here tells the client the signatures follow. */
+    packUint64(sizeBuffer, s.st_size);
+    if(sessionQueueFrame(session, stream, frame_ok, sizeBuffer, sizeof(sizeBuffer)) != 0){
+        fclose(pipefp);
+        return -1;
     }
     
-    fclose(fp);
+    stream->sourcePipe    = pipefp;
+    stream->sourcePopened = 0;
+    stream->sourceWaiting = 0;
+    stream->sinkSize      = -1;
+    stream->sinkReceived  = 0;
+    stream->state         = stream_state_send;
+    
+    return 0;
+}
+
+int executeCommandmget(Session *session, Stream *stream, const char *command){
+    char   arguments[BUFFER_SIZE];
+    char   *pattern;
+    char   *save;
+    glob_t matches;
+    int    flags;
+    int    ret;
+    
+    /* Skip the leading "mget ". */
+    memcpy(arguments, command + 5, strlen(command + 5) + 1);
+    
+    /* A pattern which matches nothing is sent as it is, the client hears it does not exist. */
+    flags = GLOB_NOCHECK;
+    for(pattern = strtok_r(arguments, " \t", &save); pattern != NULL; pattern = strtok_r(NULL, " \t", &save)){
+        if(glob(pattern, flags, NULL, &matches) == GLOB_NOSPACE){
+            globfree(&matches);
+            return -1;
+        }
+        flags |= GLOB_APPEND;
+    }
     
-    if(n < 0){
+    if(!(flags & GLOB_APPEND)){
+        if(sendReplyError(session, stream, "No files given.") != 0){
+            return -1;
+        }
+        return 1;
+    }
+    
+    ret = startArchiveDownload(session, stream, NULL, matches.gl_pathv, matches.gl_pathc);
+    globfree(&matches);
+    
+    return ret;
+}
+
+int startArchiveDownload(Session *session, Stream *stream, const char *path, char **files, int numFiles){
+    struct stat s;
+    int         pipefd[2];
+    FILE        *pipefp;
+    const char  *errorstr;
+    
+    /* The files of mget are checked by the thread writing the archive. */
+    errorstr = NULL;
+    if(path != NULL && stat(path, &s) != 0){
+        errorstr = strerror(errno);
+    }
+    else if(path != NULL && !S_ISDIR(s.st_mode)){
+        errorstr = "Not a directory, use get without -r.";
+    }
+    
+    if(errorstr != NULL){
+        if(sendReplyError(session, stream, errorstr) != 0){
+            return -1;
+        }
+        return 1;
+    }
+    
+    /* A thread writes the archive into a pipe, the stream sends it like the output of a command. */
+    if(pipe2(pipefd, O_CLOEXEC) != 0){
+        perror(CFLRED "ERROR" C_RST);
+        return -1;
+    }
+    
+    pipefp = fdopen(pipefd[0], "r");
+    if(pipefp == NULL || setNonBlocking(pipefd[0]) != 0){
+        perror(CFLRED "ERROR" C_RST);
+        if(pipefp != NULL){
+            fclose(pipefp);
+        }
+        else{
+            close(pipefd[0]);
+        }
+        close(pipefd[1]);
         return -1;
     }
     
+    if((path != NULL ? archiveStart(pipefd[1], AT_FDCWD, path) : archiveStartFiles(pipefd[1], AT_FDCWD, files, numFiles)) != 0){
+        errorstr = strerror(errno);
+        fclose(pipefp);
+        close(pipefd[1]);
+        
+        if(sendReplyError(session, stream, errorstr) != 0){
+            return -1;
+        }
+        return 1;
+    }
+    
+    if(sessionQueueFrame(session, stream, frame_ok, NULL, 0) != 0){
+        fclose(pipefp);
+        return -1;
+    }
+    
+    /* The frame_end carries the hash of the archive. */
+    if(session->hashType != hash_unknown){
+        stream->hash = malloc(sizeof(HashState));
+        if(stream->hash == NULL){
+            fclose(pipefp);
+            return -1;
+        }
+        hashInit(stream->hash, session->hashType);
+    }
+    
+    stream->sourcePipe    = pipefp;
+    stream->sourcePopened = 0;
+    stream->sourceWaiting = 0;
+    stream->state         = stream_state_send;
+    
     return 0;
 }
 
-int executeCommandcd(int sockfd, const char *command){
+int startArchiveUpload(Session *session, Stream *stream, const char *directory){
+    const char *errorstr;
+    int        dirfd;
+    
+    /* Created empty, and only readable by the server until the archive sets its mode. mput extracts into the working directory. */
+    dirfd = -1;
+    if(directory == NULL){
+        dirfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    else if(mkdir(directory, 0700) == 0){
+        dirfd = open(directory, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    }
+    if(dirfd == -1){
+        errorstr = errno == EEXIST ? "Directory already exists." : strerror(errno);
+        if(sendReplyError(session, stream, errorstr) != 0){
+            return -1;
+        }
+        return 1;
+    }
+    
+    stream->archive = archiveReaderCreate(dirfd, NULL);
+    if(stream->archive == NULL){
+        close(dirfd);
+        return -1;
+    }
+    stream->archive->filesOnly = directory == NULL;
+    
+    if(sessionQueueFrame(session, stream, frame_ok, NULL, 0) != 0){
+        return -1;
+    }
+    
+    /* The stream extracts the frame_data until the client sends frame_end. */
+    stream->sinkfd       = -1;
+    stream->sinkSize     = -1;
+    stream->sinkReceived = 0;
+    stream->state        = stream_state_receive;
+    
+    /* Checked against the trailer of the frame_end of the client. */
+    if(session->hashType != hash_unknown){
+        stream->hash = malloc(sizeof(HashState));
+        if(stream->hash == NULL){
+            return -1;
+        }
+        hashInit(stream->hash, session->hashType);
+    }
+    
+    return 0;
+}
+
+int executeCommandls(Session *session, Stream *stream, const char *command){
+    ListingOptions options;
+    char           arguments[BUFFER_SIZE];
+    char           *paths[LISTING_MAX_PATHS];
+    int            numPaths;
+    unsigned char  sizeBuffer[FRAME_SIZE_SIZE];
+    char           errorstr[BUFFER_SIZE];
+    struct stat    s;
+    int            fd;
+    int            i;
+    
+    /* Skip the leading "sls". */
+    memcpy(arguments, command + 3, strlen(command + 3) + 1);
+    
+    /* Options ls has and this does not, ls can handle those. */
+    numPaths = listingParseArguments(arguments, &options, paths);
+    if(numPaths == -1){
+        return executeReadOnlyUnixCommand(stream, command);
+    }
+    
+    if(numPaths == 0){
+        paths[numPaths++] = ".";
+    }
+    
+    /* The records are collected in memory and then sent like a file, so the client knows their size up front. */
+    fd = memfd_create("listing", MFD_CLOEXEC);
+    if(fd == -1){
+        return -1;
+    }
+    
+    for(i=0; i<numPaths; i++){
+        if(listingWrite(fd, paths[i], numPaths > 1, &options) != 0){
+            snprintf(errorstr, sizeof(errorstr), "%s: %s", paths[i], strerror(errno));
+            close(fd);
+            
+            if(sendReplyError(session, stream, errorstr) != 0){
+                return -1;
+            }
+            return 1;
+        }
+    }
+    
+    if(fstat(fd, &s) != 0 || lseek(fd, 0, SEEK_SET) != 0){
+        close(fd);
+        return -1;
+    }
+    
+    /* Queue the size of the records, they follow as frame_data. */
+    packUint64(sizeBuffer, s.st_size);
+    if(sessionQueueFrame(session, stream, frame_size, sizeBuffer, sizeof(sizeBuffer)) != 0){
+        close(fd);
+        return -1;
+    }
+    
+    stream->sourcefd        = fd;
+    stream->sourceLeft      = s.st_size;
+    stream->sourceFrameLeft = 0;
+    stream->sourceBuffered  = 0;
+    stream->state           = stream_state_send;
+    
+    return 0;
+}
+
+int executeCommandmd5(Session *session, Stream *stream, const char *command){
+    ChecksumOptions options;
+    char            arguments[BUFFER_SIZE];
+    char            *files[CHECKSUM_MAX_FILES];
+    int             numFiles;
+    int             pipefd[2];
+    FILE            *pipefp;
+    
+    /* Skip the leading "smd5sum". */
+    memcpy(arguments, command + 7, strlen(command + 7) + 1);
+    
+    /* Options md5sum has and this does not, md5sum can handle those. */
+    numFiles = checksumParseArguments(arguments, &options, files);
+    if(numFiles == -1){
+        return executeReadOnlyUnixCommand(stream, command);
+    }
+    
+    if(numFiles <= 0){
+        if(sendReplyError(session, stream, numFiles == -2 ? "Unknown hash, use -a md5|crc32c|xxh3|blake3." : "No files given.") != 0){
+            return -1;
+        }
+        return 1;
+    }
+    
+    /* The threads write the lines into a pipe, the stream sends them like the output of a command. */
+    if(pipe2(pipefd, O_CLOEXEC) != 0){
+        perror(CFLRED "ERROR" C_RST);
+        return -1;
+    }
+    
+    pipefp = fdopen(pipefd[0], "r");
+    if(pipefp == NULL || setNonBlocking(pipefd[0]) != 0){
+        perror(CFLRED "ERROR" C_RST);
+        if(pipefp != NULL){
+            fclose(pipefp);
+        }
+        else{
+            close(pipefd[0]);
+        }
+        close(pipefd[1]);
+        return -1;
+    }
+    
+    if(checksumStart(pipefd[1], &options, files, numFiles) != 0){
+        perror(CFLRED "ERROR" C_RST);
+        fclose(pipefp);
+        close(pipefd[1]);
+        return -1;
+    }
+    
+    stream->sourcePipe    = pipefp;
+    stream->sourcePopened = 0;
+    stream->sourceWaiting = 0;
+    stream->state         = stream_state_send;
+    
+    return 0;
+}
+
+int executeCommandcd(Session *session, Stream *stream, const char *command){
     const char *successstr = "Directory Changed.";
     const char *directory;
     const char *errorstr;
+    int        dirfd;
     long       ret;
     
     /* Skip the initial "scd " */
     directory = command + 4;
     
-    /* Attempt to change the directory. */
-    ret = chdir(directory);
+    /* Attempt to open the directory, it becomes the working directory of this session only. */
+    dirfd = open(directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
     
     /* An error occured, send an error message. */
-    if(ret != 0){
+    if(dirfd == -1){
         errorstr = strerror(errno);
-        ret      = write(sockfd, errorstr, strlen(errorstr)+1);
+        ret      = sendReplyError(session, stream, errorstr);
     }
     /* Everything went OK, send a success message. */
     else{
-        ret = write(sockfd, successstr, strlen(successstr)+1);
+        close(session->dirfd);
+        session->dirfd = dirfd;
+        
+        ret = sessionQueueFrame(session, stream, frame_data, successstr, strlen(successstr));
+        if(ret == 0){
+            ret = sessionQueueFrame(session, stream, frame_end, NULL, 0);
+        }
     }
     
-    if(ret <= 0){
+    if(ret != 0){
         return -1;
     }
     
     return 0;
 }
 
-int executeReadOnlyUnixCommand(int sockfd, const char *command){
+int executeReadOnlyUnixCommand(Stream *stream, const char *command){
     FILE *pipefp;
-    char buffer[BUFFER_SIZE];
-    long n;
     
     const char *stderrRedirectstr = " 2>&1"; /* So that we can also send the stderr output of the command. */
     long commandLength;
@@ -390,42 +1017,38 @@ int executeReadOnlyUnixCommand(int sockfd, const char *command){
     memcpy(fullcommand+commandLength, stderrRedirectstr, stderrRedirectstrLength+1);
     
     /* Open a pipe to the process. */
-    pipefp = popen(fullcommand, "r");
+    pipefp = popen(fullcommand, "re");
     free(fullcommand);
     
-    while((n=fread(buffer, 1, sizeof(buffer), pipefp)) == sizeof(buffer)){
-        write(sockfd, buffer, n);
-    }
-    /* An error occured while reading from the pipe. */
-    if(ferror(pipefp)){
+    if(pipefp == NULL){
         perror("ERROR");
-        /*
-        errorstr = strerror(errno);
-        write(sockfd, errorstr, strlen(errorstr)+1);
-        */
         return -1;
     }
     
-    if(feof(pipefp)){
-        if(n > 0){
-            write(sockfd, buffer, n);
-        }
-        /* Send a packet containing only a null terminating byte to indicate the end of transmission. */
-        buffer[0] = '\0';
-        write(sockfd, buffer, 1);
+    /* The stream sends the output of the command as it becomes available. */
+    if(setNonBlocking(fileno(pipefp)) != 0){
+        perror("ERROR");
+        pclose(pipefp);
+        return -1;
     }
-    pclose(pipefp);
-    
     
+    stream->sourcePipe    = pipefp;
+    stream->sourcePopened = 1;
+    stream->sourceWaiting = 0;
+    stream->state         = stream_state_send;
     
     return 0;
 }
 
 void printUsage(const char *executableName){
     printf("USAGE:   Start up a server on the local machine.\n"
-           "         %s <port>\n"
+           "         %s [-m fork|epoll] <port>\n"
+           "\n"
+           "OPTIONS: -m fork   One process per client (default).\n"
+           "         -m epoll  One process for all clients, driven by epoll.\n"
            "\n"
-           "EXAMPLE: %s 12345\n", executableName, executableName);
+           "EXAMPLE: %s 12345\n"
+           "         %s -m epoll 12345\n", executableName, executableName, executableName);
 }
 
 int printClientDetails(const struct sockaddr *clientAddress, socklen_t clientAddressSize, const char *str){
@@ -463,22 +1086,14 @@ int printClientDetails(const struct sockaddr *clientAddress, socklen_t clientAdd
     return 0;
 }
 
-int sendGetReplyNo(int sockfd, const char *errorstr){
-    char buffer[BUFFER_SIZE];
-    long ret;
+int sendReplyError(Session *session, const Stream *stream, const char *errorstr){
+    uint32_t length;
     
-    memcpy(buffer, GET_REPLY_NO, strlen(GET_REPLY_NO));     /* Set the start of the packet to NO */
-    memset(buffer + strlen(GET_REPLY_NO), 0, sizeof(long)); /* Pad the rest of the packet with zeros. */
-    
-    ret = write(sockfd, buffer, GET_REPLY_SIZE);            /* Send the packet. */
-    if(ret <= 0){
-        return -1;
+    /* Error messages longer than a command are cut short. */
+    length = strlen(errorstr);
+    if(length > BUFFER_SIZE){
+        length = BUFFER_SIZE;
     }
     
-    ret = write(sockfd, errorstr, strlen(errorstr));        /* Send the error message. */
-    if(ret <= 0){
-        return -1;
-    }
-    
-    return 0;
+    return sessionQueueFrame(session, stream, frame_error, errorstr, length);
 }
@@ -3,27 +3,43 @@
 
 #include <arpa/inet.h>
 
+#include "session.h"
+
 #define BACKLOG  10
 
 /* Server outline:
- * 1. Server starts up on the port specifed by argv[1]
+ * 1. Server starts up on the port specifed on the command line, using
+ *    the engine selected with -m (fork by default).
  * 
  * 2. Server listens for connections.
  * 
- * 3. Once the server gets a connection, it fork()s. The child server
- *    now handles the client (step 4 and on), and the parent server
- *    continues listening (back to step 1).
+ * 3a. fork:  Once the server gets a connection, it fork()s. The child
+ *            server now handles the client (step 4 and on), and the
+ *            parent server continues listening (back to step 1).
+ * 
+ * 3b. epoll: Once the server gets a connection, it adds it to the set
+ *            of sessions it is watching with epoll, and every session
+ *            is handled by this one process.
  * 
- * 4. Child server sits and waits for a command from the client to
- *    execute.
+ * 4. The session sits and waits for a command from the client to
+ *    execute (see session.h).
  * 
  * 5. Once it gets a command it calls executeCommand(), which will
  *    determine the correct function executeCommandXXXXX() to handle
- *    that command.
+ *    that command. These functions only start the command on a
+ *    stream of its own, the session then sends the reply, or
+ *    receives the upload, as the socket becomes ready, alongside
+ *    the other streams of the client.
  * 
  * 6. Back to 4.
  */
 
+/* The ways the server can handle its clients. */
+typedef enum{
+    server_mode_fork,  /* One process per client. */
+    server_mode_epoll  /* One process for all clients, driven by epoll. */
+} ServerMode;
+
 
 
 
@@ -33,18 +49,28 @@ void printUsage(const char *executableName);
 /* Print out the details for a client. */
 int printClientDetails(const struct sockaddr *clientAddress, socklen_t clientAddressSize, const char *str);
 
+/* PURPOSE:
+ *     Accept clients on listenfd forever, fork()ing a child to
+ *     handle each one.
+ * 
+ * RETURNS:
+ *     Only returns on a critical error.
+ */
+int runForkServer(int listenfd);
+
 
 
 
 /* Determine the type of command and call the appropriate executeCommandXXXXX() function. */
-int executeCommand(int sockfd, const char *command);
+int executeCommand(Session *session, Stream *stream, const char *command);
     /* PURPOSE:
      *     Execute a 'simple read only' command, one which does not change
      *     the processes state like the 'scd' command does, and does not
      *     require any synchronization between the client and server like
      *     the 'get' or 'put' commands do.
      * 
-     *     Uses popen() to open a pipe to the process.
+     *     Uses popen() to open a pipe to the process, the stream of
+     *     the command sends its output.
      * 
      * RETURNS:
      *     0 - Everything went 0K.
@@ -52,9 +78,35 @@ int executeCommand(int sockfd, const char *command);
      *    -1 - Critical error.
      * 
      * Examples of simple commands:
-     *     sls, spwd, smd5sum
+     *     spwd, and sls or smd5sum with options only ls or md5sum have
      */
-    int executeReadOnlyUnixCommand(int sockfd, const char *command);
+    int executeReadOnlyUnixCommand(Stream *stream, const char *command);
+    
+    
+    /* PURPOSE:
+     *     List directories without a shell (see listing.h), the
+     *     records are sent like a file. Options which are not
+     *     supported natively are handed to ls instead.
+     * 
+     * RETURNS:
+     *     0 - Everything went OK.
+     *     1 - Non critical error, a path could not be listed.
+     *    -1 - A critical error occured.
+     */
+    int executeCommandls(Session *session, Stream *stream, const char *command);
+    
+    
+    /* PURPOSE:
+     *     Hash files without a shell (see checksum.h), in the format
+     *     of md5sum. Options which are not supported natively are
+     *     handed to md5sum instead.
+     * 
+     * RETURNS:
+     *     0 - Everything went OK.
+     *     1 - Non critical error, no files or an unknown algorithm.
+     *    -1 - A critical error occured.
+     */
+    int executeCommandmd5(Session *session, Stream *stream, const char *command);
     
     
     /* PURPOSE:
@@ -65,7 +117,7 @@ int executeCommand(int sockfd, const char *command);
      *     1 - Non critical error.
      *    -1 - A critical error occured.
      */
-    int executeCommandcd(int sockfd, const char *command);
+    int executeCommandcd(Session *session, Stream *stream, const char *command);
     
     
     /* File download/upload commands.
@@ -75,8 +127,76 @@ int executeCommand(int sockfd, const char *command);
      *     1 - Non-critical error.
      *    -1 - Critical error.
      */
-    int executeCommandget(int sockfd, const char *command);
-    int sendGetReplyNo(int sockfd, const char *errorstr);
-    int executeCommandput(int sockfd, const char *command);
+    int executeCommandget(Session *session, Stream *stream, const char *command);
+    int executeCommandput(Session *session, Stream *stream, const char *command);
+    
+    
+    /* PURPOSE:
+     *     put -s, one stripe of a put -p: size bytes of the file which
+     *     are received from offset on. The stripe at offset 0 creates
+     *     the file at its full size, the others open it.
+     * 
+     * RETURNS:
+     *     0 - Success
+     *     1 - Non-critical error.
+     *    -1 - Critical error.
+     */
+    int startRangeUpload(Session *session, Stream *stream, const char *fileName, long offset, long size);
     
+    
+    /* PURPOSE:
+     *     get -d and put -d (see delta.h). startDeltaDownload() sends
+     *     the file fd of size bytes to a client with a copy of basisSize
+     *     bytes, startDeltaUpload() sends the signatures of basisfd, the
+     *     copy of fileName here, and rebuilds the file the client sends.
+     *     Both take over the file descriptor.
+     * 
+     * RETURNS:
+     *     0 - Success
+     *     1 - Non-critical error.
+     *    -1 - Critical error.
+     */
+    int startDeltaDownload(Session *session, Stream *stream, int fd, long size, long basisSize);
+    int startDeltaUpload(Session *session, Stream *stream, const char *fileName, int basisfd);
+    
+    
+    /* PURPOSE:
+     *     get -r and put -r (see archive.h). startArchiveDownload() sends
+     *     the directory path as an archive, startArchiveUpload() creates
+     *     the directory and extracts the archive the client sends into
+     *     it.
+     * 
+     *     mget and mput: with a NULL path the archive holds the numFiles
+     *     files instead, with a NULL directory the files the client sends
+     *     are extracted into the working directory.
+     * 
+     * RETURNS:
+     *     0 - Success
+     *     1 - Non-critical error.
+     *    -1 - Critical error.
+     */
+    int startArchiveDownload(Session *session, Stream *stream, const char *path, char **files, int numFiles);
+    int startArchiveUpload(Session *session, Stream *stream, const char *directory);
+    
+    
+    /* PURPOSE:
+     *     mget: the files matching the patterns (glob(), separated by
+     *     whitespace), sent with startArchiveDownload().
+     * 
+     * RETURNS:
+     *     0 - Success
+     *     1 - Non-critical error.
+     *    -1 - Critical error.
+     */
+    int executeCommandmget(Session *session, Stream *stream, const char *command);
+    
+    /* PURPOSE:
+     *     Queue a frame_error carrying errorstr, ending the stream.
+     * 
+     * RETURNS:
+     *     0 - Success.
+     *    -1 - Critical error.
+     */
+    int sendReplyError(Session *session, const Stream *stream, const char *errorstr);
+
 #endif
\ No newline at end of file
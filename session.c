@@ -0,0 +1,1578 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+
+#include "shared.h"
+#include "server.h"
+#include "session.h"
+
+
+
+
+static int sessionQueue(Session *session, const void *data, long length);
+static Stream *sessionFindStream(Session *session, uint32_t id);
+static Stream *sessionFreeStream(Session *session);
+static int sessionStreamReady(const Stream *stream);
+static void sessionCloseStream(Session *session, Stream *stream);
+static void sessionConsumeInput(Session *session, long length);
+static long sessionInputWanted(const Session *session);
+static int sessionProcessInput(Session *session);
+static int sessionHandleFrame(Session *session, const FrameHeader *header, const char *payload);
+static int sessionStartCommands(Session *session);
+static int sessionWriteUpload(Session *session, const char *data, long length);
+static int sessionCollectCompressed(Session *session, const char *data, long length);
+static int sessionDecodes(const Stream *stream);
+static int sessionWriteDecoded(Stream *stream, const char *data, long length);
+static long sessionReceiveFile(Session *session, long maxLength);
+static int sessionUseReceiveBuffer(Session *session);
+static void sessionFinishUpload(Session *session, Stream *stream);
+static int sessionNextFrame(Session *session);
+static int sessionStreamFrame(Session *session, Stream *stream);
+static long sessionSendFile(Session *session, long maxLength);
+static int sessionReadFile(Session *session);
+static int sessionQueueData(Session *session, Stream *stream, long length);
+static int sessionCompressBuffer(Session *session);
+
+
+
+
+Session *sessionCreate(int sockfd, const struct sockaddr *address, socklen_t addressSize, int dirfd){
+    Session *session;
+    int     i;
+    
+    session = malloc(sizeof(Session));
+    if(session == NULL){
+        return NULL;
+    }
+    
+    /* The session gets its own copy, scd replaces it. */
+    if(dirfd == AT_FDCWD){
+        session->dirfd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    }
+    else{
+        session->dirfd = fcntl(dirfd, F_DUPFD_CLOEXEC, 0);
+    }
+    if(session->dirfd == -1){
+        free(session);
+        return NULL;
+    }
+    
+    session->sockfd = sockfd;
+    session->state  = session_state_open;
+    
+    memcpy(&session->address, address, addressSize);
+    session->addressSize = addressSize;
+    
+    session->inLength       = 0;
+    session->dataLeft       = 0;
+    session->dataStream     = NULL;
+    session->dataCompressed = 0;
+    session->dataCollected  = 0;
+    session->outStart       = 0;
+    session->outEnd         = 0;
+    
+    session->queueStart  = 0;
+    session->queueLength = 0;
+    
+    for(i=0; i<SESSION_MAX_STREAMS; i++){
+        session->streams[i].state      = stream_state_free;
+        session->streams[i].sourcefd   = -1;
+        session->streams[i].sourcePipe = NULL;
+        session->streams[i].sinkfd     = -1;
+        session->streams[i].hash       = NULL;
+        
+        session->streams[i].deltaEncoder = NULL;
+        session->streams[i].deltaApply   = NULL;
+        session->streams[i].archive      = NULL;
+    }
+    session->sending    = NULL;
+    session->nextStream = 0;
+    session->receiving  = 0;
+    
+    session->splicefd[0]    = -1;
+    session->splicefd[1]    = -1;
+    session->splicePipeSize = 0;
+    session->sinkBuffered   = 0;
+    session->sinkBuffer     = NULL;
+    
+    session->hashType  = hash_unknown;
+    session->hashReply = 0;
+    
+    session->compress       = 0;
+    session->compressReply  = 0;
+    session->compressBuffer = NULL;
+    
+    session->watchedEvents = 0;
+    session->watchedPipes  = 0;
+    
+    return session;
+}
+
+void sessionDestroy(Session *session){
+    int i;
+    
+    for(i=0; i<SESSION_MAX_STREAMS; i++){
+        sessionCloseStream(session, &session->streams[i]);
+    }
+    
+    while(session->queueLength > 0){
+        free(session->queue[session->queueStart]);
+        session->queueStart = (session->queueStart + 1) % SESSION_MAX_QUEUED;
+        session->queueLength--;
+    }
+    
+    free(session->compressBuffer);
+    close(session->dirfd);
+    close(session->sockfd);
+    free(session);
+}
+
+int sessionQueueFrame(Session *session, const Stream *stream, unsigned char type, const void *payload, uint32_t length){
+    unsigned char header[FRAME_HEADER_SIZE];
+    
+    /* Make sure the whole frame fits before queueing any of it. */
+    if(session->outEnd - session->outStart + FRAME_HEADER_SIZE + (long)length > (long)sizeof(session->out)){
+        return -1;
+    }
+    
+    frameEncodeHeader(header, type, 0, stream->id, length);
+    
+    if(sessionQueue(session, header, sizeof(header)) != 0){
+        return -1;
+    }
+    
+    return sessionQueue(session, payload, length);
+}
+
+/* PURPOSE:
+ *     Queue bytes to be sent to the client.
+ * 
+ * RETURNS:
+ *     0 - The bytes were queued.
+ *    -1 - There is no room left in the outgoing buffer.
+ */
+static int sessionQueue(Session *session, const void *data, long length){
+    if(length == 0){
+        return 0;
+    }
+    
+    /* Move the unsent bytes to the front of the buffer to make room. */
+    if(session->outEnd + length > (long)sizeof(session->out)){
+        memmove(session->out, session->out + session->outStart, session->outEnd - session->outStart);
+        session->outEnd  -= session->outStart;
+        session->outStart = 0;
+    }
+    
+    if(session->outEnd + length > (long)sizeof(session->out)){
+        return -1;
+    }
+    
+    memcpy(session->out + session->outEnd, data, length);
+    session->outEnd += length;
+    
+    return 0;
+}
+
+
+
+
+/*********************************************************************************
+ * Streams.
+ ********************************************************************************/
+
+/* Returns the stream in use with the id, NULL if there is none. */
+static Stream *sessionFindStream(Session *session, uint32_t id){
+    int i;
+    
+    for(i=0; i<SESSION_MAX_STREAMS; i++){
+        if(session->streams[i].state != stream_state_free && session->streams[i].id == id){
+            return &session->streams[i];
+        }
+    }
+    
+    return NULL;
+}
+
+/* Returns a stream which is not in use, NULL if they all are. */
+static Stream *sessionFreeStream(Session *session){
+    int i;
+    
+    for(i=0; i<SESSION_MAX_STREAMS; i++){
+        if(session->streams[i].state == stream_state_free){
+            return &session->streams[i];
+        }
+    }
+    
+    return NULL;
+}
+
+/* Returns 1 if the stream has a frame to send right now, 0 otherwise. */
+static int sessionStreamReady(const Stream *stream){
+    switch(stream->state){
+        case stream_state_reply:
+            return 1;
+        
+        case stream_state_send:
+            /* get -d: its frame_size and frame_end do not need any window, its frame_data need room for an instruction. */
+            if(stream->deltaEncoder != NULL){
+                return stream->sourceLeft != 0 || stream->deltaEncoder->done || stream->window >= DELTA_MIN_ROOM;
+            }
+            
+            /* The frame_end of a file does not need any window. */
+            if(stream->sourcefd != -1){
+                return stream->sourceLeft == 0 || stream->window > 0;
+            }
+            return stream->sourcePipe != NULL && !stream->sourceWaiting && stream->window > 0;
+        
+        default:
+            return 0;
+    }
+}
+
+/* Close everything the stream was using and mark it as free. */
+static void sessionCloseStream(Session *session, Stream *stream){
+    if(stream->sourcefd != -1){
+        close(stream->sourcefd);
+        stream->sourcefd = -1;
+    }
+    if(stream->sourcePipe != NULL){
+        if(stream->sourcePopened){
+            pclose(stream->sourcePipe);
+        }
+        else{
+            fclose(stream->sourcePipe);
+        }
+        stream->sourcePipe = NULL;
+    }
+    if(stream->sinkfd != -1 || stream->state == stream_state_receive){
+        sessionFinishUpload(session, stream);
+    }
+    if(session->sending == stream){
+        session->sending = NULL;
+    }
+    
+    /* An unfinished put -d leaves the file as it was. */
+    if(stream->deltaEncoder != NULL){
+        deltaEncoderFree(stream->deltaEncoder);
+        stream->deltaEncoder = NULL;
+    }
+    if(stream->deltaApply != NULL){
+        deltaApplyFree(stream->deltaApply);
+        stream->deltaApply = NULL;
+    }
+    if(stream->archive != NULL){
+        archiveReaderFree(stream->archive);
+        stream->archive = NULL;
+    }
+    
+    free(stream->hash);
+    stream->hash  = NULL;
+    stream->state = stream_state_free;
+}
+
+
+
+
+/*********************************************************************************
+ * Engine interface.
+ ********************************************************************************/
+int sessionWantsRead(const Session *session){
+    return session->state == session_state_open;
+}
+
+int sessionWantsWrite(const Session *session){
+    int freeStream;
+    int i;
+    
+    if(session->outStart < session->outEnd || session->sending != NULL || session->hashReply || session->compressReply){
+        return 1;
+    }
+    
+    freeStream = 0;
+    for(i=0; i<SESSION_MAX_STREAMS; i++){
+        if(sessionStreamReady(&session->streams[i])){
+            return 1;
+        }
+        if(session->streams[i].state == stream_state_free){
+            freeStream = 1;
+        }
+    }
+    
+    /* A command waiting for a stream can start. */
+    return session->queueLength > 0 && freeStream;
+}
+
+int sessionPipefds(const Session *session, int *fds){
+    const Stream *stream;
+    int          n;
+    int          i;
+    
+    /* Only pipes the client has room for, the rest wait for a frame_window. */
+    n = 0;
+    for(i=0; i<SESSION_MAX_STREAMS; i++){
+        stream = &session->streams[i];
+        if(stream->state == stream_state_send && stream->sourcePipe != NULL && stream->sourceWaiting && stream->window > 0){
+            fds[n++] = fileno(stream->sourcePipe);
+        }
+    }
+    
+    return n;
+}
+
+int sessionOnReadable(Session *session){
+    long total;         /* Bytes read during this call. */
+    int  receivingFile; /* 1 if the payload of a frame_data is being received. */
+    long n;
+    
+    total = 0;
+    while(total < SESSION_IO_BUDGET && sessionWantsRead(session)){
+        receivingFile = session->dataLeft > 0 && session->inLength == 0;
+        
+        /* The payload of a frame_data goes straight from the socket to the file. */
+        if(receivingFile){
+            n = sessionReceiveFile(session, SESSION_IO_BUDGET - total);
+        }
+        /* Everything else is collected in session->in. */
+        else{
+            n = recv(session->sockfd, session->in + session->inLength, sessionInputWanted(session), 0);
+        }
+        
+        /* Client closed the connection. */
+        if(n == 0){
+            printClientDetails((struct sockaddr *)&session->address, session->addressSize, ": " CFLRED "Disconnected." C_RST "\n");
+            session->state = session_state_closed;
+            return 0;
+        }
+        
+        if(n == -1){
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                return 0;
+            }
+            if(errno == EINTR){
+                continue;
+            }
+            perror(CFLRED "ERROR" C_RST);
+            return -1;
+        }
+        
+        total += n;
+        
+        if(!receivingFile){
+            session->inLength += n;
+        }
+        
+        if(sessionProcessInput(session) != 0){
+            return -1;
+        }
+    }
+    
+    return 0;
+}
+
+int sessionOnWritable(Session *session){
+    long total; /* Bytes sent during this call. */
+    long n;
+    
+    total = 0;
+    while(total < SESSION_IO_BUDGET){
+        /* Send whatever is queued first, telling TCP when file data follows so the two are packed together. */
+        if(session->outStart < session->outEnd){
+            n = send(session->sockfd, session->out + session->outStart, session->outEnd - session->outStart, MSG_NOSIGNAL | (session->sending != NULL ? MSG_MORE : 0));
+            if(n == -1){
+                if(errno == EAGAIN || errno == EWOULDBLOCK){
+                    return 0;
+                }
+                if(errno == EINTR){
+                    continue;
+                }
+                return -1;
+            }
+            
+            session->outStart += n;
+            total             += n;
+            continue;
+        }
+        
+        session->outStart = 0;
+        session->outEnd   = 0;
+        
+        /* Finish the payload of the frame_data being sent before anything else. */
+        if(session->sending != NULL){
+            /* Hand it straight to the socket. */
+            if(!session->sending->sourceBuffered){
+                n = sessionSendFile(session, SESSION_IO_BUDGET - total);
+                if(n == -1){
+                    return -1;
+                }
+                if(n == -2){
+                    return 0;
+                }
+                
+                total += n;
+                continue;
+            }
+            
+            /* The file can not be used with sendfile(), copy it through out. */
+            if(sessionReadFile(session) != 0){
+                return -1;
+            }
+            continue;
+        }
+        
+        /* Start the commands which were waiting for a stream. */
+        if(sessionStartCommands(session) != 0){
+            return -1;
+        }
+        if(session->outEnd > 0){
+            continue;
+        }
+        
+        /* Queue a frame from the next stream which has one. */
+        n = sessionNextFrame(session);
+        if(n == -1){
+            return -1;
+        }
+        
+        /* Every stream is waiting, for its pipe or for a frame_window. */
+        if(n == 1){
+            break;
+        }
+    }
+    
+    return 0;
+}
+
+int sessionOnPipeReadable(Session *session){
+    int i;
+    
+    /* Try every pipe again, the ones which still have no data go back to waiting. */
+    for(i=0; i<SESSION_MAX_STREAMS; i++){
+        session->streams[i].sourceWaiting = 0;
+    }
+    
+    return sessionOnWritable(session);
+}
+
+int runSession(Session *session){
+    struct pollfd fds[1 + SESSION_MAX_STREAMS];
+    int           pipefds[SESSION_MAX_STREAMS];
+    nfds_t        nfds;
+    int           pipeReady;
+    nfds_t        i;
+    
+    while(session->state != session_state_closed){
+        fds[0].fd      = session->sockfd;
+        fds[0].events  = (sessionWantsRead(session) ? POLLIN : 0) | (sessionWantsWrite(session) ? POLLOUT : 0);
+        fds[0].revents = 0;
+        
+        nfds = 1 + sessionPipefds(session, pipefds);
+        for(i=1; i<nfds; i++){
+            fds[i].fd      = pipefds[i-1];
+            fds[i].events  = POLLIN;
+            fds[i].revents = 0;
+        }
+        
+        if(poll(fds, nfds, -1) == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        
+        /* A command being sent has more output. */
+        pipeReady = 0;
+        for(i=1; i<nfds; i++){
+            if(fds[i].revents != 0){
+                pipeReady = 1;
+            }
+        }
+        if(pipeReady){
+            if(sessionOnPipeReadable(session) != 0){
+                return -1;
+            }
+        }
+        
+        /* Socket error, or the client hung up while we were not reading. */
+        if((fds[0].revents & (POLLERR | POLLNVAL)) || ((fds[0].revents & POLLHUP) && !(fds[0].revents & POLLIN))){
+            return -1;
+        }
+        
+        if(fds[0].revents & POLLOUT){
+            if(sessionOnWritable(session) != 0){
+                return -1;
+            }
+        }
+        
+        if(fds[0].revents & POLLIN){
+            if(sessionOnReadable(session) != 0){
+                return -1;
+            }
+        }
+    }
+    
+    return 0;
+}
+
+
+
+
+/*********************************************************************************
+ * State machine.
+ ********************************************************************************/
+
+/* Remove bytes which have been handled from the front of session->in. */
+static void sessionConsumeInput(Session *session, long length){
+    memmove(session->in, session->in + length, session->inLength - length);
+    session->inLength -= length;
+}
+
+/* PURPOSE:
+ *     Determine how many bytes to ask recv() for. While an upload is in
+ *     progress only the rest of the next frame header (or the payload it
+ *     announces) is read, so the payload of the next frame_data is left
+ *     in the socket for splice().
+ * 
+ * RETURNS:
+ *     The number of bytes to read into session->in.
+ */
+static long sessionInputWanted(const Session *session){
+    long space;
+    long wanted;
+    
+    space = sizeof(session->in) - session->inLength;
+    
+    if(session->receiving == 0){
+        return space;
+    }
+    
+    if(session->inLength < FRAME_HEADER_SIZE){
+        return FRAME_HEADER_SIZE - session->inLength;
+    }
+    
+    /* A header other than frame_data has arrived, read the rest of its payload. */
+    wanted = FRAME_HEADER_SIZE + unpackUint32((const unsigned char *)session->in + 8) - session->inLength;
+    
+    return wanted < space ? wanted : space;
+}
+
+/* Handle every complete frame in session->in, then start whichever commands can be started. */
+static int sessionProcessInput(Session *session){
+    FrameHeader header;
+    Stream      *stream;
+    long        n;
+    
+    while(1){
+        /* Payload of a frame_data which arrived together with other frames. */
+        if(session->dataLeft > 0){
+            if(session->inLength == 0){
+                break;
+            }
+            
+            n = session->inLength < session->dataLeft ? session->inLength : session->dataLeft;
+            if(sessionWriteUpload(session, session->in, n) != 0){
+                return -1;
+            }
+            sessionConsumeInput(session, n);
+            continue;
+        }
+        
+        /* The header has not completely arrived yet. */
+        if(session->inLength < FRAME_HEADER_SIZE){
+            break;
+        }
+        
+        if(frameDecodeHeader((const unsigned char *)session->in, &header) != 0){
+            puts(CFLRED "ERROR:" C_RST " Client sent an invalid frame, closing connection...");
+            return -1;
+        }
+        
+        /* The payload of a frame_data belongs to the file being uploaded, it is never collected in session->in. */
+        if(header.type == frame_data){
+            stream = sessionFindStream(session, header.streamId);
+            if(stream == NULL || stream->state != stream_state_receive){
+                puts(CFLRED "ERROR:" C_RST " Client sent data without an upload, closing connection...");
+                return -1;
+            }
+            if(stream->deltaApply == NULL && stream->sinkSize != -1 && stream->sinkReceived + (long)header.length > stream->sinkSize && !(header.flags & FRAME_FLAG_COMPRESSED)){
+                puts(CFLRED "ERROR:" C_RST " Client sent more data than it announced, closing connection...");
+                return -1;
+            }
+            
+            /* A compressed payload is collected whole, then decompressed (and checked against the size) in one go. */
+            session->dataCompressed = (header.flags & FRAME_FLAG_COMPRESSED) != 0;
+            session->dataCollected  = 0;
+            if(session->dataCompressed){
+                if(!session->compress || header.length > COMPRESS_FRAME_SIZE){
+                    puts(CFLRED "ERROR:" C_RST " Client sent invalid compressed data, closing connection...");
+                    return -1;
+                }
+                if(session->sinkBuffer == NULL){
+                    session->sinkBuffer = malloc(SESSION_RECEIVE_BUFFER_SIZE);
+                    if(session->sinkBuffer == NULL){
+                        perror(CFLRED "ERROR" C_RST);
+                        return -1;
+                    }
+                }
+            }
+            
+            sessionConsumeInput(session, FRAME_HEADER_SIZE);
+            session->dataLeft   = header.length;
+            session->dataStream = stream;
+            continue;
+        }
+        
+        /* Every other frame is handled once its whole payload has arrived. */
+        if(header.length >= BUFFER_SIZE){
+            puts(CFLRED "ERROR:" C_RST " Client sent a frame which is too long, closing connection...");
+            return -1;
+        }
+        if(session->inLength < FRAME_HEADER_SIZE + (long)header.length){
+            break;
+        }
+        
+        if(sessionHandleFrame(session, &header, session->in + FRAME_HEADER_SIZE) != 0){
+            return -1;
+        }
+        
+        sessionConsumeInput(session, FRAME_HEADER_SIZE + header.length);
+    }
+    
+    return sessionStartCommands(session);
+}
+
+/* PURPOSE:
+ *     Handle a complete frame (other than frame_data) sent by the client.
+ * 
+ * RETURNS:
+ *     0 - OK.
+ *    -1 - Critical error, or the frame was not expected.
+ */
+static int sessionHandleFrame(Session *session, const FrameHeader *header, const char *payload){
+    Stream *stream;
+    char   *command;
+    char   names[BUFFER_SIZE];
+    char   *name;
+    char   *save;
+    long   offset;
+    int    i;
+    
+    /* A new command, it waits in the queue until a stream is free. */
+    if(header->type == frame_command){
+        if(session->queueLength == SESSION_MAX_QUEUED){
+            puts(CFLRED "ERROR:" C_RST " Client sent too many commands at once, closing connection...");
+            return -1;
+        }
+        
+        command = malloc(header->length + 1);
+        if(command == NULL){
+            perror(CFLRED "ERROR" C_RST);
+            return -1;
+        }
+        memcpy(command, payload, header->length);
+        command[header->length] = '\0';
+        
+        i = (session->queueStart + session->queueLength) % SESSION_MAX_QUEUED;
+        session->queue[i]    = command;
+        session->queueIds[i] = header->streamId;
+        session->queueLength++;
+        
+        return 0;
+    }
+    
+    /* The hashes the client can check, the first one known here is used for every transfer from now on. */
+    if(header->type == frame_hash){
+        memcpy(names, payload, header->length);
+        names[header->length] = '\0';
+        
+        session->hashType = hash_unknown;
+        for(name = strtok_r(names, ",", &save); name != NULL && session->hashType == hash_unknown; name = strtok_r(NULL, ",", &save)){
+            session->hashType = hashFromName(name);
+        }
+        
+        session->hashReply = 1;
+        return 0;
+    }
+    
+    /* The codecs the client can decompress, frame_data may be compressed from now on if this one is among them. */
+    if(header->type == frame_compress){
+        memcpy(names, payload, header->length);
+        names[header->length] = '\0';
+        
+        session->compress = 0;
+        for(name = strtok_r(names, ",", &save); name != NULL && !session->compress; name = strtok_r(NULL, ",", &save)){
+            session->compress = strcmp(name, COMPRESS_NAME) == 0;
+        }
+        
+        session->compressReply = 1;
+        return 0;
+    }
+    
+    stream = sessionFindStream(session, header->streamId);
+    
+    /* The client consumed data, the stream may send more. It may have ended in the meantime. */
+    if(header->type == frame_window){
+        if(header->length != FRAME_WINDOW_SIZE){
+            puts(CFLRED "ERROR:" C_RST " Client sent an invalid window, closing connection...");
+            return -1;
+        }
+        
+        if(stream != NULL && stream->state == stream_state_send){
+            stream->window += unpackUint32((const unsigned char *)payload);
+        }
+        return 0;
+    }
+    
+    /* The rest belong to an upload in progress. */
+    if(stream == NULL || stream->state != stream_state_receive){
+        puts(CFLRED "ERROR:" C_RST " Client sent an unexpected frame, closing connection...");
+        return -1;
+    }
+    
+    switch(header->type){
+        /* The number of bytes which follow, reserve the space for all of them up front without changing the size of the file. */
+        case frame_size:
+            if(header->length != FRAME_SIZE_SIZE && header->length != FRAME_RESUME_SIZE){
+                break;
+            }
+            
+            stream->sinkSize = unpackUint64((const unsigned char *)payload);
+            
+            /* A resumed upload carries on from offset, anything after it did not match the file of the client. */
+            offset = 0;
+            if(header->length == FRAME_RESUME_SIZE){
+                offset = unpackUint64((const unsigned char *)payload + FRAME_SIZE_SIZE);
+                if(ftruncate(stream->sinkfd, offset) != 0 || lseek(stream->sinkfd, offset, SEEK_SET) == -1){
+                    perror(CFLRED "ERROR" C_RST);
+                    return -1;
+                }
+            }
+            
+            if(stream->sinkSize > 0 && stream->sinkfd != -1){
+                fallocate(stream->sinkfd, FALLOC_FL_KEEP_SIZE, offset, stream->sinkSize);
+            }
+            return 0;
+        
+        /* The whole file has been sent, the stream tells the client whether all of it arrived (intact) on its next turn. */
+        case frame_end:
+            if(header->length > FRAME_TRAILER_SIZE){
+                break;
+            }
+            
+            sessionFinishUpload(session, stream);
+            
+            /* get -d: the signatures of the client are all in, the file is sent from now on. */
+            if(stream->deltaEncoder != NULL){
+                stream->state = stream_state_send;
+                return 0;
+            }
+            
+            stream->sinkOk     = stream->sinkSize == -1 || stream->sinkReceived == stream->sinkSize;
+            stream->sinkHashOk = stream->hash == NULL || header->length == 0 || frameCheckTrailer((const unsigned char *)payload, header->length, stream->hash);
+            stream->state      = stream_state_reply;
+            
+            /* put -r: the directories get their modes and mtimes once everything in them is there. */
+            if(stream->archive != NULL && archiveReaderFinish(stream->archive) != 0){
+                stream->sinkOk = 0;
+            }
+            
+            /* put -d: the new file takes the place of the old one, if it is all there. */
+            if(stream->deltaApply != NULL){
+                if(stream->sinkOk && stream->sinkHashOk && deltaApplyFinish(stream->deltaApply) != 0){
+                    perror(CFLRED "ERROR" C_RST);
+                    stream->sinkOk = 0;
+                }
+                deltaApplyFree(stream->deltaApply);
+                stream->deltaApply = NULL;
+            }
+            return 0;
+        
+        /* The client could not finish sending the file, what arrived is kept. */
+        case frame_error:
+            sessionCloseStream(session, stream);
+            return 0;
+    }
+    
+    puts(CFLRED "ERROR:" C_RST " Client sent an unexpected frame, closing connection...");
+    return -1;
+}
+
+/* PURPOSE:
+ *     Start the commands in the queue, in the order they arrived, for as
+ *     long as there is a free stream and room for their first reply.
+ * 
+ * RETURNS:
+ *     0 - OK.
+ *    -1 - Critical error.
+ */
+static int sessionStartCommands(Session *session){
+    unsigned char header[FRAME_HEADER_SIZE];
+    const char    *name;
+    Stream        *stream;
+    char          *command;
+    int           ret;
+    
+    /* Nothing may be queued while the payload of a frame_data is still to be sent, it would end up inside it. */
+    if(session->sending != NULL){
+        return 0;
+    }
+    
+    /* Answer the frame_hash of the client before the replies to the commands sent after it. */
+    if(session->hashReply){
+        name = session->hashType == hash_unknown ? "" : hashName(session->hashType);
+        if((long)sizeof(session->out) - (session->outEnd - session->outStart) < FRAME_HEADER_SIZE + (long)strlen(name)){
+            return 0;
+        }
+        
+        frameEncodeHeader(header, frame_hash, 0, 0, strlen(name));
+        if(sessionQueue(session, header, sizeof(header)) != 0 || sessionQueue(session, name, strlen(name)) != 0){
+            return -1;
+        }
+        session->hashReply = 0;
+    }
+    if(session->compressReply){
+        name = session->compress ? COMPRESS_NAME : "";
+        if((long)sizeof(session->out) - (session->outEnd - session->outStart) < FRAME_HEADER_SIZE + (long)strlen(name)){
+            return 0;
+        }
+        
+        frameEncodeHeader(header, frame_compress, 0, 0, strlen(name));
+        if(sessionQueue(session, header, sizeof(header)) != 0 || sessionQueue(session, name, strlen(name)) != 0){
+            return -1;
+        }
+        session->compressReply = 0;
+    }
+    
+    while(session->queueLength > 0 && (long)sizeof(session->out) - (session->outEnd - session->outStart) >= SESSION_REPLY_ROOM){
+        stream = sessionFreeStream(session);
+        if(stream == NULL){
+            return 0;
+        }
+        
+        command    = session->queue[session->queueStart];
+        stream->id = session->queueIds[session->queueStart];
+        
+        session->queueStart = (session->queueStart + 1) % SESSION_MAX_QUEUED;
+        session->queueLength--;
+        
+        /* Print out client details and the command in blue. */
+        printClientDetails((struct sockaddr *)&session->address, session->addressSize, ": ");
+        printf(CFLBLU "%s" C_RST "\n", command);
+        
+        /* Commands are relative to the sessions working directory, not whoever ran last. */
+        if(fchdir(session->dirfd) != 0){
+            perror(CFLRED "ERROR" C_RST);
+            free(command);
+            return -1;
+        }
+        
+        /* Execute the command, it leaves the stream free if it is already done. */
+        stream->window = FRAME_WINDOW;
+        compressorInit(&stream->compressor);
+        
+        errno = 0;
+        ret   = executeCommand(session, stream, command);
+        free(command);
+        
+        if(ret == -1){
+            if(errno != 0){
+                perror(CFLRED "ERROR" C_RST);
+            }
+            return -1;
+        }
+        
+        if(stream->state == stream_state_receive){
+            session->receiving++;
+        }
+    }
+    
+    return 0;
+}
+
+/* PURPOSE:
+ *     Write bytes of the payload of a frame_data to the file being uploaded.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno set by write().
+ */
+static int sessionWriteUpload(Session *session, const char *data, long length){
+    Stream *stream;
+    
+    if(session->dataCompressed){
+        return sessionCollectCompressed(session, data, length);
+    }
+    
+    stream = session->dataStream;
+    
+    /* put -d, get -d and put -r: the payload is not written to the file as it is. */
+    if(sessionDecodes(stream)){
+        if(sessionWriteDecoded(stream, data, length) != 0){
+            perror(CFLRED "ERROR" C_RST);
+            return -1;
+        }
+        session->dataLeft -= length;
+        return 0;
+    }
+    
+    if(writeAll(stream->sinkfd, data, length) != 0){
+        perror(CFLRED "ERROR" C_RST);
+        return -1;
+    }
+    
+    if(stream->hash != NULL){
+        hashUpdate(stream->hash, data, length);
+    }
+    
+    session->dataLeft    -= length;
+    stream->sinkReceived += length;
+    
+    return 0;
+}
+
+/* PURPOSE:
+ *     Collect bytes of a compressed payload in sinkBuffer (data is NULL
+ *     if they were received there already). Once all of it is there it
+ *     is decompressed and written like any other payload.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set (EPROTO if the payload is invalid, or
+ *         holds more than the client announced).
+ */
+static int sessionCollectCompressed(Session *session, const char *data, long length){
+    Stream *stream;
+    long   n;
+    
+    if(data != NULL){
+        memcpy(session->sinkBuffer + session->dataCollected, data, length);
+    }
+    session->dataCollected += length;
+    session->dataLeft      -= length;
+    
+    if(session->dataLeft > 0){
+        return 0;
+    }
+    
+    stream = session->dataStream;
+    
+    session->dataCompressed = 0;
+    if(sessionCompressBuffer(session) != 0){
+        return -1;
+    }
+    
+    n = decompressFrame((const unsigned char *)session->sinkBuffer, session->dataCollected, session->compressBuffer, FRAME_DATA_SIZE);
+    if(n == -1 || (stream->deltaApply == NULL && stream->sinkSize != -1 && stream->sinkReceived + n > stream->sinkSize)){
+        puts(CFLRED "ERROR:" C_RST " Client sent invalid compressed data, closing connection...");
+        errno = EPROTO;
+        return -1;
+    }
+    
+    session->dataLeft = n;
+    
+    return sessionWriteUpload(session, (const char *)session->compressBuffer, n);
+}
+
+/* Returns 1 if the frame_data of the stream have to be looked at instead of going straight to sinkfd, 0 otherwise. */
+static int sessionDecodes(const Stream *stream){
+    return stream->deltaApply != NULL || stream->deltaEncoder != NULL || stream->archive != NULL;
+}
+
+/* PURPOSE:
+ *     Hand bytes of the payload of a frame_data to whatever decodes them:
+ *     the instructions of a put -d, the signatures of a get -d, or the
+ *     archive of a put -r.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set (EPROTO if the instructions or the
+ *         archive are invalid).
+ */
+static int sessionWriteDecoded(Stream *stream, const char *data, long length){
+    if(stream->archive != NULL){
+        if(archiveReaderWrite(stream->archive, data, length) != 0){
+            return -1;
+        }
+        if(stream->hash != NULL){
+            hashUpdate(stream->hash, data, length);
+        }
+        stream->sinkReceived += length;
+        return 0;
+    }
+    
+    if(stream->deltaApply != NULL){
+        if(deltaApply(stream->deltaApply, data, length) != 0){
+            return -1;
+        }
+        stream->sinkReceived = stream->deltaApply->written;
+        return 0;
+    }
+    
+    deltaEncoderSignatures(stream->deltaEncoder, data, length);
+    stream->sinkReceived += length;
+    
+    return 0;
+}
+
+/* PURPOSE:
+ *     Move up to maxLength bytes of the payload of a frame_data from the
+ *     socket to the file. The bytes are splice()d from the socket into a
+ *     pipe and from the pipe into the file, so they never enter this
+ *     process. When splice() can not be used they are copied through a
+ *     large buffer instead.
+ * 
+ * RETURNS:
+ *     Like recv():
+ *     SUCCESS: The number of bytes moved.
+ *     FAILURE: 0 if the client closed the connection, -1 otherwise
+ *              (errno EAGAIN if the socket has no data).
+ */
+static long sessionReceiveFile(Session *session, long maxLength){
+    int  sinkfd;
+    long n;
+    long moved;
+    long m;
+    
+    sinkfd = session->dataStream->sinkfd;
+    
+    if(maxLength > session->dataLeft){
+        maxLength = session->dataLeft;
+    }
+    
+    /* A compressed payload, collected in the buffer until all of it arrived. */
+    if(session->dataCompressed){
+        n = recv(session->sockfd, session->sinkBuffer + session->dataCollected, maxLength, 0);
+        if(n <= 0){
+            return n;
+        }
+        
+        if(sessionCollectCompressed(session, NULL, n) != 0){
+            return -1;
+        }
+        
+        return n;
+    }
+    
+    /* put -d, get -d and put -r: the payload has to be looked at, it goes through the buffer. */
+    if(sessionDecodes(session->dataStream)){
+        if(session->sinkBuffer == NULL){
+            session->sinkBuffer = malloc(SESSION_RECEIVE_BUFFER_SIZE);
+            if(session->sinkBuffer == NULL){
+                return -1;
+            }
+        }
+        if(maxLength > SESSION_RECEIVE_BUFFER_SIZE){
+            maxLength = SESSION_RECEIVE_BUFFER_SIZE;
+        }
+        
+        n = recv(session->sockfd, session->sinkBuffer, maxLength, 0);
+        if(n <= 0){
+            return n;
+        }
+        
+        if(sessionWriteDecoded(session->dataStream, session->sinkBuffer, n) != 0){
+            return -1;
+        }
+        session->dataLeft -= n;
+        
+        return n;
+    }
+    
+    /* Create the pipe, it is kept until the last upload is done. */
+    if(!session->sinkBuffered && session->splicefd[0] == -1){
+        if(pipe2(session->splicefd, O_NONBLOCK | O_CLOEXEC) != 0){
+            session->splicefd[0] = -1;
+            session->splicefd[1] = -1;
+            
+            if(sessionUseReceiveBuffer(session) != 0){
+                return -1;
+            }
+        }
+        else{
+            /* A bigger pipe means fewer trips through here, fine if the system will not allow it. */
+            fcntl(session->splicefd[1], F_SETPIPE_SZ, SESSION_PIPE_SIZE);
+            session->splicePipeSize = fcntl(session->splicefd[1], F_GETPIPE_SZ);
+            if(session->splicePipeSize <= 0){
+                session->splicePipeSize = 65536;
+            }
+        }
+    }
+    
+    /* Copy through a large buffer. */
+    if(session->sinkBuffered){
+        if(maxLength > SESSION_RECEIVE_BUFFER_SIZE){
+            maxLength = SESSION_RECEIVE_BUFFER_SIZE;
+        }
+        
+        n = recv(session->sockfd, session->sinkBuffer, maxLength, 0);
+        if(n <= 0){
+            return n;
+        }
+        
+        if(writeAll(sinkfd, session->sinkBuffer, n) != 0){
+            return -1;
+        }
+        
+        if(session->dataStream->hash != NULL){
+            hashUpdate(session->dataStream->hash, session->sinkBuffer, n);
+        }
+    }
+    /* Socket to pipe, then the pipe is drained into the file so it is empty for the next call. */
+    else{
+        if(maxLength > session->splicePipeSize){
+            maxLength = session->splicePipeSize;
+        }
+        
+        n = splice(session->sockfd, NULL, session->splicefd[1], NULL, maxLength, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if(n == -1 && errno == EINVAL){
+            if(sessionUseReceiveBuffer(session) != 0){
+                return -1;
+            }
+            return sessionReceiveFile(session, maxLength);
+        }
+        if(n <= 0){
+            return n;
+        }
+        
+        moved = 0;
+        while(moved < n){
+            m = splice(session->splicefd[0], NULL, sinkfd, NULL, n - moved, SPLICE_F_MOVE);
+            
+            if(m == -1 && errno == EINTR){
+                continue;
+            }
+            
+            /* The file system can not be splice()d into, copy what is in the pipe and use the buffer from now on. */
+            if(m == -1 && errno == EINVAL){
+                if(sessionUseReceiveBuffer(session) != 0){
+                    return -1;
+                }
+                
+                m = read(session->splicefd[0], session->sinkBuffer, n - moved);
+                if(m <= 0 || writeAll(sinkfd, session->sinkBuffer, m) != 0){
+                    return -1;
+                }
+            }
+            else if(m <= 0){
+                return -1;
+            }
+            
+            moved += m;
+        }
+        
+        /* What was just written is still in the page cache. */
+        if(session->dataStream->hash != NULL && hashUpdateFile(session->dataStream->hash, sinkfd, lseek(sinkfd, 0, SEEK_CUR) - n, n) != 0){
+            return -1;
+        }
+    }
+    
+    session->dataLeft                 -= n;
+    session->dataStream->sinkReceived += n;
+    
+    return n;
+}
+
+/* PURPOSE:
+ *     Switch uploads to being copied through a large buffer.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Out of memory.
+ */
+static int sessionUseReceiveBuffer(Session *session){
+    if(session->sinkBuffer == NULL){
+        session->sinkBuffer = malloc(SESSION_RECEIVE_BUFFER_SIZE);
+        if(session->sinkBuffer == NULL){
+            return -1;
+        }
+    }
+    
+    session->sinkBuffered = 1;
+    
+    return 0;
+}
+
+/* Close the uploaded file, and release everything used to receive uploads once the last one is done. */
+static void sessionFinishUpload(Session *session, Stream *stream){
+    if(stream->sinkfd != -1){
+        close(stream->sinkfd);
+        stream->sinkfd = -1;
+    }
+    
+    if(session->dataStream == stream){
+        session->dataLeft       = 0;
+        session->dataStream     = NULL;
+        session->dataCompressed = 0;
+    }
+    
+    if(stream->state == stream_state_receive){
+        session->receiving--;
+    }
+    if(session->receiving > 0){
+        return;
+    }
+    
+    if(session->splicefd[0] != -1){
+        close(session->splicefd[0]);
+        close(session->splicefd[1]);
+        session->splicefd[0] = -1;
+        session->splicefd[1] = -1;
+    }
+    
+    free(session->sinkBuffer);
+    session->sinkBuffer   = NULL;
+    session->sinkBuffered = 0;
+}
+
+/* PURPOSE:
+ *     Queue a frame from the first stream after the one which sent last
+ *     that has one ready, so every stream gets its turn.
+ * 
+ * RETURNS:
+ *     0 - A frame was queued.
+ *     1 - No stream has anything to send right now.
+ *    -1 - Critical error.
+ */
+static int sessionNextFrame(Session *session){
+    Stream *stream;
+    int    ret;
+    int    i;
+    
+    for(i=0; i<SESSION_MAX_STREAMS; i++){
+        stream = &session->streams[(session->nextStream + i) % SESSION_MAX_STREAMS];
+        if(!sessionStreamReady(stream)){
+            continue;
+        }
+        
+        ret = sessionStreamFrame(session, stream);
+        if(ret == 1){
+            continue;
+        }
+        
+        session->nextStream = (session->nextStream + i + 1) % SESSION_MAX_STREAMS;
+        return ret;
+    }
+    
+    return 1;
+}
+
+/* PURPOSE:
+ *     Queue the next frame of a stream: the header of the next frame_data
+ *     of its file (the payload is sent by sessionSendFile()), a frame_data
+ *     holding the next output of its command, or the frame ending it.
+ *     Only called while out is empty.
+ * 
+ * RETURNS:
+ *     0 - A frame was queued.
+ *     1 - The pipe of the stream has no data yet.
+ *    -1 - Critical error.
+ */
+static int sessionStreamFrame(Session *session, Stream *stream){
+    unsigned char header[FRAME_HEADER_SIZE];
+    unsigned char trailer[FRAME_TRAILER_SIZE];
+    uint32_t      trailerLength;
+    char          message[BUFFER_SIZE];
+    long          length;
+    long          n;
+    int           ret;
+    
+    /* An upload which is complete, tell the client whether all of it arrived. */
+    if(stream->state == stream_state_reply){
+        if(!stream->sinkOk){
+            ret = sendReplyError(session, stream, "File was not completely received.");
+        }
+        else if(!stream->sinkHashOk){
+            ret = sendReplyError(session, stream, "Checksum mismatch, the file was damaged on its way to the server.");
+        }
+        else if(stream->archive != NULL && stream->archive->errors > 0){
+            snprintf(message, sizeof(message), "%ld entries could not be created, first: %s", stream->archive->errors, stream->archive->error);
+            ret = sendReplyError(session, stream, message);
+        }
+        else{
+            ret = sessionQueueFrame(session, stream, frame_end, NULL, 0);
+        }
+        
+        sessionCloseStream(session, stream);
+        return ret;
+    }
+    
+    /* get -d: the size of the file, then the instructions to rebuild it from the copy of the client, read in after the space for their frame header. */
+    if(stream->deltaEncoder != NULL){
+        if(stream->sourceLeft != 0){
+            packUint64(trailer, stream->sourceLeft);
+            stream->sourceLeft = 0;
+            return sessionQueueFrame(session, stream, frame_size, trailer, FRAME_SIZE_SIZE);
+        }
+        
+        length = sizeof(session->out) - FRAME_HEADER_SIZE;
+        if(length > stream->window){
+            length = stream->window;
+        }
+        
+        n = stream->deltaEncoder->done ? 0 : deltaEncode(stream->deltaEncoder, (unsigned char *)session->out + FRAME_HEADER_SIZE, length);
+        if(n == -1){
+            perror(CFLRED "ERROR" C_RST);
+            return -1;
+        }
+        
+        if(n == 0){
+            trailerLength = stream->hash != NULL ? frameEncodeTrailer(trailer, stream->hash) : 0;
+            sessionCloseStream(session, stream);
+            return sessionQueueFrame(session, stream, frame_end, trailer, trailerLength);
+        }
+        
+        return sessionQueueData(session, stream, n);
+    }
+    
+    /* A file being downloaded. */
+    if(stream->sourcefd != -1){
+        if(stream->sourceLeft == 0){
+            trailerLength = stream->hash != NULL ? frameEncodeTrailer(trailer, stream->hash) : 0;
+            sessionCloseStream(session, stream);
+            return sessionQueueFrame(session, stream, frame_end, trailer, trailerLength);
+        }
+        
+        length = stream->sourceLeft < FRAME_DATA_SIZE ? stream->sourceLeft : FRAME_DATA_SIZE;
+        if(length > stream->window){
+            length = stream->window;
+        }
+        
+        /* A frame worth compressing is read in after the space for its header, and hashed there. */
+        if(session->compress && compressWanted(&stream->compressor, length)){
+            n = read(stream->sourcefd, session->out + FRAME_HEADER_SIZE, length);
+            
+            /* The client was promised sourceLeft more bytes, it has no way of recovering from less. */
+            if(n <= 0){
+                fputs(CFLRED "ERROR:" C_RST " File shrank while it was being sent.\n", stderr);
+                return -1;
+            }
+            
+            if(stream->hash != NULL){
+                hashUpdate(stream->hash, session->out + FRAME_HEADER_SIZE, n);
+            }
+            stream->sourceLeft -= n;
+            
+            return sessionQueueData(session, stream, n);
+        }
+        if(session->compress){
+            compressSkipped(&stream->compressor, length);
+        }
+        
+        /* The bytes sendfile() is about to send, read back out of the page cache. */
+        if(stream->hash != NULL && hashUpdateFile(stream->hash, stream->sourcefd, lseek(stream->sourcefd, 0, SEEK_CUR), length) != 0){
+            perror(CFLRED "ERROR" C_RST);
+            return -1;
+        }
+        
+        frameEncodeHeader(header, frame_data, 0, stream->id, length);
+        stream->sourceFrameLeft = length;
+        stream->window         -= length;
+        session->sending        = stream;
+        
+        return sessionQueue(session, header, sizeof(header));
+    }
+    
+    /* The output of a command, read in after the space for its frame header. */
+    length = sizeof(session->out) - FRAME_HEADER_SIZE;
+    if(length > stream->window){
+        length = stream->window;
+    }
+    
+    n = read(fileno(stream->sourcePipe), session->out + FRAME_HEADER_SIZE, length);
+    
+    if(n == -1){
+        if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR){
+            stream->sourceWaiting = 1;
+            return 1;
+        }
+        perror(CFLRED "ERROR" C_RST);
+        return -1;
+    }
+    
+    /* put -d: the signatures have all been sent, the instructions to rebuild the file are received next. */
+    if(n == 0 && stream->deltaApply != NULL){
+        fclose(stream->sourcePipe);
+        stream->sourcePipe = NULL;
+        stream->state      = stream_state_receive;
+        session->receiving++;
+        return sessionQueueFrame(session, stream, frame_end, NULL, 0);
+    }
+    
+    /* The command finished, end the stream, get -r with the hash of the archive. */
+    if(n == 0){
+        trailerLength = stream->hash != NULL ? frameEncodeTrailer(trailer, stream->hash) : 0;
+        sessionCloseStream(session, stream);
+        return sessionQueueFrame(session, stream, frame_end, trailer, trailerLength);
+    }
+    
+    /* Only get -r hashes the output, the hash of put -d is for the file it receives afterwards. */
+    if(stream->hash != NULL && stream->deltaApply == NULL){
+        hashUpdate(stream->hash, session->out + FRAME_HEADER_SIZE, n);
+    }
+    
+    return sessionQueueData(session, stream, n);
+}
+
+/* PURPOSE:
+ *     Send up to maxLength bytes of the frame_data being sent with
+ *     sendfile(), the kernel copies them from the page cache to the
+ *     socket without them ever entering this process.
+ * 
+ *     If the file can not be used with sendfile(), sourceBuffered is
+ *     set and sessionReadFile() copies it through out instead.
+ * 
+ * RETURNS:
+ *     SUCCESS: The number of bytes sent (may be 0).
+ *     FAILURE: -1 Critical error.
+ *              -2 The socket is full.
+ */
+static long sessionSendFile(Session *session, long maxLength){
+    Stream *stream;
+    long   n;
+    
+    stream = session->sending;
+    
+    n = stream->sourceFrameLeft < maxLength ? stream->sourceFrameLeft : maxLength;
+    
+    /* The file offset is advanced by sendfile(), so the buffered fallback can carry on from it. */
+    n = sendfile(session->sockfd, stream->sourcefd, NULL, n);
+    
+    if(n == -1){
+        if(errno == EAGAIN || errno == EWOULDBLOCK){
+            return -2;
+        }
+        if(errno == EINTR){
+            return 0;
+        }
+        if(errno == EINVAL || errno == ENOSYS){
+            stream->sourceBuffered = 1;
+            return 0;
+        }
+        perror(CFLRED "ERROR" C_RST);
+        return -1;
+    }
+    
+    /* The file shrank, the client was promised sourceLeft more bytes and has no way of recovering from less. */
+    if(n == 0){
+        fputs(CFLRED "ERROR:" C_RST " File shrank while it was being sent.\n", stderr);
+        return -1;
+    }
+    
+    stream->sourceFrameLeft -= n;
+    stream->sourceLeft      -= n;
+    
+    if(stream->sourceFrameLeft == 0){
+        session->sending = NULL;
+    }
+    
+    return n;
+}
+
+/* PURPOSE:
+ *     Copy the next piece of the frame_data being sent into out, for
+ *     files which sendfile() can not handle.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Critical error.
+ */
+static int sessionReadFile(Session *session){
+    Stream *stream;
+    long   n;
+    
+    stream = session->sending;
+    
+    n = sizeof(session->out);
+    if(n > stream->sourceFrameLeft){
+        n = stream->sourceFrameLeft;
+    }
+    
+    n = read(stream->sourcefd, session->out, n);
+    
+    /* The client was promised sourceLeft more bytes, it has no way of recovering from less. */
+    if(n <= 0){
+        perror(CFLRED "ERROR" C_RST);
+        return -1;
+    }
+    
+    session->outEnd          = n;
+    stream->sourceFrameLeft -= n;
+    stream->sourceLeft      -= n;
+    
+    if(stream->sourceFrameLeft == 0){
+        session->sending = NULL;
+    }
+    
+    return 0;
+}
+
+/* PURPOSE:
+ *     Queue the frame_data whose length bytes were read in after the
+ *     space for its header in out, compressed if a codec was negotiated
+ *     and the Compressor of the stream finds it worth it. The window is
+ *     charged the bytes before they were compressed.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Out of memory.
+ */
+static int sessionQueueData(Session *session, Stream *stream, long length){
+    unsigned short flags;
+    long           n;
+    
+    flags = 0;
+    n     = length;
+    
+    if(session->compress && compressWanted(&stream->compressor, length)){
+        if(sessionCompressBuffer(session) != 0){
+            perror(CFLRED "ERROR" C_RST);
+            return -1;
+        }
+        
+        n = compressFrame(&stream->compressor, (const unsigned char *)session->out + FRAME_HEADER_SIZE, length, session->compressBuffer);
+        if(n > 0){
+            memcpy(session->out + FRAME_HEADER_SIZE, session->compressBuffer, n);
+            flags = FRAME_FLAG_COMPRESSED;
+        }
+        else{
+            n = length;
+        }
+    }
+    else if(session->compress){
+        compressSkipped(&stream->compressor, length);
+    }
+    
+    frameEncodeHeader((unsigned char *)session->out, frame_data, flags, stream->id, n);
+    session->outEnd  = FRAME_HEADER_SIZE + n;
+    stream->window  -= length;
+    
+    return 0;
+}
+
+/* PURPOSE:
+ *     Allocate compressBuffer, if it is not already.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Out of memory.
+ */
+static int sessionCompressBuffer(Session *session){
+    if(session->compressBuffer == NULL){
+        session->compressBuffer = malloc(COMPRESS_FRAME_SIZE);
+        if(session->compressBuffer == NULL){
+            return -1;
+        }
+    }
+    
+    return 0;
+}
@@ -0,0 +1,246 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stdio.h>
+#include <sys/socket.h>
+
+#include "shared.h"
+#include "delta.h"
+#include "archive.h"
+#include "compress.h"
+
+#define SESSION_BUFFER_SIZE (FRAME_HEADER_SIZE + FRAME_DATA_SIZE) /* Size of the outgoing buffer every session owns, a whole frame_data of a pipe fits. */
+#define SESSION_IO_BUDGET   (256 * 1024) /* Max bytes moved per readiness event, so one fast client can not starve the rest. */
+#define SESSION_PIPE_SIZE   (1024 * 1024) /* Size asked for the pipe uploads are splice()d through. */
+#define SESSION_RECEIVE_BUFFER_SIZE (256 * 1024) /* Size of the buffer uploads are copied through when splice() can not be used. */
+#define SESSION_MAX_STREAMS 8            /* Commands a session runs at the same time, the rest wait their turn. */
+#define SESSION_MAX_QUEUED  256          /* Commands which may be waiting to run, a client sending more is disconnected. */
+#define SESSION_REPLY_ROOM  (2 * FRAME_HEADER_SIZE + BUFFER_SIZE) /* Room a command needs in the outgoing buffer to start. */
+
+/* Session outline:
+ * 
+ * A session is one client connection, written as a state machine so
+ * that it can be driven by either server engine:
+ * 
+ *   + fork:  a child process owns the session and poll()s its socket.
+ *   + epoll: one process owns thousands of sessions and epoll()s them all.
+ * 
+ * The socket is always non-blocking. Instead of looping until a file
+ * has been sent, the executeCommandXXXXX() functions queue a reply and
+ * tell the stream of the command where the rest of it comes from (a
+ * file, or a pipe to a command). The engine then calls
+ * sessionOnWritable() whenever the socket can take more data, and
+ * sessionOnReadable() whenever the client has sent something.
+ * 
+ * Files are handed to the socket with sendfile(), and uploads are
+ * splice()d from the socket through a pipe into the file, so neither
+ * is copied through this process.
+ * 
+ * Everything is sent and received as frames (see shared.h), and every
+ * command runs on its own stream:
+ * 
+ * 1. Every frame_command is added to a queue. Commands leave the queue
+ *    in the order they arrived, as soon as one of the SESSION_MAX_STREAMS
+ *    streams is free, so an scd is always done before the commands
+ *    sent after it start.
+ * 
+ * 2. stream_state_send:    The reply (get, sls, spwd, smd5sum) is sent
+ *    as frame_data, one frame at a time from each stream in turn, as
+ *    far as the window of the stream allows. A frame_end ends it.
+ * 
+ * 3. stream_state_receive: The frame_data of an upload (put) is written
+ *    to disk as it arrives, until the client sends frame_end.
+ * 
+ * 4. stream_state_reply:   The upload is complete, the stream is freed
+ *    once its frame_end (or frame_error) has been queued.
+ * 
+ * Once a hash has been negotiated, get and put streams hash their file
+ * as it passes. The bytes sendfile() and splice() move are hashed with
+ * pread() out of the page cache, so the file is not read from disk a
+ * second time.
+ * 
+ * get -d and put -d (see delta.h) turn their stream around once. put -d
+ * sends the signatures of the file here from a pipe, like the output of
+ * a command, then receives the instructions to rebuild it. get -d
+ * receives the signatures of the copy of the client, then sends the
+ * instructions its DeltaEncoder makes from them.
+ * 
+ * get -r sends an archive (see archive.h) from a pipe, like the output
+ * of a command but hashed like a file. put -r extracts the frame_data
+ * with its ArchiveReader instead of writing them to a file.
+ * 
+ * Once a codec has been negotiated, the frame_data of every stream
+ * going out (files, listings, the output of commands, archives and
+ * instructions) may be compressed, as its Compressor decides. A file
+ * is then read in here instead of going out with sendfile(). A
+ * compressed frame_data which arrives is collected whole before it is
+ * decompressed, it never goes through splice().
+ * 
+ * The socket is read all of the time, so frame_window can always reach
+ * the streams waiting for it.
+ */
+typedef enum{
+    session_state_open,  /* Connected. */
+    session_state_closed /* Client disconnected, the session should be destroyed. */
+} SessionState;
+
+typedef enum{
+    stream_state_free,    /* Not in use. */
+    stream_state_send,    /* Streaming a reply to the client. */
+    stream_state_receive, /* Receiving an uploaded file from the client. */
+    stream_state_reply    /* Upload complete, the final reply still has to be queued. */
+} StreamState;
+
+typedef struct{
+    uint32_t    id;
+    StreamState state;
+    long        window; /* Bytes of frame_data payload the client will still accept on this stream. */
+    
+    /* Where the reply comes from. */
+    int   sourcefd;        /* File being downloaded, -1 if none. */
+    long  sourceLeft;      /* Bytes of sourcefd left to send (get -d: its size, until the frame_size is queued). */
+    long  sourceFrameLeft; /* Bytes of sourcefd left to send in the current frame_data. */
+    int   sourceBuffered;  /* 1 if sendfile() does not work on sourcefd and it has to be copied through out. */
+    FILE *sourcePipe;      /* Pipe to a command, or to the threads of a native command, NULL if none. */
+    int   sourcePopened;   /* 1 if sourcePipe was opened with popen() and has to be pclose()d. */
+    int   sourceWaiting;   /* 1 if sourcePipe had no data the last time it was read. */
+    
+    /* Where an upload is written to. */
+    int  sinkfd;       /* The file being uploaded, -1 if none. */
+    long sinkSize;     /* Size announced by the client with frame_size, -1 until then. */
+    long sinkReceived; /* Bytes of the file received so far. */
+    int  sinkOk;       /* stream_state_reply: 1 if all of the file arrived. */
+    int  sinkHashOk;   /* stream_state_reply: 0 if the trailer of the client does not match what arrived. */
+    
+    HashState *hash; /* Hash of the frame_data of a get or put, NULL if no hash was negotiated. */
+    
+    DeltaEncoder *deltaEncoder; /* get -d: makes the frame_data from sourcefd, fed the signatures the client sends first, NULL if none. */
+    DeltaApply   *deltaApply;   /* put -d: rebuilds the file (in sinkfd) from the frame_data, NULL if none. */
+    
+    ArchiveReader *archive; /* put -r: extracts the frame_data into the directory, NULL if none. */
+    
+    Compressor compressor; /* Whether and how hard the frame_data sent are compressed, once a codec was negotiated. */
+} Stream;
+
+typedef struct{
+    int          sockfd;
+    int          dirfd;    /* The working directory of this session, scd changes this instead of the whole process. */
+    SessionState state;
+    
+    HashType hashType;  /* Picked from the frame_hash of the client, hash_unknown until then (no trailers). */
+    int      hashReply; /* 1 if the frame_hash telling the client which hash was picked has not been queued yet. */
+    
+    int           compress;       /* 1 once the client offered COMPRESS_NAME with frame_compress, frame_data may be compressed. */
+    int           compressReply;  /* 1 if the frame_compress telling the client has not been queued yet. */
+    unsigned char *compressBuffer; /* COMPRESS_FRAME_SIZE bytes frames are compressed into and decompressed into, allocated when first needed. */
+    
+    struct sockaddr_storage address;
+    socklen_t               addressSize;
+    
+    /* Bytes received from the client which have not been handled yet, at most one
+     * frame header and the payload of a frame_command.
+     */
+    char   in[FRAME_HEADER_SIZE + BUFFER_SIZE];
+    long   inLength;
+    long   dataLeft;   /* Bytes of the payload of a frame_data still to be written to dataStream. */
+    Stream *dataStream;
+    int    dataCompressed; /* 1 if the payload is compressed, it is collected in sinkBuffer first. */
+    long   dataCollected;  /* Bytes of it in sinkBuffer. */
+    
+    /* Bytes queued to be sent to the client, out[outStart] to out[outEnd-1]. */
+    char out[SESSION_BUFFER_SIZE];
+    long outStart;
+    long outEnd;
+    
+    /* Commands which have arrived but not started, queue[queueStart] onwards. */
+    char     *queue[SESSION_MAX_QUEUED];
+    uint32_t queueIds[SESSION_MAX_QUEUED];
+    int      queueStart;
+    int      queueLength;
+    
+    Stream streams[SESSION_MAX_STREAMS];
+    Stream *sending;     /* Stream whose frame_data payload is being sent, NULL if none. */
+    int    nextStream;   /* Where the search for the next stream to send from starts, so they all get a turn. */
+    int    receiving;    /* Number of streams in stream_state_receive. */
+    
+    /* Used to receive uploads, shared by every stream. */
+    int  splicefd[2];    /* Pipe uploads are splice()d through, created when the first upload starts. */
+    long splicePipeSize; /* Capacity of splicefd. */
+    int  sinkBuffered;   /* 1 if splice() does not work and uploads are copied through sinkBuffer. */
+    char *sinkBuffer;    /* SESSION_RECEIVE_BUFFER_SIZE bytes, only allocated when sinkBuffered. */
+    
+    /* Used by the engines to remember what they are watching. */
+    int watchedEvents;
+    int watchedPipefds[SESSION_MAX_STREAMS];
+    int watchedPipes;
+} Session;
+
+
+
+
+/* PURPOSE:
+ *     Create a session for a newly accepted client.
+ * 
+ * PARAMETERS:
+ *     int sockfd:                     The (non-blocking) client socket,
+ *                                     owned by the session from now on.
+ *     const struct sockaddr *address: The address of the client.
+ *     socklen_t addressSize:          The size of address.
+ *     int dirfd:                      The directory the session starts
+ *                                     out in (it is duplicated), or
+ *                                     AT_FDCWD for the current one.
+ * 
+ * RETURNS:
+ *     SUCCESS: A new session.
+ *     FAILURE: NULL, errno is set.
+ */
+Session *sessionCreate(int sockfd, const struct sockaddr *address, socklen_t addressSize, int dirfd);
+
+/* Close every file descriptor owned by the session and free it. */
+void sessionDestroy(Session *session);
+
+/* PURPOSE:
+ *     Queue a frame on a stream to be sent to the client.
+ * 
+ * RETURNS:
+ *     0 - The frame was queued.
+ *    -1 - There is no room left in the outgoing buffer.
+ */
+int sessionQueueFrame(Session *session, const Stream *stream, unsigned char type, const void *payload, uint32_t length);
+
+
+
+
+/* Which events the session is interested in on its socket (1 - yes, 0 - no). */
+int sessionWantsRead(const Session *session);
+int sessionWantsWrite(const Session *session);
+
+/* Fills fds with the pipes the session is waiting on (besides its socket)
+ * and returns how many there are, at most SESSION_MAX_STREAMS.
+ */
+int sessionPipefds(const Session *session, int *fds);
+
+/* PURPOSE:
+ *     Called by the engine when the socket is readable, the socket is
+ *     writable, or one of the pipes returned by sessionPipefds() is
+ *     readable.
+ * 
+ * RETURNS:
+ *     0 - Everything went OK, check session->state for session_state_closed.
+ *    -1 - Critical error, the session should be destroyed.
+ */
+int sessionOnReadable(Session *session);
+int sessionOnWritable(Session *session);
+int sessionOnPipeReadable(Session *session);
+
+/* PURPOSE:
+ *     Drive a single session with poll() until the client disconnects,
+ *     used by the fork engine.
+ * 
+ * RETURNS:
+ *     0 - The client disconnected.
+ *    -1 - Critical error.
+ */
+int runSession(Session *session);
+
+#endif
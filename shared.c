@@ -1,6 +1,14 @@
+#define _GNU_SOURCE
+
 #include <string.h>
 
+#include <errno.h>
+
+#include <fcntl.h>
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -16,6 +24,8 @@ SharedCommandType getSharedCommandType(const char *command){
     else if (strncmp("put ", command, 4) == 0)     { return command_put;  }
     else if (strncmp("spwd", command, 4) == 0)     { return command_pwd;  }
     else if (strncmp("smd5sum ", command, 8) == 0) { return command_md5;  }
+    else if (strncmp("mget ", command, 5) == 0)    { return command_mget; }
+    else if (strncmp("mput ", command, 5) == 0 || strcmp("mput", command) == 0) { return command_mput; }
     
     return command_unknown;
 }
@@ -66,4 +76,289 @@ const char *extractFileName(const char *filePath){
     }
     
     return endFilePath;
-}
\ No newline at end of file
+}
+
+
+
+
+/*********************************************************************************
+ * I/O functions below.
+ ********************************************************************************/
+int writeAll(int fd, const void *data, long length){
+    long n;
+    
+    while(length > 0){
+        n = write(fd, data, length);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        data    = (const char *)data + n;
+        length -= n;
+    }
+    
+    return 0;
+}
+
+int setNonBlocking(int fd){
+    int flags;
+    
+    flags = fcntl(fd, F_GETFL);
+    if(flags == -1){
+        return -1;
+    }
+    
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int readAll(int fd, void *data, long length){
+    long n;
+    
+    while(length > 0){
+        n = read(fd, data, length);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        if(n == 0){
+            errno = 0;
+            return -1;
+        }
+        data    = (char *)data + n;
+        length -= n;
+    }
+    
+    return 0;
+}
+
+void packUint32(unsigned char *buffer, uint32_t value){
+    buffer[0] = value >> 24;
+    buffer[1] = value >> 16;
+    buffer[2] = value >> 8;
+    buffer[3] = value;
+}
+
+void packUint64(unsigned char *buffer, uint64_t value){
+    packUint32(buffer, value >> 32);
+    packUint32(buffer + 4, value);
+}
+
+uint32_t unpackUint32(const unsigned char *buffer){
+    return ((uint32_t)buffer[0] << 24) | ((uint32_t)buffer[1] << 16) | ((uint32_t)buffer[2] << 8) | buffer[3];
+}
+
+uint64_t unpackUint64(const unsigned char *buffer){
+    return ((uint64_t)unpackUint32(buffer) << 32) | unpackUint32(buffer + 4);
+}
+
+
+
+
+/*********************************************************************************
+ * Frame functions below.
+ ********************************************************************************/
+void frameEncodeHeader(unsigned char *buffer, unsigned char type, unsigned short flags, uint32_t streamId, uint32_t length){
+    buffer[0] = FRAME_VERSION;
+    buffer[1] = type;
+    buffer[2] = flags >> 8;
+    buffer[3] = flags;
+    packUint32(buffer + 4, streamId);
+    packUint32(buffer + 8, length);
+}
+
+int frameDecodeHeader(const unsigned char *buffer, FrameHeader *header){
+    header->version  = buffer[0];
+    header->type     = buffer[1];
+    header->flags    = (buffer[2] << 8) | buffer[3];
+    header->streamId = unpackUint32(buffer + 4);
+    header->length   = unpackUint32(buffer + 8);
+    
+    if(header->version != FRAME_VERSION || header->length > FRAME_MAX_PAYLOAD){
+        return -1;
+    }
+    
+    return 0;
+}
+
+int frameSend(int sockfd, unsigned char type, unsigned short flags, uint32_t streamId, const void *payload, uint32_t length){
+    unsigned char header[FRAME_HEADER_SIZE];
+    struct iovec  iov[2];
+    struct iovec  *current;
+    int           iovcnt;
+    long          n;
+    
+    frameEncodeHeader(header, type, flags, streamId, length);
+    
+    iov[0].iov_base = header;
+    iov[0].iov_len  = sizeof(header);
+    iov[1].iov_base = (void *)payload;
+    iov[1].iov_len  = length;
+    
+    current = iov;
+    iovcnt  = length > 0 ? 2 : 1;
+    
+    while(iovcnt > 0){
+        n = writev(sockfd, current, iovcnt);
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        
+        /* Partial write, skip what was sent. */
+        while(iovcnt > 0 && n >= (long)current->iov_len){
+            n -= current->iov_len;
+            current++;
+            iovcnt--;
+        }
+        if(iovcnt > 0){
+            current->iov_base = (char *)current->iov_base + n;
+            current->iov_len -= n;
+        }
+    }
+    
+    return 0;
+}
+
+int frameSendFileData(int sockfd, uint32_t streamId, int fd, uint32_t length){
+    unsigned char header[FRAME_HEADER_SIZE];
+    char          buffer[BUFFER_SIZE * 16];
+    int           buffered;
+    long          n;
+    
+    frameEncodeHeader(header, frame_data, 0, streamId, length);
+    
+    /* Tell TCP the payload follows so the header is not sent on its own. */
+    if(send(sockfd, header, sizeof(header), MSG_MORE) != sizeof(header)){
+        return -1;
+    }
+    
+    buffered = 0;
+    while(length > 0){
+        if(!buffered){
+            n = sendfile(sockfd, fd, NULL, length);
+            
+            /* The file can not be used with sendfile(), copy it instead. */
+            if(n == -1 && (errno == EINVAL || errno == ENOSYS)){
+                buffered = 1;
+                continue;
+            }
+        }
+        else{
+            n = read(fd, buffer, length < sizeof(buffer) ? length : sizeof(buffer));
+            if(n > 0 && writeAll(sockfd, buffer, n) != 0){
+                return -1;
+            }
+        }
+        
+        if(n == -1){
+            if(errno == EINTR){
+                continue;
+            }
+            return -1;
+        }
+        
+        /* The file is shorter than it was. */
+        if(n == 0){
+            errno = 0;
+            return -1;
+        }
+        
+        length -= n;
+    }
+    
+    return 0;
+}
+
+int frameReceiveHeader(int sockfd, FrameHeader *header){
+    unsigned char buffer[FRAME_HEADER_SIZE];
+    
+    if(readAll(sockfd, buffer, sizeof(buffer)) != 0){
+        return -1;
+    }
+    
+    if(frameDecodeHeader(buffer, header) != 0){
+        errno = 0;
+        return -1;
+    }
+    
+    return 0;
+}
+
+int resumeBlockHash(int fd, long offset, unsigned char *digest){
+    HashState state;
+    long      start;
+    
+    start = offset > RESUME_BLOCK_SIZE ? offset - RESUME_BLOCK_SIZE : 0;
+    
+    hashInit(&state, hash_xxh3);
+    if(hashUpdateFile(&state, fd, start, offset - start) != 0){
+        return -1;
+    }
+    hashFinal(&state, digest);
+    
+    return 0;
+}
+
+uint32_t frameEncodeTrailer(unsigned char *trailer, HashState *state){
+    trailer[0] = state->type;
+    
+    return 1 + hashFinal(state, trailer + 1);
+}
+
+int frameCheckTrailer(const unsigned char *trailer, uint32_t length, HashState *state){
+    unsigned char digest[HASH_MAX_DIGEST_SIZE];
+    int           digestLength;
+    
+    if(length < 1 || trailer[0] != state->type){
+        return 0;
+    }
+    
+    digestLength = hashFinal(state, digest);
+    
+    return length == 1 + (uint32_t)digestLength && memcmp(trailer + 1, digest, digestLength) == 0;
+}
+
+
+
+/*********************************************************************************
+ * Listing functions below.
+ ********************************************************************************/
+void listingEncodeRecord(unsigned char *buffer, const ListingRecord *record){
+    buffer[0] = record->kind;
+    packUint32(buffer + 1, record->mode);
+    packUint32(buffer + 5, record->nlink);
+    packUint32(buffer + 9, record->uid);
+    packUint32(buffer + 13, record->gid);
+    packUint64(buffer + 17, record->size);
+    packUint64(buffer + 25, record->mtime);
+    buffer[33] = record->nameLength >> 8;
+    buffer[34] = record->nameLength;
+}
+
+long listingDecodeRecord(const unsigned char *buffer, long length, ListingRecord *record){
+    if(length < LISTING_RECORD_HEADER_SIZE){
+        return -1;
+    }
+    
+    record->kind       = buffer[0];
+    record->mode       = unpackUint32(buffer + 1);
+    record->nlink      = unpackUint32(buffer + 5);
+    record->uid        = unpackUint32(buffer + 9);
+    record->gid        = unpackUint32(buffer + 13);
+    record->size       = unpackUint64(buffer + 17);
+    record->mtime      = (int64_t)unpackUint64(buffer + 25);
+    record->nameLength = (buffer[33] << 8) | buffer[34];
+    record->name       = (const char *)buffer + LISTING_RECORD_HEADER_SIZE;
+    
+    if(length < LISTING_RECORD_HEADER_SIZE + record->nameLength){
+        return -1;
+    }
+    
+    return LISTING_RECORD_HEADER_SIZE + record->nameLength;
+}
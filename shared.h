@@ -1,22 +1,170 @@
 #ifndef SHARED_H
 #define SHARED_H
 
+#include <stdint.h>
 
+#include "hash.h"
 
 
-#define BUFFER_SIZE 500
 
 
+#define BUFFER_SIZE 500 /* Longest command (including the null terminator). */
 
 
-/* Get and put macros. */
-#define GET_REPLY_SIZE (2 + sizeof(long)) /* Big enough to hold the leading "OK" or "NO", and the size of the file. */
-#define GET_REPLY_OK   "OK"
-#define GET_REPLY_NO   "NO"
 
-#define PUT_REPLY_SIZE  2   /* Big enough to hold the leading "OK" or "NO". */
-#define PUT_REPLY_OK   "OK"
-#define PUT_REPLY_NO   "NO"
+
+/* Frame layer.
+ * 
+ * Everything sent between the client and server is a frame: a 12 byte
+ * header followed by "length" bytes of payload. All numbers are in
+ * network byte order.
+ * 
+ *   [version][type][flags flags][stream stream stream stream][length length length length][payload...]
+ * 
+ * Every command the client sends starts a new stream, and everything
+ * belonging to that command (replies, file contents, output) carries
+ * the same stream id. Since the length of every frame is known up front,
+ * both sides read exactly the bytes they need, and can pack any number
+ * of frames into a single write().
+ * 
+ * Several streams can be running at once, the server sends their frames
+ * in turns. A stream the server sends frame_data on starts out with a
+ * window of FRAME_WINDOW bytes, the server never sends more payload than
+ * the window allows, and the client grows it with frame_window as it
+ * consumes the data. A slow stream therefore never fills the connection
+ * and holds up the others.
+ * 
+ * Transfers are checked end to end: the client names the hashes it can
+ * check with frame_hash before its first command, the server picks one,
+ * and from then on the sender of a get or put hashes the frame_data as
+ * it goes and ends the stream with a frame_end carrying a trailer:
+ * 
+ *   [hash type][digest...]
+ * 
+ * which the receiver compares with its own hash of what arrived.
+ * 
+ * A get or put can carry on where an earlier one was cut short ("-c").
+ * The side which has the whole file compares the RESUME_BLOCK_SIZE bytes
+ * before the end of the partial copy (their xxh3 hash) with its own, and
+ * only the rest of the file is sent if they match, all of it otherwise:
+ * 
+ *   get: COMMAND "get -c OFFSET HASH PATH", the server replies frame_ok
+ *        [offset] with the offset it sends from, then frame_size as usual
+ *        with the number of bytes which follow.
+ *   put: COMMAND "put -c NAME", the server replies frame_ok [size][hash]
+ *        with the size of its copy, the client sends frame_size
+ *        [bytes which follow][offset] and the file from offset on.
+ * 
+ * The trailer of a resumed transfer covers the bytes it sent.
+ * 
+ * A get or put can also send only what changed in a file the receiver
+ * has an older copy of ("-d", see delta.h). The stream turns around:
+ * the receiver first sends the signatures of its copy, then the sender
+ * sends the instructions which rebuild the file from it:
+ * 
+ *   get: COMMAND "get -d SIZE PATH", the server replies frame_ok, the
+ *        client sends the signatures (frame_size, frame_data, frame_end),
+ *        the server sends frame_size [size of the file], the instructions
+ *        as frame_data and frame_end.
+ *   put: COMMAND "put -d NAME", the server replies frame_ok [size of its
+ *        copy] and sends the signatures as frame_data and frame_end, the
+ *        client sends frame_size [size of the file], the instructions and
+ *        frame_end. Without a copy the server replies an empty frame_ok,
+ *        a plain put.
+ * 
+ * The trailer covers the whole new file, not the instructions.
+ * 
+ * A large file can be striped over several connections ("-p", see
+ * stripe.h), each of them sends a range of it with "get -s" or "put -s",
+ * checked by a trailer of its own.
+ * 
+ * A directory is sent as a single archive ("-r", see archive.h), with no
+ * size up front:
+ * 
+ *   get: COMMAND "get -r PATH", the server replies frame_ok, the archive
+ *        as frame_data and frame_end.
+ *   put: COMMAND "put -r NAME", the server creates the directory NAME and
+ *        replies frame_ok, the client sends the archive as frame_data and
+ *        frame_end, the server replies frame_end, or frame_error if
+ *        entries could not be created.
+ * 
+ * mget (COMMAND "mget PATTERN...") and mput (COMMAND "mput") send the
+ * files matching the patterns the same way, as an archive of files only.
+ * 
+ * The trailer covers the archive.
+ * 
+ * The client also names the codecs it can decompress with
+ * frame_compress, and once the server picked one either side may
+ * compress any frame_data (see compress.h), flagging it with
+ * FRAME_FLAG_COMPRESSED. Windows, sizes and trailers count the bytes
+ * decompressed.
+ */
+#define FRAME_VERSION      1                 /* Bumped whenever the layout of a frame changes. */
+#define FRAME_HEADER_SIZE  12
+#define FRAME_MAX_PAYLOAD  (1024 * 1024)     /* Frames bigger than this are a protocol error. */
+#define FRAME_DATA_SIZE    (64 * 1024)       /* Largest payload put in a frame_data by a sender. */
+#define FRAME_SIZE_SIZE    8                 /* Payload size of a frame_size. */
+#define FRAME_WINDOW_SIZE  4                 /* Payload size of a frame_window. */
+#define FRAME_WINDOW       (4 * 1024 * 1024) /* Bytes of frame_data payload a download stream may send before the receiver grants more. */
+#define FRAME_TRAILER_SIZE (1 + HASH_MAX_DIGEST_SIZE) /* Largest payload of a frame_end. */
+#define FRAME_RESUME_SIZE  16                         /* Payload size of the frame_ok and frame_size resuming a put. */
+#define RESUME_BLOCK_SIZE  (64 * 1024)                /* Bytes before the end of a partial copy compared before resuming. */
+#define RESUME_HASH_SIZE   8                          /* Size of the (xxh3) hash of those bytes. */
+#define FRAME_HASHES       "xxh3,crc32c,blake3,md5"   /* The hashes the client offers by default, most preferred first. */
+#define FRAME_FLAG_COMPRESSED 0x0001                  /* The payload of the frame_data is compressed. */
+
+typedef enum{
+    frame_command  = 1, /* Client -> server, starts a stream. Payload: the command (not null terminated). */
+    frame_ok       = 2, /* The command was accepted. */
+    frame_error    = 3, /* The command failed, ends the stream. Payload: the error message. */
+    frame_size     = 4, /* The total size of the frame_data which follows. Payload: 8 byte size. */
+    frame_data     = 5, /* Part of a file, or part of the output of a command. */
+    frame_end      = 6, /* No more frame_data on this stream. Payload: nothing, or the trailer of a get or put. */
+    frame_window   = 7, /* Client -> server, the receiver consumed data. Payload: 4 byte number of bytes to add to the window. */
+    frame_hash     = 8, /* Stream 0. Client -> server: the hashes it can check, comma separated. Server -> client: the one picked, empty for none. */
+    frame_compress = 9  /* Stream 0. Client -> server: the codecs it can decompress, comma separated. Server -> client: the one picked, empty for none. */
+} FrameType;
+
+typedef struct{
+    unsigned char  version;
+    unsigned char  type;     /* One of the values in FrameType. */
+    unsigned short flags;    /* FRAME_FLAG_COMPRESSED on a frame_data, 0 otherwise. */
+    uint32_t       streamId;
+    uint32_t       length;   /* Length of the payload. */
+} FrameHeader;
+
+
+
+
+/* Listing records.
+ * 
+ * A native sls replies like a get: frame_size (which the output of a
+ * command never starts with), then frame_data holding listing records,
+ * which the client formats:
+ * 
+ *   [kind][mode x4][nlink x4][uid x4][gid x4][size x8][mtime x8][name length x2][name...]
+ * 
+ * A listing_record_directory starts the entries of a directory when more
+ * than one is listed (-R, or several paths), its name is the path.
+ */
+#define LISTING_RECORD_HEADER_SIZE 35
+
+typedef enum{
+    listing_record_entry     = 1, /* A file, its name is relative to the directory. */
+    listing_record_directory = 2  /* The entries which follow belong to this directory. */
+} ListingRecordKind;
+
+typedef struct{
+    unsigned char kind;       /* One of the values in ListingRecordKind. */
+    uint32_t      mode;       /* st_mode, only the file type bits unless -l, -S or -t were used. */
+    uint32_t      nlink;
+    uint32_t      uid;
+    uint32_t      gid;
+    uint64_t      size;
+    int64_t       mtime;      /* Seconds since the epoch. */
+    uint16_t      nameLength;
+    const char    *name;      /* Not null terminated. */
+} ListingRecord;
 
 
 
@@ -42,6 +190,8 @@ typedef enum{
     command_md5,    /* Compute the md5 for a file. */
     command_get,    /* get (download) a file. */
     command_put,    /* put (upload) a file. */
+    command_mget,   /* get the files matching patterns. */
+    command_mput,   /* put the files matching patterns. */
     command_unknown /* Unknown command. */
 } SharedCommandType;
 
@@ -123,4 +273,132 @@ int isRegularFile(const char *filePath);
  */
 int fileExists(const char *filePath);
 
+
+
+
+/* PURPOSE:
+ *     Write all of the data to a file descriptor, retrying
+ *     after partial writes.
+ * 
+ * RETURNS:
+ *     0 - Everything was written.
+ *    -1 - An error occured, errno set by write().
+ */
+int writeAll(int fd, const void *data, long length);
+
+/* PURPOSE:
+ *     Put a file descriptor into non-blocking mode.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno set by fcntl().
+ */
+int setNonBlocking(int fd);
+
+/* PURPOSE:
+ *     Read exactly length bytes from a file descriptor, retrying
+ *     after partial reads.
+ * 
+ * RETURNS:
+ *     0 - Everything was read.
+ *    -1 - An error occured, errno set by read(), or the other side
+ *         closed the connection first, errno set to 0.
+ */
+int readAll(int fd, void *data, long length);
+
+/* Store/load numbers in network byte order. */
+void packUint32(unsigned char *buffer, uint32_t value);
+void packUint64(unsigned char *buffer, uint64_t value);
+uint32_t unpackUint32(const unsigned char *buffer);
+uint64_t unpackUint64(const unsigned char *buffer);
+
+
+
+
+/* PURPOSE:
+ *     Convert a frame header to/from the 12 bytes sent on the wire.
+ * 
+ * RETURNS (frameDecodeHeader):
+ *     0 - The header is valid.
+ *    -1 - The header has a different version, or its payload is larger
+ *         than FRAME_MAX_PAYLOAD.
+ */
+void frameEncodeHeader(unsigned char *buffer, unsigned char type, unsigned short flags, uint32_t streamId, uint32_t length);
+int frameDecodeHeader(const unsigned char *buffer, FrameHeader *header);
+
+/* PURPOSE:
+ *     Send a whole frame on a blocking socket, the header and payload
+ *     go out in a single writev().
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set.
+ */
+int frameSend(int sockfd, unsigned char type, unsigned short flags, uint32_t streamId, const void *payload, uint32_t length);
+
+/* PURPOSE:
+ *     Send length bytes of the file fd (from its current offset) as a
+ *     single frame_data on a blocking socket. The payload is sent with
+ *     sendfile(), or read()/write() when sendfile() does not work.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set (0 if the file was shorter than length).
+ */
+int frameSendFileData(int sockfd, uint32_t streamId, int fd, uint32_t length);
+
+/* PURPOSE:
+ *     Read the next frame header from a blocking socket.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, errno is set (0 if the connection was closed or
+ *         the header was invalid).
+ */
+int frameReceiveHeader(int sockfd, FrameHeader *header);
+
+/* PURPOSE:
+ *     Hash (xxh3) the RESUME_BLOCK_SIZE bytes of a file before offset,
+ *     or all of them if offset is smaller, to check that a partial
+ *     copy of a file matches the whole one up to offset.
+ * 
+ * RETURNS:
+ *     0 - Success, RESUME_HASH_SIZE bytes were written to digest.
+ *    -1 - Failure, errno is set (0 if the file is shorter than offset).
+ */
+int resumeBlockHash(int fd, long offset, unsigned char *digest);
+
+/* PURPOSE:
+ *     Finish a hash of the frame_data of a stream and write it into
+ *     trailer as the payload of its frame_end.
+ * 
+ * RETURNS:
+ *     The length of the trailer, at most FRAME_TRAILER_SIZE.
+ */
+uint32_t frameEncodeTrailer(unsigned char *trailer, HashState *state);
+
+/* PURPOSE:
+ *     Finish a hash of the frame_data of a stream and compare it with
+ *     the trailer the other side sent in its frame_end.
+ * 
+ * RETURNS:
+ *     1 - The digests match.
+ *     0 - They do not, or the trailer is of a different hash.
+ */
+int frameCheckTrailer(const unsigned char *trailer, uint32_t length, HashState *state);
+
+
+
+
+/* PURPOSE:
+ *     Convert a listing record to/from its bytes. The encoder writes the
+ *     LISTING_RECORD_HEADER_SIZE byte header only, the name follows it.
+ * 
+ * RETURNS (listingDecodeRecord):
+ *     SUCCESS: The size of the whole record, record->name points into buffer.
+ *     FAILURE: -1, length is too short for the record.
+ */
+void listingEncodeRecord(unsigned char *buffer, const ListingRecord *record);
+long listingDecodeRecord(const unsigned char *buffer, long length, ListingRecord *record);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,594 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <errno.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <netdb.h>
+
+#include "client.h"
+#include "stripe.h"
+
+static int stripeOpen(Stripe *stripe);
+static int stripeReceiveFrame(Stripe *stripe, FrameHeader *header, unsigned char *payload);
+static int stripeCommand(Stripe *stripe, const char *command);
+static int stripeReceiveRange(Stripe *stripe);
+static int stripeStartUpload(Stripe *stripe);
+static int stripeSendRange(Stripe *stripe);
+static void *stripeGetThread(void *arg);
+static void *stripePutThread(void *arg);
+static int stripeRun(Stripe *stripes, int count, void *(*thread)(void *));
+static void stripeCut(Stripe *stripes, int count, long size);
+static void stripeReport(FILE *output, const Stripe *stripes, int count, const struct timespec *start, const char *verb);
+
+
+
+
+/*********************************************************************************
+ * Interface.
+ ********************************************************************************/
+int stripeCount(int requested, long size){
+    long count;
+    
+    count = size / STRIPE_MIN_RANGE;
+    if(count > requested){
+        count = requested;
+    }
+    if(count > STRIPE_MAX_CONNECTIONS){
+        count = STRIPE_MAX_CONNECTIONS;
+    }
+    
+    return count < 1 ? 1 : count;
+}
+
+int stripeGet(const StripeServer *server, const char *filePath, const char *fileName, int connections, FILE *output){
+    Stripe          stripes[STRIPE_MAX_CONNECTIONS];
+    struct timespec start;
+    int             count;
+    int             fd;
+    int             ret;
+    
+    fd = open(fileName, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+    if(fd == -1){
+        fprintf(output, CFLRED "ERROR:" C_RST " %s: %s\n", fileName, strerror(errno));
+        return 1;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    /* The first connection learns the size of the file, with an empty range. */
+    memset(&stripes[0], 0, sizeof(Stripe));
+    stripes[0].server   = server;
+    stripes[0].path     = filePath;
+    stripes[0].fd       = fd;
+    stripes[0].fileSize = -1;
+    stripes[0].sockfd   = -1;
+    
+    if(stripeOpen(&stripes[0]) != 0 || stripeReceiveRange(&stripes[0]) != 0){
+        fprintf(output, CFLRED "ERROR:" C_RST " %s\n", stripes[0].error);
+        if(stripes[0].sockfd != -1){
+            close(stripes[0].sockfd);
+        }
+        close(fd);
+        unlink(fileName);
+        return 1;
+    }
+    
+    /* Every range is pwrite()n into the file at its full size. */
+    if(stripes[0].fileSize > 0 && fallocate(fd, 0, 0, stripes[0].fileSize) != 0 && ftruncate(fd, stripes[0].fileSize) != 0){
+        fprintf(output, CFLRED "ERROR:" C_RST " %s: %s\n", fileName, strerror(errno));
+        close(stripes[0].sockfd);
+        close(fd);
+        unlink(fileName);
+        return 1;
+    }
+    
+    count = stripeCount(connections, stripes[0].fileSize);
+    stripeCut(stripes, count, stripes[0].fileSize);
+    
+    ret = stripeRun(stripes, count, stripeGetThread);
+    close(fd);
+    
+    stripeReport(output, stripes, count, &start, "downloaded");
+    if(ret != 0){
+        unlink(fileName);
+    }
+    
+    return ret;
+}
+
+int stripePut(const StripeServer *server, const char *filePath, const char *fileName, int connections, FILE *output){
+    Stripe          stripes[STRIPE_MAX_CONNECTIONS];
+    struct timespec start;
+    struct stat     s;
+    int             count;
+    int             ret;
+    int             i;
+    
+    if(stat(filePath, &s) != 0){
+        fprintf(output, CFLRED "ERROR:" C_RST " %s: %s\n", filePath, strerror(errno));
+        return 1;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    
+    memset(&stripes[0], 0, sizeof(Stripe));
+    stripes[0].server = server;
+    stripes[0].path   = fileName;
+    
+    count = stripeCount(connections, s.st_size);
+    stripeCut(stripes, count, s.st_size);
+    
+    /* Every stripe reads the file through a descriptor of its own, sendfile() goes from its offset. */
+    for(i=0; i<count; i++){
+        stripes[i].fd = open(filePath, O_RDONLY | O_CLOEXEC);
+        if(stripes[i].fd == -1 || lseek(stripes[i].fd, stripes[i].offset, SEEK_SET) == -1){
+            fprintf(output, CFLRED "ERROR:" C_RST " %s: %s\n", filePath, strerror(errno));
+            while(i >= 0){
+                if(stripes[i].fd != -1){
+                    close(stripes[i].fd);
+                }
+                i--;
+            }
+            return 1;
+        }
+    }
+    
+    /* The first stripe creates the file on the server, the others write into it. */
+    if(stripeOpen(&stripes[0]) != 0 || stripeStartUpload(&stripes[0]) != 0){
+        fprintf(output, CFLRED "ERROR:" C_RST " %s\n", stripes[0].error);
+        if(stripes[0].sockfd != -1){
+            close(stripes[0].sockfd);
+        }
+        for(i=0; i<count; i++){
+            close(stripes[i].fd);
+        }
+        return 1;
+    }
+    
+    ret = stripeRun(stripes, count, stripePutThread);
+    for(i=0; i<count; i++){
+        close(stripes[i].fd);
+    }
+    
+    stripeReport(output, stripes, count, &start, "uploaded");
+    
+    return ret;
+}
+
+
+
+
+/*********************************************************************************
+ * Connections.
+ ********************************************************************************/
+/* PURPOSE:
+ *     Open the connection of a stripe, offer the hash of the prompt, and
+ *     scd to its working directory.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, stripe->error says why.
+ */
+static int stripeOpen(Stripe *stripe){
+    FrameHeader   header;
+    unsigned char payload[FRAME_DATA_SIZE];
+    char          command[BUFFER_SIZE];
+    const char    *name;
+    int           ret;
+    
+    ret = connectipport(stripe->server->ip, stripe->server->port, &stripe->sockfd);
+    if(ret != 0){
+        snprintf(stripe->error, sizeof(stripe->error), "Could not connect to %s on port %s: %s", stripe->server->ip, stripe->server->port, ret == -1 ? gai_strerror(stripe->sockfd) : strerror(errno));
+        stripe->sockfd = -1;
+        return -1;
+    }
+    
+    /* The server replies with the hash it picked before anything else, it has to be the one the prompt uses. */
+    if(stripe->server->hash != hash_unknown){
+        name = hashName(stripe->server->hash);
+        if(frameSend(stripe->sockfd, frame_hash, 0, 0, name, strlen(name)) != 0 || stripeReceiveFrame(stripe, &header, payload) != 0){
+            return -1;
+        }
+        if(header.type != frame_hash || header.streamId != 0 || header.length != strlen(name) || memcmp(payload, name, header.length) != 0){
+            snprintf(stripe->error, sizeof(stripe->error), "The server did not accept %s on a new connection.", name);
+            return -1;
+        }
+    }
+    
+    if(snprintf(command, sizeof(command), "scd %s", stripe->server->directory) >= (int)sizeof(command)){
+        snprintf(stripe->error, sizeof(stripe->error), "Server directory too long.");
+        return -1;
+    }
+    
+    return stripeCommand(stripe, command);
+}
+
+/* PURPOSE:
+ *     Read the next frame of a stripe, its payload goes into payload
+ *     (FRAME_DATA_SIZE bytes). A frame_error is turned into a failure
+ *     with its message.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, stripe->error says why.
+ */
+static int stripeReceiveFrame(Stripe *stripe, FrameHeader *header, unsigned char *payload){
+    if(frameReceiveHeader(stripe->sockfd, header) != 0 || header->length > FRAME_DATA_SIZE || readAll(stripe->sockfd, payload, header->length) != 0){
+        snprintf(stripe->error, sizeof(stripe->error), "Connection to the server failed: %s", errno != 0 ? strerror(errno) : "closed");
+        return -1;
+    }
+    
+    if(header->type == frame_error){
+        snprintf(stripe->error, sizeof(stripe->error), "%.*s", (int)header->length, (const char *)payload);
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* PURPOSE:
+ *     Run a command whose output is of no interest (scd), on a stream of
+ *     its own.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, stripe->error says why.
+ */
+static int stripeCommand(Stripe *stripe, const char *command){
+    FrameHeader   header;
+    unsigned char payload[FRAME_DATA_SIZE];
+    
+    stripe->streamId++;
+    if(frameSend(stripe->sockfd, frame_command, 0, stripe->streamId, command, strlen(command)) != 0){
+        snprintf(stripe->error, sizeof(stripe->error), "Connection to the server failed: %s", strerror(errno));
+        return -1;
+    }
+    
+    do{
+        if(stripeReceiveFrame(stripe, &header, payload) != 0){
+            return -1;
+        }
+    } while(header.type != frame_end);
+    
+    return 0;
+}
+
+
+
+
+/*********************************************************************************
+ * Ranges.
+ ********************************************************************************/
+/* PURPOSE:
+ *     Download the range of a stripe with "get -s", pwrite()ing it into
+ *     its place in the file. stripe->fileSize is set to the size of the
+ *     file on the server, and has to match it if it is already set.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, stripe->error says why.
+ */
+static int stripeReceiveRange(Stripe *stripe){
+    FrameHeader   header;
+    unsigned char payload[FRAME_DATA_SIZE];
+    char          command[BUFFER_SIZE];
+    HashState     hash;
+    long          size;
+    long          received;
+    long          unacked;
+    
+    if(snprintf(command, sizeof(command), "get -s %ld %ld %s", stripe->offset, stripe->length, stripe->path) >= (int)sizeof(command)){
+        snprintf(stripe->error, sizeof(stripe->error), "command too long.");
+        return -1;
+    }
+    
+    stripe->streamId++;
+    if(frameSend(stripe->sockfd, frame_command, 0, stripe->streamId, command, strlen(command)) != 0){
+        snprintf(stripe->error, sizeof(stripe->error), "Connection to the server failed: %s", strerror(errno));
+        return -1;
+    }
+    
+    if(stripe->server->hash != hash_unknown){
+        hashInit(&hash, stripe->server->hash);
+    }
+    
+    size     = -1;
+    received = 0;
+    unacked  = 0;
+    while(1){
+        if(stripeReceiveFrame(stripe, &header, payload) != 0){
+            return -1;
+        }
+        
+        switch(header.type){
+            /* The size of the whole file, it must not have changed since the first stripe asked. */
+            case frame_ok: {
+                if(header.length != FRAME_SIZE_SIZE){
+                    break;
+                }
+                if(stripe->fileSize != -1 && (long)unpackUint64(payload) != stripe->fileSize){
+                    snprintf(stripe->error, sizeof(stripe->error), "%s changed on the server during the download.", stripe->path);
+                    return -1;
+                }
+                stripe->fileSize = unpackUint64(payload);
+                continue;
+            }
+            
+            case frame_size: {
+                if(header.length != FRAME_SIZE_SIZE || size != -1){
+                    break;
+                }
+                size = unpackUint64(payload);
+                if(size != stripe->length){
+                    snprintf(stripe->error, sizeof(stripe->error), "%s changed on the server during the download.", stripe->path);
+                    return -1;
+                }
+                continue;
+            }
+            
+            case frame_data: {
+                if(size == -1 || received + (long)header.length > size){
+                    break;
+                }
+                if(pwrite(stripe->fd, payload, header.length, stripe->offset + received) != (ssize_t)header.length){
+                    snprintf(stripe->error, sizeof(stripe->error), "Could not write the download: %s", strerror(errno));
+                    return -1;
+                }
+                if(stripe->server->hash != hash_unknown){
+                    hashUpdate(&hash, payload, header.length);
+                }
+                received += header.length;
+                
+                /* Grant the server more window, half of it at a time like pumpConnection() does. */
+                unacked += header.length;
+                if(unacked >= FRAME_WINDOW / 2){
+                    packUint32(payload, unacked);
+                    unacked = 0;
+                    if(frameSend(stripe->sockfd, frame_window, 0, stripe->streamId, payload, FRAME_WINDOW_SIZE) != 0){
+                        snprintf(stripe->error, sizeof(stripe->error), "Connection to the server failed: %s", strerror(errno));
+                        return -1;
+                    }
+                }
+                continue;
+            }
+            
+            case frame_end: {
+                if(received != size || header.length > FRAME_TRAILER_SIZE){
+                    break;
+                }
+                if(stripe->server->hash != hash_unknown && header.length != 0 && !frameCheckTrailer(payload, header.length, &hash)){
+                    snprintf(stripe->error, sizeof(stripe->error), "%s checksum mismatch in bytes %ld to %ld.", hashName(stripe->server->hash), stripe->offset, stripe->offset + stripe->length);
+                    return -1;
+                }
+                return 0;
+            }
+        }
+        
+        snprintf(stripe->error, sizeof(stripe->error), "Could not download file.");
+        return -1;
+    }
+}
+
+/* PURPOSE:
+ *     Ask the server to take the range of a stripe with "put -s", and
+ *     wait until it does.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, stripe->error says why.
+ */
+static int stripeStartUpload(Stripe *stripe){
+    FrameHeader   header;
+    unsigned char payload[FRAME_DATA_SIZE];
+    char          command[BUFFER_SIZE];
+    
+    if(snprintf(command, sizeof(command), "put -s %ld %ld %s", stripe->offset, stripe->fileSize, stripe->path) >= (int)sizeof(command)){
+        snprintf(stripe->error, sizeof(stripe->error), "command too long.");
+        return -1;
+    }
+    
+    stripe->streamId++;
+    if(frameSend(stripe->sockfd, frame_command, 0, stripe->streamId, command, strlen(command)) != 0){
+        snprintf(stripe->error, sizeof(stripe->error), "Connection to the server failed: %s", strerror(errno));
+        return -1;
+    }
+    
+    if(stripeReceiveFrame(stripe, &header, payload) != 0){
+        return -1;
+    }
+    if(header.type != frame_ok){
+        snprintf(stripe->error, sizeof(stripe->error), "Could not upload file.");
+        return -1;
+    }
+    
+    return 0;
+}
+
+/* PURPOSE:
+ *     Send the range of a stripe the server took, and wait until it
+ *     confirms all of it arrived.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *    -1 - Failure, stripe->error says why.
+ */
+static int stripeSendRange(Stripe *stripe){
+    FrameHeader   header;
+    unsigned char payload[FRAME_DATA_SIZE];
+    HashState     hash;
+    uint32_t      trailerLength;
+    long          sent;
+    long          n;
+    
+    packUint64(payload, stripe->length);
+    if(frameSend(stripe->sockfd, frame_size, 0, stripe->streamId, payload, FRAME_SIZE_SIZE) != 0){
+        snprintf(stripe->error, sizeof(stripe->error), "Connection to the server failed: %s", strerror(errno));
+        return -1;
+    }
+    
+    if(stripe->server->hash != hash_unknown){
+        hashInit(&hash, stripe->server->hash);
+    }
+    
+    /* Hashed out of the page cache first, like sendCommandputData() does. */
+    for(sent=0; sent<stripe->length; sent+=n){
+        n = stripe->length - sent < FRAME_DATA_SIZE ? stripe->length - sent : FRAME_DATA_SIZE;
+        
+        if((stripe->server->hash != hash_unknown && hashUpdateFile(&hash, stripe->fd, stripe->offset + sent, n) != 0) || frameSendFileData(stripe->sockfd, stripe->streamId, stripe->fd, n) != 0){
+            snprintf(stripe->error, sizeof(stripe->error), "Could not upload file: %s", errno != 0 ? strerror(errno) : "it shrank while it was being uploaded");
+            return -1;
+        }
+    }
+    
+    trailerLength = stripe->server->hash != hash_unknown ? frameEncodeTrailer(payload, &hash) : 0;
+    if(frameSend(stripe->sockfd, frame_end, 0, stripe->streamId, payload, trailerLength) != 0){
+        snprintf(stripe->error, sizeof(stripe->error), "Connection to the server failed: %s", strerror(errno));
+        return -1;
+    }
+    
+    /* The server ends the stream once all of the range is written, or says what went wrong. */
+    if(stripeReceiveFrame(stripe, &header, payload) != 0){
+        return -1;
+    }
+    if(header.type != frame_end){
+        snprintf(stripe->error, sizeof(stripe->error), "Could not upload file.");
+        return -1;
+    }
+    
+    return 0;
+}
+
+
+
+
+/*********************************************************************************
+ * Threads.
+ ********************************************************************************/
+static void *stripeGetThread(void *arg){
+    Stripe *stripe;
+    
+    stripe = arg;
+    
+    if(stripe->sockfd == -1 && stripeOpen(stripe) != 0){
+        return NULL;
+    }
+    stripe->ok = stripeReceiveRange(stripe) == 0;
+    
+    return NULL;
+}
+
+static void *stripePutThread(void *arg){
+    Stripe *stripe;
+    
+    stripe = arg;
+    
+    if(stripe->sockfd == -1 && (stripeOpen(stripe) != 0 || stripeStartUpload(stripe) != 0)){
+        return NULL;
+    }
+    stripe->ok = stripeSendRange(stripe) == 0;
+    
+    return NULL;
+}
+
+/* PURPOSE:
+ *     Run a thread per stripe and wait for all of them, the first stripe
+ *     carries on with the connection it already has, the others open
+ *     one of their own.
+ * 
+ * RETURNS:
+ *     0 - Every stripe succeeded.
+ *     1 - At least one failed.
+ *    -1 - A thread could not be started.
+ */
+static int stripeRun(Stripe *stripes, int count, void *(*thread)(void *)){
+    int started;
+    int ret;
+    int i;
+    
+    ret = 0;
+    for(started=0; started<count; started++){
+        if(pthread_create(&stripes[started].thread, NULL, thread, &stripes[started]) != 0){
+            ret = -1;
+            break;
+        }
+    }
+    
+    for(i=0; i<started; i++){
+        pthread_join(stripes[i].thread, NULL);
+        if(stripes[i].sockfd != -1){
+            close(stripes[i].sockfd);
+        }
+        if(!stripes[i].ok && ret == 0){
+            ret = 1;
+        }
+    }
+    
+    /* The connection of the first stripe is open even if its thread never ran. */
+    if(started == 0 && stripes[0].sockfd != -1){
+        close(stripes[0].sockfd);
+    }
+    
+    return ret;
+}
+
+/* Cut size bytes into count ranges of whole frames, the first stripe is the template for the others. */
+static void stripeCut(Stripe *stripes, int count, long size){
+    long range;
+    long end;
+    int  i;
+    
+    range = (size / count + FRAME_DATA_SIZE - 1) / FRAME_DATA_SIZE * FRAME_DATA_SIZE;
+    
+    stripes[0].fileSize = size;
+    for(i=0; i<count; i++){
+        if(i > 0){
+            stripes[i]          = stripes[0];
+            stripes[i].sockfd   = -1;
+            stripes[i].streamId = 0;
+        }
+        
+        stripes[i].offset = i * range < size ? i * range : size;
+        end               = i == count - 1 || stripes[i].offset + range > size ? size : stripes[i].offset + range;
+        stripes[i].length = end - stripes[i].offset;
+        stripes[i].ok     = 0;
+    }
+}
+
+/* Print how the transfer went, the error of every stripe which failed. */
+static void stripeReport(FILE *output, const Stripe *stripes, int count, const struct timespec *start, const char *verb){
+    struct timespec end;
+    double          seconds;
+    int             failed;
+    int             i;
+    
+    failed = 0;
+    for(i=0; i<count; i++){
+        if(!stripes[i].ok){
+            fprintf(output, CFLRED "ERROR:" C_RST " Connection %d: %s\n", i + 1, stripes[i].error[0] != '\0' ? stripes[i].error : "Could not start.");
+            failed = 1;
+        }
+    }
+    if(failed){
+        fprintf(output, "The file was not %s.\n", verb);
+        return;
+    }
+    
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    seconds = (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+    
+    fprintf(output, "File %s over %d connection%s, %.1f MB/s", verb, count, count == 1 ? "" : "s", seconds > 0 ? stripes[0].fileSize / seconds / 1e6 : 0.0);
+    if(stripes[0].server->hash != hash_unknown){
+        fprintf(output, ", %s checksum verified.\n", hashName(stripes[0].server->hash));
+    }
+    else{
+        fputs(", use 'smd5sum' to verify the files checksum on the server.\n", output);
+    }
+}
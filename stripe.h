@@ -0,0 +1,73 @@
+#ifndef STRIPE_H
+#define STRIPE_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "shared.h"
+#include "hash.h"
+
+#define STRIPE_MAX_CONNECTIONS 16                 /* Most connections a get -p or put -p opens. */
+#define STRIPE_MIN_RANGE       (16 * 1024 * 1024) /* Smallest range worth a connection of its own. */
+
+/* Striping outline (get -p N and put -p N):
+ * 
+ * A single connection rarely fills a link with a large bandwidth-delay
+ * product, so a large file is cut into N ranges, each of them sent over
+ * a connection of its own at the same time. The connections are opened
+ * with connectipport() next to the one of the prompt, offer the hash it
+ * negotiated, and scd to its working directory first.
+ * 
+ *   get: "get -s OFFSET LENGTH PATH", the server replies frame_ok [size
+ *        of the file] and sends the range like a get. A first "get -s 0 0
+ *        PATH" learns the size, the file is then created at that size
+ *        here and every range pwrite()n into it.
+ *   put: "put -s OFFSET SIZE NAME", the stripe at offset 0 creates the
+ *        file at its full size on the server, the others are sent once
+ *        it did and write into it from their offset on.
+ * 
+ * A file smaller than two STRIPE_MIN_RANGE gets a single connection.
+ * Every range is checked with its own trailer.
+ */
+
+/* Where the connections go, and what they start out with. */
+typedef struct{
+    const char *ip;
+    const char *port;
+    HashType   hash;                  /* The one negotiated by the prompt, hash_unknown for none. */
+    char       directory[BUFFER_SIZE]; /* Working directory of the prompt on the server. */
+} StripeServer;
+
+/* One range, and the connection it is sent over. */
+typedef struct{
+    const StripeServer *server;
+    const char         *path;          /* On the server. */
+    int                fd;             /* The local file, a descriptor of its own. */
+    long               offset;
+    long               length;
+    long               fileSize;       /* Size of the whole file, as the server sees it (get) or this side does (put). */
+    int                sockfd;
+    uint32_t           streamId;
+    pthread_t          thread;
+    int                ok;             /* 1 once all of the range was sent and checked. */
+    char               error[BUFFER_SIZE];
+} Stripe;
+
+/* Returns the number of connections a file of size bytes is sent over, at most requested. */
+int stripeCount(int requested, long size);
+
+/* PURPOSE:
+ *     Download filePath into fileName (which must not exist yet) over up
+ *     to connections connections, or upload filePath to fileName, the
+ *     outcome is printed to output.
+ * 
+ * RETURNS:
+ *     0 - Success.
+ *     1 - Non critical error, the transfer failed, what is left of it
+ *         here is removed (on the server it is kept).
+ *    -1 - Critical error.
+ */
+int stripeGet(const StripeServer *server, const char *filePath, const char *fileName, int connections, FILE *output);
+int stripePut(const StripeServer *server, const char *filePath, const char *fileName, int connections, FILE *output);
+
+#endif